@@ -26,6 +26,10 @@
 #include <unistr.h>
 #endif
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "mongo-bson.h"
 #include "mongo-debug.h"
 
@@ -52,21 +56,89 @@
  * modified UTF-8.
  */
 
+#ifndef MONGO_BSON_N_INDEX_KEYS
+#define MONGO_BSON_N_INDEX_KEYS 1000
+#endif
+
 #define ITER_IS_TYPE(iter, type) (GPOINTER_TO_INT(iter->user_data5) == type)
 
-const gchar *
-utf8_check (const gchar *str,
-            gssize       len)
+/*
+ * Array keys "0" through "999", each padded to 4 bytes, built on first
+ * use by mongo_bson_index_key().
+ */
+static gchar gIndexKeys[MONGO_BSON_N_INDEX_KEYS][4];
+
+/*
+ * Returns the number of leading bytes in @str that are ASCII and not NUL.
+ * Keys and most strings we see are plain ASCII, so this lets us skip the
+ * multibyte validator for all or most of them. SSE2 is part of the x86_64
+ * baseline, so there is no need to check for it at runtime.
+ */
+static inline gsize
+ascii_prefix (const gchar *str,
+              gsize        len)
 {
-#ifdef HAVE_UNISTR_H
-   return (const gchar *)u8_check((const guint8 *)str, len);
+   gsize i = 0;
+#ifdef __SSE2__
+   const __m128i zero = _mm_setzero_si128();
+   __m128i v;
+   gint mask;
+
+   for (; (i + 16) <= len; i += 16) {
+      v = _mm_loadu_si128((const __m128i *)(gconstpointer)(str + i));
+      mask = _mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, zero)));
+      if (mask) {
+         return i + g_bit_nth_lsf(mask, -1);
+      }
+   }
 #else
+   guint64 w;
+
+   for (; (i + 8) <= len; i += 8) {
+      memcpy(&w, str + i, sizeof w);
+      if ((w & G_GUINT64_CONSTANT(0x8080808080808080)) ||
+          ((w - G_GUINT64_CONSTANT(0x0101010101010101)) & ~w &
+           G_GUINT64_CONSTANT(0x8080808080808080))) {
+         break;
+      }
+   }
+#endif
+
+   for (; i < len; i++) {
+      if (!str[i] || (str[i] & 0x80)) {
+         break;
+      }
+   }
+
+   return i;
+}
+
+/*
+ * Returns a pointer to the first invalid byte in @str, or %NULL if the
+ * first @len bytes are valid UTF-8.
+ */
+static const gchar *
+utf8_check (const gchar *str,
+            gsize        len)
+{
    const gchar *end = NULL;
-   if (!g_utf8_validate(str, len, &end)) {
+   gsize n;
+
+   if ((n = ascii_prefix(str, len)) == len) {
       return NULL;
    }
-   return end;
+   str += n;
+   len -= n;
+
+#ifdef HAVE_UNISTR_H
+   end = (const gchar *)u8_check((const guint8 *)str, len);
+#else
+   if (g_utf8_validate(str, len, &end)) {
+      end = NULL;
+   }
 #endif
+
+   return end;
 }
 
 /**
@@ -157,6 +229,28 @@ mongo_bson_new_empty (void)
    return (MongoBson *)ar;
 }
 
+/**
+ * mongo_bson_new_sized:
+ * @size: (in): The number of bytes to preallocate.
+ *
+ * Creates a new empty #MongoBson like mongo_bson_new_empty() but reserves
+ * room for @size bytes up front. Use this when the approximate size of the
+ * document is known, such as when building a large $in query, to avoid
+ * growing the buffer repeatedly.
+ *
+ * Returns: An empty #MongoBson that should be freed with mongo_bson_unref().
+ */
+MongoBson *
+mongo_bson_new_sized (gsize size)
+{
+   static const guint8 empty_bson[] = { 5, 0, 0, 0, 0 };
+   GByteArray *ar;
+
+   ar = g_byte_array_sized_new(MAX(size, G_N_ELEMENTS(empty_bson)));
+   g_byte_array_append(ar, empty_bson, G_N_ELEMENTS(empty_bson));
+   return (MongoBson *)ar;
+}
+
 /**
  * mongo_bson_new:
  *
@@ -288,6 +382,7 @@ mongo_bson_type_get_type (void)
       { MONGO_BSON_UTF8,      "MONGO_BSON_UTF8",      "UTF8" },
       { MONGO_BSON_DOCUMENT,  "MONGO_BSON_DOCUMENT",  "DOCUMENT" },
       { MONGO_BSON_ARRAY,     "MONGO_BSON_ARRAY",     "ARRAY" },
+      { MONGO_BSON_BINARY,    "MONGO_BSON_BINARY",    "BINARY" },
       { MONGO_BSON_UNDEFINED, "MONGO_BSON_UNDEFINED", "UNDEFINED" },
       { MONGO_BSON_OBJECT_ID, "MONGO_BSON_OBJECT_ID", "OBJECT_ID" },
       { MONGO_BSON_BOOLEAN,   "MONGO_BSON_BOOLEAN",   "BOOLEAN" },
@@ -296,6 +391,7 @@ mongo_bson_type_get_type (void)
       { MONGO_BSON_REGEX,     "MONGO_BSON_REGEX",     "REGEX" },
       { MONGO_BSON_INT32,     "MONGO_BSON_INT32",     "INT32" },
       { MONGO_BSON_INT64,     "MONGO_BSON_INT64",     "INT64" },
+      { MONGO_BSON_TIMESTAMP, "MONGO_BSON_TIMESTAMP", "TIMESTAMP" },
       { 0 }
    };
 
@@ -332,42 +428,59 @@ mongo_bson_append (MongoBson    *bson,
                    const guint8 *data2,
                    gsize         len2)
 {
-   const guint8 trailing = 0;
    GByteArray *buf = (GByteArray *)bson;
+   const gchar *end = NULL;
    gint32 doc_len;
+   guint offset;
+   gsize key_len;
 
    g_return_if_fail(bson);
    g_return_if_fail(type);
    g_return_if_fail(key);
-   g_return_if_fail(g_utf8_validate(key, -1, NULL));
    g_return_if_fail(data1 || !len1);
    g_return_if_fail(data2 || !len2);
    g_return_if_fail(!data2 || data1);
 
    /*
-    * Overwrite our trailing byte with the type for this key.
+    * Validating the key also finds its length, so we only walk it once.
+    */
+   if (!g_utf8_validate(key, -1, &end)) {
+      g_critical("%s(): key is not valid UTF-8.", G_STRFUNC);
+      return;
+   }
+   key_len = end - key + 1;
+
+   /*
+    * Grow the buffer once for the key, the data sections and the new
+    * trailing byte, then overwrite our trailing byte with the type for
+    * this key.
     */
-   buf->data[buf->len - 1] = type;
+   offset = buf->len;
+   g_byte_array_set_size(buf, offset + key_len + len1 + len2 + 1);
+   buf->data[offset - 1] = type;
 
    /*
     * Append the field name as a BSON cstring.
     */
-   g_byte_array_append(buf, (guint8 *)key, strlen(key) + 1);
+   memcpy(buf->data + offset, key, key_len);
+   offset += key_len;
 
    /*
     * Append the data sections if needed.
     */
    if (data1) {
-      g_byte_array_append(buf, data1, len1);
+      memcpy(buf->data + offset, data1, len1);
+      offset += len1;
       if (data2) {
-         g_byte_array_append(buf, data2, len2);
+         memcpy(buf->data + offset, data2, len2);
+         offset += len2;
       }
    }
 
    /*
     * Append our trailing byte.
     */
-   g_byte_array_append(buf, &trailing, 1);
+   buf->data[offset] = 0;
 
    /*
     * Update the document length of the buffer.
@@ -376,6 +489,35 @@ mongo_bson_append (MongoBson    *bson,
    memcpy(buf->data, &doc_len, sizeof doc_len);
 }
 
+/*
+ * Appends the header of an open child document. The child's length is
+ * filled in by mongo_bson_append_document_end(). The single trailing byte
+ * left at the end of the buffer belongs to the child, so the regular
+ * append functions add fields to it.
+ */
+static guint
+mongo_bson_append_document_begin_internal (MongoBson     *bson,
+                                           MongoBsonType  type,
+                                           const gchar   *key)
+{
+   static const guint8 empty_bson[] = { 5, 0, 0, 0, 0 };
+
+   g_return_val_if_fail(bson, 0);
+   g_return_val_if_fail(key, 0);
+
+   mongo_bson_append(bson, type, key,
+                     empty_bson, G_N_ELEMENTS(empty_bson),
+                     NULL, 0);
+
+   /*
+    * Drop the trailing byte of the enclosing document, it is appended
+    * again when the child is closed.
+    */
+   g_byte_array_set_size((GByteArray *)bson, bson->len - 1);
+
+   return bson->len - G_N_ELEMENTS(empty_bson);
+}
+
 /**
  * mongo_bson_append_array:
  * @bson: (in): A #MongoBson.
@@ -406,6 +548,136 @@ mongo_bson_append_array (MongoBson       *bson,
                      NULL, 0);
 }
 
+/**
+ * mongo_bson_append_array_begin:
+ * @bson: (in): A #MongoBson.
+ * @key: (in): The field name.
+ *
+ * Starts an array under @key that is built in place within @bson, rather
+ * than being built separately and copied in with mongo_bson_append_array().
+ *
+ * Until the array is closed with mongo_bson_append_array_end(), every
+ * field appended to @bson is added to the array instead. Use
+ * mongo_bson_index_key() to get the keys of the elements. Children may
+ * be nested, but must be closed in the reverse order they were opened,
+ * and @bson must not be used for anything else until all of them are.
+ *
+ * Returns: The offset of the array within @bson, to be passed to
+ *   mongo_bson_append_array_end().
+ */
+guint
+mongo_bson_append_array_begin (MongoBson   *bson,
+                               const gchar *key)
+{
+   return mongo_bson_append_document_begin_internal(bson,
+                                                     MONGO_BSON_ARRAY,
+                                                     key);
+}
+
+/**
+ * mongo_bson_append_array_end:
+ * @bson: (in): A #MongoBson.
+ * @offset: (in): The offset returned from mongo_bson_append_array_begin().
+ *
+ * Closes an array opened with mongo_bson_append_array_begin(). Fields
+ * appended afterwards are added to the enclosing document again.
+ */
+void
+mongo_bson_append_array_end (MongoBson *bson,
+                             guint      offset)
+{
+   mongo_bson_append_document_end(bson, offset);
+}
+
+/**
+ * mongo_bson_append_document_begin:
+ * @bson: (in): A #MongoBson.
+ * @key: (in): The field name.
+ *
+ * Starts a child document under @key that is built in place within
+ * @bson. This works the same way as mongo_bson_append_array_begin().
+ *
+ * Returns: The offset of the document within @bson, to be passed to
+ *   mongo_bson_append_document_end().
+ */
+guint
+mongo_bson_append_document_begin (MongoBson   *bson,
+                                  const gchar *key)
+{
+   return mongo_bson_append_document_begin_internal(bson,
+                                                     MONGO_BSON_DOCUMENT,
+                                                     key);
+}
+
+/**
+ * mongo_bson_append_document_end:
+ * @bson: (in): A #MongoBson.
+ * @offset: (in): The offset returned from
+ *   mongo_bson_append_document_begin().
+ *
+ * Closes a child document opened with mongo_bson_append_document_begin().
+ */
+void
+mongo_bson_append_document_end (MongoBson *bson,
+                                guint      offset)
+{
+   GByteArray *buf = (GByteArray *)bson;
+   const guint8 trailing = 0;
+   gint32 len;
+
+   g_return_if_fail(bson);
+   g_return_if_fail(offset >= 4);
+   g_return_if_fail((offset + 5) <= buf->len);
+
+   /*
+    * The last byte in the buffer is the trailing byte of the child, so
+    * the child is complete once its length is filled in. The enclosing
+    * document then needs a new trailing byte of its own.
+    */
+   len = GINT32_TO_LE(buf->len - offset);
+   memcpy(buf->data + offset, &len, sizeof len);
+
+   g_byte_array_append(buf, &trailing, 1);
+
+   len = GINT32_TO_LE(buf->len);
+   memcpy(buf->data, &len, sizeof len);
+}
+
+/**
+ * mongo_bson_append_binary:
+ * @bson: (in): A #MongoBson.
+ * @key: (in): The string containing key.
+ * @subtype: (in): The BSON binary subtype, such as 0 for generic data.
+ * @data: (in) (array length=length): The bytes to store.
+ * @length: (in): The number of bytes in @data.
+ *
+ * Stores @data as a BSON binary ("BinData") value in the document under
+ * @key.
+ */
+void
+mongo_bson_append_binary (MongoBson    *bson,
+                          const gchar  *key,
+                          guint8        subtype,
+                          const guint8 *data,
+                          gsize         length)
+{
+   guint8 header[5];
+   guint32 len;
+
+   g_return_if_fail(bson != NULL);
+   g_return_if_fail(key != NULL);
+   g_return_if_fail(data || !length);
+   g_return_if_fail(length <= G_MAXINT32);
+
+   len = GUINT32_TO_LE(length);
+   memcpy(header, &len, sizeof len);
+   header[4] = subtype;
+
+   mongo_bson_append(bson, MONGO_BSON_BINARY, key,
+                     header, sizeof header,
+                     length ? data : NULL, length);
+}
+
 /**
  * mongo_bson_append_boolean:
  * @bson: (in): A #MongoBson.
@@ -643,6 +915,34 @@ mongo_bson_append_string (MongoBson   *bson,
                      (const guint8 *)value, value_len);
 }
 
+/**
+ * mongo_bson_append_timestamp:
+ * @bson: (in): A #MongoBson.
+ * @key: (in): A string containing the key.
+ * @timestamp: (in): The seconds since the UNIX epoch.
+ * @increment: (in): The ordinal of the operation within @timestamp.
+ *
+ * Appends a MongoDB internal timestamp to the document under @key. These
+ * are used by the oplog and are not meant for storing dates; use
+ * mongo_bson_append_timeval() for those.
+ */
+void
+mongo_bson_append_timestamp (MongoBson   *bson,
+                             const gchar *key,
+                             guint32      timestamp,
+                             guint32      increment)
+{
+   guint64 value;
+
+   g_return_if_fail(bson);
+   g_return_if_fail(key);
+
+   value = GUINT64_TO_LE(((guint64)timestamp << 32) | increment);
+   mongo_bson_append(bson, MONGO_BSON_TIMESTAMP, key,
+                     (const guint8 *)&value, sizeof value,
+                     NULL, 0);
+}
+
 /**
  * mongo_bson_append_timeval:
  * @bson: (in): A #MongoBson.
@@ -744,11 +1044,19 @@ gboolean
 mongo_bson_iter_find (MongoBsonIter *iter,
                       const gchar   *key)
 {
+   gsize key_len;
+
    g_return_val_if_fail(iter != NULL, FALSE);
    g_return_val_if_fail(key != NULL, FALSE);
 
-   while (mongo_bson_iter_next(iter)){
-      if (!g_strcmp0(key, mongo_bson_iter_get_key(iter))) {
+   /*
+    * mongo_bson_iter_next() records the length of each key, so most keys
+    * can be rejected without looking at them.
+    */
+   key_len = strlen(key);
+   while (mongo_bson_iter_next(iter)) {
+      if ((iter->reserved1 == key_len) &&
+          !memcmp(key, iter->user_data4, key_len)) {
          return TRUE;
       }
    }
@@ -837,6 +1145,43 @@ mongo_bson_iter_get_value_array (MongoBsonIter *iter)
    RETURN(ret);
 }
 
+/**
+ * mongo_bson_iter_get_value_binary:
+ * @iter: (in): A #MongoBsonIter.
+ * @subtype: (out) (allow-none): A location for the binary subtype.
+ * @length: (out) (allow-none): A location for the number of bytes.
+ *
+ * Fetches the current value pointed to by @iter if the type is a
+ * %MONGO_BSON_BINARY. The bytes belong to the document and are only
+ * valid as long as it is.
+ *
+ * Returns: (transfer none): The bytes of the value, or %NULL.
+ */
+const guint8 *
+mongo_bson_iter_get_value_binary (MongoBsonIter *iter,
+                                  guint8        *subtype,
+                                  gsize         *length)
+{
+   guint32 len;
+
+   g_return_val_if_fail(iter != NULL, NULL);
+
+   if (ITER_IS_TYPE(iter, MONGO_BSON_BINARY)) {
+      memcpy(&len, iter->user_data6, sizeof len);
+      if (subtype) {
+         *subtype = ((const guint8 *)iter->user_data6)[4];
+      }
+      if (length) {
+         *length = GUINT32_FROM_LE(len);
+      }
+      return iter->user_data7;
+   }
+
+   g_warning("Current value is not Binary");
+
+   return NULL;
+}
+
 /**
  * mongo_bson_iter_get_value_boolean:
  * @iter: (in): A #MongoBsonIter.
@@ -1088,6 +1433,41 @@ mongo_bson_iter_get_value_string (MongoBsonIter *iter,
    return NULL;
 }
 
+/**
+ * mongo_bson_iter_get_value_timestamp:
+ * @iter: (in): A #MongoBsonIter.
+ * @timestamp: (out) (allow-none): A location for the seconds since the
+ *   UNIX epoch.
+ * @increment: (out) (allow-none): A location for the ordinal of the
+ *   operation within @timestamp.
+ *
+ * Fetches the current value pointed to by @iter if the type is a
+ * %MONGO_BSON_TIMESTAMP.
+ */
+void
+mongo_bson_iter_get_value_timestamp (MongoBsonIter *iter,
+                                     guint32       *timestamp,
+                                     guint32       *increment)
+{
+   guint64 value;
+
+   g_return_if_fail(iter != NULL);
+
+   if (ITER_IS_TYPE(iter, MONGO_BSON_TIMESTAMP)) {
+      memcpy(&value, iter->user_data6, sizeof value);
+      value = GUINT64_FROM_LE(value);
+      if (timestamp) {
+         *timestamp = value >> 32;
+      }
+      if (increment) {
+         *increment = value & 0xFFFFFFFF;
+      }
+      return;
+   }
+
+   g_warning("Current value is not a Timestamp");
+}
+
 /**
  * mongo_bson_iter_get_value_timeval:
  * @iter: (in): A #MongoBsonIter.
@@ -1139,6 +1519,7 @@ mongo_bson_iter_get_value_type (MongoBsonIter *iter)
    case MONGO_BSON_UTF8:
    case MONGO_BSON_DOCUMENT:
    case MONGO_BSON_ARRAY:
+   case MONGO_BSON_BINARY:
    case MONGO_BSON_UNDEFINED:
    case MONGO_BSON_OBJECT_ID:
    case MONGO_BSON_BOOLEAN:
@@ -1147,6 +1528,7 @@ mongo_bson_iter_get_value_type (MongoBsonIter *iter)
    case MONGO_BSON_REGEX:
    case MONGO_BSON_INT32:
    case MONGO_BSON_INT64:
+   case MONGO_BSON_TIMESTAMP:
       return type;
    default:
       g_warning("Unknown BSON type 0x%02x", type);
@@ -1172,8 +1554,12 @@ mongo_bson_iter_is_key (MongoBsonIter *iter,
    g_return_val_if_fail(iter, FALSE);
    g_return_val_if_fail(key, FALSE);
 
-   current_key = mongo_bson_iter_get_key(iter);
-   return !g_strcmp0(key, current_key);
+   if (!(current_key = mongo_bson_iter_get_key(iter))) {
+      return FALSE;
+   }
+
+   return ((iter->reserved1 == strlen(key)) &&
+           !memcmp(key, current_key, iter->reserved1));
 }
 
 /**
@@ -1211,19 +1597,22 @@ mongo_bson_iter_recurse (MongoBsonIter *iter,
    return FALSE;
 }
 
+/*
+ * Returns the offset of the first NUL in @data, or @max_bytes if there is
+ * none. memchr() is vectorized by the C library, which also picks the
+ * best implementation for the CPU at runtime.
+ */
 static inline guint
 first_nul (const gchar *data,
            guint        max_bytes)
 {
-   guint i;
+   const gchar *nul;
 
-   for (i = 0; i < max_bytes; i++) {
-      if (!data[i]) {
-         return i;
-      }
+   if ((nul = memchr(data, '\0', max_bytes))) {
+      return nul - data;
    }
 
-   return 0;
+   return max_bytes;
 }
 
 /**
@@ -1247,6 +1636,7 @@ mongo_bson_iter_next (MongoBsonIter *iter)
    const guint8 *value2;
    const gchar *end = NULL;
    guint32 max_len;
+   guint32 key_len;
    guint32 v32;
 
    ENTRY;
@@ -1285,11 +1675,11 @@ mongo_bson_iter_next (MongoBsonIter *iter)
     * Get the key of the next field.
     */
    key = (const gchar *)&rawbuf[++offset];
-   max_len = first_nul(key, rawbuf_len - offset - 1);
-   if (!g_utf8_validate(key, max_len, &end)) {
+   key_len = first_nul(key, rawbuf_len - offset - 1);
+   if ((key_len == (rawbuf_len - offset - 1)) || utf8_check(key, key_len)) {
       GOTO(failure);
    }
-   offset += strlen(key) + 1;
+   offset += key_len + 1;
 
    switch (type) {
    case MONGO_BSON_UTF8:
@@ -1333,6 +1723,19 @@ mongo_bson_iter_next (MongoBsonIter *iter)
          }
       }
       GOTO(failure);
+   case MONGO_BSON_BINARY:
+      if ((offset + 5) < rawbuf_len) {
+         value1 = &rawbuf[offset];
+         value2 = &rawbuf[offset + 5];
+         memcpy(&v32, value1, sizeof v32);
+         max_len = GUINT32_FROM_LE(v32);
+         if ((max_len < rawbuf_len) &&
+             ((offset + 5 + max_len) < rawbuf_len)) {
+            offset += 4 + max_len;
+            GOTO(success);
+         }
+      }
+      GOTO(failure);
    case MONGO_BSON_NULL:
    case MONGO_BSON_UNDEFINED:
       value1 = NULL;
@@ -1357,6 +1760,7 @@ mongo_bson_iter_next (MongoBsonIter *iter)
    case MONGO_BSON_DATE_TIME:
    case MONGO_BSON_DOUBLE:
    case MONGO_BSON_INT64:
+   case MONGO_BSON_TIMESTAMP:
       if ((offset + 8) < rawbuf_len) {
          value1 = &rawbuf[offset];
          value2 = NULL;
@@ -1367,7 +1771,7 @@ mongo_bson_iter_next (MongoBsonIter *iter)
    case MONGO_BSON_REGEX:
       value1 = &rawbuf[offset];
       max_len = first_nul((gchar *)value1, rawbuf_len - offset - 1);
-      if (!g_utf8_validate((gchar *)value1, max_len, &end)) {
+      if (utf8_check((gchar *)value1, max_len)) {
          GOTO(failure);
       }
       offset += max_len + 1;
@@ -1376,7 +1780,7 @@ mongo_bson_iter_next (MongoBsonIter *iter)
       }
       value2 = &rawbuf[offset];
       max_len = first_nul((gchar *)value2, rawbuf_len - offset - 1);
-      if (!g_utf8_validate((gchar *)value2, max_len, &end)) {
+      if (utf8_check((gchar *)value2, max_len)) {
          GOTO(failure);
       }
       offset += max_len + 1;
@@ -1400,6 +1804,7 @@ success:
    iter->user_data5 = GINT_TO_POINTER(type);
    iter->user_data6 = (gpointer)value1;
    iter->user_data7 = (gpointer)value2;
+   iter->reserved1 = key_len;
    RETURN(TRUE);
 
 failure:
@@ -1538,6 +1943,28 @@ again:
       case MONGO_BSON_UNDEFINED:
          g_string_append(str, "undefined");
          break;
+      case MONGO_BSON_BINARY:
+         {
+            const guint8 *data;
+            guint8 subtype = 0;
+            gsize len = 0;
+            gchar *b64;
+
+            data = mongo_bson_iter_get_value_binary(&iter, &subtype, &len);
+            b64 = g_base64_encode(data, len);
+            g_string_append_printf(str, "BinData(%u, \"%s\")", subtype, b64);
+            g_free(b64);
+         }
+         break;
+      case MONGO_BSON_TIMESTAMP:
+         {
+            guint32 ts = 0;
+            guint32 inc = 0;
+
+            mongo_bson_iter_get_value_timestamp(&iter, &ts, &inc);
+            g_string_append_printf(str, "Timestamp(%u, %u)", ts, inc);
+         }
+         break;
       default:
          g_assert_not_reached();
       }
@@ -1553,6 +1980,42 @@ again:
    return g_string_free(str, FALSE);
 }
 
+/**
+ * mongo_bson_index_key:
+ * @idx: (in): The index of an array element.
+ * @buf: (out caller-allocates) (array fixed-size=12): A buffer of at least
+ *   12 bytes.
+ *
+ * Gets the key for the array element at @idx, such as "7" for 7. Keys
+ * for the first 1000 elements come from a table built once, so building
+ * an array does not format a string for every element. Larger indexes
+ * are formatted into @buf.
+ *
+ * Returns: The key, which is either a static string or @buf.
+ */
+const gchar *
+mongo_bson_index_key (guint  idx,
+                      gchar *buf)
+{
+   static gsize initialized;
+   guint i;
+
+   g_return_val_if_fail(buf, NULL);
+
+   if (idx < MONGO_BSON_N_INDEX_KEYS) {
+      if (g_once_init_enter(&initialized)) {
+         for (i = 0; i < MONGO_BSON_N_INDEX_KEYS; i++) {
+            g_snprintf(gIndexKeys[i], sizeof gIndexKeys[i], "%u", i);
+         }
+         g_once_init_leave(&initialized, TRUE);
+      }
+      return gIndexKeys[idx];
+   }
+
+   g_snprintf(buf, 12, "%u", idx);
+   return buf;
+}
+
 /**
  * mongo_bson_join:
  * @bson: (in): A #MongoBson.
@@ -90,6 +90,17 @@ G_BEGIN_DECLS
 #define MONGO_BSON_ITER_HOLDS_ARRAY(b) \
    (MONGO_BSON_ITER_HOLDS(b, MONGO_BSON_ARRAY))
 
+/**
+ * MONGO_BSON_ITER_HOLDS_BINARY:
+ * @b: A #MongoBsonIter.
+ *
+ * Checks to see if @b is pointing at a field of type %MONGO_BSON_BINARY.
+ *
+ * Returns: %TRUE if the type matches.
+ */
+#define MONGO_BSON_ITER_HOLDS_BINARY(b) \
+   (MONGO_BSON_ITER_HOLDS(b, MONGO_BSON_BINARY))
+
 /**
  * MONGO_BSON_ITER_HOLDS_UNDEFINED:
  * @b: A #MongoBsonIter.
@@ -178,6 +189,17 @@ G_BEGIN_DECLS
 #define MONGO_BSON_ITER_HOLDS_INT64(b) \
    (MONGO_BSON_ITER_HOLDS(b, MONGO_BSON_INT64))
 
+/**
+ * MONGO_BSON_ITER_HOLDS_TIMESTAMP:
+ * @b: A #MongoBsonIter.
+ *
+ * Checks to see if @b is pointing at a field of type %MONGO_BSON_TIMESTAMP.
+ *
+ * Returns: %TRUE if the type matches.
+ */
+#define MONGO_BSON_ITER_HOLDS_TIMESTAMP(b) \
+   (MONGO_BSON_ITER_HOLDS(b, MONGO_BSON_TIMESTAMP))
+
 /**
  * MongoBson:
  * @data (array length=len): The raw bson buffer.
@@ -200,7 +222,7 @@ typedef struct _MongoBson MongoBson;
  * @user_data6: Pointer to first value for mutli-value fields.
  * @user_data7: Pointer to second value for multi-value fields.
  * @flags: flags used while parsing data.
- * @reserved1: reserved for future use.
+ * @reserved1: The length of the current key.
  *
  * #MongoBsonIter is used to iterate through the contents of a #MongoBson.
  * It is meant to be used on the stack and can allow for reading data
@@ -222,6 +244,8 @@ typedef struct _MongoBsonIter MongoBsonIter;
  * @MONGO_BSON_NULL: Field contains %NULL.
  * @MONGO_BSON_REGEX: Field contains a #GRegex.
  * @MONGO_BSON_INT32: Field contains a #gint32.
+ * @MONGO_BSON_TIMESTAMP: Field contains a MongoDB internal timestamp, such
+ *   as those found in the oplog.
  * @MONGO_BSON_INT64: Field contains a #gint64.
  *
  * These enumerations specify the field type within a #MongoBson.
@@ -233,6 +257,7 @@ typedef enum
    MONGO_BSON_UTF8      = 0x02,
    MONGO_BSON_DOCUMENT  = 0x03,
    MONGO_BSON_ARRAY     = 0x04,
+   MONGO_BSON_BINARY    = 0x05,
    MONGO_BSON_UNDEFINED = 0x06,
    MONGO_BSON_OBJECT_ID = 0x07,
    MONGO_BSON_BOOLEAN   = 0x08,
@@ -240,6 +265,7 @@ typedef enum
    MONGO_BSON_NULL      = 0x0A,
    MONGO_BSON_REGEX     = 0x0B,
    MONGO_BSON_INT32     = 0x10,
+   MONGO_BSON_TIMESTAMP = 0x11,
    MONGO_BSON_INT64     = 0x12,
 } MongoBsonType;
 
@@ -260,13 +286,14 @@ struct _MongoBsonIter
    gpointer user_data6; /* Value1 */
    gpointer user_data7; /* Value2 */
    gint32   flags;
-   gint32   reserved1;
+   gint32   reserved1;  /* Key length */
 };
 
 GType          mongo_bson_get_type                 (void) G_GNUC_CONST;
 GType          mongo_bson_type_get_type            (void) G_GNUC_CONST;
 MongoBson     *mongo_bson_new                      (void);
 MongoBson     *mongo_bson_new_empty                (void);
+MongoBson     *mongo_bson_new_sized                (gsize            size);
 MongoBson     *mongo_bson_new_from_data            (const guint8    *buffer,
                                                     gsize            length);
 MongoBson     *mongo_bson_new_take_data            (guint8          *buffer,
@@ -277,6 +304,15 @@ void           mongo_bson_unref                    (MongoBson       *bson);
 void           mongo_bson_append_array             (MongoBson       *bson,
                                                     const gchar     *key,
                                                     const MongoBson *value);
+void           mongo_bson_append_binary            (MongoBson       *bson,
+                                                    const gchar     *key,
+                                                    guint8           subtype,
+                                                    const guint8    *data,
+                                                    gsize            length);
+guint          mongo_bson_append_array_begin       (MongoBson       *bson,
+                                                    const gchar     *key);
+void           mongo_bson_append_array_end         (MongoBson       *bson,
+                                                    guint            offset);
 void           mongo_bson_append_boolean           (MongoBson       *bson,
                                                     const gchar     *key,
                                                     gboolean        value);
@@ -286,6 +322,10 @@ void           mongo_bson_append_bson              (MongoBson       *bson,
 void           mongo_bson_append_date_time         (MongoBson       *bson,
                                                     const gchar     *key,
                                                     GDateTime       *value);
+guint          mongo_bson_append_document_begin    (MongoBson       *bson,
+                                                    const gchar     *key);
+void           mongo_bson_append_document_end      (MongoBson       *bson,
+                                                    guint            offset);
 void           mongo_bson_append_double            (MongoBson       *bson,
                                                     const gchar     *key,
                                                     gdouble          value);
@@ -307,12 +347,18 @@ void           mongo_bson_append_regex             (MongoBson       *bson,
 void           mongo_bson_append_string            (MongoBson       *bson,
                                                     const gchar     *key,
                                                     const gchar     *value);
+void           mongo_bson_append_timestamp         (MongoBson       *bson,
+                                                    const gchar     *key,
+                                                    guint32          timestamp,
+                                                    guint32          increment);
 void           mongo_bson_append_timeval           (MongoBson       *bson,
                                                     const gchar     *key,
                                                     GTimeVal        *value);
 void           mongo_bson_append_undefined         (MongoBson       *bson,
                                                     const gchar     *key);
 gboolean       mongo_bson_get_empty                (MongoBson       *bson);
+const gchar   *mongo_bson_index_key                (guint            idx,
+                                                    gchar           *buf);
 void           mongo_bson_join                     (MongoBson       *bson,
                                                     const MongoBson *other);
 void           mongo_bson_iter_init                (MongoBsonIter   *iter,
@@ -324,6 +370,9 @@ gboolean       mongo_bson_iter_find                (MongoBsonIter   *iter,
                                                     const gchar     *key);
 const gchar   *mongo_bson_iter_get_key             (MongoBsonIter   *iter);
 MongoBson     *mongo_bson_iter_get_value_array     (MongoBsonIter   *iter);
+const guint8  *mongo_bson_iter_get_value_binary    (MongoBsonIter   *iter,
+                                                    guint8          *subtype,
+                                                    gsize           *length);
 gboolean       mongo_bson_iter_get_value_boolean   (MongoBsonIter   *iter);
 MongoBson     *mongo_bson_iter_get_value_bson      (MongoBsonIter   *iter);
 GDateTime     *mongo_bson_iter_get_value_date_time (MongoBsonIter   *iter);
@@ -336,6 +385,9 @@ void           mongo_bson_iter_get_value_regex     (MongoBsonIter   *iter,
                                                     const gchar    **options);
 const gchar   *mongo_bson_iter_get_value_string    (MongoBsonIter   *iter,
                                                     gsize           *length);
+void           mongo_bson_iter_get_value_timestamp (MongoBsonIter   *iter,
+                                                    guint32         *timestamp,
+                                                    guint32         *increment);
 void           mongo_bson_iter_get_value_timeval   (MongoBsonIter   *iter,
                                                     GTimeVal        *value);
 MongoBsonType  mongo_bson_iter_get_value_type      (MongoBsonIter   *iter);
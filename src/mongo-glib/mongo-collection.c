@@ -541,6 +541,7 @@ mongo_collection_delete_async (MongoCollection      *collection,
                              priv->db_and_collection,
                              flags,
                              selector,
+                             NULL,
                              cancellable,
                              mongo_collection_delete_cb,
                              simple);
@@ -632,6 +633,7 @@ mongo_collection_update_async (MongoCollection      *collection,
                              flags,
                              selector,
                              update,
+                             NULL,
                              cancellable,
                              mongo_collection_update_cb,
                              simple);
@@ -720,6 +722,7 @@ mongo_collection_insert_async (MongoCollection      *collection,
                              flags,
                              documents,
                              n_documents,
+                             NULL,
                              cancellable,
                              mongo_collection_insert_cb,
                              simple);
@@ -34,8 +34,7 @@
  */
 
 /*
- * TODO: Query replica set information occasionally.
- *       Support the rest of the options currently parsed.
+ * TODO: Support the rest of the options currently parsed.
  *       Resiliency to network partitions.
  *       Memory leak detection.
  *
@@ -47,6 +46,31 @@ G_DEFINE_TYPE(MongoConnection, mongo_connection, G_TYPE_OBJECT)
 #define MONGO_PORT_DEFAULT 27017
 #endif
 
+/*
+ * Number of sockets to open to the primary unless maxPoolSize is given
+ * in the connection URI.
+ */
+#ifndef MONGO_CONNECTION_MAX_POOL_SIZE
+#define MONGO_CONNECTION_MAX_POOL_SIZE 1
+#endif
+
+/*
+ * Number of seconds between ismaster requests used to track changes
+ * to the replica set.
+ */
+#ifndef MONGO_CONNECTION_TOPOLOGY_INTERVAL
+#define MONGO_CONNECTION_TOPOLOGY_INTERVAL 30
+#endif
+
+/*
+ * Seconds a cursor may go unused before it is unpinned from its
+ * protocol. The server times out idle cursors after ten minutes, so a
+ * cursor abandoned without killCursors is gone by then anyway.
+ */
+#ifndef MONGO_CONNECTION_CURSOR_TIMEOUT
+#define MONGO_CONNECTION_CURSOR_TIMEOUT 600
+#endif
+
 struct _MongoConnectionPrivate
 {
    /*
@@ -55,10 +79,32 @@ struct _MongoConnectionPrivate
    GHashTable *databases;
 
    /*
-    * Connection and protocol.
+    * Connection and pool of protocols to the primary.
     */
    GSocketClient *socket_client;
-   MongoProtocol *protocol;
+   GPtrArray *protocols;
+   gchar *connecting_host;
+   gchar *host;
+   guint max_pool_size;
+   guint n_pool_connecting;
+   guint pool_generation;
+
+   /*
+    * Secondaries of the replica set keyed by host. The value is the
+    * MongoProtocol for the secondary, or NULL while connecting.
+    */
+   GHashTable *secondaries;
+   MongoReadPreference read_preference;
+   guint topology_handler;
+
+   /*
+    * Hashtable of cursor id to the CursorPin for the MongoProtocol that
+    * owns the cursor. The protocols are borrowed from the pool. Pins
+    * idle past MONGO_CONNECTION_CURSOR_TIMEOUT are swept at most that
+    * often.
+    */
+   GHashTable *cursors;
+   gint64 cursors_swept_at;
 
    /*
     * Cancellable emitted when shutting down.
@@ -100,9 +146,40 @@ struct _MongoConnectionPrivate
 
 typedef struct
 {
-   MongoOperation oper;
+   MongoConnection *connection;
+   guint generation;
+} PoolConnect;
+
+typedef struct
+{
+   MongoProtocol *protocol;
+   gint64 used_at;
+} CursorPin;
+
+typedef struct
+{
+   MongoConnection *connection;
+   gchar *host;
+   guint generation;
+} SecondaryConnect;
+
+typedef enum
+{
+   REQUEST_UPDATE,
+   REQUEST_INSERT,
+   REQUEST_QUERY,
+   REQUEST_GETMORE,
+   REQUEST_DELETE,
+   REQUEST_KILL_CURSORS,
+   REQUEST_BULK_WRITE,
+} RequestKind;
+
+typedef struct
+{
+   RequestKind kind;
    GSimpleAsyncResult *simple;
    GCancellable *cancellable;
+   MongoWriteConcern *concern;
    union {
       struct {
          gchar *db_and_collection;
@@ -136,12 +213,20 @@ typedef struct
       struct {
          GArray *cursors;
       } kill_cursors;
+      struct {
+         gchar *db_and_collection;
+         GArray *operations;
+      } bulk_write;
    } u;
 } Request;
 
 enum
 {
    PROP_0,
+   PROP_IN_FLIGHT,
+   PROP_MAX_POOL_SIZE,
+   PROP_POOL_SIZE,
+   PROP_READ_PREFERENCE,
    PROP_REPLICA_SET,
    PROP_SLAVE_OKAY,
    PROP_URI,
@@ -167,6 +252,66 @@ static guint       gSignals[LAST_SIGNAL];
 
 static void mongo_connection_start_connecting (MongoConnection *connection);
 
+static gboolean
+mongo_connection_cursor_is_idle (gpointer key,
+                                 gpointer value,
+                                 gpointer user_data)
+{
+   CursorPin *pin = value;
+   gint64 *now = user_data;
+
+   return ((*now - pin->used_at) >=
+           (MONGO_CONNECTION_CURSOR_TIMEOUT * G_USEC_PER_SEC));
+}
+
+static void
+mongo_connection_track_cursor (MongoConnection *connection,
+                               MongoProtocol   *protocol,
+                               guint64          cursor_id)
+{
+   MongoConnectionPrivate *priv;
+   CursorPin *pin;
+   gint64 *key;
+   gint64 now;
+
+   g_assert(MONGO_IS_CONNECTION(connection));
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+   g_assert(cursor_id);
+
+   priv = connection->priv;
+   now = g_get_monotonic_time();
+
+   /*
+    * Cursors that are abandoned without killCursors are never unpinned
+    * otherwise.
+    */
+   if ((now - priv->cursors_swept_at) >=
+       (MONGO_CONNECTION_CURSOR_TIMEOUT * G_USEC_PER_SEC)) {
+      g_hash_table_foreach_remove(priv->cursors,
+                                  mongo_connection_cursor_is_idle,
+                                  &now);
+      priv->cursors_swept_at = now;
+   }
+
+   key = g_new(gint64, 1);
+   *key = cursor_id;
+   pin = g_new(CursorPin, 1);
+   pin->protocol = protocol;
+   pin->used_at = now;
+   g_hash_table_replace(priv->cursors, key, pin);
+}
+
+static void
+mongo_connection_untrack_cursor (MongoConnection *connection,
+                                 guint64          cursor_id)
+{
+   gint64 key = cursor_id;
+
+   g_assert(MONGO_IS_CONNECTION(connection));
+
+   g_hash_table_remove(connection->priv->cursors, &key);
+}
+
 static void
 mongo_connection_update_cb (GObject      *object,
                             GAsyncResult *result,
@@ -234,9 +379,11 @@ mongo_connection_query_cb (GObject      *object,
                            gpointer      user_data)
 {
    GSimpleAsyncResult *simple = user_data;
+   MongoConnection *connection;
    MongoProtocol *protocol = (MongoProtocol *)object;
    MongoMessageReply *reply;
    GError *error = NULL;
+   guint64 cursor_id;
 
    g_assert(MONGO_IS_PROTOCOL(protocol));
    g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
@@ -244,6 +391,16 @@ mongo_connection_query_cb (GObject      *object,
    if (!(reply = mongo_protocol_query_finish(protocol, result, &error))) {
       g_simple_async_result_take_error(simple, error);
    } else {
+      /*
+       * Pin the cursor to this socket so that getmore and killCursors
+       * follow it.
+       */
+      if ((cursor_id = mongo_message_reply_get_cursor_id(reply))) {
+         connection = MONGO_CONNECTION(
+               g_async_result_get_source_object(G_ASYNC_RESULT(simple)));
+         mongo_connection_track_cursor(connection, protocol, cursor_id);
+         g_object_unref(connection);
+      }
       g_simple_async_result_set_op_res_gpointer(simple, reply, g_object_unref);
    }
 
@@ -259,9 +416,11 @@ mongo_connection_getmore_cb (GObject      *object,
                              gpointer      user_data)
 {
    GSimpleAsyncResult *simple = user_data;
+   MongoConnection *connection;
    MongoProtocol *protocol = (MongoProtocol *)object;
    MongoMessageReply *reply;
    GError *error = NULL;
+   guint64 *cursor_id;
 
    ENTRY;
 
@@ -274,6 +433,18 @@ mongo_connection_getmore_cb (GObject      *object,
       g_simple_async_result_set_op_res_gpointer(simple, reply, g_object_unref);
    }
 
+   /*
+    * Unpin the cursor once the server has exhausted it, or when the
+    * getmore failed since the cursor cannot be followed any further.
+    */
+   if ((!reply || !mongo_message_reply_get_cursor_id(reply)) &&
+       (cursor_id = g_object_get_data(G_OBJECT(simple), "cursor-id"))) {
+      connection = MONGO_CONNECTION(
+            g_async_result_get_source_object(G_ASYNC_RESULT(simple)));
+      mongo_connection_untrack_cursor(connection, *cursor_id);
+      g_object_unref(connection);
+   }
+
    mongo_simple_async_result_complete_in_idle(simple);
    g_object_unref(simple);
 
@@ -332,6 +503,38 @@ mongo_connection_kill_cursors_cb (GObject      *object,
    EXIT;
 }
 
+static void
+mongo_connection_bulk_write_cb (GObject      *object,
+                                GAsyncResult *result,
+                                gpointer      user_data)
+{
+   GSimpleAsyncResult *simple = user_data;
+   MongoProtocol *protocol = (MongoProtocol *)object;
+   gboolean ret;
+   gssize failed_index = -1;
+   GError *error = NULL;
+
+   ENTRY;
+
+   g_return_if_fail(MONGO_IS_PROTOCOL(protocol));
+   g_return_if_fail(G_IS_SIMPLE_ASYNC_RESULT(simple));
+
+   if (!(ret = mongo_protocol_bulk_write_finish(protocol,
+                                                result,
+                                                &failed_index,
+                                                &error))) {
+      g_simple_async_result_take_error(simple, error);
+   }
+
+   g_object_set_data(G_OBJECT(simple), "failed-index",
+                     GSIZE_TO_POINTER(failed_index + 1));
+   g_simple_async_result_set_op_res_gboolean(simple, ret);
+   mongo_simple_async_result_complete_in_idle(simple);
+   g_object_unref(simple);
+
+   EXIT;
+}
+
 static void
 request_fail (Request      *request,
               const GError *error)
@@ -344,30 +547,32 @@ static void
 request_run (Request       *request,
              MongoProtocol *protocol)
 {
-   switch (request->oper) {
-   case MONGO_OPERATION_UPDATE:
+   switch (request->kind) {
+   case REQUEST_UPDATE:
       mongo_protocol_update_async(
             protocol,
             request->u.update.db_and_collection,
             request->u.update.flags,
             request->u.update.selector,
             request->u.update.update,
+            request->concern,
             request->cancellable,
             mongo_connection_update_cb,
             g_object_ref(request->simple));
       break;
-   case MONGO_OPERATION_INSERT:
+   case REQUEST_INSERT:
       mongo_protocol_insert_async(
             protocol,
             request->u.insert.db_and_collection,
             request->u.insert.flags,
             (MongoBson **)request->u.insert.documents->pdata,
             request->u.insert.documents->len,
+            request->concern,
             request->cancellable,
             mongo_connection_insert_cb,
             g_object_ref(request->simple));
       break;
-   case MONGO_OPERATION_QUERY:
+   case REQUEST_QUERY:
       mongo_protocol_query_async(
             protocol,
             request->u.query.db_and_collection,
@@ -380,7 +585,12 @@ request_run (Request       *request,
             mongo_connection_query_cb,
             g_object_ref(request->simple));
       break;
-   case MONGO_OPERATION_GETMORE:
+   case REQUEST_GETMORE:
+      g_object_set_data_full(G_OBJECT(request->simple),
+                             "cursor-id",
+                             g_memdup(&request->u.getmore.cursor_id,
+                                      sizeof request->u.getmore.cursor_id),
+                             g_free);
       mongo_protocol_getmore_async(
             protocol,
             request->u.getmore.db_and_collection,
@@ -390,17 +600,18 @@ request_run (Request       *request,
             mongo_connection_getmore_cb,
             g_object_ref(request->simple));
       break;
-   case MONGO_OPERATION_DELETE:
+   case REQUEST_DELETE:
       mongo_protocol_delete_async(
             protocol,
             request->u.delete.db_and_collection,
             request->u.delete.flags,
             request->u.delete.selector,
+            request->concern,
             request->cancellable,
             mongo_connection_delete_cb,
             g_object_ref(request->simple));
       break;
-   case MONGO_OPERATION_KILL_CURSORS:
+   case REQUEST_KILL_CURSORS:
       mongo_protocol_kill_cursors_async(
             protocol,
             (guint64 *)(gpointer)request->u.kill_cursors.cursors->data,
@@ -409,8 +620,16 @@ request_run (Request       *request,
             mongo_connection_kill_cursors_cb,
             g_object_ref(request->simple));
       break;
-   case MONGO_OPERATION_REPLY:
-   case MONGO_OPERATION_MSG:
+   case REQUEST_BULK_WRITE:
+      mongo_protocol_bulk_write_async(
+            protocol,
+            request->u.bulk_write.db_and_collection,
+            (MongoBulkOperation *)(gpointer)request->u.bulk_write.operations->data,
+            request->u.bulk_write.operations->len,
+            request->cancellable,
+            mongo_connection_bulk_write_cb,
+            g_object_ref(request->simple));
+      break;
    default:
       g_assert_not_reached();
       break;
@@ -431,68 +650,791 @@ request_new (gpointer             source,
    g_assert(callback);
    g_assert(tag);
 
-   request = g_slice_new0(Request);
-   request->cancellable = cancellable ? g_object_ref(cancellable) : NULL;
-   request->simple = g_simple_async_result_new(source,
-                                               callback,
-                                               user_data,
-                                               tag);
-   g_simple_async_result_set_check_cancellable(request->simple,
-                                               cancellable);
+   request = g_slice_new0(Request);
+   request->cancellable = cancellable ? g_object_ref(cancellable) : NULL;
+   request->simple = g_simple_async_result_new(source,
+                                               callback,
+                                               user_data,
+                                               tag);
+   g_simple_async_result_set_check_cancellable(request->simple,
+                                               cancellable);
+
+   return request;
+}
+
+static void
+request_free (Request *request)
+{
+   MongoBulkOperation *op;
+   guint i;
+
+   if (request) {
+      g_clear_object(&request->simple);
+      g_clear_object(&request->cancellable);
+      mongo_write_concern_free(request->concern);
+      switch (request->kind) {
+      case REQUEST_UPDATE:
+         g_free(request->u.update.db_and_collection);
+         if (request->u.update.selector) {
+            mongo_bson_unref(request->u.update.selector);
+         }
+         if (request->u.update.update) {
+            mongo_bson_unref(request->u.update.update);
+         }
+         break;
+      case REQUEST_INSERT:
+         g_free(request->u.insert.db_and_collection);
+         g_ptr_array_free(request->u.insert.documents, TRUE);
+         break;
+      case REQUEST_QUERY:
+         g_free(request->u.insert.db_and_collection);
+         if (request->u.query.query) {
+            mongo_bson_unref(request->u.query.query);
+         }
+         if (request->u.query.field_selector) {
+            mongo_bson_unref(request->u.query.field_selector);
+         }
+         break;
+      case REQUEST_GETMORE:
+         g_free(request->u.insert.db_and_collection);
+         break;
+      case REQUEST_DELETE:
+         g_free(request->u.insert.db_and_collection);
+         if (request->u.delete.selector) {
+            mongo_bson_unref(request->u.delete.selector);
+         }
+         break;
+      case REQUEST_KILL_CURSORS:
+         g_array_free(request->u.kill_cursors.cursors, TRUE);
+         break;
+      case REQUEST_BULK_WRITE:
+         g_free(request->u.bulk_write.db_and_collection);
+         for (i = 0; i < request->u.bulk_write.operations->len; i++) {
+            op = &g_array_index(request->u.bulk_write.operations,
+                                MongoBulkOperation, i);
+            if (op->selector) {
+               mongo_bson_unref(op->selector);
+            }
+            if (op->document) {
+               mongo_bson_unref(op->document);
+            }
+         }
+         g_array_free(request->u.bulk_write.operations, TRUE);
+         break;
+      default:
+         g_assert_not_reached();
+         break;
+      }
+      memset(&request->u, 0, sizeof request->u);
+      g_slice_free(Request, request);
+   }
+}
+
+static gboolean
+mongo_connection_cursor_is_on (gpointer key,
+                               gpointer value,
+                               gpointer user_data)
+{
+   CursorPin *pin = value;
+
+   return (pin->protocol == user_data);
+}
+
+static void mongo_connection_protocol_failed (MongoProtocol   *protocol,
+                                              const GError    *error,
+                                              MongoConnection *connection);
+
+static MongoProtocol *
+mongo_connection_protocol_new (MongoConnection   *connection,
+                               GSocketConnection *conn)
+{
+   MongoConnectionPrivate *priv;
+
+   g_assert(MONGO_IS_CONNECTION(connection));
+   g_assert(G_IS_SOCKET_CONNECTION(conn));
+
+   priv = connection->priv;
+
+   return g_object_new(MONGO_TYPE_PROTOCOL,
+                       "fsync", priv->fsync,
+                       "io-stream", conn,
+                       "journal", priv->journal,
+                       "safe", priv->safe,
+                       "write-timeout", priv->wtimeoutms,
+                       "write-quorum", priv->w,
+                       NULL);
+}
+
+static void
+mongo_connection_add_protocol (MongoConnection *connection,
+                               MongoProtocol   *protocol)
+{
+   ENTRY;
+
+   g_assert(MONGO_IS_CONNECTION(connection));
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+
+   g_ptr_array_add(connection->priv->protocols, g_object_ref(protocol));
+
+   /*
+    * Wire up failure of the protocol so that we can replace it, or
+    * connect to the next host if the pool is empty.
+    */
+   g_signal_connect(protocol, "failed",
+                    G_CALLBACK(mongo_connection_protocol_failed),
+                    connection);
+
+   EXIT;
+}
+
+static void
+mongo_connection_remove_protocol (MongoConnection *connection,
+                                  MongoProtocol   *protocol)
+{
+   MongoConnectionPrivate *priv;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_CONNECTION(connection));
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+
+   priv = connection->priv;
+
+   g_signal_handlers_disconnect_by_func(protocol,
+                                        mongo_connection_protocol_failed,
+                                        connection);
+   g_hash_table_foreach_remove(priv->cursors,
+                               mongo_connection_cursor_is_on,
+                               protocol);
+   g_ptr_array_remove(priv->protocols, protocol);
+
+   EXIT;
+}
+
+/**
+ * mongo_connection_select:
+ * @connection: (in): A #MongoConnection.
+ * @request: (in): A #Request.
+ *
+ * Selects the protocol in the pool that @request should be sent on.
+ * getmore and killCursors follow the socket that owns the cursor,
+ * everything else goes to the socket with the fewest requests waiting
+ * on a reply.
+ *
+ * Returns: (transfer none): A #MongoProtocol.
+ */
+static MongoProtocol *
+mongo_connection_select (MongoConnection *connection,
+                         Request         *request)
+{
+   MongoConnectionPrivate *priv;
+   CursorPin *pin;
+   GHashTableIter iter;
+   MongoProtocol *protocol = NULL;
+   MongoProtocol *tmp;
+   gint64 cursor_id = 0;
+   guint n_pending;
+   guint min_pending = G_MAXUINT;
+   guint i;
+
+   g_assert(MONGO_IS_CONNECTION(connection));
+   g_assert(request);
+
+   priv = connection->priv;
+
+   g_assert(priv->protocols->len);
+
+   if (request->kind == REQUEST_GETMORE) {
+      cursor_id = request->u.getmore.cursor_id;
+   } else if (request->kind == REQUEST_KILL_CURSORS) {
+      cursor_id = g_array_index(request->u.kill_cursors.cursors, guint64, 0);
+   }
+
+   if (cursor_id && (pin = g_hash_table_lookup(priv->cursors, &cursor_id))) {
+      pin->used_at = g_get_monotonic_time();
+      return pin->protocol;
+   }
+
+   /*
+    * Queries that allow reading from a secondary may go to the least
+    * loaded secondary. Commands always go to the primary since some of
+    * them, such as findAndModify, write.
+    */
+   if ((request->kind == REQUEST_QUERY) &&
+       (request->u.query.flags & MONGO_QUERY_SLAVE_OK) &&
+       (priv->read_preference != MONGO_READ_PRIMARY) &&
+       !g_str_has_suffix(request->u.query.db_and_collection, ".$cmd")) {
+      g_hash_table_iter_init(&iter, priv->secondaries);
+      while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&tmp)) {
+         if (tmp &&
+             ((n_pending = mongo_protocol_get_n_pending(tmp)) < min_pending)) {
+            min_pending = n_pending;
+            protocol = tmp;
+         }
+      }
+      if (protocol &&
+          (priv->read_preference == MONGO_READ_SECONDARY_PREFERRED)) {
+         return protocol;
+      }
+   }
+
+   for (i = 0; i < priv->protocols->len; i++) {
+      tmp = g_ptr_array_index(priv->protocols, i);
+      if ((n_pending = mongo_protocol_get_n_pending(tmp)) < min_pending) {
+         min_pending = n_pending;
+         protocol = tmp;
+      }
+   }
+
+   return protocol;
+}
+
+static void
+mongo_connection_run (MongoConnection *connection,
+                      Request         *request)
+{
+   guint i;
+
+   g_assert(MONGO_IS_CONNECTION(connection));
+   g_assert(request);
+
+   request_run(request, mongo_connection_select(connection, request));
+
+   if (request->kind == REQUEST_KILL_CURSORS) {
+      for (i = 0; i < request->u.kill_cursors.cursors->len; i++) {
+         mongo_connection_untrack_cursor(
+               connection,
+               g_array_index(request->u.kill_cursors.cursors, guint64, i));
+      }
+   }
+}
+
+static void
+mongo_connection_pool_connect_cb (GObject      *object,
+                                  GAsyncResult *result,
+                                  gpointer      user_data)
+{
+   MongoConnectionPrivate *priv;
+   GSocketConnection *conn;
+   MongoConnection *connection;
+   GSocketClient *socket_client = (GSocketClient *)object;
+   MongoProtocol *protocol;
+   PoolConnect *pool_connect = user_data;
+   GError *error = NULL;
+
+   ENTRY;
+
+   g_assert(G_IS_SOCKET_CLIENT(socket_client));
+   g_assert(pool_connect);
+
+   connection = pool_connect->connection;
+   priv = connection->priv;
+
+   conn = g_socket_client_connect_to_host_finish(socket_client,
+                                                 result,
+                                                 &error);
+
+   /*
+    * Drop the socket if the pool was torn down while we were connecting,
+    * since it may now be for a different host.
+    */
+   if (pool_connect->generation == priv->pool_generation) {
+      priv->n_pool_connecting--;
+      if (!conn) {
+         g_message("Failed to grow connection pool: %s", error->message);
+      } else if (priv->state == STATE_CONNECTED) {
+         protocol = mongo_connection_protocol_new(connection, conn);
+         mongo_connection_add_protocol(connection, protocol);
+         g_object_unref(protocol);
+      }
+   }
+
+   g_clear_error(&error);
+   g_clear_object(&conn);
+   g_object_unref(pool_connect->connection);
+   g_slice_free(PoolConnect, pool_connect);
+
+   EXIT;
+}
+
+/**
+ * mongo_connection_grow_pool:
+ * @connection: (in): A #MongoConnection.
+ *
+ * Opens sockets to the primary until the pool contains "max-pool-size"
+ * protocols. The primary was already verified with ismaster by the
+ * first socket, so additional sockets are used as soon as they connect.
+ */
+static void
+mongo_connection_grow_pool (MongoConnection *connection)
+{
+   MongoConnectionPrivate *priv;
+   PoolConnect *pool_connect;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_CONNECTION(connection));
+
+   priv = connection->priv;
+
+   g_assert(priv->host);
+
+   while ((priv->protocols->len + priv->n_pool_connecting) <
+          priv->max_pool_size) {
+      pool_connect = g_slice_new0(PoolConnect);
+      pool_connect->connection = g_object_ref(connection);
+      pool_connect->generation = priv->pool_generation;
+      priv->n_pool_connecting++;
+      g_socket_client_connect_to_host_async(priv->socket_client,
+                                            priv->host,
+                                            MONGO_PORT_DEFAULT,
+                                            priv->dispose_cancel,
+                                            mongo_connection_pool_connect_cb,
+                                            pool_connect);
+   }
+
+   EXIT;
+}
+
+static void
+mongo_connection_secondary_failed (MongoProtocol   *protocol,
+                                   const GError    *error,
+                                   MongoConnection *connection)
+{
+   MongoConnectionPrivate *priv;
+   GHashTableIter iter;
+   gpointer value;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+   g_assert(MONGO_IS_CONNECTION(connection));
+
+   priv = connection->priv;
+
+   g_message("Mongo secondary failure: %s.",
+             error ? error->message : "Unknown error");
+
+   /*
+    * Forget the secondary. It will be reconnected the next time the
+    * replica set is refreshed if it is still a member.
+    */
+   g_signal_handlers_disconnect_by_func(protocol,
+                                        mongo_connection_secondary_failed,
+                                        connection);
+   g_hash_table_foreach_remove(priv->cursors,
+                               mongo_connection_cursor_is_on,
+                               protocol);
+   g_hash_table_iter_init(&iter, priv->secondaries);
+   while (g_hash_table_iter_next(&iter, NULL, &value)) {
+      if (value == protocol) {
+         g_hash_table_iter_remove(&iter);
+         g_object_unref(protocol);
+         break;
+      }
+   }
+
+   EXIT;
+}
+
+static void
+mongo_connection_clear_secondaries (MongoConnection *connection)
+{
+   MongoConnectionPrivate *priv;
+   GHashTableIter iter;
+   MongoProtocol *protocol;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_CONNECTION(connection));
+
+   priv = connection->priv;
+
+   g_hash_table_iter_init(&iter, priv->secondaries);
+   while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&protocol)) {
+      if (protocol) {
+         g_signal_handlers_disconnect_by_func(protocol,
+                                              mongo_connection_secondary_failed,
+                                              connection);
+         g_hash_table_foreach_remove(priv->cursors,
+                                     mongo_connection_cursor_is_on,
+                                     protocol);
+         g_object_unref(protocol);
+      }
+      g_hash_table_iter_remove(&iter);
+   }
+
+   EXIT;
+}
+
+static void
+secondary_connect_free (SecondaryConnect *secondary_connect)
+{
+   g_object_unref(secondary_connect->connection);
+   g_free(secondary_connect->host);
+   g_slice_free(SecondaryConnect, secondary_connect);
+}
+
+/*
+ * Checks that a secondary we were connecting to is still wanted. The
+ * replica set may have been refreshed, or the primary lost, while the
+ * connection was in progress.
+ */
+static gboolean
+secondary_connect_is_current (SecondaryConnect *secondary_connect)
+{
+   MongoConnectionPrivate *priv = secondary_connect->connection->priv;
+   gpointer value = NULL;
+
+   return ((secondary_connect->generation == priv->pool_generation) &&
+           g_hash_table_lookup_extended(priv->secondaries,
+                                        secondary_connect->host,
+                                        NULL,
+                                        &value) &&
+           !value);
+}
+
+static void
+mongo_connection_secondary_ismaster_cb (GObject      *object,
+                                        GAsyncResult *result,
+                                        gpointer      user_data)
+{
+   MongoConnectionPrivate *priv;
+   SecondaryConnect *secondary_connect = user_data;
+   MongoMessageReply *reply;
+   MongoProtocol *protocol = (MongoProtocol *)object;
+   const MongoBson *docs;
+   MongoBsonIter iter;
+   gboolean secondary = FALSE;
+   gsize n_docs = 0;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+   g_assert(secondary_connect);
+
+   priv = secondary_connect->connection->priv;
+
+   if (!(reply = mongo_protocol_query_finish(protocol, result, NULL))) {
+      GOTO(failure);
+   }
+
+   /*
+    * Only use the member if it is currently a secondary of the
+    * replica set we were configured for.
+    */
+   docs = mongo_message_reply_peek_documents(reply, &n_docs);
+   if (n_docs) {
+      mongo_bson_iter_init(&iter, &docs[0]);
+      if (mongo_bson_iter_find(&iter, "secondary") &&
+          (mongo_bson_iter_get_value_type(&iter) == MONGO_BSON_BOOLEAN)) {
+         secondary = mongo_bson_iter_get_value_boolean(&iter);
+      }
+      if (priv->replica_set) {
+         mongo_bson_iter_init(&iter, &docs[0]);
+         if (!mongo_bson_iter_find(&iter, "setName") ||
+             (mongo_bson_iter_get_value_type(&iter) != MONGO_BSON_UTF8) ||
+             !!g_strcmp0(priv->replica_set,
+                         mongo_bson_iter_get_value_string(&iter, NULL))) {
+            secondary = FALSE;
+         }
+      }
+   }
+
+   g_object_unref(reply);
+
+   if (!secondary) {
+      GOTO(failure);
+   }
+
+   if (secondary_connect_is_current(secondary_connect)) {
+      g_hash_table_replace(priv->secondaries,
+                           g_strdup(secondary_connect->host),
+                           g_object_ref(protocol));
+      g_signal_connect(protocol, "failed",
+                       G_CALLBACK(mongo_connection_secondary_failed),
+                       secondary_connect->connection);
+   }
+
+   secondary_connect_free(secondary_connect);
+
+   EXIT;
+
+failure:
+   if (secondary_connect_is_current(secondary_connect)) {
+      g_hash_table_remove(priv->secondaries, secondary_connect->host);
+   }
+   secondary_connect_free(secondary_connect);
+
+   EXIT;
+}
+
+static void
+mongo_connection_secondary_connect_cb (GObject      *object,
+                                       GAsyncResult *result,
+                                       gpointer      user_data)
+{
+   SecondaryConnect *secondary_connect = user_data;
+   GSocketConnection *conn;
+   GSocketClient *socket_client = (GSocketClient *)object;
+   MongoProtocol *protocol;
+   MongoBson *command;
+   GError *error = NULL;
+
+   ENTRY;
+
+   g_assert(G_IS_SOCKET_CLIENT(socket_client));
+   g_assert(secondary_connect);
+
+   if (!(conn = g_socket_client_connect_to_host_finish(socket_client,
+                                                       result,
+                                                       &error))) {
+      g_message("Failed to connect to secondary: %s", error->message);
+      if (secondary_connect_is_current(secondary_connect)) {
+         g_hash_table_remove(secondary_connect->connection->priv->secondaries,
+                             secondary_connect->host);
+      }
+      secondary_connect_free(secondary_connect);
+      g_error_free(error);
+      EXIT;
+   }
+
+   protocol = mongo_connection_protocol_new(secondary_connect->connection,
+                                            conn);
+
+   command = mongo_bson_new_empty();
+   mongo_bson_append_int(command, "ismaster", 1);
+   mongo_protocol_query_async(protocol,
+                              "admin.$cmd",
+                              MONGO_QUERY_SLAVE_OK,
+                              0,
+                              1,
+                              command,
+                              NULL,
+                              NULL,
+                              mongo_connection_secondary_ismaster_cb,
+                              secondary_connect);
+   mongo_bson_unref(command);
+   g_object_unref(protocol);
+   g_object_unref(conn);
+
+   EXIT;
+}
+
+static void
+mongo_connection_add_members (MongoConnection *connection,
+                              const MongoBson *ismaster,
+                              const gchar     *key,
+                              const gchar     *primary,
+                              GHashTable      *members)
+{
+   MongoConnectionPrivate *priv;
+   SecondaryConnect *secondary_connect;
+   MongoBsonIter iter;
+   MongoBsonIter iter2;
+   const gchar *host;
+
+   g_assert(MONGO_IS_CONNECTION(connection));
+   g_assert(ismaster);
+   g_assert(key);
+   g_assert(members);
+
+   priv = connection->priv;
+
+   mongo_bson_iter_init(&iter, ismaster);
+   if (!mongo_bson_iter_find(&iter, key) ||
+       (mongo_bson_iter_get_value_type(&iter) != MONGO_BSON_ARRAY) ||
+       !mongo_bson_iter_recurse(&iter, &iter2)) {
+      return;
+   }
+
+   while (mongo_bson_iter_next(&iter2)) {
+      if (mongo_bson_iter_get_value_type(&iter2) != MONGO_BSON_UTF8) {
+         continue;
+      }
+      host = mongo_bson_iter_get_value_string(&iter2, NULL);
+      if (!g_strcmp0(host, primary) || !g_strcmp0(host, priv->host)) {
+         continue;
+      }
+      g_hash_table_add(members, (gchar *)host);
+      if (!g_hash_table_contains(priv->secondaries, host)) {
+         g_hash_table_insert(priv->secondaries, g_strdup(host), NULL);
+         secondary_connect = g_slice_new0(SecondaryConnect);
+         secondary_connect->connection = g_object_ref(connection);
+         secondary_connect->host = g_strdup(host);
+         secondary_connect->generation = priv->pool_generation;
+         g_socket_client_connect_to_host_async(
+               priv->socket_client,
+               host,
+               MONGO_PORT_DEFAULT,
+               priv->dispose_cancel,
+               mongo_connection_secondary_connect_cb,
+               secondary_connect);
+      }
+   }
+}
+
+/**
+ * mongo_connection_discover:
+ * @connection: (in): A #MongoConnection.
+ * @ismaster: (in): The reply to ismaster from the primary.
+ *
+ * Updates the set of secondaries from the members of the replica set
+ * listed by the primary. New members are connected to and members that
+ * have left the replica set are dropped.
+ */
+static void
+mongo_connection_discover (MongoConnection *connection,
+                           const MongoBson *ismaster)
+{
+   MongoConnectionPrivate *priv;
+   GHashTableIter iter;
+   MongoProtocol *protocol;
+   const gchar *primary = NULL;
+   MongoBsonIter biter;
+   GHashTable *members;
+   gchar *host;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_CONNECTION(connection));
+   g_assert(ismaster);
+
+   priv = connection->priv;
+
+   /*
+    * Secondaries are only used for reads, so there is no reason to hold
+    * sockets open to them unless the read preference allows it.
+    */
+   if (priv->read_preference == MONGO_READ_PRIMARY) {
+      mongo_connection_clear_secondaries(connection);
+      EXIT;
+   }
+
+   mongo_bson_iter_init(&biter, ismaster);
+   if (mongo_bson_iter_find(&biter, "primary") &&
+       (mongo_bson_iter_get_value_type(&biter) == MONGO_BSON_UTF8)) {
+      primary = mongo_bson_iter_get_value_string(&biter, NULL);
+   }
+
+   members = g_hash_table_new(g_str_hash, g_str_equal);
+   mongo_connection_add_members(connection, ismaster, "hosts",
+                                primary, members);
+   mongo_connection_add_members(connection, ismaster, "passives",
+                                primary, members);
+
+   g_hash_table_iter_init(&iter, priv->secondaries);
+   while (g_hash_table_iter_next(&iter,
+                                 (gpointer *)&host,
+                                 (gpointer *)&protocol)) {
+      if (!g_hash_table_contains(members, host)) {
+         if (protocol) {
+            g_signal_handlers_disconnect_by_func(
+                  protocol,
+                  mongo_connection_secondary_failed,
+                  connection);
+            g_hash_table_foreach_remove(priv->cursors,
+                                        mongo_connection_cursor_is_on,
+                                        protocol);
+            g_object_unref(protocol);
+         }
+         g_hash_table_iter_remove(&iter);
+      }
+   }
+
+   g_hash_table_unref(members);
 
-   return request;
+   EXIT;
 }
 
 static void
-request_free (Request *request)
+mongo_connection_topology_cb (GObject      *object,
+                              GAsyncResult *result,
+                              gpointer      user_data)
 {
-   if (request) {
-      g_clear_object(&request->simple);
-      g_clear_object(&request->cancellable);
-      switch (request->oper) {
-      case MONGO_OPERATION_UPDATE:
-         g_free(request->u.update.db_and_collection);
-         if (request->u.update.selector) {
-            mongo_bson_unref(request->u.update.selector);
-         }
-         if (request->u.update.update) {
-            mongo_bson_unref(request->u.update.update);
-         }
-         break;
-      case MONGO_OPERATION_INSERT:
-         g_free(request->u.insert.db_and_collection);
-         g_ptr_array_free(request->u.insert.documents, TRUE);
-         break;
-      case MONGO_OPERATION_QUERY:
-         g_free(request->u.insert.db_and_collection);
-         if (request->u.query.query) {
-            mongo_bson_unref(request->u.query.query);
-         }
-         if (request->u.query.field_selector) {
-            mongo_bson_unref(request->u.query.field_selector);
+   MongoConnectionPrivate *priv;
+   MongoMessageReply *reply;
+   MongoConnection *connection = user_data;
+   MongoProtocol *protocol = (MongoProtocol *)object;
+   const MongoBson *docs;
+   MongoBsonIter iter;
+   GPtrArray *protocols;
+   gsize n_docs = 0;
+   guint i;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+   g_assert(MONGO_IS_CONNECTION(connection));
+
+   priv = connection->priv;
+
+   if (!(reply = mongo_protocol_query_finish(protocol, result, NULL))) {
+      g_object_unref(connection);
+      EXIT;
+   }
+
+   docs = mongo_message_reply_peek_documents(reply, &n_docs);
+
+   if (n_docs && (priv->state == STATE_CONNECTED)) {
+      /*
+       * If the primary stepped down, fail the pool so that we go looking
+       * for the new primary.
+       */
+      mongo_bson_iter_init(&iter, &docs[0]);
+      if (mongo_bson_iter_find(&iter, "ismaster") &&
+          (mongo_bson_iter_get_value_type(&iter) == MONGO_BSON_BOOLEAN) &&
+          !mongo_bson_iter_get_value_boolean(&iter)) {
+         protocols = g_ptr_array_new_with_free_func(g_object_unref);
+         for (i = 0; i < priv->protocols->len; i++) {
+            g_ptr_array_add(protocols,
+                            g_object_ref(g_ptr_array_index(priv->protocols, i)));
          }
-         break;
-      case MONGO_OPERATION_GETMORE:
-         g_free(request->u.insert.db_and_collection);
-         break;
-      case MONGO_OPERATION_DELETE:
-         g_free(request->u.insert.db_and_collection);
-         if (request->u.delete.selector) {
-            mongo_bson_unref(request->u.delete.selector);
+         for (i = 0; i < protocols->len; i++) {
+            mongo_protocol_fail(g_ptr_array_index(protocols, i), NULL);
          }
-         break;
-      case MONGO_OPERATION_KILL_CURSORS:
-         g_array_free(request->u.kill_cursors.cursors, TRUE);
-         break;
-      case MONGO_OPERATION_REPLY:
-      case MONGO_OPERATION_MSG:
-      default:
-         g_assert_not_reached();
-         break;
+         g_ptr_array_unref(protocols);
+      } else {
+         mongo_connection_discover(connection, &docs[0]);
       }
-      memset(&request->u, 0, sizeof request->u);
-      g_slice_free(Request, request);
    }
+
+   g_object_unref(reply);
+   g_object_unref(connection);
+
+   EXIT;
+}
+
+static gboolean
+mongo_connection_topology_timeout (gpointer data)
+{
+   MongoConnectionPrivate *priv;
+   MongoConnection *connection = data;
+   MongoBson *command;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_CONNECTION(connection));
+
+   priv = connection->priv;
+
+   if ((priv->state == STATE_CONNECTED) && priv->protocols->len) {
+      command = mongo_bson_new_empty();
+      mongo_bson_append_int(command, "ismaster", 1);
+      mongo_protocol_query_async(g_ptr_array_index(priv->protocols, 0),
+                                 "admin.$cmd",
+                                 MONGO_QUERY_NONE,
+                                 0,
+                                 1,
+                                 command,
+                                 NULL,
+                                 NULL,
+                                 mongo_connection_topology_cb,
+                                 g_object_ref(connection));
+      mongo_bson_unref(command);
+   }
+
+   RETURN(TRUE);
 }
 
 static void
@@ -500,24 +1442,41 @@ mongo_connection_protocol_failed (MongoProtocol   *protocol,
                                   const GError    *error,
                                   MongoConnection *connection)
 {
+   MongoConnectionPrivate *priv;
+
    ENTRY;
 
    g_assert(MONGO_IS_PROTOCOL(protocol));
    g_assert(MONGO_IS_CONNECTION(connection));
 
+   priv = connection->priv;
+
    g_warning("Mongo protocol failure: %s.",
              error ? error->message : "Unknown error");
 
-   /*
-    * Clear the protocol so we can connect to the next host.
-    */
-   connection->priv->state = STATE_0;
-   g_clear_object(&connection->priv->protocol);
+   mongo_connection_remove_protocol(connection, protocol);
+
+   if (g_cancellable_is_cancelled(priv->dispose_cancel)) {
+      EXIT;
+   }
 
    /*
-    * Start connecting to the next configured host.
+    * Replace the socket if the rest of the pool is still healthy.
+    * Otherwise, start connecting to the next configured host.
     */
-   if (!g_cancellable_is_cancelled(connection->priv->dispose_cancel)) {
+   if (priv->protocols->len) {
+      mongo_connection_grow_pool(connection);
+   } else {
+      priv->state = STATE_0;
+      priv->pool_generation++;
+      priv->n_pool_connecting = 0;
+      g_free(priv->host);
+      priv->host = NULL;
+      mongo_connection_clear_secondaries(connection);
+      if (priv->topology_handler) {
+         g_source_remove(priv->topology_handler);
+         priv->topology_handler = 0;
+      }
       mongo_connection_start_connecting(connection);
    }
 
@@ -637,20 +1596,27 @@ mongo_connection_ismaster_cb (GObject      *object,
    mongo_manager_reset_delay(priv->manager);
 
    /*
-    * This is the master and we are connected, so lets store the
-    * protocol for use by the connection and change the state to
-    * connected.
+    * This is the master and we are connected, so lets add the
+    * protocol to the pool and change the state to connected. The rest
+    * of the pool connects to the same host in the background.
     */
-   priv->protocol = g_object_ref(protocol);
+   g_free(priv->host);
+   priv->host = g_strdup(priv->connecting_host);
+   mongo_connection_add_protocol(connection, protocol);
    priv->state = STATE_CONNECTED;
+   mongo_connection_grow_pool(connection);
 
    /*
-    * Wire up failure of the protocol so that we can connect to
-    * the next host.
+    * Connect to the secondaries listed by the primary and keep watching
+    * the replica set for changes.
     */
-   g_signal_connect(protocol, "failed",
-                    G_CALLBACK(mongo_connection_protocol_failed),
-                    connection);
+   mongo_connection_discover(connection, list->data);
+   if (!priv->topology_handler) {
+      priv->topology_handler =
+         g_timeout_add_seconds(MONGO_CONNECTION_TOPOLOGY_INTERVAL,
+                               mongo_connection_topology_timeout,
+                               connection);
+   }
 
    /*
     * Emit the ::connected signal.
@@ -667,9 +1633,9 @@ mongo_connection_ismaster_cb (GObject      *object,
     * Flush any pending requests.
     */
    while ((priv->state == STATE_CONNECTED) &&
-          (priv->protocol) &&
+          (priv->protocols->len) &&
           (request = g_queue_pop_head(priv->queue))) {
-      request_run(request, priv->protocol);
+      mongo_connection_run(connection, request);
       request_free(request);
    }
 
@@ -721,14 +1687,7 @@ mongo_connection_connect_to_host_cb (GObject      *object,
    /*
     * Build a protocol using our connection.
     */
-   protocol = g_object_new(MONGO_TYPE_PROTOCOL,
-                           "fsync", priv->fsync,
-                           "io-stream", conn,
-                           "journal", priv->journal,
-                           "safe", priv->safe,
-                           "write-timeout", priv->wtimeoutms,
-                           "write-quorum", priv->w,
-                           NULL);
+   protocol = mongo_connection_protocol_new(connection, conn);
 
    /*
     * We then need to check that the server is PRIMARY and matches our
@@ -800,6 +1759,9 @@ mongo_connection_start_connecting (MongoConnection *connection)
       EXIT;
    }
 
+   g_free(priv->connecting_host);
+   priv->connecting_host = g_strdup(host);
+
    g_socket_client_connect_to_host_async(priv->socket_client,
                                          host,
                                          MONGO_PORT_DEFAULT,
@@ -836,7 +1798,7 @@ mongo_connection_queue (MongoConnection *connection,
        * queue in that case.
        */
       if (g_queue_is_empty(priv->queue)) {
-         request_run(request, priv->protocol);
+         mongo_connection_run(connection, request);
          request_free(request);
       } else {
          g_queue_push_tail(priv->queue, request);
@@ -1083,12 +2045,146 @@ mongo_connection_command_finish (MongoConnection  *connection,
    RETURN(ret);
 }
 
+/**
+ * mongo_connection_bulk_write_async:
+ * @connection: A #MongoConnection.
+ * @db_and_collection: A string containing the "db.collection".
+ * @operations: (array length=n_operations): The writes to perform.
+ * @n_operations: (in): The number of elements in @operations.
+ * @cancellable: (allow-none): A #GCancellable or %NULL.
+ * @callback: A #GAsyncReadyCallback.
+ * @user_data: (allow-none): User data for @callback.
+ *
+ * Asynchronously performs a batch of inserts, updates and deletes against
+ * a single collection. The operations are written back to back, each
+ * followed by its error check, so the batch costs one round trip to the
+ * server rather than one per operation. The batch is acknowledged using
+ * the write concern of the connection.
+ *
+ * Operations are applied in order. A failed operation does not prevent
+ * the operations after it from being applied.
+ *
+ * @operations is copied, so it may be freed after this function returns.
+ *
+ * @callback MUST call mongo_connection_bulk_write_finish().
+ */
+void
+mongo_connection_bulk_write_async (MongoConnection          *connection,
+                                   const gchar              *db_and_collection,
+                                   const MongoBulkOperation *operations,
+                                   gsize                     n_operations,
+                                   GCancellable             *cancellable,
+                                   GAsyncReadyCallback       callback,
+                                   gpointer                  user_data)
+{
+   MongoBulkOperation op;
+   Request *request;
+   gsize i;
+
+   ENTRY;
+
+   g_return_if_fail(MONGO_IS_CONNECTION(connection));
+   g_return_if_fail(db_and_collection);
+   g_return_if_fail(strstr(db_and_collection, "."));
+   g_return_if_fail(operations);
+   g_return_if_fail(n_operations);
+   g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
+   g_return_if_fail(callback);
+
+   for (i = 0; i < n_operations; i++) {
+      switch (operations[i].oper) {
+      case MONGO_OPERATION_INSERT:
+         g_return_if_fail(operations[i].document);
+         break;
+      case MONGO_OPERATION_UPDATE:
+         g_return_if_fail(operations[i].selector);
+         g_return_if_fail(operations[i].document);
+         break;
+      case MONGO_OPERATION_DELETE:
+         g_return_if_fail(operations[i].selector);
+         break;
+      case MONGO_OPERATION_REPLY:
+      case MONGO_OPERATION_MSG:
+      case MONGO_OPERATION_QUERY:
+      case MONGO_OPERATION_GETMORE:
+      case MONGO_OPERATION_KILL_CURSORS:
+      default:
+         g_return_if_reached();
+      }
+   }
+
+   request = request_new(connection, cancellable, callback, user_data,
+                         mongo_connection_bulk_write_async);
+   request->kind = REQUEST_BULK_WRITE;
+   request->u.bulk_write.db_and_collection = g_strdup(db_and_collection);
+   request->u.bulk_write.operations =
+      g_array_sized_new(FALSE, FALSE, sizeof op, n_operations);
+   for (i = 0; i < n_operations; i++) {
+      op.oper = operations[i].oper;
+      op.flags = operations[i].flags;
+      op.selector = operations[i].selector ?
+         mongo_bson_dup(operations[i].selector) : NULL;
+      op.document = operations[i].document ?
+         mongo_bson_dup(operations[i].document) : NULL;
+      g_array_append_val(request->u.bulk_write.operations, op);
+   }
+   mongo_connection_queue(connection, request);
+
+   EXIT;
+}
+
+/**
+ * mongo_connection_bulk_write_finish:
+ * @connection: A #MongoConnection.
+ * @result: A #GAsyncResult.
+ * @failed_index: (out) (allow-none): A location for the index of the
+ *   failed operation, or %NULL.
+ * @error: (out) (allow-none): A location for a #GError, or %NULL.
+ *
+ * Completes an asynchronous request to mongo_connection_bulk_write_async().
+ *
+ * If an operation in the batch failed, @failed_index is set to its index
+ * within the operations passed to mongo_connection_bulk_write_async(). If
+ * several operations failed, the first of them is reported. If the batch
+ * succeeded, or could not be sent at all, @failed_index is set to -1.
+ *
+ * Returns: %TRUE if every operation succeeded; otherwise %FALSE and
+ *   @error is set.
+ */
+gboolean
+mongo_connection_bulk_write_finish (MongoConnection  *connection,
+                                    GAsyncResult     *result,
+                                    gssize           *failed_index,
+                                    GError          **error)
+{
+   GSimpleAsyncResult *simple = (GSimpleAsyncResult *)result;
+   gboolean ret;
+
+   g_return_val_if_fail(MONGO_IS_CONNECTION(connection), FALSE);
+   g_return_val_if_fail(G_IS_SIMPLE_ASYNC_RESULT(simple), FALSE);
+
+   ENTRY;
+
+   if (!(ret = g_simple_async_result_get_op_res_gboolean(simple))) {
+      g_simple_async_result_propagate_error(simple, error);
+   }
+
+   if (failed_index) {
+      *failed_index = (gssize)GPOINTER_TO_SIZE(
+            g_object_get_data(G_OBJECT(simple), "failed-index")) - 1;
+   }
+
+   RETURN(ret);
+}
+
 /**
  * mongo_connection_delete_async:
  * @connection: (in): A #MongoConnection.
  * @db_and_collection: A string containing the "db.collection".
  * @flags: A bitwise-or of #MongoDeleteFlags.
  * @selector: A #MongoBson of fields to select for deletion.
+ * @concern: (allow-none): A #MongoWriteConcern, or %NULL to use the
+ *   write concern of the connection.
  * @cancellable: (allow-none): A #GCancellable or %NULL.
  * @callback: A #GAsyncReadyCallback to execute upon completion.
  * @user_data: (allow-none): User data for @callback.
@@ -1107,6 +2203,7 @@ mongo_connection_delete_async (MongoConnection     *connection,
                                const gchar         *db_and_collection,
                                MongoDeleteFlags     flags,
                                const MongoBson     *selector,
+                               MongoWriteConcern   *concern,
                                GCancellable        *cancellable,
                                GAsyncReadyCallback  callback,
                                gpointer             user_data)
@@ -1124,7 +2221,8 @@ mongo_connection_delete_async (MongoConnection     *connection,
 
    request = request_new(connection, cancellable, callback, user_data,
                          mongo_connection_delete_async);
-   request->oper = MONGO_OPERATION_DELETE;
+   request->kind = REQUEST_DELETE;
+   request->concern = concern ? mongo_write_concern_copy(concern) : NULL;
    request->u.delete.db_and_collection = g_strdup(db_and_collection);
    request->u.delete.flags = flags;
    request->u.delete.selector = mongo_bson_dup(selector);
@@ -1171,12 +2269,18 @@ mongo_connection_delete_finish (MongoConnection  *connection,
  * @flags: A bitwise-or of #MongoUpdateFlags.
  * @selector: (allow-none): A #MongoBson or %NULL.
  * @update: A #MongoBson to apply as an update to documents matching @selector.
+ * @concern: (allow-none): A #MongoWriteConcern, or %NULL to use the
+ *   write concern of the connection.
  * @cancellable: (allow-none): A #GCancellable, or %NULL.
  * @callback: A #GAsyncReadyCallback.
  * @user_data: (allow-none): User data for @callback.
  *
  * Asynchronously requests an update to all documents matching @selector.
  *
+ * If @concern is unacknowledged (see
+ * mongo_write_concern_new_unsafe()), no getlasterror is sent and
+ * @callback is executed as soon as the update has been written.
+ *
  * @callback MUST call mongo_connection_update_finish().
  */
 void
@@ -1185,6 +2289,7 @@ mongo_connection_update_async (MongoConnection     *connection,
                                MongoUpdateFlags     flags,
                                const MongoBson     *selector,
                                const MongoBson     *update,
+                               MongoWriteConcern   *concern,
                                GCancellable        *cancellable,
                                GAsyncReadyCallback  callback,
                                gpointer             user_data)
@@ -1202,7 +2307,8 @@ mongo_connection_update_async (MongoConnection     *connection,
 
    request = request_new(connection, cancellable, callback, user_data,
                          mongo_connection_update_async);
-   request->oper = MONGO_OPERATION_UPDATE;
+   request->kind = REQUEST_UPDATE;
+   request->concern = concern ? mongo_write_concern_copy(concern) : NULL;
    request->u.update.db_and_collection = g_strdup(db_and_collection);
    request->u.update.flags = flags;
    request->u.update.selector = mongo_bson_dup(selector);
@@ -1264,6 +2370,8 @@ mongo_connection_update_finish (MongoConnection  *connection,
  * @documents: (array length=n_documents) (element-type MongoBson*): Array  of
  *    #MongoBson documents to insert.
  * @n_documents: (in): The number of elements in @documents.
+ * @concern: (allow-none): A #MongoWriteConcern, or %NULL to use the
+ *   write concern of the connection.
  * @cancellable: (allow-none): A #GCancellable or %NULL.
  * @callback: A #GAsyncReadyCallback.
  * @user_data: (allow-none): User data for @callback.
@@ -1278,6 +2386,7 @@ mongo_connection_insert_async (MongoConnection      *connection,
                                MongoInsertFlags      flags,
                                MongoBson           **documents,
                                gsize                 n_documents,
+                               MongoWriteConcern    *concern,
                                GCancellable         *cancellable,
                                GAsyncReadyCallback   callback,
                                gpointer              user_data)
@@ -1297,7 +2406,8 @@ mongo_connection_insert_async (MongoConnection      *connection,
 
    request = request_new(connection, cancellable, callback, user_data,
                          mongo_connection_insert_async);
-   request->oper = MONGO_OPERATION_INSERT;
+   request->kind = REQUEST_INSERT;
+   request->concern = concern ? mongo_write_concern_copy(concern) : NULL;
    request->u.insert.db_and_collection = g_strdup(db_and_collection);
    request->u.insert.flags = flags;
    request->u.insert.documents = g_ptr_array_sized_new(n_documents);
@@ -1391,7 +2501,7 @@ mongo_connection_query_async (MongoConnection     *connection,
 
    request = request_new(connection, cancellable, callback, user_data,
                          mongo_connection_query_async);
-   request->oper = MONGO_OPERATION_QUERY;
+   request->kind = REQUEST_QUERY;
    request->u.query.db_and_collection = g_strdup(db_and_collection);
    request->u.query.flags = flags;
    request->u.query.skip = skip;
@@ -1469,7 +2579,7 @@ mongo_connection_getmore_async (MongoConnection     *connection,
 
    request = request_new(connection, cancellable, callback, user_data,
                          mongo_connection_getmore_async);
-   request->oper = MONGO_OPERATION_GETMORE;
+   request->kind = REQUEST_GETMORE;
    request->u.getmore.db_and_collection = g_strdup(db_and_collection);
    request->u.getmore.limit = limit;
    request->u.getmore.cursor_id = cursor_id;
@@ -1544,7 +2654,7 @@ mongo_connection_kill_cursors_async (MongoConnection     *connection,
 
    request = request_new(connection, cancellable, callback, user_data,
                          mongo_connection_kill_cursors_async);
-   request->oper = MONGO_OPERATION_KILL_CURSORS;
+   request->kind = REQUEST_KILL_CURSORS;
    request->u.kill_cursors.cursors = g_array_new(FALSE, FALSE, sizeof(guint64));
    g_array_append_vals(request->u.kill_cursors.cursors, cursors, n_cursors);
    mongo_connection_queue(connection, request);
@@ -1582,6 +2692,103 @@ mongo_connection_kill_cursors_finish (MongoConnection  *connection,
    RETURN(ret);
 }
 
+/**
+ * mongo_connection_get_in_flight:
+ * @connection: (in): A #MongoConnection.
+ *
+ * Fetches the number of requests across the connection pool that have
+ * been sent and are waiting for a reply. Requests queued while
+ * connecting are not included.
+ *
+ * Returns: The number of requests in flight.
+ */
+guint
+mongo_connection_get_in_flight (MongoConnection *connection)
+{
+   MongoConnectionPrivate *priv;
+   guint ret = 0;
+   guint i;
+
+   g_return_val_if_fail(MONGO_IS_CONNECTION(connection), 0);
+
+   priv = connection->priv;
+
+   for (i = 0; i < priv->protocols->len; i++) {
+      ret += mongo_protocol_get_n_pending(g_ptr_array_index(priv->protocols, i));
+   }
+
+   return ret;
+}
+
+/**
+ * mongo_connection_get_max_pool_size:
+ * @connection: (in): A #MongoConnection.
+ *
+ * Fetches the number of sockets the connection will open to the primary.
+ * This is set with the maxPoolSize option of the connection URI.
+ *
+ * Returns: The maximum size of the connection pool.
+ */
+guint
+mongo_connection_get_max_pool_size (MongoConnection *connection)
+{
+   g_return_val_if_fail(MONGO_IS_CONNECTION(connection), 0);
+   return connection->priv->max_pool_size;
+}
+
+/**
+ * mongo_connection_get_pool_size:
+ * @connection: (in): A #MongoConnection.
+ *
+ * Fetches the number of sockets currently connected to the primary.
+ *
+ * Returns: The size of the connection pool.
+ */
+guint
+mongo_connection_get_pool_size (MongoConnection *connection)
+{
+   g_return_val_if_fail(MONGO_IS_CONNECTION(connection), 0);
+   return connection->priv->protocols->len;
+}
+
+/**
+ * mongo_connection_get_read_preference:
+ * @connection: (in): A #MongoConnection.
+ *
+ * Fetches the "read-preference" property. See
+ * mongo_connection_set_read_preference().
+ *
+ * Returns: A #MongoReadPreference.
+ */
+MongoReadPreference
+mongo_connection_get_read_preference (MongoConnection *connection)
+{
+   g_return_val_if_fail(MONGO_IS_CONNECTION(connection), MONGO_READ_PRIMARY);
+   return connection->priv->read_preference;
+}
+
+/**
+ * mongo_connection_set_read_preference:
+ * @connection: (in): A #MongoConnection.
+ * @read_preference: (in): A #MongoReadPreference.
+ *
+ * Sets the "read-preference" property. This controls whether queries
+ * with %MONGO_QUERY_SLAVE_OK set may be served by secondaries of the
+ * replica set. Secondaries are discovered from the primary and are
+ * connected to the next time the replica set is refreshed.
+ */
+void
+mongo_connection_set_read_preference (MongoConnection     *connection,
+                                      MongoReadPreference  read_preference)
+{
+   g_return_if_fail(MONGO_IS_CONNECTION(connection));
+   g_return_if_fail(read_preference <= MONGO_READ_NEAREST);
+
+   connection->priv->read_preference = read_preference;
+   g_object_notify_by_pspec(G_OBJECT(connection),
+                            gParamSpecs[PROP_READ_PREFERENCE]);
+}
+
 const gchar *
 mongo_connection_get_replica_set (MongoConnection *connection)
 {
@@ -1690,6 +2897,8 @@ mongo_connection_set_uri (MongoConnection *connection,
     * Clear existing parameters.
     */
    priv->connecttimeoutms = 0;
+   priv->max_pool_size = MONGO_CONNECTION_MAX_POOL_SIZE;
+   priv->read_preference = MONGO_READ_PRIMARY;
    priv->fsync = FALSE;
    priv->fsync_set = FALSE;
    priv->w = 0;
@@ -1736,6 +2945,21 @@ mongo_connection_set_uri (MongoConnection *connection,
       if ((value = g_hash_table_lookup(params, "sockettimeoutms"))) {
          priv->sockettimeoutms = MAX(0, strtol(value, NULL, 10));
       }
+      if ((value = g_hash_table_lookup(params, "maxpoolsize"))) {
+         priv->max_pool_size = MAX(1, strtol(value, NULL, 10));
+      }
+      if ((value = g_hash_table_lookup(params, "readpreference"))) {
+         /*
+          * We never hold a query waiting for a secondary, so "secondary"
+          * behaves like "secondaryPreferred".
+          */
+         if (!g_strcmp0(value, "secondary") ||
+             !g_strcmp0(value, "secondarypreferred")) {
+            priv->read_preference = MONGO_READ_SECONDARY_PREFERRED;
+         } else if (!g_strcmp0(value, "nearest")) {
+            priv->read_preference = MONGO_READ_NEAREST;
+         }
+      }
       g_hash_table_unref(params);
    }
    g_free(lower);
@@ -1782,12 +3006,13 @@ static void
 mongo_connection_finalize (GObject *object)
 {
    MongoConnectionPrivate *priv;
+   MongoConnection *connection = (MongoConnection *)object;
    GHashTable *hash;
    Request *request;
 
    ENTRY;
 
-   priv = MONGO_CONNECTION(object)->priv;
+   priv = connection->priv;
 
    if ((hash = priv->databases)) {
       priv->databases = NULL;
@@ -1810,7 +3035,31 @@ mongo_connection_finalize (GObject *object)
    priv->queue = NULL;
 
    g_clear_object(&priv->socket_client);
-   g_clear_object(&priv->protocol);
+
+   while (priv->protocols->len) {
+      mongo_connection_remove_protocol(connection,
+                                       g_ptr_array_index(priv->protocols, 0));
+   }
+   g_ptr_array_unref(priv->protocols);
+   priv->protocols = NULL;
+
+   if (priv->topology_handler) {
+      g_source_remove(priv->topology_handler);
+      priv->topology_handler = 0;
+   }
+
+   mongo_connection_clear_secondaries(connection);
+   g_hash_table_unref(priv->secondaries);
+   priv->secondaries = NULL;
+
+   g_hash_table_unref(priv->cursors);
+   priv->cursors = NULL;
+
+   g_free(priv->connecting_host);
+   priv->connecting_host = NULL;
+
+   g_free(priv->host);
+   priv->host = NULL;
 
    if (priv->uri_string) {
       g_free(priv->uri_string);
@@ -1834,6 +3083,18 @@ mongo_connection_get_property (GObject    *object,
    MongoConnection *connection = MONGO_CONNECTION(object);
 
    switch (prop_id) {
+   case PROP_IN_FLIGHT:
+      g_value_set_uint(value, mongo_connection_get_in_flight(connection));
+      break;
+   case PROP_MAX_POOL_SIZE:
+      g_value_set_uint(value, mongo_connection_get_max_pool_size(connection));
+      break;
+   case PROP_POOL_SIZE:
+      g_value_set_uint(value, mongo_connection_get_pool_size(connection));
+      break;
+   case PROP_READ_PREFERENCE:
+      g_value_set_enum(value, mongo_connection_get_read_preference(connection));
+      break;
    case PROP_REPLICA_SET:
       g_value_set_string(value, mongo_connection_get_replica_set(connection));
       break;
@@ -1857,6 +3118,10 @@ mongo_connection_set_property (GObject      *object,
    MongoConnection *connection = MONGO_CONNECTION(object);
 
    switch (prop_id) {
+   case PROP_READ_PREFERENCE:
+      mongo_connection_set_read_preference(connection,
+                                           g_value_get_enum(value));
+      break;
    case PROP_REPLICA_SET:
       mongo_connection_set_replica_set(connection, g_value_get_string(value));
       break;
@@ -1884,6 +3149,49 @@ mongo_connection_class_init (MongoConnectionClass *klass)
    object_class->set_property = mongo_connection_set_property;
    g_type_class_add_private(object_class, sizeof(MongoConnectionPrivate));
 
+   gParamSpecs[PROP_IN_FLIGHT] =
+      g_param_spec_uint("in-flight",
+                        _("In Flight"),
+                        _("The number of requests awaiting a reply."),
+                        0,
+                        G_MAXUINT,
+                        0,
+                        G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+   g_object_class_install_property(object_class, PROP_IN_FLIGHT,
+                                   gParamSpecs[PROP_IN_FLIGHT]);
+
+   gParamSpecs[PROP_MAX_POOL_SIZE] =
+      g_param_spec_uint("max-pool-size",
+                        _("Max Pool Size"),
+                        _("The number of sockets to open to the primary."),
+                        1,
+                        G_MAXUINT,
+                        MONGO_CONNECTION_MAX_POOL_SIZE,
+                        G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+   g_object_class_install_property(object_class, PROP_MAX_POOL_SIZE,
+                                   gParamSpecs[PROP_MAX_POOL_SIZE]);
+
+   gParamSpecs[PROP_POOL_SIZE] =
+      g_param_spec_uint("pool-size",
+                        _("Pool Size"),
+                        _("The number of sockets connected to the primary."),
+                        0,
+                        G_MAXUINT,
+                        0,
+                        G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+   g_object_class_install_property(object_class, PROP_POOL_SIZE,
+                                   gParamSpecs[PROP_POOL_SIZE]);
+
+   gParamSpecs[PROP_READ_PREFERENCE] =
+      g_param_spec_enum("read-preference",
+                        _("Read Preference"),
+                        _("Which replica set members may serve queries."),
+                        MONGO_TYPE_READ_PREFERENCE,
+                        MONGO_READ_PRIMARY,
+                        G_PARAM_READWRITE);
+   g_object_class_install_property(object_class, PROP_READ_PREFERENCE,
+                                   gParamSpecs[PROP_READ_PREFERENCE]);
+
    gParamSpecs[PROP_REPLICA_SET] =
       g_param_spec_string("replica-set",
                           _("Replica Set"),
@@ -1938,6 +3246,16 @@ mongo_connection_init (MongoConnection *connection)
    mongo_manager_add_seed(connection->priv->manager, "127.0.0.1:27017");
    connection->priv->queue = g_queue_new();
    connection->priv->safe = TRUE;
+   connection->priv->max_pool_size = MONGO_CONNECTION_MAX_POOL_SIZE;
+   connection->priv->protocols = g_ptr_array_new_with_free_func(g_object_unref);
+   connection->priv->cursors = g_hash_table_new_full(g_int64_hash,
+                                                     g_int64_equal,
+                                                     g_free,
+                                                     g_free);
+   connection->priv->secondaries = g_hash_table_new_full(g_str_hash,
+                                                         g_str_equal,
+                                                         g_free,
+                                                         NULL);
    connection->priv->socket_client =
          g_object_new(G_TYPE_SOCKET_CLIENT,
                       "timeout", 0,
@@ -98,16 +98,29 @@ void               mongo_connection_insert_async        (MongoConnection      *c
                                                          MongoInsertFlags      flags,
                                                          MongoBson           **documents,
                                                          gsize                 n_documents,
+                                                         MongoWriteConcern    *concern,
                                                          GCancellable         *cancellable,
                                                          GAsyncReadyCallback   callback,
                                                          gpointer              user_data);
 gboolean           mongo_connection_insert_finish       (MongoConnection      *connection,
                                                          GAsyncResult         *result,
                                                          GError              **error);
+void               mongo_connection_bulk_write_async    (MongoConnection      *connection,
+                                                         const gchar          *db_and_collection,
+                                                         const MongoBulkOperation *operations,
+                                                         gsize                 n_operations,
+                                                         GCancellable         *cancellable,
+                                                         GAsyncReadyCallback   callback,
+                                                         gpointer              user_data);
+gboolean           mongo_connection_bulk_write_finish   (MongoConnection      *connection,
+                                                         GAsyncResult         *result,
+                                                         gssize               *failed_index,
+                                                         GError              **error);
 void               mongo_connection_delete_async        (MongoConnection      *connection,
                                                          const gchar          *db_and_collection,
                                                          MongoDeleteFlags      flags,
                                                          const MongoBson      *selector,
+                                                         MongoWriteConcern    *concern,
                                                          GCancellable         *cancellable,
                                                          GAsyncReadyCallback   callback,
                                                          gpointer              user_data);
@@ -119,6 +132,7 @@ void               mongo_connection_update_async        (MongoConnection      *c
                                                          MongoUpdateFlags      flags,
                                                          const MongoBson      *selector,
                                                          const MongoBson      *update,
+                                                         MongoWriteConcern    *concern,
                                                          GCancellable         *cancellable,
                                                          GAsyncReadyCallback   callback,
                                                          gpointer              user_data);
@@ -154,6 +168,12 @@ GType              mongo_connection_get_type            (void) G_GNUC_CONST;
 GQuark             mongo_connection_error_quark         (void) G_GNUC_CONST;
 MongoConnection   *mongo_connection_new                 (void);
 MongoConnection   *mongo_connection_new_from_uri        (const gchar          *uri);
+guint              mongo_connection_get_in_flight       (MongoConnection      *connection);
+guint              mongo_connection_get_max_pool_size   (MongoConnection      *connection);
+guint              mongo_connection_get_pool_size       (MongoConnection      *connection);
+MongoReadPreference mongo_connection_get_read_preference (MongoConnection     *connection);
+void               mongo_connection_set_read_preference (MongoConnection      *connection,
+                                                         MongoReadPreference   read_preference);
 gboolean           mongo_connection_get_slave_okay      (MongoConnection      *connection);
 void               mongo_connection_set_slave_okay      (MongoConnection      *connection,
                                                          gboolean              slave_okay);
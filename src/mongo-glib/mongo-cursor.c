@@ -45,7 +45,24 @@ struct _MongoCursorPrivate
    guint limit;
    guint skip;
    guint batch_size;
+   guint prefetch;
    MongoQueryFlags flags;
+
+   /*
+    * Number of getmore requests sent for mongo_cursor_foreach_async()
+    * that have not yet been dispatched.
+    */
+   guint n_in_flight;
+
+   /*
+    * Pause state used for back-pressure from mongo_cursor_foreach_async()
+    * consumers. While paused, the next getmore is stashed here and
+    * issued by mongo_cursor_resume().
+    */
+   guint paused;
+   GSimpleAsyncResult *pending;
+   guint64 pending_cursor_id;
+   guint32 pending_n_return;
 };
 
 enum
@@ -58,6 +75,7 @@ enum
    PROP_FIELDS,
    PROP_FLAGS,
    PROP_LIMIT,
+   PROP_PREFETCH,
    PROP_QUERY,
    PROP_SKIP,
    LAST_PROP
@@ -69,6 +87,28 @@ static void mongo_cursor_foreach_getmore_cb (GObject      *object,
 
 static GParamSpec *gParamSpecs[LAST_PROP];
 
+static guint32
+mongo_cursor_get_n_return (MongoCursor *cursor,
+                           guint        n_returned)
+{
+   MongoCursorPrivate *priv;
+   guint32 ret;
+
+   g_assert(MONGO_IS_CURSOR(cursor));
+
+   priv = cursor->priv;
+
+   ret = priv->batch_size;
+
+   if (priv->limit) {
+      g_assert_cmpint(n_returned, <, priv->limit);
+      ret = ret ? MIN(ret, priv->limit - n_returned)
+                : priv->limit - n_returned;
+   }
+
+   return ret;
+}
+
 guint
 mongo_cursor_get_batch_size (MongoCursor *cursor)
 {
@@ -113,6 +153,45 @@ mongo_cursor_get_fields (MongoCursor *cursor)
    return cursor->priv->fields;
 }
 
+/**
+ * mongo_cursor_get_prefetch:
+ * @cursor: (in): A #MongoCursor.
+ *
+ * Fetches the "prefetch" property. See mongo_cursor_set_prefetch().
+ *
+ * Returns: The number of batches to request ahead of the consumer.
+ */
+guint
+mongo_cursor_get_prefetch (MongoCursor *cursor)
+{
+   g_return_val_if_fail(MONGO_IS_CURSOR(cursor), 0);
+   return cursor->priv->prefetch;
+}
+
+/**
+ * mongo_cursor_set_prefetch:
+ * @cursor: (in): A #MongoCursor.
+ * @prefetch: (in): The number of batches to request ahead.
+ *
+ * Sets the number of getmore requests mongo_cursor_foreach_async() keeps
+ * in flight. When non-zero, the next batch is requested as soon as a
+ * batch arrives so that the round trip overlaps with the foreach
+ * callback processing the current batch. The default of zero only
+ * requests the next batch once the current one has been processed.
+ *
+ * No further batches are requested while the cursor is paused, but
+ * batches that were already requested are still delivered.
+ */
+void
+mongo_cursor_set_prefetch (MongoCursor *cursor,
+                           guint        prefetch)
+{
+   g_return_if_fail(MONGO_IS_CURSOR(cursor));
+   cursor->priv->prefetch = prefetch;
+   g_object_notify_by_pspec(G_OBJECT(cursor),
+                            gParamSpecs[PROP_PREFETCH]);
+}
+
 MongoQueryFlags
 mongo_cursor_get_flags (MongoCursor *cursor)
 {
@@ -318,10 +397,11 @@ mongo_cursor_count_finish (MongoCursor   *cursor,
                            GError       **error)
 {
    GSimpleAsyncResult *simple = (GSimpleAsyncResult *)result;
+   const MongoBson *docs;
    MongoMessageReply *reply;
    MongoBsonIter iter;
    gboolean ret = FALSE;
-   GList *list;
+   gsize n_docs;
 
    g_return_val_if_fail(MONGO_IS_CURSOR(cursor), FALSE);
    g_return_val_if_fail(G_IS_SIMPLE_ASYNC_RESULT(simple), FALSE);
@@ -332,11 +412,11 @@ mongo_cursor_count_finish (MongoCursor   *cursor,
       GOTO(failure);
    }
 
-   if (!(list = mongo_message_reply_get_documents(reply))) {
+   if (!(docs = mongo_message_reply_peek_documents(reply, &n_docs))) {
       GOTO(failure);
    }
 
-   mongo_bson_iter_init(&iter, list->data);
+   mongo_bson_iter_init(&iter, &docs[0]);
    if (!mongo_bson_iter_find(&iter, "n") ||
        (mongo_bson_iter_get_value_type(&iter) != MONGO_BSON_DOUBLE)) {
       GOTO(failure);
@@ -361,6 +441,93 @@ mongo_cursor_kill_cursors_cb (GObject      *object,
    EXIT;
 }
 
+static void
+mongo_cursor_foreach_getmore (MongoCursor        *cursor,
+                              MongoConnection    *connection,
+                              guint64             cursor_id,
+                              guint32             n_return,
+                              GSimpleAsyncResult *simple)
+{
+   MongoCursorPrivate *priv;
+   GCancellable *cancellable;
+   gchar *db_and_collection;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_CURSOR(cursor));
+   g_assert(MONGO_IS_CONNECTION(connection));
+   g_assert(cursor_id);
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+
+   priv = cursor->priv;
+
+   cancellable = g_object_get_data(G_OBJECT(simple), "cancellable");
+   g_assert(!cancellable || G_IS_CANCELLABLE(cancellable));
+
+   priv->n_in_flight++;
+
+   db_and_collection = g_strdup_printf("%s.%s",
+                                       priv->database,
+                                       priv->collection);
+   mongo_connection_getmore_async(connection,
+                                  db_and_collection,
+                                  n_return,
+                                  cursor_id,
+                                  cancellable,
+                                  mongo_cursor_foreach_getmore_cb,
+                                  simple);
+   g_free(db_and_collection);
+
+   EXIT;
+}
+
+/**
+ * mongo_cursor_foreach_prefetch:
+ * @cursor: (in): A #MongoCursor.
+ * @connection: (in): A #MongoConnection.
+ * @cursor_id: (in): The server side cursor id.
+ * @n_fetched: (in): The number of documents received so far.
+ * @simple: (in): The #GSimpleAsyncResult for the foreach.
+ *
+ * Issues getmore requests until "prefetch" of them are in flight. Each
+ * request holds a reference to @simple. Batches that were requested but
+ * not yet received are counted against the limit as full batches.
+ */
+static void
+mongo_cursor_foreach_prefetch (MongoCursor        *cursor,
+                               MongoConnection    *connection,
+                               guint64             cursor_id,
+                               guint               n_fetched,
+                               GSimpleAsyncResult *simple)
+{
+   MongoCursorPrivate *priv;
+   guint n_requested;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_CURSOR(cursor));
+   g_assert(MONGO_IS_CONNECTION(connection));
+   g_assert(cursor_id);
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+
+   priv = cursor->priv;
+
+   while (!priv->paused && (priv->n_in_flight < priv->prefetch)) {
+      n_requested = n_fetched + (priv->n_in_flight * priv->batch_size);
+      if (priv->limit && (n_requested >= priv->limit)) {
+         break;
+      }
+      mongo_cursor_foreach_getmore(cursor,
+                                   connection,
+                                   cursor_id,
+                                   mongo_cursor_get_n_return(cursor,
+                                                             n_requested),
+                                   g_object_ref(simple));
+   }
+
+   EXIT;
+}
+
 static void
 mongo_cursor_foreach_dispatch (MongoConnection    *connection,
                                MongoMessageReply  *reply,
@@ -369,13 +536,11 @@ mongo_cursor_foreach_dispatch (MongoConnection    *connection,
    MongoCursorCallback func;
    MongoCursorPrivate *priv;
    GCancellable *cancellable;
+   const MongoBson *docs;
    MongoCursor *cursor;
-   MongoBson *bson;
    gpointer func_data;
    guint64 cursor_id;
-   gchar *db_and_collection;
-   GList *iter;
-   GList *list;
+   gsize n_docs;
    guint offset;
    guint i;
 
@@ -397,26 +562,44 @@ mongo_cursor_foreach_dispatch (MongoConnection    *connection,
 
    priv = cursor->priv;
 
-   if (!(list = mongo_message_reply_get_documents(reply))) {
+   cursor_id = mongo_message_reply_get_cursor_id(reply);
+
+   if (!(docs = mongo_message_reply_peek_documents(reply, &n_docs))) {
       GOTO(stop);
    }
 
    offset = mongo_message_reply_get_offset(reply);
 
-   for (iter = list, i = 0; iter; iter = iter->next, i++) {
-      bson = iter->data;
+   /*
+    * Request the following batches before handing this one to the
+    * consumer so that the round trip overlaps with processing.
+    */
+   if (priv->prefetch &&
+       cursor_id &&
+       !(priv->flags & MONGO_QUERY_EXHAUST) &&
+       !(priv->limit && ((offset + n_docs) >= priv->limit))) {
+      mongo_cursor_foreach_prefetch(cursor, connection, cursor_id,
+                                    offset + n_docs, simple);
+   }
+
+   /*
+    * Hand out views into the reply buffer rather than copying each
+    * document; they are only valid until the callback returns.
+    */
+   for (i = 0; i < n_docs; i++) {
       if (priv->limit && (offset + i) >= priv->limit) {
          GOTO(stop);
       }
-      if (!func(cursor, bson, func_data)) {
+      if (!func(cursor, (MongoBson *)&docs[i], func_data)) {
          GOTO(stop);
       }
    }
 
-   offset = mongo_message_reply_get_offset(reply);
-   cursor_id = mongo_message_reply_get_cursor_id(reply);
-
-   if (!cursor_id || ((offset + g_list_length(list)) >= priv->limit)) {
+   /*
+    * A limit of zero means there is no limit, so only stop once the
+    * server has exhausted the cursor.
+    */
+   if (!cursor_id || (priv->limit && ((offset + i) >= priv->limit))) {
       GOTO(stop);
    }
 
@@ -424,18 +607,30 @@ mongo_cursor_foreach_dispatch (MongoConnection    *connection,
     * TODO: How do we know if we are finished if EXHAUST is set?
     */
 
-   if (!(cursor->priv->flags & MONGO_QUERY_EXHAUST)) {
-      db_and_collection = g_strdup_printf("%s.%s",
-                                          cursor->priv->database,
-                                          cursor->priv->collection);
-      mongo_connection_getmore_async(connection,
-                                     db_and_collection,
-                                     cursor->priv->batch_size,
-                                     cursor_id,
-                                     cancellable,
-                                     mongo_cursor_foreach_getmore_cb,
-                                     simple);
-      g_free(db_and_collection);
+   if (!(priv->flags & MONGO_QUERY_EXHAUST)) {
+      if (priv->n_in_flight) {
+         /*
+          * The next batch was already prefetched and the getmore holds
+          * its own reference.
+          */
+         g_object_unref(simple);
+      } else if (priv->paused) {
+         /*
+          * The consumer has asked us to hold off on fetching more
+          * documents. Stash the getmore until mongo_cursor_resume().
+          */
+         g_assert(!priv->pending);
+         priv->pending = simple;
+         priv->pending_cursor_id = cursor_id;
+         priv->pending_n_return = mongo_cursor_get_n_return(cursor, offset + i);
+      } else {
+         mongo_cursor_foreach_getmore(cursor,
+                                      connection,
+                                      cursor_id,
+                                      mongo_cursor_get_n_return(cursor,
+                                                                offset + i),
+                                      simple);
+      }
    }
 
    g_object_unref(cursor);
@@ -443,7 +638,13 @@ mongo_cursor_foreach_dispatch (MongoConnection    *connection,
    EXIT;
 
 stop:
-   if (mongo_message_reply_get_cursor_id(reply)) {
+   /*
+    * Prefetched batches may still arrive after we stop, they are
+    * dropped by mongo_cursor_foreach_getmore_cb().
+    */
+   g_object_set_data(G_OBJECT(simple), "foreach-done", GINT_TO_POINTER(TRUE));
+
+   if (cursor_id) {
       mongo_connection_kill_cursors_async(connection,
                                           &cursor_id,
                                           1,
@@ -468,6 +669,7 @@ mongo_cursor_foreach_getmore_cb (GObject      *object,
    GSimpleAsyncResult *simple = user_data;
    MongoConnection *connection = (MongoConnection *)object;
    MongoMessageReply *reply;
+   MongoCursor *cursor;
    GError *error = NULL;
 
    ENTRY;
@@ -475,7 +677,22 @@ mongo_cursor_foreach_getmore_cb (GObject      *object,
    g_assert(MONGO_IS_CONNECTION(connection));
    g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
 
-   if (!(reply = mongo_connection_getmore_finish(connection, result, &error))) {
+   cursor = MONGO_CURSOR(g_async_result_get_source_object(G_ASYNC_RESULT(simple)));
+   cursor->priv->n_in_flight--;
+   g_object_unref(cursor);
+
+   reply = mongo_connection_getmore_finish(connection, result, &error);
+
+   if (g_object_get_data(G_OBJECT(simple), "foreach-done")) {
+      g_clear_error(&error);
+      g_clear_object(&reply);
+      g_object_unref(simple);
+      EXIT;
+   }
+
+   if (!reply) {
+      g_object_set_data(G_OBJECT(simple), "foreach-done",
+                        GINT_TO_POINTER(TRUE));
       g_simple_async_result_take_error(simple, error);
       mongo_simple_async_result_complete_in_idle(simple);
       g_object_unref(simple);
@@ -573,7 +790,7 @@ mongo_cursor_foreach_async (MongoCursor         *cursor,
                                 db_and_collection,
                                 priv->flags,
                                 priv->skip,
-                                priv->limit,
+                                mongo_cursor_get_n_return(cursor, 0),
                                 priv->query,
                                 priv->fields,
                                 cancellable,
@@ -592,7 +809,85 @@ mongo_cursor_foreach_finish (MongoCursor   *cursor,
                              GAsyncResult  *result,
                              GError       **error)
 {
-   return TRUE;
+   GSimpleAsyncResult *simple = (GSimpleAsyncResult *)result;
+   gboolean ret;
+
+   ENTRY;
+
+   g_return_val_if_fail(MONGO_IS_CURSOR(cursor), FALSE);
+   g_return_val_if_fail(G_IS_SIMPLE_ASYNC_RESULT(simple), FALSE);
+
+   if (!(ret = g_simple_async_result_get_op_res_gboolean(simple))) {
+      g_simple_async_result_propagate_error(simple, error);
+   }
+
+   RETURN(ret);
+}
+
+/**
+ * mongo_cursor_pause:
+ * @cursor: (in): A #MongoCursor.
+ *
+ * Requests that an active mongo_cursor_foreach_async() stop fetching
+ * further batches from the server. Documents in the batch currently being
+ * dispatched will still be delivered, but the next getmore will not be
+ * issued until mongo_cursor_resume() has been called as many times as
+ * mongo_cursor_pause().
+ *
+ * This can be used by consumers to apply back-pressure when they cannot
+ * keep up with the rate documents are delivered.
+ */
+void
+mongo_cursor_pause (MongoCursor *cursor)
+{
+   g_return_if_fail(MONGO_IS_CURSOR(cursor));
+   cursor->priv->paused++;
+}
+
+/**
+ * mongo_cursor_resume:
+ * @cursor: (in): A #MongoCursor.
+ *
+ * Reverses a previous call to mongo_cursor_pause(). If a getmore was
+ * held back while the cursor was paused, it will be issued now.
+ */
+void
+mongo_cursor_resume (MongoCursor *cursor)
+{
+   MongoCursorPrivate *priv;
+   GSimpleAsyncResult *simple;
+
+   ENTRY;
+
+   g_return_if_fail(MONGO_IS_CURSOR(cursor));
+   g_return_if_fail(cursor->priv->paused);
+
+   priv = cursor->priv;
+
+   if (--priv->paused || !priv->pending) {
+      EXIT;
+   }
+
+   simple = priv->pending;
+   priv->pending = NULL;
+
+   if (!priv->connection) {
+      g_simple_async_result_set_error(simple,
+                                      MONGO_CONNECTION_ERROR,
+                                      MONGO_CONNECTION_ERROR_NOT_CONNECTED,
+                                      _("Cursor is missing MongoConnection."));
+      mongo_simple_async_result_complete_in_idle(simple);
+      g_object_unref(simple);
+      EXIT;
+   }
+
+   mongo_cursor_foreach_getmore(cursor,
+                                priv->connection,
+                                priv->pending_cursor_id,
+                                priv->pending_n_return,
+                                simple);
+
+   EXIT;
 }
 
 static void
@@ -658,6 +953,9 @@ mongo_cursor_get_property (GObject    *object,
    case PROP_LIMIT:
       g_value_set_uint(value, mongo_cursor_get_limit(cursor));
       break;
+   case PROP_PREFETCH:
+      g_value_set_uint(value, mongo_cursor_get_prefetch(cursor));
+      break;
    case PROP_QUERY:
       g_value_set_boxed(value, mongo_cursor_get_query(cursor));
       break;
@@ -699,6 +997,9 @@ mongo_cursor_set_property (GObject      *object,
    case PROP_LIMIT:
       mongo_cursor_set_limit(cursor, g_value_get_uint(value));
       break;
+   case PROP_PREFETCH:
+      mongo_cursor_set_prefetch(cursor, g_value_get_uint(value));
+      break;
    case PROP_QUERY:
       mongo_cursor_set_query(cursor, g_value_get_boxed(value));
       break;
@@ -792,6 +1093,17 @@ mongo_cursor_class_init (MongoCursorClass *klass)
    g_object_class_install_property(object_class, PROP_LIMIT,
                                    gParamSpecs[PROP_LIMIT]);
 
+   gParamSpecs[PROP_PREFETCH] =
+      g_param_spec_uint("prefetch",
+                        _("Prefetch"),
+                        _("The number of batches to request ahead."),
+                        0,
+                        G_MAXUINT32,
+                        0,
+                        G_PARAM_READWRITE);
+   g_object_class_install_property(object_class, PROP_PREFETCH,
+                                   gParamSpecs[PROP_PREFETCH]);
+
    gParamSpecs[PROP_QUERY] =
       g_param_spec_boxed("query",
                          _("Query"),
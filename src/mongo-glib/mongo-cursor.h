@@ -55,6 +55,9 @@ typedef struct _MongoCursorPrivate MongoCursorPrivate;
  * There may be delay between successive calls to this function while
  * data is delivered from the Mongo server.
  *
+ * @bson is a read-only view into the reply from the server and is only
+ * valid until the callback returns. Use mongo_bson_dup() to keep it.
+ *
  * Returns: %TRUE to continue processing, %FALSE to stop.
  */
 typedef gboolean (*MongoCursorCallback) (MongoCursor *cursor,
@@ -114,6 +117,11 @@ GType            mongo_cursor_get_type       (void) G_GNUC_CONST;
 guint            mongo_cursor_get_batch_size (MongoCursor          *cursor);
 void             mongo_cursor_set_batch_size (MongoCursor          *cursor,
                                               guint                 batch_size);
+guint            mongo_cursor_get_prefetch   (MongoCursor          *cursor);
+void             mongo_cursor_set_prefetch   (MongoCursor          *cursor,
+                                              guint                 prefetch);
+void             mongo_cursor_pause          (MongoCursor          *cursor);
+void             mongo_cursor_resume         (MongoCursor          *cursor);
 
 G_END_DECLS
 
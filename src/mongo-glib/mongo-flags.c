@@ -81,6 +81,26 @@ mongo_query_flags_get_type (void)
    return type_id;
 }
 
+GType
+mongo_read_preference_get_type (void)
+{
+   static gsize initialized;
+   static GType type_id;
+   static const GEnumValue values[] = {
+      { MONGO_READ_PRIMARY, "MONGO_READ_PRIMARY", "PRIMARY" },
+      { MONGO_READ_SECONDARY_PREFERRED, "MONGO_READ_SECONDARY_PREFERRED", "SECONDARY_PREFERRED" },
+      { MONGO_READ_NEAREST, "MONGO_READ_NEAREST", "NEAREST" },
+      { 0 }
+   };
+
+   if (g_once_init_enter(&initialized)) {
+      type_id = g_enum_register_static("MongoReadPreference", values);
+      g_once_init_leave(&initialized, TRUE);
+   }
+
+   return type_id;
+}
+
 GType
 mongo_reply_flags_get_type (void)
 {
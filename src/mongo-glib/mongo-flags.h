@@ -26,6 +26,7 @@ G_BEGIN_DECLS
 #define MONGO_TYPE_DELETE_FLAGS (mongo_delete_flags_get_type())
 #define MONGO_TYPE_INSERT_FLAGS (mongo_insert_flags_get_type())
 #define MONGO_TYPE_QUERY_FLAGS  (mongo_query_flags_get_type())
+#define MONGO_TYPE_READ_PREFERENCE (mongo_read_preference_get_type())
 #define MONGO_TYPE_REPLY_FLAGS  (mongo_reply_flags_get_type())
 #define MONGO_TYPE_UPDATE_FLAGS (mongo_update_flags_get_type())
 
@@ -88,6 +89,25 @@ typedef enum
    MONGO_QUERY_PARTIAL           = 1 << 7,
 } MongoQueryFlags;
 
+/**
+ * MongoReadPreference:
+ * @MONGO_READ_PRIMARY: All queries are sent to the primary.
+ * @MONGO_READ_SECONDARY_PREFERRED: Queries with %MONGO_QUERY_SLAVE_OK set
+ *    are sent to a secondary, or to the primary if no secondary is
+ *    available.
+ * @MONGO_READ_NEAREST: Queries with %MONGO_QUERY_SLAVE_OK set are sent to
+ *    the least loaded member of the replica set.
+ *
+ * #MongoReadPreference describes which members of a replica set may serve
+ * a query. Commands and writes are always sent to the primary.
+ */
+typedef enum
+{
+   MONGO_READ_PRIMARY             = 0,
+   MONGO_READ_SECONDARY_PREFERRED = 1,
+   MONGO_READ_NEAREST             = 2,
+} MongoReadPreference;
+
 /**
  * MongoReplyFlags:
  * @MONGO_REPLY_NONE: No flags set.
@@ -127,6 +147,7 @@ typedef enum
 GType mongo_delete_flags_get_type (void) G_GNUC_CONST;
 GType mongo_insert_flags_get_type (void) G_GNUC_CONST;
 GType mongo_query_flags_get_type  (void) G_GNUC_CONST;
+GType mongo_read_preference_get_type (void) G_GNUC_CONST;
 GType mongo_reply_flags_get_type  (void) G_GNUC_CONST;
 GType mongo_update_flags_get_type (void) G_GNUC_CONST;
 
@@ -51,6 +51,7 @@ G_BEGIN_DECLS
 #include "mongo-protocol.h"
 #include "mongo-server.h"
 #include "mongo-version.h"
+#include "mongo-write-concern.h"
 
 #undef MONGO_INSIDE
 
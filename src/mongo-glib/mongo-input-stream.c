@@ -23,15 +23,34 @@
 #include "mongo-operation.h"
 #include "mongo-source.h"
 
+/*
+ * Size of the read-ahead buffer. It grows to fit larger messages and is
+ * reused for the lifetime of the stream.
+ */
+#ifndef MONGO_INPUT_STREAM_BUFFER_SIZE
+#define MONGO_INPUT_STREAM_BUFFER_SIZE 16384
+#endif
+
+/*
+ * Messages larger than this are treated as a corrupt stream rather than
+ * growing the read-ahead buffer to fit them.
+ */
+#ifndef MONGO_INPUT_STREAM_MAX_MESSAGE
+#define MONGO_INPUT_STREAM_MAX_MESSAGE (64 * 1024 * 1024)
+#endif
+
 G_DEFINE_TYPE(MongoInputStream, mongo_input_stream, G_TYPE_FILTER_INPUT_STREAM)
 
 struct _MongoInputStreamPrivate
 {
    GCancellable *shutdown;
    MongoSource *source;
-   gint32 msg_len;
-   gint32 to_read;
    guint8 *buffer;
+   gsize buffer_size;
+   gsize begin;
+   gsize end;
+   GQueue ready;
+   GError *error;
 };
 
 enum
@@ -84,17 +103,13 @@ mongo_input_stream_set_async_context (MongoInputStream *stream,
    EXIT;
 }
 
-static void
-mongo_input_stream_read_message_body_cb (GObject      *object,
-                                         GAsyncResult *result,
-                                         gpointer      user_data)
+static MongoMessage *
+mongo_input_stream_decode (MongoInputStream  *stream,
+                           const guint8      *data,
+                           gsize              length,
+                           GError           **error)
 {
-   MongoInputStreamPrivate *priv;
-   GSimpleAsyncResult *simple = user_data;
-   MongoInputStream *input = (MongoInputStream *)object;
-   MongoMessage *message = NULL;
-   GError *error = NULL;
-   gssize ret;
+   MongoMessage *message;
    GType type_id;
 #pragma pack(push, 1)
    struct {
@@ -107,91 +122,157 @@ mongo_input_stream_read_message_body_cb (GObject      *object,
 
    ENTRY;
 
-   g_assert(MONGO_IS_INPUT_STREAM(input));
-   g_assert(G_IS_ASYNC_RESULT(result));
-   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
-
-   priv = input->priv;
-
-   ret = g_input_stream_read_finish(G_INPUT_STREAM(input), result, &error);
-   if (ret == -1) {
-      if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
-         g_simple_async_result_take_error(simple, error);
-      }
-      GOTO(failure);
-   } else if (ret == 0) {
-      /* End of stream */
-      GOTO(failure);
-   } else if (ret != priv->to_read) {
-      /* Short read! */
-      priv->to_read -= ret;
-      g_assert_cmpint(priv->msg_len + priv->to_read, >, 0);
-      g_assert_cmpint(priv->msg_len, >, 0);
-      g_assert_cmpint(priv->to_read, >, 0);
-      g_input_stream_read_async(G_INPUT_STREAM(input),
-                                priv->buffer + (priv->msg_len - priv->to_read),
-                                priv->to_read,
-                                G_PRIORITY_DEFAULT,
-                                priv->shutdown,
-                                mongo_input_stream_read_message_body_cb,
-                                simple);
-      EXIT;
-   }
-
-   memcpy(&header, priv->buffer, sizeof header);
-   if (!(type_id = mongo_operation_get_message_type(header.op_code))) {
-      GOTO(failure);
-   }
+   g_assert(MONGO_IS_INPUT_STREAM(stream));
+   g_assert(data);
+   g_assert_cmpint(length, >, sizeof header);
 
+   memcpy(&header, data, sizeof header);
    header.msg_len = GINT32_FROM_LE(header.msg_len);
    header.request_id = GINT32_FROM_LE(header.request_id);
    header.response_to = GINT32_FROM_LE(header.response_to);
    header.op_code = GINT32_FROM_LE(header.op_code);
 
-   DUMP_BYTES(buffer, priv->buffer, priv->msg_len);
+   if (!(type_id = mongo_operation_get_message_type(header.op_code))) {
+      g_set_error(error,
+                  MONGO_INPUT_STREAM_ERROR,
+                  MONGO_INPUT_STREAM_ERROR_UNKNOWN_OPERATION,
+                  _("Unknown operation %d."),
+                  header.op_code);
+      RETURN(NULL);
+   }
+
+   DUMP_BYTES(buffer, data, length);
 
    message = g_object_new(type_id,
                           "request-id", header.request_id,
                           "response-to", header.response_to,
                           NULL);
    if (!mongo_message_load_from_data(message,
-                                     priv->buffer + sizeof header, // FIXME: load all data.
-                                     priv->msg_len - sizeof header)) {
-      GOTO(failure);
+                                     data + sizeof header,
+                                     length - sizeof header)) {
+      g_set_error(error,
+                  MONGO_INPUT_STREAM_ERROR,
+                  MONGO_INPUT_STREAM_ERROR_INVALID_MESSAGE,
+                  _("Failed to decode message."));
+      g_object_unref(message);
+      RETURN(NULL);
    }
 
-   g_simple_async_result_set_op_res_gpointer(simple, message, g_object_unref);
-   mongo_source_complete_in_idle(priv->source, simple);
-   g_object_unref(simple);
-   g_free(priv->buffer);
-   priv->buffer = NULL;
-   priv->to_read = 0;
-   priv->msg_len = 0;
+   RETURN(message);
+}
+
+/**
+ * mongo_input_stream_parse:
+ * @stream: (in): A #MongoInputStream.
+ *
+ * Decodes every complete message in the read-ahead buffer and queues
+ * them to be handed out by mongo_input_stream_read_message_async().
+ * A malformed message poisons the stream; the error is delivered once
+ * the messages before it have been consumed.
+ */
+static void
+mongo_input_stream_parse (MongoInputStream *stream)
+{
+   MongoInputStreamPrivate *priv;
+   MongoMessage *message;
+   guint32 msg_len;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_INPUT_STREAM(stream));
+
+   priv = stream->priv;
+
+   while (!priv->error && ((priv->end - priv->begin) >= sizeof msg_len)) {
+      memcpy(&msg_len, priv->buffer + priv->begin, sizeof msg_len);
+      msg_len = GUINT32_FROM_LE(msg_len);
+
+      if (msg_len <= 16) {
+         g_set_error(&priv->error,
+                     MONGO_INPUT_STREAM_ERROR,
+                     MONGO_INPUT_STREAM_ERROR_INSUFFICIENT_DATA,
+                     _("Insufficient data for message."));
+         break;
+      } else if (msg_len > MONGO_INPUT_STREAM_MAX_MESSAGE) {
+         g_set_error(&priv->error,
+                     MONGO_INPUT_STREAM_ERROR,
+                     MONGO_INPUT_STREAM_ERROR_INVALID_MESSAGE,
+                     _("Message length %u is too large."),
+                     msg_len);
+         break;
+      } else if ((priv->end - priv->begin) < msg_len) {
+         break;
+      }
+
+      if ((message = mongo_input_stream_decode(stream,
+                                               priv->buffer + priv->begin,
+                                               msg_len,
+                                               &priv->error))) {
+         g_queue_push_tail(&priv->ready, message);
+      }
+
+      priv->begin += msg_len;
+   }
+
+   if (priv->begin == priv->end) {
+      priv->begin = 0;
+      priv->end = 0;
+   }
 
    EXIT;
+}
 
-failure:
-   g_input_stream_close(G_INPUT_STREAM(input), NULL, NULL);
-   mongo_source_complete_in_idle(input->priv->source, simple);
+/**
+ * mongo_input_stream_complete:
+ * @stream: (in): A #MongoInputStream.
+ * @simple: (in): A #GSimpleAsyncResult.
+ *
+ * Completes @simple with the next decoded message, or with the error
+ * that poisoned the stream.
+ *
+ * Returns: %TRUE if @simple was completed; %FALSE if more data is needed.
+ */
+static gboolean
+mongo_input_stream_complete (MongoInputStream   *stream,
+                             GSimpleAsyncResult *simple)
+{
+   MongoInputStreamPrivate *priv;
+   MongoMessage *message;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_INPUT_STREAM(stream));
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+
+   priv = stream->priv;
+
+   if ((message = g_queue_pop_head(&priv->ready))) {
+      g_simple_async_result_set_op_res_gpointer(simple, message,
+                                                g_object_unref);
+   } else if (priv->error) {
+      g_input_stream_close(G_INPUT_STREAM(stream), NULL, NULL);
+      g_simple_async_result_set_from_error(simple, priv->error);
+   } else {
+      RETURN(FALSE);
+   }
+
+   mongo_source_complete_in_idle(priv->source, simple);
    g_object_unref(simple);
-   g_free(priv->buffer);
-   priv->buffer = NULL;
-   g_clear_object(&message);
-   priv->to_read = 0;
-   priv->msg_len = 0;
 
-   EXIT;
+   RETURN(TRUE);
 }
 
+static void mongo_input_stream_fill (MongoInputStream   *stream,
+                                     GSimpleAsyncResult *simple);
+
 static void
-mongo_input_stream_read_message_header_cb (GObject      *object,
-                                           GAsyncResult *result,
-                                           gpointer      user_data)
+mongo_input_stream_fill_cb (GObject      *object,
+                            GAsyncResult *result,
+                            gpointer      user_data)
 {
    MongoInputStreamPrivate *priv;
    GSimpleAsyncResult *simple = user_data;
    MongoInputStream *input = (MongoInputStream *)object;
-   gint32 msg_len_le;
    GError *error = NULL;
    gssize ret;
 
@@ -204,44 +285,84 @@ mongo_input_stream_read_message_header_cb (GObject      *object,
    priv = input->priv;
 
    ret = g_input_stream_read_finish(G_INPUT_STREAM(input), result, &error);
-   if (ret != sizeof priv->msg_len) {
+
+   if (ret <= 0) {
       g_input_stream_close(G_INPUT_STREAM(input), NULL, NULL);
-      if (error) {
-         g_simple_async_result_take_error(simple, error);
-      } else {
+      if (ret == 0) {
          g_simple_async_result_set_error(simple,
                                          G_IO_ERROR,
                                          G_IO_ERROR_CLOSED,
                                          _("The stream is closed."));
+      } else if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+         g_simple_async_result_take_error(simple, error);
+         error = NULL;
       }
-      mongo_source_complete_in_idle(input->priv->source, simple);
+      g_clear_error(&error);
+      mongo_source_complete_in_idle(priv->source, simple);
       g_object_unref(simple);
       EXIT;
    }
 
-   msg_len_le = priv->msg_len;
-   priv->msg_len = GINT32_FROM_LE(priv->msg_len);
+   priv->end += ret;
 
-   if (priv->msg_len <= 16) {
-      g_simple_async_result_set_error(simple,
-                                      MONGO_INPUT_STREAM_ERROR,
-                                      MONGO_INPUT_STREAM_ERROR_INSUFFICIENT_DATA,
-                                      _("Insufficient data for message."));
-      mongo_source_complete_in_idle(input->priv->source, simple);
-      g_object_unref(simple);
-      EXIT;
+   mongo_input_stream_parse(input);
+
+   if (!mongo_input_stream_complete(input, simple)) {
+      mongo_input_stream_fill(input, simple);
    }
 
-   priv->buffer = g_malloc(priv->msg_len);
-   memcpy(priv->buffer, &msg_len_le, sizeof msg_len_le);
-   priv->to_read = priv->msg_len - 4;
+   EXIT;
+}
 
-   g_input_stream_read_async(G_INPUT_STREAM(input),
-                             priv->buffer + (priv->msg_len - priv->to_read),
-                             priv->to_read,
+/**
+ * mongo_input_stream_fill:
+ * @stream: (in): A #MongoInputStream.
+ * @simple: (in): A #GSimpleAsyncResult.
+ *
+ * Reads as much as is available from the base stream into the
+ * read-ahead buffer. The partial message at the front of the buffer is
+ * moved to the start first, and the buffer is grown if it cannot hold
+ * the whole message.
+ */
+static void
+mongo_input_stream_fill (MongoInputStream   *stream,
+                         GSimpleAsyncResult *simple)
+{
+   MongoInputStreamPrivate *priv;
+   guint32 msg_len;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_INPUT_STREAM(stream));
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+
+   priv = stream->priv;
+
+   if (priv->begin) {
+      memmove(priv->buffer,
+              priv->buffer + priv->begin,
+              priv->end - priv->begin);
+      priv->end -= priv->begin;
+      priv->begin = 0;
+   }
+
+   if (priv->end >= sizeof msg_len) {
+      memcpy(&msg_len, priv->buffer, sizeof msg_len);
+      msg_len = GUINT32_FROM_LE(msg_len);
+      if (msg_len > priv->buffer_size) {
+         priv->buffer = g_realloc(priv->buffer, msg_len);
+         priv->buffer_size = msg_len;
+      }
+   }
+
+   g_assert_cmpint(priv->end, <, priv->buffer_size);
+
+   g_input_stream_read_async(G_INPUT_STREAM(stream),
+                             priv->buffer + priv->end,
+                             priv->buffer_size - priv->end,
                              G_PRIORITY_DEFAULT,
                              priv->shutdown,
-                             mongo_input_stream_read_message_body_cb,
+                             mongo_input_stream_fill_cb,
                              simple);
 
    EXIT;
@@ -255,6 +376,10 @@ mongo_input_stream_read_message_header_cb (GObject      *object,
  * @user_data: user data for @callback.
  *
  * Asynchronously reads the next message from the #MongoInputStream.
+ *
+ * Reads pull as much data as the base stream has available, and every
+ * complete message is decoded at once. Messages that were already
+ * buffered are returned without touching the base stream.
  */
 void
 mongo_input_stream_read_message_async (MongoInputStream    *stream,
@@ -262,7 +387,6 @@ mongo_input_stream_read_message_async (MongoInputStream    *stream,
                                        GAsyncReadyCallback  callback,
                                        gpointer             user_data)
 {
-   MongoInputStreamPrivate *priv;
    GSimpleAsyncResult *simple;
 
    ENTRY;
@@ -270,19 +394,13 @@ mongo_input_stream_read_message_async (MongoInputStream    *stream,
    g_return_if_fail(MONGO_IS_INPUT_STREAM(stream));
    g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
 
-   priv = stream->priv;
-
    simple = g_simple_async_result_new(G_OBJECT(stream), callback, user_data,
                                       mongo_input_stream_read_message_async);
    g_simple_async_result_set_check_cancellable(simple, cancellable);
 
-   g_input_stream_read_async(G_INPUT_STREAM(stream),
-                             &priv->msg_len,
-                             sizeof priv->msg_len,
-                             G_PRIORITY_DEFAULT,
-                             priv->shutdown,
-                             mongo_input_stream_read_message_header_cb,
-                             simple);
+   if (!mongo_input_stream_complete(stream, simple)) {
+      mongo_input_stream_fill(stream, simple);
+   }
 
    EXIT;
 }
@@ -419,6 +537,14 @@ mongo_input_stream_finalize (GObject *object)
    g_source_destroy((GSource *)priv->source);
    priv->source = NULL;
 
+   g_queue_foreach(&priv->ready, (GFunc)g_object_unref, NULL);
+   g_queue_clear(&priv->ready);
+   g_clear_error(&priv->error);
+   g_clear_object(&priv->shutdown);
+
+   g_free(priv->buffer);
+   priv->buffer = NULL;
+
    G_OBJECT_CLASS(mongo_input_stream_parent_class)->finalize(object);
 
    EXIT;
@@ -492,6 +618,9 @@ mongo_input_stream_init (MongoInputStream *stream)
                                               MONGO_TYPE_INPUT_STREAM,
                                               MongoInputStreamPrivate);
    stream->priv->shutdown = g_cancellable_new();
+   stream->priv->buffer = g_malloc(MONGO_INPUT_STREAM_BUFFER_SIZE);
+   stream->priv->buffer_size = MONGO_INPUT_STREAM_BUFFER_SIZE;
+   g_queue_init(&stream->priv->ready);
    EXIT;
 }
 
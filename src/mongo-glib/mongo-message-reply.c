@@ -27,6 +27,9 @@ G_DEFINE_TYPE(MongoMessageReply, mongo_message_reply, MONGO_TYPE_MESSAGE)
 struct _MongoMessageReplyPrivate
 {
    guint64           cursor_id;
+   guint8           *buffer;
+   MongoBson        *views;
+   gsize             n_documents;
    GList            *documents;
    MongoReplyFlags   flags;
    guint32           offset;
@@ -44,11 +47,32 @@ enum
 
 static GParamSpec *gParamSpecs[LAST_PROP];
 
+static void
+mongo_message_reply_clear (MongoMessageReply *reply)
+{
+   MongoMessageReplyPrivate *priv;
+
+   g_assert(MONGO_IS_MESSAGE_REPLY(reply));
+
+   priv = reply->priv;
+
+   g_list_foreach(priv->documents, (GFunc)mongo_bson_unref, NULL);
+   g_list_free(priv->documents);
+   priv->documents = NULL;
+
+   g_free(priv->views);
+   priv->views = NULL;
+   priv->n_documents = 0;
+
+   g_free(priv->buffer);
+   priv->buffer = NULL;
+}
+
 gsize
 mongo_message_reply_get_count (MongoMessageReply *reply)
 {
    g_return_val_if_fail(MONGO_IS_MESSAGE_REPLY(reply), 0);
-   return g_list_length(reply->priv->documents);
+   return reply->priv->n_documents;
 }
 
 guint64
@@ -71,16 +95,61 @@ mongo_message_reply_set_cursor_id (MongoMessageReply *reply,
  * mongo_message_reply_get_documents:
  * @reply: (in): A #MongoMessageReply.
  *
- * Returns an array of documents for the reply. @count is set to the
- * number of documents returned.
+ * Returns the documents for the reply as a #GList.
+ *
+ * If the reply was read from the wire, the first call copies each
+ * document out of the reply buffer. Use
+ * mongo_message_reply_peek_documents() to avoid the copies.
  *
  * Returns: (transfer none) (element-type MongoBson*): A #GList of #MongoBson.
  */
 GList *
 mongo_message_reply_get_documents (MongoMessageReply *reply)
+{
+   MongoMessageReplyPrivate *priv;
+   GList *list = NULL;
+   gsize i;
+
+   g_return_val_if_fail(MONGO_IS_MESSAGE_REPLY(reply), NULL);
+
+   priv = reply->priv;
+
+   if (!priv->documents && priv->n_documents) {
+      for (i = priv->n_documents; i > 0; i--) {
+         list = g_list_prepend(list, mongo_bson_dup(&priv->views[i - 1]));
+      }
+      priv->documents = list;
+   }
+
+   return priv->documents;
+}
+
+/**
+ * mongo_message_reply_peek_documents:
+ * @reply: (in): A #MongoMessageReply.
+ * @n_documents: (out): A location for the number of documents.
+ *
+ * Returns the documents for the reply as an array of read-only views into
+ * the reply buffer. No copies are made, so this is the preferred way to
+ * walk large batches.
+ *
+ * The views are only valid for the lifetime of @reply. They are not
+ * reference counted; they must not be passed to mongo_bson_ref(),
+ * mongo_bson_unref() or any of the mongo_bson_append functions. Use
+ * mongo_bson_dup() to keep a document.
+ *
+ * Returns: (transfer none) (array length=n_documents): An array of
+ *   #MongoBson views.
+ */
+const MongoBson *
+mongo_message_reply_peek_documents (MongoMessageReply *reply,
+                                    gsize             *n_documents)
 {
    g_return_val_if_fail(MONGO_IS_MESSAGE_REPLY(reply), NULL);
-   return reply->priv->documents;
+   g_return_val_if_fail(n_documents, NULL);
+
+   *n_documents = reply->priv->n_documents;
+   return reply->priv->views;
 }
 
 /**
@@ -97,24 +166,35 @@ mongo_message_reply_set_documents (MongoMessageReply *reply,
                                    GList             *documents)
 {
    MongoMessageReplyPrivate *priv;
+   MongoBson *bson;
    GList *list = NULL;
    GList *iter;
+   gsize i = 0;
 
    g_return_if_fail(MONGO_IS_MESSAGE_REPLY(reply));
 
    priv = reply->priv;
 
-   g_list_foreach(priv->documents, (GFunc)mongo_bson_unref, NULL);
-   g_list_free(priv->documents);
-   priv->documents = NULL;
+   mongo_message_reply_clear(reply);
 
    for (iter = documents; iter; iter = iter->next) {
       if (iter->data) {
          list = g_list_prepend(list, mongo_bson_ref(iter->data));
+         priv->n_documents++;
       }
    }
    priv->documents = g_list_reverse(list);
 
+   /*
+    * The views borrow from the documents we now hold a reference to.
+    */
+   priv->views = g_new(MongoBson, priv->n_documents);
+   for (iter = priv->documents; iter; iter = iter->next, i++) {
+      bson = iter->data;
+      priv->views[i].data = bson->data;
+      priv->views[i].len = bson->len;
+   }
+
    g_object_notify_by_pspec(G_OBJECT(reply), gParamSpecs[PROP_COUNT]);
 }
 
@@ -157,11 +237,10 @@ mongo_message_reply_save_to_data (MongoMessage *message,
    MongoMessageReplyPrivate *priv;
    MongoMessageReply *reply = (MongoMessageReply *)message;
    GByteArray *bytes;
-   MongoBson *bson;
    gint32 v32;
    gint64 v64;
    guint8 *ret;
-   GList *iter;
+   gsize i;
 
    ENTRY;
 
@@ -197,13 +276,12 @@ mongo_message_reply_save_to_data (MongoMessage *message,
    g_byte_array_append(bytes, (guint8 *)&v32, sizeof v32);
 
    /* Number of documents returned */
-   v32 = GUINT32_TO_LE(g_list_length(priv->documents));
+   v32 = GUINT32_TO_LE(priv->n_documents);
    g_byte_array_append(bytes, (guint8 *)&v32, sizeof v32);
 
    /* encode BSON documents */
-   for (iter = priv->documents; iter; iter = iter->next) {
-      bson = iter->data;
-      g_byte_array_append(bytes, bson->data, bson->len);
+   for (i = 0; i < priv->n_documents; i++) {
+      g_byte_array_append(bytes, priv->views[i].data, priv->views[i].len);
    }
 
    /* Update message length */
@@ -225,14 +303,15 @@ mongo_message_reply_load_from_data (MongoMessage *message,
 {
    MongoMessageReplyPrivate *priv;
    MongoMessageReply *reply = (MongoMessageReply *)message;
-   MongoBson *bson;
+   MongoBson *views = NULL;
    guint64 cursor;
    guint32 flags;
    guint32 offset;
    guint32 count;
    guint32 msg_len;
-   gssize len = length;
-   GList *list = NULL;
+   guint8 *buffer = NULL;
+   gsize len = length;
+   gsize pos = 0;
    guint i;
 
    ENTRY;
@@ -243,6 +322,10 @@ mongo_message_reply_load_from_data (MongoMessage *message,
 
    priv = reply->priv;
 
+   if (len < 20) {
+      GOTO(failure);
+   }
+
    memcpy(&flags, data, sizeof flags);
    flags = GUINT32_FROM_LE(flags);
    data += 4;
@@ -263,52 +346,62 @@ mongo_message_reply_load_from_data (MongoMessage *message,
    data += 4;
    len -= 4;
 
+   /*
+    * The smallest BSON document is 5 bytes, so don't trust a count that
+    * could not possibly fit in the message.
+    */
+   if (count > (len / 5)) {
+      GOTO(failure);
+   }
+
+   /*
+    * Copy the documents once into a buffer owned by the reply and hand
+    * out views into it rather than allocating each document.
+    */
+   if (count) {
+      buffer = g_memdup(data, len);
+      views = g_new(MongoBson, count);
+   }
+
    for (i = 0; i < count; i++) {
-      if (len <= 0) {
+      if ((len - pos) < 5) {
          GOTO(failure);
       }
 
-      memcpy(&msg_len, data, sizeof msg_len);
+      memcpy(&msg_len, buffer + pos, sizeof msg_len);
       msg_len = GUINT32_FROM_LE(msg_len);
 
-      if (msg_len <= len) {
-         if ((bson = mongo_bson_new_from_data(data, msg_len))) {
-            list = g_list_append(list, bson);
-         } else {
-            GOTO(failure);
-         }
+      if ((msg_len < 5) || (msg_len > (len - pos))) {
+         GOTO(failure);
       }
 
-      data += msg_len;
+      views[i].data = buffer + pos;
+      views[i].len = msg_len;
+      pos += msg_len;
    }
 
-   if (g_list_length(list) != count) {
-      GOTO(failure);
-   }
+   mongo_message_reply_clear(reply);
 
    priv->cursor_id = cursor;
    priv->flags = flags;
    priv->offset = offset;
-   priv->documents = list;
+   priv->buffer = buffer;
+   priv->views = views;
+   priv->n_documents = count;
    RETURN(TRUE);
 
 failure:
-   g_list_foreach(list, (GFunc)mongo_bson_unref, NULL);
-   g_list_free(list);
+   g_free(views);
+   g_free(buffer);
    RETURN(FALSE);
 }
 
 static void
 mongo_message_reply_finalize (GObject *object)
 {
-   MongoMessageReplyPrivate *priv;
-
    ENTRY;
 
-   priv = MONGO_MESSAGE_REPLY(object)->priv;
-
-   g_list_foreach(priv->documents, (GFunc)mongo_bson_unref, NULL);
-   g_list_free(priv->documents);
+   mongo_message_reply_clear(MONGO_MESSAGE_REPLY(object));
 
    G_OBJECT_CLASS(mongo_message_reply_parent_class)->finalize(object);
 
@@ -54,6 +54,8 @@ GList           *mongo_message_reply_get_documents  (MongoMessageReply   *reply)
 MongoReplyFlags  mongo_message_reply_get_flags      (MongoMessageReply   *reply);
 guint            mongo_message_reply_get_offset     (MongoMessageReply   *reply);
 GType            mongo_message_reply_get_type       (void) G_GNUC_CONST;
+const MongoBson *mongo_message_reply_peek_documents (MongoMessageReply   *reply,
+                                                     gsize               *n_documents);
 void             mongo_message_reply_set_cursor_id  (MongoMessageReply   *reply,
                                                      guint64              cursor_id);
 void             mongo_message_reply_set_documents  (MongoMessageReply   *reply,
@@ -301,7 +301,7 @@ mongo_output_stream_write_message_async (MongoOutputStream   *stream,
 {
    MongoOutputStreamPrivate *priv;
    GSimpleAsyncResult *simple;
-   MongoMessage *gle;
+   MongoMessage *gle = NULL;
    gboolean ignore_error;
    GError *error = NULL;
    GBytes *bytes;
@@ -346,6 +346,14 @@ mongo_output_stream_write_message_async (MongoOutputStream   *stream,
    case MONGO_OPERATION_UPDATE:
    case MONGO_OPERATION_INSERT:
    case MONGO_OPERATION_DELETE:
+      /*
+       * Unacknowledged writes have no getlasterror to wait for.
+       */
+      if (!(gle = mongo_write_concern_build_getlasterror(concern, "admin"))) { // FIXME
+         complete = COMPLETE_ON_WRITE;
+         request_id = 0;
+         break;
+      }
       complete = COMPLETE_ON_GETLASTERROR;
       request_id = mongo_output_stream_get_next_request_id(stream);
       break;
@@ -361,6 +369,7 @@ mongo_output_stream_write_message_async (MongoOutputStream   *stream,
       g_simple_async_result_take_error(simple, error);
       mongo_source_complete_in_idle(priv->source, simple);
       g_object_unref(simple);
+      g_clear_object(&gle);
       RETURN(0);
    }
 
@@ -373,7 +382,7 @@ mongo_output_stream_write_message_async (MongoOutputStream   *stream,
    /*
     * Queue the bytes to be written to the underlying stream.
     */
-   ignore_error = (mongo_write_concern_get_w(concern) == -1);
+   ignore_error = (mongo_write_concern_get_w(concern) < 0);
    mongo_output_stream_queue(stream, simple, bytes, ignore_error);
    g_bytes_unref(bytes);
 
@@ -382,7 +391,6 @@ mongo_output_stream_write_message_async (MongoOutputStream   *stream,
     * then send that now.
     */
    if (complete == COMPLETE_ON_GETLASTERROR) {
-      gle = mongo_write_concern_build_getlasterror(concern, "admin"); // FIXME
       g_assert(MONGO_IS_MESSAGE_QUERY(gle));
 
       bytes = mongo_message_save_to_bytes(gle, NULL);
@@ -411,7 +419,8 @@ mongo_output_stream_write_message_async (MongoOutputStream   *stream,
  * If no #MongoWriteConcern was provided to
  * mongo_output_stream_write_message_async() or a write concern w=-1, then
  * this will never fail. However, if w=0 or more, then socket errors can
- * cause this to fail.
+ * cause this to fail. Unacknowledged writes complete once they have been
+ * written since no getlasterror is sent for them.
  *
  * Returns: %TRUE if successful; otherwise %FALSE and @error is set.
  */
@@ -22,6 +22,15 @@
 #include "mongo-input-stream.h"
 #include "mongo-protocol.h"
 #include "mongo-source.h"
+#include "mongo-write-concern.h"
+
+/*
+ * Messages are corked until the main loop is idle or this many bytes
+ * are waiting, whichever comes first.
+ */
+#ifndef MONGO_PROTOCOL_CORK_SIZE
+#define MONGO_PROTOCOL_CORK_SIZE (64 * 1024)
+#endif
 
 /**
  * SECTION:mongo-protocol
@@ -40,6 +49,10 @@ struct _MongoProtocolPrivate
    GIOStream *io_stream;
    MongoInputStream *input_stream;
    GOutputStream *output_stream;
+   GByteArray *corked;
+   GByteArray *writing;
+   gsize writing_offset;
+   guint uncork_handler;
    guint32 last_request_id;
    GCancellable *shutdown;
    GHashTable *requests;
@@ -168,6 +181,11 @@ mongo_protocol_fail (MongoProtocol *protocol,
 
    g_hash_table_remove_all(priv->requests);
 
+   /*
+    * Anything still corked belongs to the requests we just failed.
+    */
+   g_byte_array_set_size(priv->corked, 0);
+
    g_signal_emit(protocol, gSignals[FAILED], 0, local_error);
 
    g_error_free(local_error);
@@ -179,36 +197,192 @@ mongo_protocol_fail (MongoProtocol *protocol,
    EXIT;
 }
 
+static void mongo_protocol_uncork (MongoProtocol *protocol);
+
+static void
+mongo_protocol_write_cb (GObject      *object,
+                         GAsyncResult *result,
+                         gpointer      user_data)
+{
+   MongoProtocolPrivate *priv;
+   GOutputStream *output_stream = (GOutputStream *)object;
+   MongoProtocol *protocol = user_data;
+   GError *error = NULL;
+   gssize n_written;
+
+   ENTRY;
+
+   g_assert(G_IS_OUTPUT_STREAM(output_stream));
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+
+   priv = protocol->priv;
+
+   n_written = g_output_stream_write_finish(output_stream, result, &error);
+
+   if (n_written < 0) {
+      g_byte_array_set_size(priv->writing, 0);
+      priv->writing_offset = 0;
+      if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+         mongo_protocol_fail(protocol, error);
+      }
+      g_error_free(error);
+      g_object_unref(protocol);
+      EXIT;
+   }
+
+   priv->writing_offset += n_written;
+
+   if (priv->writing_offset < priv->writing->len) {
+      g_output_stream_write_async(output_stream,
+                                  priv->writing->data + priv->writing_offset,
+                                  priv->writing->len - priv->writing_offset,
+                                  G_PRIORITY_DEFAULT,
+                                  priv->shutdown,
+                                  mongo_protocol_write_cb,
+                                  protocol);
+      EXIT;
+   }
+
+   g_byte_array_set_size(priv->writing, 0);
+   priv->writing_offset = 0;
+
+   /*
+    * Send whatever was corked while we were writing.
+    */
+   if (priv->corked->len) {
+      mongo_protocol_uncork(protocol);
+   }
+
+   g_object_unref(protocol);
+
+   EXIT;
+}
+
+/**
+ * mongo_protocol_uncork:
+ * @protocol: (in): A #MongoProtocol.
+ *
+ * Starts writing the corked messages to the output stream. If a write is
+ * already in flight, the messages are sent once it completes.
+ */
+static void
+mongo_protocol_uncork (MongoProtocol *protocol)
+{
+   MongoProtocolPrivate *priv;
+   GByteArray *tmp;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+
+   priv = protocol->priv;
+
+   if (priv->uncork_handler) {
+      g_source_remove(priv->uncork_handler);
+      priv->uncork_handler = 0;
+   }
+
+   if (priv->writing->len || !priv->corked->len) {
+      EXIT;
+   }
+
+   tmp = priv->writing;
+   priv->writing = priv->corked;
+   priv->corked = tmp;
+
+   g_output_stream_write_async(priv->output_stream,
+                               priv->writing->data,
+                               priv->writing->len,
+                               G_PRIORITY_DEFAULT,
+                               priv->shutdown,
+                               mongo_protocol_write_cb,
+                               g_object_ref(protocol));
+
+   EXIT;
+}
+
+static gboolean
+mongo_protocol_uncork_cb (gpointer user_data)
+{
+   MongoProtocol *protocol = user_data;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+
+   protocol->priv->uncork_handler = 0;
+   mongo_protocol_uncork(protocol);
+
+   RETURN(FALSE);
+}
+
+/**
+ * mongo_protocol_flush_sync:
+ * @protocol: (in): A #MongoProtocol.
+ *
+ * Synchronously writes any corked messages to the output stream. This
+ * blocks the caller and is typically only useful before shutting down.
+ * If an asynchronous write is already in flight, the corked messages
+ * are left for it to send.
+ */
 void
 mongo_protocol_flush_sync (MongoProtocol *protocol)
 {
+   MongoProtocolPrivate *priv;
+   GError *error = NULL;
+
    ENTRY;
 
    g_return_if_fail(MONGO_IS_PROTOCOL(protocol));
 
-   if (!g_output_stream_has_pending(protocol->priv->output_stream)) {
-      g_output_stream_flush(protocol->priv->output_stream, NULL, NULL);
+   priv = protocol->priv;
+
+   if (priv->uncork_handler) {
+      g_source_remove(priv->uncork_handler);
+      priv->uncork_handler = 0;
+   }
+
+   if (priv->writing->len || !priv->corked->len) {
+      EXIT;
+   }
+
+   if (!g_output_stream_write_all(priv->output_stream,
+                                  priv->corked->data,
+                                  priv->corked->len,
+                                  NULL,
+                                  NULL,
+                                  &error)) {
+      mongo_protocol_fail(protocol, error);
+      g_error_free(error);
    }
 
+   g_byte_array_set_size(priv->corked, 0);
+
    EXIT;
 }
 
+/**
+ * mongo_protocol_write:
+ * @protocol: (in): A #MongoProtocol.
+ * @buffer: (in): The encoded message.
+ * @buffer_len: (in): The length of @buffer in bytes.
+ *
+ * Corks a message to be written to the output stream. Messages are
+ * coalesced and written asynchronously once per main loop iteration, or
+ * immediately once %MONGO_PROTOCOL_CORK_SIZE bytes are waiting. Failures
+ * are reported through mongo_protocol_fail(), which completes every
+ * outstanding request.
+ */
 static void
-mongo_protocol_write (MongoProtocol      *protocol,
-                      guint32             request_id,
-                      GSimpleAsyncResult *simple,
-                      const guint8       *buffer,
-                      gsize               buffer_len)
+mongo_protocol_write (MongoProtocol *protocol,
+                      const guint8  *buffer,
+                      gsize          buffer_len)
 {
    MongoProtocolPrivate *priv;
-   GError *error = NULL;
-   gsize n_written = 0;
 
    ENTRY;
 
    g_assert(MONGO_IS_PROTOCOL(protocol));
-   g_assert(request_id);
-   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
    g_assert(buffer);
    g_assert(buffer_len);
 
@@ -216,31 +390,155 @@ mongo_protocol_write (MongoProtocol      *protocol,
 
    DUMP_BYTES(buffer, buffer, buffer_len);
 
-   if (!g_output_stream_write_all(priv->output_stream,
-                                  buffer,
-                                  buffer_len,
-                                  &n_written,
-                                  NULL, &error)) {
-      mongo_protocol_fail(protocol, error);
-      g_simple_async_result_take_error(simple, error);
-      mongo_simple_async_result_complete_in_idle(simple);
-      g_object_unref(simple);
-      EXIT;
-   }
+   g_byte_array_append(priv->corked, buffer, buffer_len);
 
-   mongo_protocol_flush_sync(protocol);
+   if (priv->corked->len >= MONGO_PROTOCOL_CORK_SIZE) {
+      mongo_protocol_uncork(protocol);
+   } else if (!priv->uncork_handler) {
+      priv->uncork_handler =
+         g_idle_add_full(G_PRIORITY_DEFAULT,
+                         mongo_protocol_uncork_cb,
+                         protocol,
+                         NULL);
+   }
 
    EXIT;
 }
 
 static void
-mongo_protocol_append_getlasterror (MongoProtocol *protocol,
-                                    GByteArray    *array,
-                                    const gchar   *db_and_collection)
+mongo_protocol_append_update (GByteArray      *buffer,
+                              guint32          request_id,
+                              const gchar     *db_and_collection,
+                              MongoUpdateFlags flags,
+                              const MongoBson *selector,
+                              const MongoBson *update)
+{
+   guint offset = buffer->len;
+
+   mongo_protocol_append_int32(buffer, 0);
+   mongo_protocol_append_int32(buffer, GINT32_TO_LE(request_id));
+   mongo_protocol_append_int32(buffer, 0);
+   mongo_protocol_append_int32(buffer, GINT32_TO_LE(MONGO_OPERATION_UPDATE));
+   mongo_protocol_append_int32(buffer, 0);
+   mongo_protocol_append_cstring(buffer, db_and_collection);
+   mongo_protocol_append_int32(buffer, GINT32_TO_LE(flags));
+   mongo_protocol_append_bson(buffer, selector);
+   mongo_protocol_append_bson(buffer, update);
+   mongo_protocol_overwrite_int32(buffer, offset,
+                                  GINT32_TO_LE(buffer->len - offset));
+}
+
+static void
+mongo_protocol_append_insert (GByteArray       *buffer,
+                              guint32           request_id,
+                              const gchar      *db_and_collection,
+                              MongoInsertFlags  flags,
+                              MongoBson       **documents,
+                              gsize             n_documents)
+{
+   guint offset = buffer->len;
+   guint i;
+
+   mongo_protocol_append_int32(buffer, 0);
+   mongo_protocol_append_int32(buffer, GINT32_TO_LE(request_id));
+   mongo_protocol_append_int32(buffer, 0);
+   mongo_protocol_append_int32(buffer, GINT32_TO_LE(MONGO_OPERATION_INSERT));
+   mongo_protocol_append_int32(buffer, GINT32_TO_LE(flags));
+   mongo_protocol_append_cstring(buffer, db_and_collection);
+   for (i = 0; i < n_documents; i++) {
+      mongo_protocol_append_bson(buffer, documents[i]);
+   }
+   mongo_protocol_overwrite_int32(buffer, offset,
+                                  GINT32_TO_LE(buffer->len - offset));
+}
+
+static void
+mongo_protocol_append_delete (GByteArray       *buffer,
+                              guint32           request_id,
+                              const gchar      *db_and_collection,
+                              MongoDeleteFlags  flags,
+                              const MongoBson  *selector)
+{
+   guint offset = buffer->len;
+
+   mongo_protocol_append_int32(buffer, 0);
+   mongo_protocol_append_int32(buffer, GINT32_TO_LE(request_id));
+   mongo_protocol_append_int32(buffer, 0);
+   mongo_protocol_append_int32(buffer, GINT32_TO_LE(MONGO_OPERATION_DELETE));
+   mongo_protocol_append_int32(buffer, 0);
+   mongo_protocol_append_cstring(buffer, db_and_collection);
+   mongo_protocol_append_int32(buffer, GINT32_TO_LE(flags));
+   mongo_protocol_append_bson(buffer, selector);
+   mongo_protocol_overwrite_int32(buffer, offset,
+                                  GINT32_TO_LE(buffer->len - offset));
+}
+
+/*
+ * Appends a command such as {"getlasterror": 1} to be run against the
+ * database of @db_and_collection.
+ */
+static void
+mongo_protocol_append_command (GByteArray  *buffer,
+                               guint32      request_id,
+                               const gchar *db_and_collection,
+                               const gchar *command)
+{
+   MongoBson *bson;
+   gchar **split;
+   gchar *db_cmd;
+   guint offset = buffer->len;
+
+   split = g_strsplit(db_and_collection, ".", 2);
+   db_cmd = g_strdup_printf("%s.$cmd", split[0]);
+   g_strfreev(split);
+
+   bson = mongo_bson_new_empty();
+   mongo_bson_append_int(bson, command, 1);
+
+   mongo_protocol_append_int32(buffer, 0);
+   mongo_protocol_append_int32(buffer, GINT32_TO_LE(request_id));
+   mongo_protocol_append_int32(buffer, 0);
+   mongo_protocol_append_int32(buffer, GINT32_TO_LE(MONGO_OPERATION_QUERY));
+   mongo_protocol_append_int32(buffer, GINT32_TO_LE(MONGO_QUERY_NONE));
+   mongo_protocol_append_cstring(buffer, db_cmd);
+   mongo_protocol_append_int32(buffer, 0);
+   mongo_protocol_append_int32(buffer, 1);
+   mongo_protocol_append_bson(buffer, bson);
+   mongo_protocol_overwrite_int32(buffer, offset,
+                                  GINT32_TO_LE(buffer->len - offset));
+
+   mongo_bson_unref(bson);
+   g_free(db_cmd);
+}
+
+/**
+ * mongo_protocol_append_getlasterror:
+ * @protocol: (in): A #MongoProtocol.
+ * @array: (in): The buffer containing the write operation.
+ * @db_and_collection: (in): The "db.collection" that was written to.
+ * @concern: (in) (allow-none): A #MongoWriteConcern or %NULL.
+ *
+ * Appends the getlasterror command that acknowledges the write in @array.
+ * If @concern is %NULL, the write concern of @protocol is used.
+ *
+ * Unacknowledged writes (a @concern with w of 0 and no journal, fsync,
+ * majority or tags requirement) do not need a getlasterror and nothing
+ * is appended.
+ *
+ * Returns: The request id of the appended getlasterror, or 0 if nothing
+ *   was appended.
+ */
+static guint32
+mongo_protocol_append_getlasterror (MongoProtocol     *protocol,
+                                    GByteArray        *array,
+                                    const gchar       *db_and_collection,
+                                    MongoWriteConcern *concern)
 {
    MongoProtocolPrivate *priv;
+   MongoMessage *message;
    MongoBson *bson;
    guint32 request_id;
+   GBytes *bytes;
    gchar **split;
    gchar *db_cmd;
    guint offset;
@@ -251,16 +549,38 @@ mongo_protocol_append_getlasterror (MongoProtocol *protocol,
    g_assert(array);
    g_assert(db_and_collection);
 
+   priv = protocol->priv;
+
+   split = g_strsplit(db_and_collection, ".", 2);
+
    /*
-    * TODO: If the user did not request safe=True, we should either make us not
-    *       call this and return success immediately or handle it here for
-    *       everything and synthesize the result here.
+    * Let the caller provided write concern build the command. It builds
+    * nothing for unacknowledged writes.
     */
-
-   priv = protocol->priv;
+   if (concern) {
+      if (!(message = mongo_write_concern_build_getlasterror(concern,
+                                                             split[0]))) {
+         g_strfreev(split);
+         RETURN(0);
+      }
+      request_id = mongo_protocol_next_request_id(protocol);
+      mongo_message_set_request_id(message, request_id);
+      bytes = mongo_message_save_to_bytes(message, NULL);
+      g_assert(bytes);
+      g_byte_array_append(array,
+                          g_bytes_get_data(bytes, NULL),
+                          g_bytes_get_size(bytes));
+      g_bytes_unref(bytes);
+      g_object_unref(message);
+      g_strfreev(split);
+      RETURN(request_id);
+   }
 
    offset = array->len;
-   request_id = ++protocol->priv->last_request_id;
+   request_id = mongo_protocol_next_request_id(protocol);
+
+   db_cmd = g_strdup_printf("%s.$cmd", split[0]);
+   g_strfreev(split);
 
    /*
     * Build getlasterror command spec.
@@ -280,10 +600,6 @@ mongo_protocol_append_getlasterror (MongoProtocol *protocol,
       mongo_bson_append_boolean(bson, "fsync", priv->getlasterror_fsync);
    }
 
-   split = g_strsplit(db_and_collection, ".", 2);
-   db_cmd = g_strdup_printf("%s.$cmd", split[0]);
-   g_strfreev(split);
-
    /*
     * Build the MONGO_OPERATION_QUERY message.
     */
@@ -302,6 +618,64 @@ mongo_protocol_append_getlasterror (MongoProtocol *protocol,
    g_free(db_cmd);
    mongo_bson_unref(bson);
 
+   RETURN(request_id);
+}
+
+/**
+ * mongo_protocol_send_write:
+ * @protocol: (in): A #MongoProtocol.
+ * @simple: (in) (transfer full): The result for the write.
+ * @buffer: (in): The buffer containing the write operation.
+ * @db_and_collection: (in): The "db.collection" that was written to.
+ * @concern: (in) (allow-none): A #MongoWriteConcern or %NULL.
+ *
+ * Sends a write operation followed by its getlasterror. Acknowledged
+ * writes complete when the getlasterror reply arrives. Unacknowledged
+ * writes complete as soon as possible with an empty reply.
+ */
+static void
+mongo_protocol_send_write (MongoProtocol      *protocol,
+                           GSimpleAsyncResult *simple,
+                           GByteArray         *buffer,
+                           const gchar        *db_and_collection,
+                           MongoWriteConcern  *concern)
+{
+   MongoProtocolPrivate *priv;
+   MongoMessageReply *reply;
+   guint32 request_id;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_PROTOCOL(protocol));
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+   g_assert(buffer);
+   g_assert(db_and_collection);
+
+   priv = protocol->priv;
+
+   if ((request_id = mongo_protocol_append_getlasterror(protocol,
+                                                        buffer,
+                                                        db_and_collection,
+                                                        concern))) {
+      /*
+       * We get our response from the getlasterror command, so use it's
+       * request id as the key in the hashtable.
+       */
+      g_hash_table_insert(priv->requests,
+                          GINT_TO_POINTER(request_id),
+                          simple);
+   } else {
+      reply = g_object_new(MONGO_TYPE_MESSAGE_REPLY, NULL);
+      g_simple_async_result_set_op_res_gpointer(simple, reply, g_object_unref);
+      mongo_simple_async_result_complete_in_idle(simple);
+      g_object_unref(simple);
+   }
+
+   /*
+    * Cork the bytes until the next main loop iteration.
+    */
+   mongo_protocol_write(protocol, buffer->data, buffer->len);
+
    EXIT;
 }
 
@@ -311,11 +685,11 @@ mongo_protocol_update_async (MongoProtocol       *protocol,
                              MongoUpdateFlags     flags,
                              const MongoBson     *selector,
                              const MongoBson     *update,
+                             MongoWriteConcern   *concern,
                              GCancellable        *cancellable,
                              GAsyncReadyCallback  callback,
                              gpointer             user_data)
 {
-   MongoProtocolPrivate *priv;
    GSimpleAsyncResult *simple;
    GByteArray *buffer;
    guint32 request_id;
@@ -329,39 +703,16 @@ mongo_protocol_update_async (MongoProtocol       *protocol,
    g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
    g_return_if_fail(callback);
 
-   priv = protocol->priv;
-
    simple = g_simple_async_result_new(G_OBJECT(protocol), callback, user_data,
                                       mongo_protocol_update_async);
 
    request_id = mongo_protocol_next_request_id(protocol);
 
    buffer = g_byte_array_new();
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(request_id));
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(MONGO_OPERATION_UPDATE));
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_cstring(buffer, db_and_collection);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(flags));
-   mongo_protocol_append_bson(buffer, selector);
-   mongo_protocol_append_bson(buffer, update);
-   mongo_protocol_overwrite_int32(buffer, 0, GINT32_TO_LE(buffer->len));
-   mongo_protocol_append_getlasterror(protocol, buffer, db_and_collection);
-
-   /*
-    * We get our response from the getlasterror command, so use it's request
-    * id as the key in the hashtable.
-    */
-   g_hash_table_insert(priv->requests,
-                       GINT_TO_POINTER(request_id + 1),
-                       simple);
-
-   /*
-    * Write the bytes to the buffered stream.
-    */
-   mongo_protocol_write(protocol, request_id, simple,
-                        buffer->data, buffer->len);
+   mongo_protocol_append_update(buffer, request_id, db_and_collection,
+                                flags, selector, update);
+   mongo_protocol_send_write(protocol, simple, buffer,
+                             db_and_collection, concern);
 
    g_byte_array_free(buffer, TRUE);
 
@@ -392,7 +743,8 @@ mongo_protocol_update_finish (MongoProtocol  *protocol,
 {
    GSimpleAsyncResult *simple = (GSimpleAsyncResult *)result;
    MongoMessageReply *reply;
-   GList *list;
+   const MongoBson *docs;
+   gsize n_docs;
 
    ENTRY;
 
@@ -404,8 +756,9 @@ mongo_protocol_update_finish (MongoProtocol  *protocol,
    }
 
    if (document) {
-      list = mongo_message_reply_get_documents(reply);
-      *document = list ? mongo_bson_ref(list->data) : NULL;
+      n_docs = 0;
+      docs = reply ? mongo_message_reply_peek_documents(reply, &n_docs) : NULL;
+      *document = n_docs ? mongo_bson_dup(&docs[0]) : NULL;
    }
 
    RETURN(!!reply);
@@ -417,15 +770,14 @@ mongo_protocol_insert_async (MongoProtocol        *protocol,
                              MongoInsertFlags      flags,
                              MongoBson           **documents,
                              gsize                 n_documents,
+                             MongoWriteConcern   *concern,
                              GCancellable         *cancellable,
                              GAsyncReadyCallback   callback,
                              gpointer              user_data)
 {
-   MongoProtocolPrivate *priv;
    GSimpleAsyncResult *simple;
    GByteArray *buffer;
    guint32 request_id;
-   guint i;
 
    ENTRY;
 
@@ -436,39 +788,16 @@ mongo_protocol_insert_async (MongoProtocol        *protocol,
    g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
    g_return_if_fail(callback);
 
-   priv = protocol->priv;
-
    simple = g_simple_async_result_new(G_OBJECT(protocol), callback, user_data,
                                       mongo_protocol_insert_async);
 
    request_id = mongo_protocol_next_request_id(protocol);
 
    buffer = g_byte_array_new();
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(request_id));
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(MONGO_OPERATION_INSERT));
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(flags));
-   mongo_protocol_append_cstring(buffer, db_and_collection);
-   for (i = 0; i < n_documents; i++) {
-      mongo_protocol_append_bson(buffer, documents[i]);
-   }
-   mongo_protocol_overwrite_int32(buffer, 0, GINT32_TO_LE(buffer->len));
-   mongo_protocol_append_getlasterror(protocol, buffer, db_and_collection);
-
-   /*
-    * We get our response from the getlasterror command, so use it's request
-    * id as the key in the hashtable.
-    */
-   g_hash_table_insert(priv->requests,
-                       GINT_TO_POINTER(request_id + 1),
-                       simple);
-
-   /*
-    * Write the bytes to the buffered stream.
-    */
-   mongo_protocol_write(protocol, request_id, simple,
-                        buffer->data, buffer->len);
+   mongo_protocol_append_insert(buffer, request_id, db_and_collection,
+                                flags, documents, n_documents);
+   mongo_protocol_send_write(protocol, simple, buffer,
+                             db_and_collection, concern);
 
    g_byte_array_free(buffer, TRUE);
 
@@ -543,8 +872,7 @@ mongo_protocol_query_async (MongoProtocol       *protocol,
    mongo_protocol_overwrite_int32(buffer, 0, GINT32_TO_LE(buffer->len));
 
    g_hash_table_insert(priv->requests, GINT_TO_POINTER(request_id), simple);
-   mongo_protocol_write(protocol, request_id, simple,
-                        buffer->data, buffer->len);
+   mongo_protocol_write(protocol, buffer->data, buffer->len);
 
    g_byte_array_free(buffer, TRUE);
 
@@ -623,8 +951,7 @@ mongo_protocol_getmore_async (MongoProtocol       *protocol,
    mongo_protocol_overwrite_int32(buffer, 0, GINT32_TO_LE(buffer->len));
 
    g_hash_table_insert(priv->requests, GINT_TO_POINTER(request_id), simple);
-   mongo_protocol_write(protocol, request_id, simple,
-                        buffer->data, buffer->len);
+   mongo_protocol_write(protocol, buffer->data, buffer->len);
 
    g_byte_array_free(buffer, TRUE);
 
@@ -668,11 +995,11 @@ mongo_protocol_delete_async (MongoProtocol       *protocol,
                              const gchar         *db_and_collection,
                              MongoDeleteFlags     flags,
                              const MongoBson     *selector,
+                             MongoWriteConcern   *concern,
                              GCancellable        *cancellable,
                              GAsyncReadyCallback  callback,
                              gpointer             user_data)
 {
-   MongoProtocolPrivate *priv;
    GSimpleAsyncResult *simple;
    GByteArray *buffer;
    guint32 request_id;
@@ -685,38 +1012,16 @@ mongo_protocol_delete_async (MongoProtocol       *protocol,
    g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
    g_return_if_fail(callback);
 
-   priv = protocol->priv;
-
    simple = g_simple_async_result_new(G_OBJECT(protocol), callback, user_data,
                                       mongo_protocol_delete_async);
 
    request_id = mongo_protocol_next_request_id(protocol);
 
    buffer = g_byte_array_new();
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(request_id));
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(MONGO_OPERATION_DELETE));
-   mongo_protocol_append_int32(buffer, 0);
-   mongo_protocol_append_cstring(buffer, db_and_collection);
-   mongo_protocol_append_int32(buffer, GINT32_TO_LE(flags));
-   mongo_protocol_append_bson(buffer, selector);
-   mongo_protocol_overwrite_int32(buffer, 0, GINT32_TO_LE(buffer->len));
-   mongo_protocol_append_getlasterror(protocol, buffer, db_and_collection);
-
-   /*
-    * We get our response from the getlasterror command, so use it's request
-    * id as the key in the hashtable.
-    */
-   g_hash_table_insert(priv->requests,
-                       GINT_TO_POINTER(request_id + 1),
-                       simple);
-
-   /*
-    * Write the bytes to the buffered stream.
-    */
-   mongo_protocol_write(protocol, request_id, simple,
-                        buffer->data, buffer->len);
+   mongo_protocol_append_delete(buffer, request_id, db_and_collection,
+                                flags, selector);
+   mongo_protocol_send_write(protocol, simple, buffer,
+                             db_and_collection, concern);
 
    g_byte_array_free(buffer, TRUE);
 
@@ -743,6 +1048,266 @@ mongo_protocol_delete_finish (MongoProtocol  *protocol,
    RETURN(ret);
 }
 
+/*
+ * A batch submitted with mongo_protocol_bulk_write_async() waits on one
+ * getlasterror reply per operation.
+ */
+typedef struct
+{
+   GSimpleAsyncResult *simple;
+   gsize               n_pending;
+   gssize              failed_index;
+   GError             *error;
+} BulkWrite;
+
+/**
+ * mongo_protocol_bulk_write_reply_cb:
+ * @object: (in): A #MongoProtocol.
+ * @result: (in): The result of the getlasterror for one operation.
+ * @user_data: (in): A #BulkWrite.
+ *
+ * Records the outcome of one operation in a batch and completes the
+ * batch once every operation has been accounted for. A failed operation
+ * is reported in preference to a failure of the batch as a whole, and
+ * an earlier failed operation in preference to a later one.
+ */
+static void
+mongo_protocol_bulk_write_reply_cb (GObject      *object,
+                                    GAsyncResult *result,
+                                    gpointer      user_data)
+{
+   GSimpleAsyncResult *simple = (GSimpleAsyncResult *)result;
+   MongoMessageReply *reply;
+   const MongoBson *docs;
+   MongoBsonIter iter;
+   const gchar *errmsg = NULL;
+   BulkWrite *bulk = user_data;
+   GError *error = NULL;
+   gboolean ret;
+   gssize index_;
+   gsize n_docs = 0;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_PROTOCOL(object));
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+   g_assert(bulk);
+
+   index_ = GPOINTER_TO_SIZE(g_object_get_data(G_OBJECT(simple),
+                                               "operation-index"));
+
+   if (!(reply = g_simple_async_result_get_op_res_gpointer(simple))) {
+      g_simple_async_result_propagate_error(simple, &error);
+      index_ = -1;
+   } else if (!(docs = mongo_message_reply_peek_documents(reply, &n_docs)) ||
+              !n_docs) {
+      g_set_error(&error,
+                  MONGO_PROTOCOL_ERROR,
+                  MONGO_PROTOCOL_ERROR_UNEXPECTED,
+                  _("getlasterror did not return a document."));
+      index_ = -1;
+   } else {
+      mongo_bson_iter_init(&iter, &docs[0]);
+      if (mongo_bson_iter_find(&iter, "err") &&
+          MONGO_BSON_ITER_HOLDS_UTF8(&iter)) {
+         errmsg = mongo_bson_iter_get_value_string(&iter, NULL);
+      }
+      if (errmsg) {
+         g_set_error(&error,
+                     MONGO_PROTOCOL_ERROR,
+                     MONGO_PROTOCOL_ERROR_WRITE_FAILED,
+                     "%s", errmsg);
+      }
+   }
+
+   if (error) {
+      if (!bulk->error ||
+          ((index_ >= 0) &&
+           ((bulk->failed_index < 0) || (index_ < bulk->failed_index)))) {
+         g_clear_error(&bulk->error);
+         bulk->error = error;
+         bulk->failed_index = index_;
+      } else {
+         g_error_free(error);
+      }
+   }
+
+   if (--bulk->n_pending) {
+      EXIT;
+   }
+
+   if (!(ret = !bulk->error)) {
+      g_simple_async_result_take_error(bulk->simple, bulk->error);
+   }
+
+   g_object_set_data(G_OBJECT(bulk->simple), "failed-index",
+                     GSIZE_TO_POINTER(bulk->failed_index + 1));
+   g_simple_async_result_set_op_res_gboolean(bulk->simple, ret);
+   g_simple_async_result_complete(bulk->simple);
+   g_object_unref(bulk->simple);
+   g_slice_free(BulkWrite, bulk);
+
+   EXIT;
+}
+
+/**
+ * mongo_protocol_bulk_write_async:
+ * @protocol: (in): A #MongoProtocol.
+ * @db_and_collection: (in): The "db.collection" to write to.
+ * @operations: (in) (array length=n_operations): The writes to perform.
+ * @n_operations: (in): The number of elements in @operations.
+ * @cancellable: (in) (allow-none): A #GCancellable or %NULL.
+ * @callback: (in): A callback to execute upon completion.
+ * @user_data: (in): User data for @callback.
+ *
+ * Writes @operations back to back, each followed by its getlasterror, so
+ * the batch costs a single round trip rather than one per operation.
+ *
+ * The getlasterror after the last operation uses the "write-quorum",
+ * "journal", "fsync" and "write-timeout" settings of @protocol. Since
+ * the server applies the operations in order, that acknowledges the
+ * whole batch. The others only check whether their operation failed.
+ *
+ * @callback MUST call mongo_protocol_bulk_write_finish().
+ */
+void
+mongo_protocol_bulk_write_async (MongoProtocol            *protocol,
+                                 const gchar              *db_and_collection,
+                                 const MongoBulkOperation *operations,
+                                 gsize                     n_operations,
+                                 GCancellable             *cancellable,
+                                 GAsyncReadyCallback       callback,
+                                 gpointer                  user_data)
+{
+   MongoProtocolPrivate *priv;
+   GSimpleAsyncResult *simple;
+   BulkWrite *bulk;
+   GByteArray *buffer;
+   guint32 request_id;
+   gsize i;
+
+   ENTRY;
+
+   g_return_if_fail(MONGO_IS_PROTOCOL(protocol));
+   g_return_if_fail(db_and_collection);
+   g_return_if_fail(operations);
+   g_return_if_fail(n_operations);
+   g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
+   g_return_if_fail(callback);
+
+   priv = protocol->priv;
+
+   bulk = g_slice_new0(BulkWrite);
+   bulk->simple = g_simple_async_result_new(G_OBJECT(protocol),
+                                            callback,
+                                            user_data,
+                                            mongo_protocol_bulk_write_async);
+   bulk->n_pending = n_operations;
+   bulk->failed_index = -1;
+
+   buffer = g_byte_array_new();
+
+   for (i = 0; i < n_operations; i++) {
+      request_id = mongo_protocol_next_request_id(protocol);
+      switch (operations[i].oper) {
+      case MONGO_OPERATION_UPDATE:
+         mongo_protocol_append_update(buffer, request_id, db_and_collection,
+                                      operations[i].flags,
+                                      operations[i].selector,
+                                      operations[i].document);
+         break;
+      case MONGO_OPERATION_INSERT:
+         mongo_protocol_append_insert(buffer, request_id, db_and_collection,
+                                      operations[i].flags,
+                                      (MongoBson **)&operations[i].document,
+                                      1);
+         break;
+      case MONGO_OPERATION_DELETE:
+         mongo_protocol_append_delete(buffer, request_id, db_and_collection,
+                                      operations[i].flags,
+                                      operations[i].selector);
+         break;
+      case MONGO_OPERATION_REPLY:
+      case MONGO_OPERATION_MSG:
+      case MONGO_OPERATION_QUERY:
+      case MONGO_OPERATION_GETMORE:
+      case MONGO_OPERATION_KILL_CURSORS:
+      default:
+         g_assert_not_reached();
+         break;
+      }
+
+      if ((i + 1) < n_operations) {
+         request_id = mongo_protocol_next_request_id(protocol);
+         mongo_protocol_append_command(buffer, request_id, db_and_collection,
+                                       "getlasterror");
+      } else {
+         request_id = mongo_protocol_append_getlasterror(protocol,
+                                                         buffer,
+                                                         db_and_collection,
+                                                         NULL);
+      }
+
+      simple = g_simple_async_result_new(G_OBJECT(protocol),
+                                         mongo_protocol_bulk_write_reply_cb,
+                                         bulk,
+                                         mongo_protocol_bulk_write_async);
+      g_object_set_data(G_OBJECT(simple), "operation-index",
+                        GSIZE_TO_POINTER(i));
+      g_hash_table_insert(priv->requests, GINT_TO_POINTER(request_id), simple);
+   }
+
+   mongo_protocol_write(protocol, buffer->data, buffer->len);
+
+   g_byte_array_free(buffer, TRUE);
+
+   EXIT;
+}
+
+/**
+ * mongo_protocol_bulk_write_finish:
+ * @protocol: (in): A #MongoProtocol.
+ * @result: (in): A #GAsyncResult.
+ * @failed_index: (out) (allow-none): A location for the index of the
+ *   failed operation, or %NULL.
+ * @error: (out): A location for a #GError, or %NULL.
+ *
+ * Completes an asynchronous request to mongo_protocol_bulk_write_async().
+ *
+ * If an operation failed, @failed_index is set to its index within the
+ * batch. If more than one operation failed, the first of them is
+ * reported. A failure to satisfy the write concern is reported against
+ * the last operation. Otherwise @failed_index is set to -1.
+ *
+ * Returns: %TRUE if every operation succeeded; otherwise %FALSE and
+ *   @error is set.
+ */
+gboolean
+mongo_protocol_bulk_write_finish (MongoProtocol  *protocol,
+                                  GAsyncResult   *result,
+                                  gssize         *failed_index,
+                                  GError        **error)
+{
+   GSimpleAsyncResult *simple = (GSimpleAsyncResult *)result;
+   gboolean ret;
+
+   ENTRY;
+
+   g_return_val_if_fail(MONGO_IS_PROTOCOL(protocol), FALSE);
+   g_return_val_if_fail(G_IS_SIMPLE_ASYNC_RESULT(simple), FALSE);
+
+   if (!(ret = g_simple_async_result_get_op_res_gboolean(simple))) {
+      g_simple_async_result_propagate_error(simple, error);
+   }
+
+   if (failed_index) {
+      *failed_index = (gssize)GPOINTER_TO_SIZE(
+            g_object_get_data(G_OBJECT(simple), "failed-index")) - 1;
+   }
+
+   RETURN(ret);
+}
+
 void
 mongo_protocol_kill_cursors_async (MongoProtocol       *protocol,
                                    guint64             *cursors,
@@ -785,8 +1350,7 @@ mongo_protocol_kill_cursors_async (MongoProtocol       *protocol,
    mongo_protocol_overwrite_int32(buffer, 0, GINT32_TO_LE(buffer->len));
 
    g_hash_table_insert(priv->requests, GINT_TO_POINTER(request_id), simple);
-   mongo_protocol_write(protocol, request_id, simple,
-                        buffer->data, buffer->len);
+   mongo_protocol_write(protocol, buffer->data, buffer->len);
 
    g_byte_array_free(buffer, TRUE);
 
@@ -848,8 +1412,7 @@ mongo_protocol_msg_async (MongoProtocol       *protocol,
    mongo_protocol_overwrite_int32(buffer, 0, GINT32_TO_LE(buffer->len));
 
    g_hash_table_insert(priv->requests, GINT_TO_POINTER(request_id), simple);
-   mongo_protocol_write(protocol, request_id, simple,
-                        buffer->data, buffer->len);
+   mongo_protocol_write(protocol, buffer->data, buffer->len);
 
    g_byte_array_free(buffer, TRUE);
 
@@ -891,6 +1454,22 @@ mongo_protocol_get_io_stream (MongoProtocol *protocol)
    return protocol->priv->io_stream;
 }
 
+/**
+ * mongo_protocol_get_n_pending:
+ * @protocol: (in): A #MongoProtocol.
+ *
+ * Fetches the number of requests that have been sent on @protocol and
+ * are still waiting for a reply.
+ *
+ * Returns: The number of outstanding requests.
+ */
+guint
+mongo_protocol_get_n_pending (MongoProtocol *protocol)
+{
+   g_return_val_if_fail(MONGO_IS_PROTOCOL(protocol), 0);
+   return g_hash_table_size(protocol->priv->requests);
+}
+
 static void
 mongo_protocol_read_message_cb (GObject      *object,
                                 GAsyncResult *result,
@@ -975,11 +1554,12 @@ mongo_protocol_set_io_stream (MongoProtocol *protocol,
          4096);
 #endif
 
+   /*
+    * Writes are coalesced in priv->corked, so there is no need for a
+    * buffered stream here.
+    */
    output_stream = g_io_stream_get_output_stream(io_stream);
-   priv->output_stream = g_buffered_output_stream_new(output_stream);
-   g_buffered_output_stream_set_auto_grow(
-         G_BUFFERED_OUTPUT_STREAM(priv->output_stream),
-         TRUE);
+   priv->output_stream = g_object_ref(output_stream);
 
    mongo_input_stream_read_message_async(
          MONGO_INPUT_STREAM(priv->input_stream),
@@ -1001,6 +1581,11 @@ mongo_protocol_dispose (GObject *object)
 
    g_cancellable_cancel(priv->shutdown);
 
+   if (priv->uncork_handler) {
+      g_source_remove(priv->uncork_handler);
+      priv->uncork_handler = 0;
+   }
+
    G_OBJECT_CLASS(mongo_protocol_parent_class)->dispose(object);
 
    EXIT;
@@ -1028,6 +1613,9 @@ mongo_protocol_finalize (GObject *object)
    g_clear_object(&priv->output_stream);
    g_clear_object(&priv->io_stream);
 
+   g_byte_array_unref(priv->corked);
+   g_byte_array_unref(priv->writing);
+
    G_OBJECT_CLASS(mongo_protocol_parent_class)->finalize(object);
 
    EXIT;
@@ -1191,6 +1779,8 @@ mongo_protocol_init (MongoProtocol *protocol)
    protocol->priv->getlasterror_w = 0;
    protocol->priv->getlasterror_j = TRUE;
    protocol->priv->shutdown = g_cancellable_new();
+   protocol->priv->corked = g_byte_array_new();
+   protocol->priv->writing = g_byte_array_new();
    protocol->priv->requests = g_hash_table_new_full(g_direct_hash,
                                                     g_direct_equal,
                                                     NULL,
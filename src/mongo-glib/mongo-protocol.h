@@ -30,6 +30,7 @@
 #include "mongo-flags.h"
 #include "mongo-operation.h"
 #include "mongo-message-reply.h"
+#include "mongo-write-concern.h"
 
 G_BEGIN_DECLS
 
@@ -51,8 +52,29 @@ typedef struct _MongoProtocolPrivate MongoProtocolPrivate;
 enum _MongoProtocolError
 {
    MONGO_PROTOCOL_ERROR_UNEXPECTED = 1,
+   MONGO_PROTOCOL_ERROR_WRITE_FAILED,
 };
 
+/**
+ * MongoBulkOperation:
+ * @oper: %MONGO_OPERATION_INSERT, %MONGO_OPERATION_UPDATE or
+ *   %MONGO_OPERATION_DELETE.
+ * @flags: The #MongoInsertFlags, #MongoUpdateFlags or #MongoDeleteFlags
+ *   for the operation.
+ * @selector: The selector for updates and deletes.
+ * @document: The document to insert, or the update to apply.
+ *
+ * #MongoBulkOperation describes a single write within a batch submitted
+ * with mongo_connection_bulk_write_async().
+ */
+typedef struct
+{
+   MongoOperation  oper;
+   guint           flags;
+   MongoBson      *selector;
+   MongoBson      *document;
+} MongoBulkOperation;
+
 struct _MongoProtocol
 {
    GObject parent;
@@ -74,6 +96,7 @@ struct _MongoProtocolClass
 GQuark             mongo_protocol_error_quark         (void) G_GNUC_CONST;
 GType              mongo_protocol_get_type            (void) G_GNUC_CONST;
 GIOStream         *mongo_protocol_get_io_stream       (MongoProtocol        *protocol);
+guint              mongo_protocol_get_n_pending       (MongoProtocol        *protocol);
 void               mongo_protocol_fail                (MongoProtocol        *protocol,
                                                        const GError         *error);
 void               mongo_protocol_update_async        (MongoProtocol        *protocol,
@@ -81,6 +104,7 @@ void               mongo_protocol_update_async        (MongoProtocol        *pro
                                                        MongoUpdateFlags      flags,
                                                        const MongoBson      *selector,
                                                        const MongoBson      *update,
+                                                       MongoWriteConcern    *concern,
                                                        GCancellable         *cancellable,
                                                        GAsyncReadyCallback   callback,
                                                        gpointer              user_data);
@@ -93,6 +117,7 @@ void               mongo_protocol_insert_async        (MongoProtocol        *pro
                                                        MongoInsertFlags      flags,
                                                        MongoBson           **documents,
                                                        gsize                 n_documents,
+                                                       MongoWriteConcern    *concern,
                                                        GCancellable         *cancellable,
                                                        GAsyncReadyCallback   callback,
                                                        gpointer              user_data);
@@ -126,12 +151,24 @@ void               mongo_protocol_delete_async        (MongoProtocol        *pro
                                                        const gchar          *db_and_collection,
                                                        MongoDeleteFlags      flags,
                                                        const MongoBson      *selector,
+                                                       MongoWriteConcern    *concern,
                                                        GCancellable         *cancellable,
                                                        GAsyncReadyCallback   callback,
                                                        gpointer              user_data);
 gboolean           mongo_protocol_delete_finish       (MongoProtocol        *protocol,
                                                        GAsyncResult         *result,
                                                        GError              **error);
+void               mongo_protocol_bulk_write_async    (MongoProtocol        *protocol,
+                                                       const gchar          *db_and_collection,
+                                                       const MongoBulkOperation *operations,
+                                                       gsize                 n_operations,
+                                                       GCancellable         *cancellable,
+                                                       GAsyncReadyCallback   callback,
+                                                       gpointer              user_data);
+gboolean           mongo_protocol_bulk_write_finish   (MongoProtocol        *protocol,
+                                                       GAsyncResult         *result,
+                                                       gssize               *failed_index,
+                                                       GError              **error);
 void               mongo_protocol_kill_cursors_async  (MongoProtocol        *protocol,
                                                        guint64              *cursors,
                                                        gsize                 n_cursors,
@@ -32,6 +32,16 @@ struct _MongoWriteConcern
    guint32    wtimeoutms;
 };
 
+/**
+ * mongo_write_concern_new_unsafe:
+ *
+ * Creates a #MongoWriteConcern for fire-and-forget writes. This is w of 0
+ * without a journal, fsync, majority or tags requirement. No getlasterror
+ * is sent for writes using this concern, so they complete as soon as they
+ * have been written and errors from the server are not reported.
+ *
+ * Returns: (transfer full): A #MongoWriteConcern.
+ */
 MongoWriteConcern *
 mongo_write_concern_new_unsafe (void)
 {
@@ -170,7 +180,11 @@ mongo_write_concern_set_wtimeoutms (MongoWriteConcern *concern,
  * their own write conern to override the connections when performing
  * certain commands.
  *
- * Returns: (transfer full): A #MongoMessage.
+ * Unacknowledged write concerns, those with w of 0 or less and no journal,
+ * fsync, majority or tags requirement, need no getlasterror and %NULL is
+ * returned.
+ *
+ * Returns: (transfer full): A #MongoMessage or %NULL.
  */
 MongoMessage *
 mongo_write_concern_build_getlasterror (MongoWriteConcern *concern,
@@ -184,7 +198,11 @@ mongo_write_concern_build_getlasterror (MongoWriteConcern *concern,
 
    g_return_val_if_fail(concern, NULL);
 
-   if (concern->w == -1) {
+   if ((concern->w <= 0) &&
+       !concern->w_majority &&
+       !concern->w_tags &&
+       !concern->journal &&
+       !concern->_fsync) {
       RETURN(NULL);
    }
 
@@ -0,0 +1,1415 @@
+/* postal-device-index.c
+ *
+ * Copyright (C) 2012 Catch.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib/gi18n.h>
+#include <string.h>
+
+#include "postal-device-index.h"
+
+/**
+ * SECTION:postal-device-index
+ * @title: PostalDeviceIndex
+ * @short_description: In-memory index of the devices collection
+ *
+ * #PostalDeviceIndex keeps a copy of the devices collection in memory so
+ * that the audience of a notification can be resolved without a round
+ * trip to Mongo.
+ *
+ * Devices are stored in slots of parallel arrays. Users are interned and
+ * tokens are stored as length prefixed blobs, with APS tokens of either
+ * case and other lowercase hex tokens packed to half their size. Each user and each token
+ * maps to the first slot of a chain linking every device that shares it.
+ *
+ * Slots are referred to by handles, which contain a generation so that a
+ * handle held across a removal will not resolve to a reused slot.
+ *
+ * An index may be saved to a snapshot with
+ * postal_device_index_save_to_bytes() and restored with
+ * postal_device_index_new_from_file(). The snapshot is laid out as a
+ * header, fixed-width device records, a table of offsets to the user
+ * strings, the user strings and finally the token blobs. All integers are
+ * little-endian.
+ */
+
+/*
+ * Set in the token header when the token was packed from hex.
+ */
+#define TOKEN_HEX 0x8000
+
+#define SNAPSHOT_MAGIC   0x58494450 /* "PDIX" */
+#define SNAPSHOT_VERSION 2
+
+struct _PostalDeviceIndex
+{
+   volatile gint  ref_count;
+   GStringChunk  *users;
+   GPtrArray     *ids;
+   GPtrArray     *user;
+   GPtrArray     *tokens;
+   GArray        *device_types;
+   GArray        *badges;
+   GArray        *removed_at;
+   GArray        *generations;
+   GArray        *next_by_user;
+   GArray        *next_by_token;
+   GArray        *free_slots;
+   GHashTable    *by_id;
+   GHashTable    *by_user;
+   GHashTable    *by_token;
+   guint          n_devices;
+};
+
+/*
+ * A device decoded from BSON, before it is stored in a slot.
+ */
+typedef struct
+{
+   MongoObjectId *id;
+   const gchar   *user;
+   const gchar   *device_token;
+   guint8         device_type;
+   guint32        badge;
+   gint64         removed_at;
+   gchar          user_buf[25];
+   gchar          token_buf[POSTAL_DEVICE_APS_TOKEN_SIZE * 2 + 1];
+} Record;
+
+typedef struct
+{
+   guint32 magic;
+   guint32 version;
+   guint32 oplog_time;
+   guint32 oplog_increment;
+   guint32 n_records;
+   guint32 n_users;
+   guint32 users_size;
+   guint32 tokens_size;
+} SnapshotHeader;
+
+typedef struct
+{
+   guint8  id[12];
+   guint32 user;
+   guint32 token;
+   guint32 badge;
+   guint8  device_type;
+   guint8  padding[7];
+   gint64  removed_at;
+} SnapshotRecord;
+
+G_STATIC_ASSERT(sizeof(SnapshotHeader) == 32);
+G_STATIC_ASSERT(sizeof(SnapshotRecord) == 40);
+
+#define SLOT_ID(i,s)         ((MongoObjectId *)g_ptr_array_index((i)->ids, s))
+#define SLOT_USER(i,s)       ((const gchar *)g_ptr_array_index((i)->user, s))
+#define SLOT_TOKEN(i,s)      ((guint8 *)g_ptr_array_index((i)->tokens, s))
+#define SLOT_TYPE(i,s)       g_array_index((i)->device_types, guint8, s)
+#define SLOT_BADGE(i,s)      g_array_index((i)->badges, guint32, s)
+#define SLOT_REMOVED_AT(i,s) g_array_index((i)->removed_at, gint64, s)
+#define SLOT_GENERATION(i,s) g_array_index((i)->generations, guint32, s)
+#define SLOT_HANDLE(i,s)     (((guint64)SLOT_GENERATION(i,s) << 32) | (s))
+
+static guint
+token_header (const guint8 *blob)
+{
+   return blob[0] | (blob[1] << 8);
+}
+
+static gsize
+token_size (const guint8 *blob)
+{
+   return 2 + (token_header(blob) & ~TOKEN_HEX);
+}
+
+static gboolean
+token_is_hex (const gchar *token,
+              gsize        len)
+{
+   gsize i;
+
+   if (!len || (len & 1) || ((len / 2) >= TOKEN_HEX)) {
+      return FALSE;
+   }
+
+   for (i = 0; i < len; i++) {
+      if (!g_ascii_isxdigit(token[i]) || g_ascii_isupper(token[i])) {
+         return FALSE;
+      }
+   }
+
+   return TRUE;
+}
+
+static guint8 *
+token_encode (const gchar *token)
+{
+   guint8 packed[POSTAL_DEVICE_APS_TOKEN_SIZE];
+   guint8 *blob;
+   guint header;
+   gsize len;
+   gsize i;
+
+   len = strlen(token);
+
+   /*
+    * APS tokens are packed the same way they are stored, which folds
+    * their case, so a lookup matches however the token was registered.
+    */
+   if ((len == (POSTAL_DEVICE_APS_TOKEN_SIZE * 2)) &&
+       postal_device_aps_token_pack(token, packed)) {
+      header = POSTAL_DEVICE_APS_TOKEN_SIZE | TOKEN_HEX;
+      blob = g_malloc(2 + POSTAL_DEVICE_APS_TOKEN_SIZE);
+      memcpy(blob + 2, packed, POSTAL_DEVICE_APS_TOKEN_SIZE);
+   } else if (token_is_hex(token, len)) {
+      header = (len / 2) | TOKEN_HEX;
+      blob = g_malloc(2 + (len / 2));
+      for (i = 0; i < (len / 2); i++) {
+         blob[2 + i] = (g_ascii_xdigit_value(token[i * 2]) << 4) |
+                       g_ascii_xdigit_value(token[i * 2 + 1]);
+      }
+   } else if (len < TOKEN_HEX) {
+      header = len;
+      blob = g_malloc(2 + len);
+      memcpy(blob + 2, token, len);
+   } else {
+      return NULL;
+   }
+
+   blob[0] = header & 0xFF;
+   blob[1] = header >> 8;
+
+   return blob;
+}
+
+/*
+ * Raw token blobs are not NUL-terminated, so tokens are always copied
+ * out into @str rather than pointed at.
+ */
+static void
+token_decode_to_string (const guint8 *blob,
+                        GString      *str)
+{
+   static const gchar hex[] = "0123456789abcdef";
+   guint header;
+   gsize len;
+   gsize i;
+
+   header = token_header(blob);
+   len = header & ~TOKEN_HEX;
+
+   g_string_truncate(str, 0);
+
+   if (!(header & TOKEN_HEX)) {
+      g_string_append_len(str, (const gchar *)blob + 2, len);
+      return;
+   }
+
+   for (i = 0; i < len; i++) {
+      g_string_append_c(str, hex[blob[2 + i] >> 4]);
+      g_string_append_c(str, hex[blob[2 + i] & 0xF]);
+   }
+}
+
+static gchar *
+token_decode (const guint8 *blob)
+{
+   GString *str;
+
+   str = g_string_sized_new(token_size(blob) * 2);
+   token_decode_to_string(blob, str);
+
+   return g_string_free(str, FALSE);
+}
+
+static guint
+token_hash (gconstpointer key)
+{
+   const guint8 *blob = key;
+   guint hash = 5381;
+   gsize size;
+   gsize i;
+
+   size = token_size(blob);
+   for (i = 0; i < size; i++) {
+      hash = (hash << 5) + hash + blob[i];
+   }
+
+   return hash;
+}
+
+static gboolean
+token_equal (gconstpointer a,
+             gconstpointer b)
+{
+   gsize size;
+
+   size = token_size(a);
+   return (size == token_size(b)) && !memcmp(a, b, size);
+}
+
+static void
+record_init (Record *record)
+{
+   memset(record, 0, sizeof *record);
+}
+
+static void
+record_clear (Record *record)
+{
+   mongo_clear_object_id(&record->id);
+}
+
+static void
+record_apply (Record        *record,
+              MongoBsonIter *iter)
+{
+   MongoObjectId *oid;
+   const guint8 *data;
+   const gchar *str;
+   GTimeVal tv;
+   gsize len;
+
+   if (mongo_bson_iter_is_key(iter, "_id")) {
+      if (MONGO_BSON_ITER_HOLDS_OBJECT_ID(iter)) {
+         mongo_clear_object_id(&record->id);
+         record->id = mongo_bson_iter_get_value_object_id(iter);
+      }
+   } else if (mongo_bson_iter_is_key(iter, "device_type")) {
+      if (MONGO_BSON_ITER_HOLDS_UTF8(iter)) {
+         str = mongo_bson_iter_get_value_string(iter, NULL);
+         if (!g_strcmp0(str, "aps")) {
+            record->device_type = POSTAL_DEVICE_APS;
+         } else if (!g_strcmp0(str, "c2dm")) {
+            record->device_type = POSTAL_DEVICE_C2DM;
+         } else if (!g_strcmp0(str, "gcm")) {
+            record->device_type = POSTAL_DEVICE_GCM;
+         } else {
+            record->device_type = 0;
+         }
+      }
+   } else if (mongo_bson_iter_is_key(iter, "badge")) {
+      if (MONGO_BSON_ITER_HOLDS_INT32(iter)) {
+         record->badge = MAX(0, mongo_bson_iter_get_value_int(iter));
+      }
+   } else if (mongo_bson_iter_is_key(iter, "device_token")) {
+      if (MONGO_BSON_ITER_HOLDS_UTF8(iter)) {
+         record->device_token = mongo_bson_iter_get_value_string(iter, NULL);
+      } else if (MONGO_BSON_ITER_HOLDS_BINARY(iter)) {
+         data = mongo_bson_iter_get_value_binary(iter, NULL, &len);
+         if (len == POSTAL_DEVICE_APS_TOKEN_SIZE) {
+            postal_device_aps_token_unpack(data, record->token_buf);
+            record->device_token = record->token_buf;
+         }
+      }
+   } else if (mongo_bson_iter_is_key(iter, "removed_at")) {
+      if (MONGO_BSON_ITER_HOLDS_DATE_TIME(iter)) {
+         mongo_bson_iter_get_value_timeval(iter, &tv);
+         record->removed_at = ((gint64)tv.tv_sec * G_USEC_PER_SEC) + tv.tv_usec;
+      } else if (MONGO_BSON_ITER_HOLDS_NULL(iter)) {
+         record->removed_at = 0;
+      }
+   } else if (mongo_bson_iter_is_key(iter, "user")) {
+      if (MONGO_BSON_ITER_HOLDS_UTF8(iter)) {
+         record->user = mongo_bson_iter_get_value_string(iter, NULL);
+      } else if (MONGO_BSON_ITER_HOLDS_OBJECT_ID(iter)) {
+         oid = mongo_bson_iter_get_value_object_id(iter);
+         mongo_object_id_to_string_r(oid, record->user_buf);
+         record->user = record->user_buf;
+         mongo_object_id_free(oid);
+      }
+   }
+}
+
+static void
+record_load (Record          *record,
+             const MongoBson *bson)
+{
+   MongoBsonIter iter;
+
+   mongo_bson_iter_init(&iter, bson);
+   while (mongo_bson_iter_next(&iter)) {
+      record_apply(record, &iter);
+   }
+}
+
+static void
+chain_link (GHashTable *table,
+            GArray     *next,
+            gpointer    key,
+            guint       slot)
+{
+   g_array_index(next, guint32, slot) =
+      GPOINTER_TO_UINT(g_hash_table_lookup(table, key));
+   g_hash_table_replace(table, key, GUINT_TO_POINTER(slot + 1));
+}
+
+static void
+chain_unlink (GHashTable *table,
+              GArray     *next,
+              gpointer    key,
+              GPtrArray  *keys,
+              guint       slot)
+{
+   guint32 prev = 0;
+   guint32 cur;
+   guint32 after;
+
+   cur = GPOINTER_TO_UINT(g_hash_table_lookup(table, key));
+
+   while (cur && ((cur - 1) != slot)) {
+      prev = cur;
+      cur = g_array_index(next, guint32, cur - 1);
+   }
+
+   if (!cur) {
+      g_assert_not_reached();
+      return;
+   }
+
+   after = g_array_index(next, guint32, slot);
+
+   /*
+    * The table is keyed by memory owned by the head slot, so the key
+    * must be replaced along with the head.
+    */
+   if (prev) {
+      g_array_index(next, guint32, prev - 1) = after;
+   } else if (after) {
+      g_hash_table_replace(table,
+                           g_ptr_array_index(keys, after - 1),
+                           GUINT_TO_POINTER(after));
+   } else {
+      g_hash_table_remove(table, key);
+   }
+
+   g_array_index(next, guint32, slot) = 0;
+}
+
+static void
+postal_device_index_remove_slot (PostalDeviceIndex *index,
+                                 guint              slot)
+{
+   MongoObjectId *id;
+   guint8 *token;
+
+   g_assert(index);
+   g_assert(slot < index->ids->len);
+   g_assert(SLOT_ID(index, slot));
+
+   id = SLOT_ID(index, slot);
+   token = SLOT_TOKEN(index, slot);
+
+   chain_unlink(index->by_user, index->next_by_user,
+                (gpointer)SLOT_USER(index, slot), index->user, slot);
+   chain_unlink(index->by_token, index->next_by_token,
+                token, index->tokens, slot);
+   g_hash_table_remove(index->by_id, id);
+
+   mongo_object_id_free(id);
+   g_free(token);
+
+   g_ptr_array_index(index->ids, slot) = NULL;
+   g_ptr_array_index(index->user, slot) = NULL;
+   g_ptr_array_index(index->tokens, slot) = NULL;
+   SLOT_GENERATION(index, slot)++;
+   g_array_append_val(index->free_slots, slot);
+
+   index->n_devices--;
+}
+
+static void
+postal_device_index_insert_slot (PostalDeviceIndex *index,
+                                 MongoObjectId     *id,
+                                 const gchar       *user,
+                                 guint8            *token,
+                                 guint8             device_type,
+                                 guint32            badge,
+                                 gint64             removed_at)
+{
+   guint32 generation = 1;
+   guint32 zero = 0;
+   guint slot;
+
+   g_assert(index);
+   g_assert(id);
+   g_assert(user);
+   g_assert(token);
+
+   if ((slot = GPOINTER_TO_UINT(g_hash_table_lookup(index->by_id, id)))) {
+      postal_device_index_remove_slot(index, slot - 1);
+   }
+
+   if (index->free_slots->len) {
+      slot = g_array_index(index->free_slots, guint32,
+                           index->free_slots->len - 1);
+      g_array_set_size(index->free_slots, index->free_slots->len - 1);
+   } else {
+      slot = index->ids->len;
+      g_ptr_array_add(index->ids, NULL);
+      g_ptr_array_add(index->user, NULL);
+      g_ptr_array_add(index->tokens, NULL);
+      g_array_set_size(index->device_types, slot + 1);
+      g_array_set_size(index->badges, slot + 1);
+      g_array_set_size(index->removed_at, slot + 1);
+      g_array_append_val(index->generations, generation);
+      g_array_append_val(index->next_by_user, zero);
+      g_array_append_val(index->next_by_token, zero);
+   }
+
+   g_ptr_array_index(index->ids, slot) = id;
+   g_ptr_array_index(index->user, slot) =
+      g_string_chunk_insert_const(index->users, user);
+   g_ptr_array_index(index->tokens, slot) = token;
+   SLOT_TYPE(index, slot) = device_type;
+   SLOT_BADGE(index, slot) = badge;
+   SLOT_REMOVED_AT(index, slot) = removed_at;
+
+   g_hash_table_insert(index->by_id, id, GUINT_TO_POINTER(slot + 1));
+   chain_link(index->by_user, index->next_by_user,
+              (gpointer)SLOT_USER(index, slot), slot);
+   chain_link(index->by_token, index->next_by_token, token, slot);
+
+   index->n_devices++;
+}
+
+static gboolean
+postal_device_index_insert_record (PostalDeviceIndex *index,
+                                   Record            *record)
+{
+   guint8 *token;
+
+   g_assert(index);
+   g_assert(record);
+
+   if (!record->id ||
+       !record->user ||
+       !record->device_type ||
+       !record->device_token ||
+       !(token = token_encode(record->device_token))) {
+      return FALSE;
+   }
+
+   postal_device_index_insert_slot(index,
+                                   record->id,
+                                   record->user,
+                                   token,
+                                   record->device_type,
+                                   record->badge,
+                                   record->removed_at);
+   record->id = NULL;
+
+   return TRUE;
+}
+
+/*
+ * Orders handles by slot. Handles of a single slot share their
+ * generation, so duplicates compare equal.
+ */
+static gint
+handle_compare (gconstpointer a,
+                gconstpointer b)
+{
+   guint32 sa = *(const guint64 *)a & G_MAXUINT32;
+   guint32 sb = *(const guint64 *)b & G_MAXUINT32;
+
+   return (sa < sb) ? -1 : (sa > sb);
+}
+
+static gboolean
+postal_device_index_resolve (PostalDeviceIndex *index,
+                             guint64            handle,
+                             guint             *slot)
+{
+   guint32 generation = handle >> 32;
+
+   *slot = handle & G_MAXUINT32;
+
+   return ((*slot < index->ids->len) &&
+           SLOT_ID(index, *slot) &&
+           (SLOT_GENERATION(index, *slot) == generation));
+}
+
+/**
+ * postal_device_index_insert:
+ * @index: A #PostalDeviceIndex.
+ * @bson: A #MongoBson containing a device document.
+ *
+ * Inserts the device described by @bson into @index. If a device with the
+ * same _id is already indexed, it is replaced.
+ *
+ * Returns: %TRUE if the device was indexed; %FALSE if @bson is missing
+ *   one of the required fields.
+ */
+gboolean
+postal_device_index_insert (PostalDeviceIndex *index,
+                            const MongoBson   *bson)
+{
+   gboolean ret;
+   Record record;
+
+   g_return_val_if_fail(index, FALSE);
+   g_return_val_if_fail(bson, FALSE);
+
+   record_init(&record);
+   record_load(&record, bson);
+   ret = postal_device_index_insert_record(index, &record);
+   record_clear(&record);
+
+   return ret;
+}
+
+/**
+ * postal_device_index_remove:
+ * @index: A #PostalDeviceIndex.
+ * @id: The _id of the device document.
+ *
+ * Removes the device with the _id @id from @index.
+ *
+ * Returns: %TRUE if the device was found.
+ */
+gboolean
+postal_device_index_remove (PostalDeviceIndex   *index,
+                            const MongoObjectId *id)
+{
+   guint slot;
+
+   g_return_val_if_fail(index, FALSE);
+   g_return_val_if_fail(id, FALSE);
+
+   if ((slot = GPOINTER_TO_UINT(g_hash_table_lookup(index->by_id, id)))) {
+      postal_device_index_remove_slot(index, slot - 1);
+      return TRUE;
+   }
+
+   return FALSE;
+}
+
+/**
+ * postal_device_index_mark_removed:
+ * @index: A #PostalDeviceIndex.
+ * @user: (allow-none): The user of the device, or %NULL for any user.
+ * @device_type: The type of the device, or 0 for any type.
+ * @device_token: The device token.
+ * @removed_at: The time at which the device was removed.
+ *
+ * Marks the active devices with @device_token, and optionally matching
+ * @user and @device_type, as removed. Removed devices are kept so that
+ * they can still be found with postal_device_index_find().
+ *
+ * Returns: The number of devices that were marked.
+ */
+guint
+postal_device_index_mark_removed (PostalDeviceIndex *index,
+                                  const gchar       *user,
+                                  PostalDeviceType   device_type,
+                                  const gchar       *device_token,
+                                  const GTimeVal    *removed_at)
+{
+   guint8 *token;
+   guint32 cur;
+   guint slot;
+   guint ret = 0;
+
+   g_return_val_if_fail(index, 0);
+   g_return_val_if_fail(device_token, 0);
+   g_return_val_if_fail(removed_at, 0);
+
+   if (!(token = token_encode(device_token))) {
+      return 0;
+   }
+
+   cur = GPOINTER_TO_UINT(g_hash_table_lookup(index->by_token, token));
+   for (; cur; cur = g_array_index(index->next_by_token, guint32, slot)) {
+      slot = cur - 1;
+      if (!SLOT_REMOVED_AT(index, slot) &&
+          (!device_type || (SLOT_TYPE(index, slot) == device_type)) &&
+          (!user || !strcmp(user, SLOT_USER(index, slot)))) {
+         SLOT_REMOVED_AT(index, slot) =
+            ((gint64)removed_at->tv_sec * G_USEC_PER_SEC) +
+            removed_at->tv_usec;
+         ret++;
+      }
+   }
+
+   g_free(token);
+
+   return ret;
+}
+
+/**
+ * postal_device_index_replay:
+ * @index: A #PostalDeviceIndex.
+ * @entry: A #MongoBson containing an oplog entry.
+ *
+ * Applies an entry from the replica set oplog for the devices collection
+ * to @index. Inserts, deletes, and updates using $set or $unset as well
+ * as whole document replacements are supported.
+ *
+ * Returns: %TRUE if @entry was applied; %FALSE if it could not be.
+ */
+gboolean
+postal_device_index_replay (PostalDeviceIndex *index,
+                            const MongoBson   *entry)
+{
+   MongoBsonIter iter;
+   MongoBsonIter citer;
+   MongoBsonIter fiter;
+   const gchar *op = NULL;
+   MongoBson *o = NULL;
+   MongoBson *o2 = NULL;
+   gboolean ret = FALSE;
+   gboolean modifier = FALSE;
+   gchar *device_token = NULL;
+   Record record;
+   guint slot;
+
+   g_return_val_if_fail(index, FALSE);
+   g_return_val_if_fail(entry, FALSE);
+
+   record_init(&record);
+
+   mongo_bson_iter_init(&iter, entry);
+   while (mongo_bson_iter_next(&iter)) {
+      if (mongo_bson_iter_is_key(&iter, "op") &&
+          MONGO_BSON_ITER_HOLDS_UTF8(&iter)) {
+         op = mongo_bson_iter_get_value_string(&iter, NULL);
+      } else if (mongo_bson_iter_is_key(&iter, "o") &&
+                 MONGO_BSON_ITER_HOLDS_DOCUMENT(&iter)) {
+         o = mongo_bson_iter_get_value_bson(&iter);
+      } else if (mongo_bson_iter_is_key(&iter, "o2") &&
+                 MONGO_BSON_ITER_HOLDS_DOCUMENT(&iter)) {
+         o2 = mongo_bson_iter_get_value_bson(&iter);
+      }
+   }
+
+   if (!op || !o) {
+      goto cleanup;
+   }
+
+   switch (op[0]) {
+   case 'i':
+      ret = postal_device_index_insert(index, o);
+      break;
+   case 'd':
+      record_load(&record, o);
+      ret = record.id && postal_device_index_remove(index, record.id);
+      break;
+   case 'u':
+      mongo_bson_iter_init(&iter, o);
+      if (mongo_bson_iter_next(&iter)) {
+         modifier = (mongo_bson_iter_get_key(&iter)[0] == '$');
+      }
+
+      if (!modifier) {
+         record_load(&record, o);
+         if (!record.id && o2) {
+            record_load(&record, o2);
+         }
+         ret = postal_device_index_insert_record(index, &record);
+         break;
+      }
+
+      if (!o2) {
+         break;
+      }
+
+      record_load(&record, o2);
+      if (!record.id ||
+          !(slot = GPOINTER_TO_UINT(g_hash_table_lookup(index->by_id,
+                                                        record.id)))) {
+         break;
+      }
+      slot--;
+
+      /*
+       * Start from the indexed copy of the device and apply the modified
+       * fields over it.
+       */
+      device_token = token_decode(SLOT_TOKEN(index, slot));
+      record.user = SLOT_USER(index, slot);
+      record.device_token = device_token;
+      record.device_type = SLOT_TYPE(index, slot);
+      record.badge = SLOT_BADGE(index, slot);
+      record.removed_at = SLOT_REMOVED_AT(index, slot);
+
+      mongo_bson_iter_init(&iter, o);
+      while (mongo_bson_iter_next(&iter)) {
+         if (!MONGO_BSON_ITER_HOLDS_DOCUMENT(&iter) ||
+             !mongo_bson_iter_recurse(&iter, &citer)) {
+            continue;
+         }
+         if (mongo_bson_iter_is_key(&iter, "$set")) {
+            while (mongo_bson_iter_next(&citer)) {
+               record_apply(&record, &citer);
+            }
+         } else if (mongo_bson_iter_is_key(&iter, "$unset")) {
+            fiter = citer;
+            if (mongo_bson_iter_find(&fiter, "removed_at")) {
+               record.removed_at = 0;
+            }
+            fiter = citer;
+            if (mongo_bson_iter_find(&fiter, "badge")) {
+               record.badge = 0;
+            }
+         }
+      }
+
+      /*
+       * Changing the removed_at or badge fields is by far the most common
+       * update, so it is applied in place. Anything else is relinked.
+       */
+      if ((record.user == SLOT_USER(index, slot)) &&
+          (record.device_token == device_token) &&
+          (record.device_type == SLOT_TYPE(index, slot))) {
+         SLOT_BADGE(index, slot) = record.badge;
+         SLOT_REMOVED_AT(index, slot) = record.removed_at;
+         ret = TRUE;
+      } else {
+         ret = postal_device_index_insert_record(index, &record);
+      }
+      break;
+   case 'n':
+      ret = TRUE;
+      break;
+   default:
+      break;
+   }
+
+cleanup:
+   record_clear(&record);
+   g_free(device_token);
+   if (o) {
+      mongo_bson_unref(o);
+   }
+   if (o2) {
+      mongo_bson_unref(o2);
+   }
+
+   return ret;
+}
+
+/**
+ * postal_device_index_lookup:
+ * @index: A #PostalDeviceIndex.
+ * @users: (allow-none): A %NULL terminated array of users.
+ * @device_tokens: (allow-none): A %NULL terminated array of device tokens.
+ * @active_only: If devices that have been removed should be skipped.
+ *
+ * Looks up the devices that belong to any of @users or that have any of
+ * @device_tokens. Each device is returned once, in the order of their
+ * slots in @index.
+ *
+ * Returns: (transfer full): A #GArray of guint64 handles which may be
+ *   resolved with postal_device_index_get_device().
+ */
+GArray *
+postal_device_index_lookup (PostalDeviceIndex  *index,
+                            gchar             **users,
+                            gchar             **device_tokens,
+                            gboolean            active_only)
+{
+   guint64 handle;
+   guint8 *token;
+   GArray *ret;
+   guint32 cur;
+   guint slot;
+   guint i;
+   guint j;
+
+   g_return_val_if_fail(index, NULL);
+
+   ret = g_array_new(FALSE, FALSE, sizeof(guint64));
+
+   for (i = 0; users && users[i]; i++) {
+      cur = GPOINTER_TO_UINT(g_hash_table_lookup(index->by_user, users[i]));
+      for (; cur; cur = g_array_index(index->next_by_user, guint32, slot)) {
+         slot = cur - 1;
+         if (!active_only || !SLOT_REMOVED_AT(index, slot)) {
+            handle = SLOT_HANDLE(index, slot);
+            g_array_append_val(ret, handle);
+         }
+      }
+   }
+
+   for (i = 0; device_tokens && device_tokens[i]; i++) {
+      if (!(token = token_encode(device_tokens[i]))) {
+         continue;
+      }
+      cur = GPOINTER_TO_UINT(g_hash_table_lookup(index->by_token, token));
+      for (; cur; cur = g_array_index(index->next_by_token, guint32, slot)) {
+         slot = cur - 1;
+         if (!active_only || !SLOT_REMOVED_AT(index, slot)) {
+            handle = SLOT_HANDLE(index, slot);
+            g_array_append_val(ret, handle);
+         }
+      }
+      g_free(token);
+   }
+
+   /*
+    * Sorting by slot groups duplicates together.
+    */
+   if (ret->len > 1) {
+      g_array_sort(ret, handle_compare);
+      for (i = 1, j = 1; i < ret->len; i++) {
+         if (g_array_index(ret, guint64, i) !=
+             g_array_index(ret, guint64, j - 1)) {
+            g_array_index(ret, guint64, j++) = g_array_index(ret, guint64, i);
+         }
+      }
+      g_array_set_size(ret, j);
+   }
+
+   return ret;
+}
+
+/**
+ * postal_device_index_find:
+ * @index: A #PostalDeviceIndex.
+ * @user: The user of the device.
+ * @device_token: The device token.
+ *
+ * Finds the device belonging to @user with @device_token, whether or not
+ * it has been removed.
+ *
+ * Returns: A handle for the device, or 0 if it was not found.
+ */
+guint64
+postal_device_index_find (PostalDeviceIndex *index,
+                          const gchar       *user,
+                          const gchar       *device_token)
+{
+   guint64 ret = 0;
+   guint8 *token;
+   guint32 cur;
+   guint slot;
+
+   g_return_val_if_fail(index, 0);
+   g_return_val_if_fail(user, 0);
+   g_return_val_if_fail(device_token, 0);
+
+   if (!(token = token_encode(device_token))) {
+      return 0;
+   }
+
+   cur = GPOINTER_TO_UINT(g_hash_table_lookup(index->by_token, token));
+   for (; cur; cur = g_array_index(index->next_by_token, guint32, slot)) {
+      slot = cur - 1;
+      if (!strcmp(user, SLOT_USER(index, slot))) {
+         ret = SLOT_HANDLE(index, slot);
+         break;
+      }
+   }
+
+   g_free(token);
+
+   return ret;
+}
+
+/**
+ * postal_device_index_get_device:
+ * @index: A #PostalDeviceIndex.
+ * @handle: A handle from postal_device_index_lookup().
+ *
+ * Inflates a #PostalDevice for the device referred to by @handle.
+ *
+ * Returns: (transfer full): A #PostalDevice, or %NULL if the device has
+ *   since been removed from @index.
+ */
+PostalDevice *
+postal_device_index_get_device (PostalDeviceIndex *index,
+                                guint64            handle)
+{
+   PostalDevice *device;
+   gint64 removed_at;
+   GTimeVal tv;
+   gchar *token;
+   guint slot;
+
+   g_return_val_if_fail(index, NULL);
+
+   if (!postal_device_index_resolve(index, handle, &slot)) {
+      return NULL;
+   }
+
+   device = postal_device_new();
+
+   mongo_object_id_get_timeval(SLOT_ID(index, slot), &tv);
+   postal_device_set_created_at(device, &tv);
+
+   token = token_decode(SLOT_TOKEN(index, slot));
+   postal_device_set_device_token(device, token);
+   g_free(token);
+
+   postal_device_set_badge(device, SLOT_BADGE(index, slot));
+   postal_device_set_device_type(device, SLOT_TYPE(index, slot));
+   postal_device_set_user(device, SLOT_USER(index, slot));
+
+   if ((removed_at = SLOT_REMOVED_AT(index, slot))) {
+      tv.tv_sec = removed_at / G_USEC_PER_SEC;
+      tv.tv_usec = removed_at % G_USEC_PER_SEC;
+      postal_device_set_removed_at(device, &tv);
+   }
+
+   return device;
+}
+
+/**
+ * postal_device_index_peek_device:
+ * @index: A #PostalDeviceIndex.
+ * @handle: A handle from postal_device_index_lookup().
+ * @device_type: (out): A location for the type of the device.
+ * @user: (out) (transfer none): A location for the user of the device.
+ * @device_token: A #GString to store the device token in.
+ * @badge: (out): A location for the badge of the device.
+ * @removed: (out): A location for whether the device has been removed.
+ *
+ * Reads the fields of the device referred to by @handle without inflating
+ * a #PostalDevice, for callers that walk many handles. @user is owned by
+ * @index and lives as long as it does.
+ *
+ * Returns: %TRUE if the device was found; %FALSE if it has since been
+ *   removed from @index.
+ */
+gboolean
+postal_device_index_peek_device (PostalDeviceIndex  *index,
+                                 guint64             handle,
+                                 PostalDeviceType   *device_type,
+                                 const gchar       **user,
+                                 GString            *device_token,
+                                 guint              *badge,
+                                 gboolean           *removed)
+{
+   guint slot;
+
+   g_return_val_if_fail(index, FALSE);
+   g_return_val_if_fail(device_type, FALSE);
+   g_return_val_if_fail(user, FALSE);
+   g_return_val_if_fail(device_token, FALSE);
+   g_return_val_if_fail(badge, FALSE);
+   g_return_val_if_fail(removed, FALSE);
+
+   if (!postal_device_index_resolve(index, handle, &slot)) {
+      return FALSE;
+   }
+
+   *device_type = SLOT_TYPE(index, slot);
+   *user = SLOT_USER(index, slot);
+   *badge = SLOT_BADGE(index, slot);
+   *removed = !!SLOT_REMOVED_AT(index, slot);
+   token_decode_to_string(SLOT_TOKEN(index, slot), device_token);
+
+   return TRUE;
+}
+
+/**
+ * postal_device_index_is_active:
+ * @index: A #PostalDeviceIndex.
+ * @handle: A handle from postal_device_index_find() or
+ *   postal_device_index_lookup().
+ *
+ * Checks that @handle still refers to a device that has not been removed,
+ * without inflating a #PostalDevice.
+ *
+ * Returns: %TRUE if the device is indexed and active.
+ */
+gboolean
+postal_device_index_is_active (PostalDeviceIndex *index,
+                               guint64            handle)
+{
+   guint slot;
+
+   g_return_val_if_fail(index, FALSE);
+
+   return (postal_device_index_resolve(index, handle, &slot) &&
+           !SLOT_REMOVED_AT(index, slot));
+}
+
+/**
+ * postal_device_index_get_size:
+ * @index: A #PostalDeviceIndex.
+ *
+ * Fetches the number of devices in @index, including removed devices.
+ *
+ * Returns: The number of devices.
+ */
+guint
+postal_device_index_get_size (PostalDeviceIndex *index)
+{
+   g_return_val_if_fail(index, 0);
+   return index->n_devices;
+}
+
+/**
+ * postal_device_index_save_to_bytes:
+ * @index: A #PostalDeviceIndex.
+ * @oplog_time: The time of the last oplog entry applied to @index.
+ * @oplog_increment: The increment of the last oplog entry applied.
+ *
+ * Serializes @index to a snapshot that can be restored with
+ * postal_device_index_new_from_file(). The oplog position is stored as
+ * the high-water mark of the snapshot, so that only the entries that
+ * follow it need to be replayed after a restore.
+ *
+ * Returns: (transfer full): A #GBytes containing the snapshot.
+ */
+GBytes *
+postal_device_index_save_to_bytes (PostalDeviceIndex *index,
+                                   guint32            oplog_time,
+                                   guint32            oplog_increment)
+{
+   SnapshotHeader *header;
+   SnapshotRecord *record;
+   GHashTableIter iter;
+   GHashTable *user_ids;
+   GByteArray *ret;
+   gpointer key;
+   guint32 *user_offsets;
+   guint8 *token;
+   gsize records_offset;
+   gsize users_offset;
+   gsize strings_offset;
+   gsize tokens_offset;
+   gsize users_size = 0;
+   gsize tokens_size = 0;
+   gsize len;
+   guint n_users;
+   guint i;
+   guint j;
+
+   g_return_val_if_fail(index, NULL);
+
+   /*
+    * Number the users that still have devices and size each section.
+    */
+   user_ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+   g_hash_table_iter_init(&iter, index->by_user);
+   for (n_users = 0; g_hash_table_iter_next(&iter, &key, NULL); n_users++) {
+      g_hash_table_insert(user_ids, key, GUINT_TO_POINTER(n_users));
+      users_size += strlen(key) + 1;
+   }
+
+   for (i = 0; i < index->ids->len; i++) {
+      if (SLOT_ID(index, i)) {
+         tokens_size += token_size(SLOT_TOKEN(index, i));
+      }
+   }
+
+   records_offset = sizeof *header;
+   users_offset = records_offset + (index->n_devices * sizeof *record);
+   strings_offset = users_offset + (n_users * sizeof(guint32));
+   tokens_offset = strings_offset + users_size;
+
+   ret = g_byte_array_sized_new(tokens_offset + tokens_size);
+   g_byte_array_set_size(ret, tokens_offset + tokens_size);
+   memset(ret->data, 0, ret->len);
+
+   header = (SnapshotHeader *)ret->data;
+   header->magic = GUINT32_TO_LE(SNAPSHOT_MAGIC);
+   header->version = GUINT32_TO_LE(SNAPSHOT_VERSION);
+   header->oplog_time = GUINT32_TO_LE(oplog_time);
+   header->oplog_increment = GUINT32_TO_LE(oplog_increment);
+   header->n_records = GUINT32_TO_LE(index->n_devices);
+   header->n_users = GUINT32_TO_LE(n_users);
+   header->users_size = GUINT32_TO_LE(users_size);
+   header->tokens_size = GUINT32_TO_LE(tokens_size);
+
+   user_offsets = (guint32 *)(ret->data + users_offset);
+   len = 0;
+   g_hash_table_iter_init(&iter, index->by_user);
+   for (i = 0; g_hash_table_iter_next(&iter, &key, NULL); i++) {
+      user_offsets[i] = GUINT32_TO_LE(len);
+      memcpy(ret->data + strings_offset + len, key, strlen(key) + 1);
+      len += strlen(key) + 1;
+   }
+
+   record = (SnapshotRecord *)(ret->data + records_offset);
+   len = 0;
+   for (i = 0, j = 0; i < index->ids->len; i++) {
+      if (!SLOT_ID(index, i)) {
+         continue;
+      }
+      token = SLOT_TOKEN(index, i);
+      memcpy(record[j].id, mongo_object_id_get_data(SLOT_ID(index, i), NULL),
+             sizeof record[j].id);
+      record[j].user = GUINT32_TO_LE(GPOINTER_TO_UINT(
+            g_hash_table_lookup(user_ids, SLOT_USER(index, i))));
+      record[j].token = GUINT32_TO_LE(len);
+      record[j].badge = GUINT32_TO_LE(SLOT_BADGE(index, i));
+      record[j].device_type = SLOT_TYPE(index, i);
+      record[j].removed_at = GINT64_TO_LE(SLOT_REMOVED_AT(index, i));
+      memcpy(ret->data + tokens_offset + len, token, token_size(token));
+      len += token_size(token);
+      j++;
+   }
+
+   g_hash_table_unref(user_ids);
+
+   return g_byte_array_free_to_bytes(ret);
+}
+
+/**
+ * postal_device_index_new_from_file:
+ * @filename: The path to a snapshot.
+ * @oplog_time: (out): A location for the time of the high-water mark.
+ * @oplog_increment: (out): A location for the increment of the mark.
+ * @error: (out): A location for a #GError, or %NULL.
+ *
+ * Restores an index from a snapshot written with
+ * postal_device_index_save_to_bytes(). The snapshot is mapped into memory
+ * and the index is rebuilt from its records.
+ *
+ * Returns: (transfer full): A #PostalDeviceIndex if successful; otherwise
+ *   %NULL and @error is set.
+ */
+PostalDeviceIndex *
+postal_device_index_new_from_file (const gchar  *filename,
+                                   guint32      *oplog_time,
+                                   guint32      *oplog_increment,
+                                   GError      **error)
+{
+   const SnapshotHeader *header;
+   const SnapshotRecord *record;
+   PostalDeviceIndex *index = NULL;
+   const guint32 *user_offsets;
+   const guint8 *tokens;
+   const gchar *strings;
+   const gchar *data;
+   GMappedFile *mapped;
+   guint32 n_records;
+   guint32 n_users;
+   guint32 users_size;
+   guint32 tokens_size;
+   guint32 user;
+   guint32 offset;
+   gsize length;
+   guint i;
+
+   g_return_val_if_fail(filename, NULL);
+   g_return_val_if_fail(oplog_time, NULL);
+   g_return_val_if_fail(oplog_increment, NULL);
+
+   if (!(mapped = g_mapped_file_new(filename, FALSE, error))) {
+      return NULL;
+   }
+
+   data = g_mapped_file_get_contents(mapped);
+   length = g_mapped_file_get_length(mapped);
+   header = (const SnapshotHeader *)data;
+
+   if ((length < sizeof *header) ||
+       (GUINT32_FROM_LE(header->magic) != SNAPSHOT_MAGIC) ||
+       (GUINT32_FROM_LE(header->version) != SNAPSHOT_VERSION)) {
+      goto invalid;
+   }
+
+   n_records = GUINT32_FROM_LE(header->n_records);
+   n_users = GUINT32_FROM_LE(header->n_users);
+   users_size = GUINT32_FROM_LE(header->users_size);
+   tokens_size = GUINT32_FROM_LE(header->tokens_size);
+
+   if (length != (sizeof *header +
+                  ((guint64)n_records * sizeof *record) +
+                  ((guint64)n_users * sizeof(guint32)) +
+                  users_size +
+                  tokens_size)) {
+      goto invalid;
+   }
+
+   record = (const SnapshotRecord *)(data + sizeof *header);
+   user_offsets = (const guint32 *)(record + n_records);
+   strings = (const gchar *)(user_offsets + n_users);
+   tokens = (const guint8 *)(strings + users_size);
+
+   /*
+    * The user strings must be terminated within their section.
+    */
+   if (users_size && strings[users_size - 1]) {
+      goto invalid;
+   }
+
+   for (i = 0; i < n_users; i++) {
+      if (GUINT32_FROM_LE(user_offsets[i]) >= users_size) {
+         goto invalid;
+      }
+   }
+
+   index = postal_device_index_new();
+
+   for (i = 0; i < n_records; i++) {
+      user = GUINT32_FROM_LE(record[i].user);
+      offset = GUINT32_FROM_LE(record[i].token);
+      if ((user >= n_users) ||
+          (offset > tokens_size) ||
+          ((tokens_size - offset) < 2) ||
+          ((tokens_size - offset) < token_size(tokens + offset)) ||
+          !record[i].device_type ||
+          (record[i].device_type > POSTAL_DEVICE_GCM)) {
+         goto invalid;
+      }
+      postal_device_index_insert_slot(
+            index,
+            mongo_object_id_new_from_data(record[i].id),
+            strings + GUINT32_FROM_LE(user_offsets[user]),
+            g_memdup(tokens + offset, token_size(tokens + offset)),
+            record[i].device_type,
+            GUINT32_FROM_LE(record[i].badge),
+            GINT64_FROM_LE(record[i].removed_at));
+   }
+
+   *oplog_time = GUINT32_FROM_LE(header->oplog_time);
+   *oplog_increment = GUINT32_FROM_LE(header->oplog_increment);
+
+   g_mapped_file_unref(mapped);
+
+   return index;
+
+invalid:
+   g_set_error(error,
+               POSTAL_DEVICE_INDEX_ERROR,
+               POSTAL_DEVICE_INDEX_ERROR_INVALID_SNAPSHOT,
+               _("\"%s\" is not a valid device index snapshot."),
+               filename);
+   if (index) {
+      postal_device_index_unref(index);
+   }
+   g_mapped_file_unref(mapped);
+
+   return NULL;
+}
+
+/**
+ * postal_device_index_new:
+ *
+ * Creates a new, empty #PostalDeviceIndex.
+ *
+ * Returns: (transfer full): A #PostalDeviceIndex.
+ */
+PostalDeviceIndex *
+postal_device_index_new (void)
+{
+   PostalDeviceIndex *index;
+
+   index = g_slice_new0(PostalDeviceIndex);
+   index->ref_count = 1;
+   index->users = g_string_chunk_new(4096);
+   index->ids = g_ptr_array_new();
+   index->user = g_ptr_array_new();
+   index->tokens = g_ptr_array_new();
+   index->device_types = g_array_new(FALSE, TRUE, sizeof(guint8));
+   index->badges = g_array_new(FALSE, TRUE, sizeof(guint32));
+   index->removed_at = g_array_new(FALSE, TRUE, sizeof(gint64));
+   index->generations = g_array_new(FALSE, FALSE, sizeof(guint32));
+   index->next_by_user = g_array_new(FALSE, FALSE, sizeof(guint32));
+   index->next_by_token = g_array_new(FALSE, FALSE, sizeof(guint32));
+   index->free_slots = g_array_new(FALSE, FALSE, sizeof(guint32));
+   index->by_id = g_hash_table_new(mongo_object_id_hash,
+                                   mongo_object_id_equal);
+   index->by_user = g_hash_table_new(g_str_hash, g_str_equal);
+   index->by_token = g_hash_table_new(token_hash, token_equal);
+
+   return index;
+}
+
+/**
+ * postal_device_index_ref:
+ * @index: A #PostalDeviceIndex.
+ *
+ * Increments the reference count of @index by one.
+ *
+ * Returns: (transfer full): @index.
+ */
+PostalDeviceIndex *
+postal_device_index_ref (PostalDeviceIndex *index)
+{
+   g_return_val_if_fail(index, NULL);
+   g_return_val_if_fail(index->ref_count > 0, NULL);
+   g_atomic_int_inc(&index->ref_count);
+   return index;
+}
+
+/**
+ * postal_device_index_unref:
+ * @index: A #PostalDeviceIndex.
+ *
+ * Decrements the reference count of @index by one. When the reference
+ * count reaches zero, the structure will be freed.
+ */
+void
+postal_device_index_unref (PostalDeviceIndex *index)
+{
+   guint i;
+
+   g_return_if_fail(index);
+   g_return_if_fail(index->ref_count > 0);
+
+   if (g_atomic_int_dec_and_test(&index->ref_count)) {
+      for (i = 0; i < index->ids->len; i++) {
+         if (SLOT_ID(index, i)) {
+            mongo_object_id_free(SLOT_ID(index, i));
+            g_free(SLOT_TOKEN(index, i));
+         }
+      }
+      g_hash_table_unref(index->by_id);
+      g_hash_table_unref(index->by_user);
+      g_hash_table_unref(index->by_token);
+      g_ptr_array_unref(index->ids);
+      g_ptr_array_unref(index->user);
+      g_ptr_array_unref(index->tokens);
+      g_array_unref(index->device_types);
+      g_array_unref(index->badges);
+      g_array_unref(index->removed_at);
+      g_array_unref(index->generations);
+      g_array_unref(index->next_by_user);
+      g_array_unref(index->next_by_token);
+      g_array_unref(index->free_slots);
+      g_string_chunk_free(index->users);
+      g_slice_free(PostalDeviceIndex, index);
+   }
+}
+
+GQuark
+postal_device_index_error_quark (void)
+{
+   return g_quark_from_static_string("PostalDeviceIndexError");
+}
+
+/**
+ * postal_device_index_get_type:
+ *
+ * Fetches the #GType for #PostalDeviceIndex to be used with the GObject
+ * type system.
+ *
+ * Returns: The #GType for #PostalDeviceIndex.
+ */
+GType
+postal_device_index_get_type (void)
+{
+   static volatile GType type_id;
+
+   if (g_once_init_enter(&type_id)) {
+      GType registered;
+      registered = g_boxed_type_register_static(
+            "PostalDeviceIndex",
+            (GBoxedCopyFunc)postal_device_index_ref,
+            (GBoxedFreeFunc)postal_device_index_unref);
+      g_once_init_leave(&type_id, registered);
+   }
+
+   return type_id;
+}
@@ -0,0 +1,83 @@
+/* postal-device-index.h
+ *
+ * Copyright (C) 2012 Catch.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POSTAL_DEVICE_INDEX_H
+#define POSTAL_DEVICE_INDEX_H
+
+#include <glib-object.h>
+#include <mongo-glib.h>
+
+#include "postal-device.h"
+
+G_BEGIN_DECLS
+
+#define POSTAL_DEVICE_INDEX_ERROR (postal_device_index_error_quark())
+
+typedef struct _PostalDeviceIndex PostalDeviceIndex;
+
+typedef enum
+{
+   POSTAL_DEVICE_INDEX_ERROR_INVALID_SNAPSHOT = 1,
+} PostalDeviceIndexError;
+
+GQuark             postal_device_index_error_quark   (void) G_GNUC_CONST;
+guint64            postal_device_index_find          (PostalDeviceIndex   *index,
+                                                      const gchar         *user,
+                                                      const gchar         *device_token);
+PostalDevice      *postal_device_index_get_device    (PostalDeviceIndex   *index,
+                                                      guint64              handle);
+guint              postal_device_index_get_size      (PostalDeviceIndex   *index);
+GType              postal_device_index_get_type      (void) G_GNUC_CONST;
+gboolean           postal_device_index_insert        (PostalDeviceIndex   *index,
+                                                      const MongoBson     *bson);
+gboolean           postal_device_index_is_active     (PostalDeviceIndex   *index,
+                                                      guint64              handle);
+GArray            *postal_device_index_lookup        (PostalDeviceIndex   *index,
+                                                      gchar              **users,
+                                                      gchar              **device_tokens,
+                                                      gboolean             active_only);
+guint              postal_device_index_mark_removed  (PostalDeviceIndex   *index,
+                                                      const gchar         *user,
+                                                      PostalDeviceType     device_type,
+                                                      const gchar         *device_token,
+                                                      const GTimeVal      *removed_at);
+PostalDeviceIndex *postal_device_index_new           (void);
+PostalDeviceIndex *postal_device_index_new_from_file (const gchar         *filename,
+                                                      guint32             *oplog_time,
+                                                      guint32             *oplog_increment,
+                                                      GError             **error);
+gboolean           postal_device_index_peek_device   (PostalDeviceIndex   *index,
+                                                      guint64              handle,
+                                                      PostalDeviceType    *device_type,
+                                                      const gchar        **user,
+                                                      GString             *device_token,
+                                                      guint               *badge,
+                                                      gboolean            *removed);
+PostalDeviceIndex *postal_device_index_ref           (PostalDeviceIndex   *index);
+gboolean           postal_device_index_remove        (PostalDeviceIndex   *index,
+                                                      const MongoObjectId *id);
+gboolean           postal_device_index_replay        (PostalDeviceIndex   *index,
+                                                      const MongoBson     *entry);
+GBytes            *postal_device_index_save_to_bytes (PostalDeviceIndex   *index,
+                                                      guint32              oplog_time,
+                                                      guint32              oplog_increment);
+void               postal_device_index_unref         (PostalDeviceIndex   *index);
+
+G_END_DECLS
+
+#endif /* POSTAL_DEVICE_INDEX_H */
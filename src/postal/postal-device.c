@@ -20,6 +20,7 @@
 
 #include "postal-debug.h"
 #include "postal-device.h"
+#include "push-aps-identity.h"
 
 G_DEFINE_TYPE(PostalDevice, postal_device, G_TYPE_OBJECT)
 
@@ -68,6 +69,58 @@ postal_device_type_to_string (PostalDeviceType device_type)
    return str;
 }
 
+/**
+ * postal_device_aps_token_pack:
+ * @device_token: (in): A device token.
+ * @packed: (out caller-allocates) (array fixed-size=32): A location for
+ *   the packed token.
+ *
+ * Packs an APS device token, which is printed as 64 hex characters of
+ * either case, into the POSTAL_DEVICE_APS_TOKEN_SIZE bytes it encodes.
+ * This is the form APS tokens are stored in.
+ *
+ * Returns: %TRUE if @device_token was packed; %FALSE if it is not an APS
+ *   device token.
+ */
+gboolean
+postal_device_aps_token_pack (const gchar *device_token,
+                              guint8      *packed)
+{
+   g_return_val_if_fail(device_token, FALSE);
+   g_return_val_if_fail(packed, FALSE);
+
+   return (push_aps_identity_decode_token(device_token,
+                                          packed,
+                                          POSTAL_DEVICE_APS_TOKEN_SIZE) &&
+           !device_token[POSTAL_DEVICE_APS_TOKEN_SIZE * 2]);
+}
+
+/**
+ * postal_device_aps_token_unpack:
+ * @packed: (in) (array fixed-size=32): A packed APS device token.
+ * @device_token: (out caller-allocates) (array fixed-size=65): A location
+ *   for the device token.
+ *
+ * Prints a token packed with postal_device_aps_token_pack() as 64
+ * lowercase hex characters, which is how it is shown at the HTTP API.
+ */
+void
+postal_device_aps_token_unpack (const guint8 *packed,
+                                gchar        *device_token)
+{
+   static const gchar hex[] = "0123456789abcdef";
+   guint i;
+
+   g_return_if_fail(packed);
+   g_return_if_fail(device_token);
+
+   for (i = 0; i < POSTAL_DEVICE_APS_TOKEN_SIZE; i++) {
+      device_token[i * 2] = hex[packed[i] >> 4];
+      device_token[i * 2 + 1] = hex[packed[i] & 0xF];
+   }
+   device_token[POSTAL_DEVICE_APS_TOKEN_SIZE * 2] = '\0';
+}
+
 /**
  * postal_device_new:
  *
@@ -337,8 +390,11 @@ postal_device_load_from_bson (PostalDevice  *device,
    MongoObjectId *oid;
    MongoBsonIter iter;
    const gchar *str;
+   const guint8 *data;
    GTimeVal tv;
    gchar oidstr[25];
+   gchar tokenstr[POSTAL_DEVICE_APS_TOKEN_SIZE * 2 + 1];
+   gsize len;
 
    ENTRY;
 
@@ -358,8 +414,20 @@ postal_device_load_from_bson (PostalDevice  *device,
          str = mongo_bson_iter_get_value_string(&iter, NULL);
          postal_device_set_device_type_string(device, str);
       } else if (mongo_bson_iter_is_key(&iter, "device_token")) {
-         str = mongo_bson_iter_get_value_string(&iter, NULL);
-         postal_device_set_device_token(device, str);
+         if (MONGO_BSON_ITER_HOLDS_BINARY(&iter)) {
+            /*
+             * APS tokens are stored packed. Older documents still hold
+             * them as hex strings, so both are accepted.
+             */
+            data = mongo_bson_iter_get_value_binary(&iter, NULL, &len);
+            if (len == POSTAL_DEVICE_APS_TOKEN_SIZE) {
+               postal_device_aps_token_unpack(data, tokenstr);
+               postal_device_set_device_token(device, tokenstr);
+            }
+         } else {
+            str = mongo_bson_iter_get_value_string(&iter, NULL);
+            postal_device_set_device_token(device, str);
+         }
       } else if (mongo_bson_iter_is_key(&iter, "removed_at")) {
          if (mongo_bson_iter_get_value_type(&iter) == MONGO_BSON_DATE_TIME) {
             mongo_bson_iter_get_value_timeval(&iter, &tv);
@@ -404,6 +472,7 @@ postal_device_save_to_bson (PostalDevice  *device,
    MongoObjectId *id;
    const gchar *str;
    MongoBson *ret;
+   guint8 packed[POSTAL_DEVICE_APS_TOKEN_SIZE];
 
    ENTRY;
 
@@ -422,7 +491,14 @@ postal_device_save_to_bson (PostalDevice  *device,
    }
 
    ret = mongo_bson_new_empty();
-   mongo_bson_append_string(ret, "device_token", priv->device_token);
+   if ((priv->device_type == POSTAL_DEVICE_APS) &&
+       priv->device_token &&
+       postal_device_aps_token_pack(priv->device_token, packed)) {
+      mongo_bson_append_binary(ret, "device_token", 0,
+                               packed, sizeof packed);
+   } else {
+      mongo_bson_append_string(ret, "device_token", priv->device_token);
+   }
    str = postal_device_type_to_string(priv->device_type);
    mongo_bson_append_string(ret, "device_type", str);
 
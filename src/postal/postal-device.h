@@ -35,6 +35,12 @@ G_BEGIN_DECLS
 #define POSTAL_IS_DEVICE_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass),  POSTAL_TYPE_DEVICE))
 #define POSTAL_DEVICE_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj),  POSTAL_TYPE_DEVICE, PostalDeviceClass))
 
+/*
+ * The size of an APS device token in bytes. It is 64 hex characters
+ * when printed.
+ */
+#define POSTAL_DEVICE_APS_TOKEN_SIZE 32
+
 typedef struct _PostalDevice        PostalDevice;
 typedef struct _PostalDeviceClass   PostalDeviceClass;
 typedef struct _PostalDevicePrivate PostalDevicePrivate;
@@ -70,6 +76,10 @@ struct _PostalDeviceClass
    GObjectClass parent_class;
 };
 
+gboolean          postal_device_aps_token_pack   (const gchar       *device_token,
+                                                  guint8            *packed);
+void              postal_device_aps_token_unpack (const guint8      *packed,
+                                                  gchar             *device_token);
 GQuark            postal_device_error_quark      (void) G_GNUC_CONST;
 guint             postal_device_get_badge        (PostalDevice      *device);
 GTimeVal         *postal_device_get_created_at   (PostalDevice      *device);
@@ -0,0 +1,348 @@
+/* postal-fp-cache.c
+ *
+ * Copyright (C) 2012 Catch.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "postal-fp-cache.h"
+
+/**
+ * SECTION:postal-fp-cache
+ * @title: PostalFpCache
+ * @short_description: Time-bucketed fingerprint cache
+ *
+ * #PostalFpCache remembers 64-bit fingerprints for a window of time. It is
+ * used to drop duplicate notifications to the same device that share a
+ * collapse key.
+ *
+ * The table is set-associative. Each set is exactly one cache line of
+ * #POSTAL_FP_CACHE_WAYS entries, so a lookup hashes once and touches a
+ * single cache line. Every entry is tagged with the time bucket it was
+ * inserted in. Entries whose bucket has fallen out of the window are
+ * treated as empty and are overwritten lazily; nothing is ever freed or
+ * allocated after creation.
+ *
+ * Like any fingerprint table, there is a very small chance of a false
+ * positive when two keys share the same 48-bit fingerprint within a set.
+ * Bucket tags are 16 bits wide, so an entry that is never overwritten
+ * could alias as live again after 65536 buckets.
+ */
+
+#ifndef POSTAL_FP_CACHE_WAYS
+#define POSTAL_FP_CACHE_WAYS 8
+#endif
+
+#define POSTAL_FP_CACHE_LINE_SIZE (POSTAL_FP_CACHE_WAYS * sizeof(guint64))
+#define POSTAL_FP_CACHE_TAG_MASK  G_GUINT64_CONSTANT(0xFFFF)
+
+typedef struct
+{
+   guint64 entries[POSTAL_FP_CACHE_WAYS];
+} PostalFpCacheSet;
+
+struct _PostalFpCache
+{
+   gint              ref_count;
+   guint             n_sets;
+   guint             set_mask;
+   guint             n_buckets;
+   gint64            bucket_usec;
+   PostalFpCacheSet *sets;
+   gpointer          allocated;
+};
+
+G_STATIC_ASSERT(sizeof(PostalFpCacheSet) == POSTAL_FP_CACHE_LINE_SIZE);
+
+static inline guint16
+postal_fp_cache_get_bucket (PostalFpCache *cache,
+                            gint64         now)
+{
+   return (now / cache->bucket_usec) & POSTAL_FP_CACHE_TAG_MASK;
+}
+
+static inline guint
+postal_fp_cache_get_age (guint64 entry,
+                         guint16 bucket)
+{
+   return (guint16)(bucket - (entry & POSTAL_FP_CACHE_TAG_MASK));
+}
+
+static inline guint64
+postal_fp_cache_get_key (guint64 fingerprint)
+{
+   guint64 key;
+
+   /*
+    * The low 16 bits of each entry hold the bucket tag. Make sure we never
+    * produce a key of zero since that denotes an empty slot.
+    */
+   key = fingerprint & ~POSTAL_FP_CACHE_TAG_MASK;
+   return key ? key : (POSTAL_FP_CACHE_TAG_MASK + 1);
+}
+
+/**
+ * postal_fp_cache_hash:
+ * @str1: A string.
+ * @str2: (allow-none): A string or %NULL.
+ *
+ * Computes a 64-bit fingerprint of @str1 and @str2 as if they had been
+ * joined with a ':' separator, without allocating the joined string.
+ *
+ * Returns: A 64-bit fingerprint.
+ */
+guint64
+postal_fp_cache_hash (const gchar *str1,
+                      const gchar *str2)
+{
+   const guint8 *p;
+   guint64 h = G_GUINT64_CONSTANT(0xcbf29ce484222325);
+
+   g_return_val_if_fail(str1, 0);
+
+   /*
+    * FNV-1a followed by a 64-bit finalizer so that both the set index
+    * (low bits) and the fingerprint (high bits) are well distributed.
+    */
+   for (p = (const guint8 *)str1; *p; p++) {
+      h = (h ^ *p) * G_GUINT64_CONSTANT(0x100000001b3);
+   }
+
+   h = (h ^ ':') * G_GUINT64_CONSTANT(0x100000001b3);
+
+   if (str2) {
+      for (p = (const guint8 *)str2; *p; p++) {
+         h = (h ^ *p) * G_GUINT64_CONSTANT(0x100000001b3);
+      }
+   }
+
+   h ^= h >> 33;
+   h *= G_GUINT64_CONSTANT(0xff51afd7ed558ccd);
+   h ^= h >> 33;
+   h *= G_GUINT64_CONSTANT(0xc4ceb9fe1a85ec53);
+   h ^= h >> 33;
+
+   return h;
+}
+
+/**
+ * postal_fp_cache_contains:
+ * @cache: A #PostalFpCache.
+ * @fingerprint: A fingerprint from postal_fp_cache_hash().
+ * @now: The current monotonic time in microseconds.
+ *
+ * Checks to see if @fingerprint was inserted within the window of time
+ * covered by @cache.
+ *
+ * Returns: %TRUE if @fingerprint was found; otherwise %FALSE.
+ */
+gboolean
+postal_fp_cache_contains (PostalFpCache *cache,
+                          guint64        fingerprint,
+                          gint64         now)
+{
+   PostalFpCacheSet *set;
+   guint64 key;
+   guint16 bucket;
+   guint i;
+
+   g_return_val_if_fail(cache, FALSE);
+
+   key = postal_fp_cache_get_key(fingerprint);
+   bucket = postal_fp_cache_get_bucket(cache, now);
+   set = &cache->sets[fingerprint & cache->set_mask];
+
+   for (i = 0; i < POSTAL_FP_CACHE_WAYS; i++) {
+      if (((set->entries[i] & ~POSTAL_FP_CACHE_TAG_MASK) == key) &&
+          (postal_fp_cache_get_age(set->entries[i], bucket) < cache->n_buckets)) {
+         return TRUE;
+      }
+   }
+
+   return FALSE;
+}
+
+/**
+ * postal_fp_cache_insert:
+ * @cache: A #PostalFpCache.
+ * @fingerprint: A fingerprint from postal_fp_cache_hash().
+ * @now: The current monotonic time in microseconds.
+ *
+ * Inserts @fingerprint into @cache unless it is already present within
+ * the window of time covered by @cache. An existing entry is not
+ * refreshed, so the window is measured from the first insertion.
+ *
+ * If the set is full, the oldest entry within the set is replaced.
+ *
+ * Returns: %TRUE if @fingerprint was already present.
+ */
+gboolean
+postal_fp_cache_insert (PostalFpCache *cache,
+                        guint64        fingerprint,
+                        gint64         now)
+{
+   PostalFpCacheSet *set;
+   guint64 entry;
+   guint64 key;
+   guint16 bucket;
+   guint victim = 0;
+   guint victim_age = 0;
+   guint age;
+   guint i;
+
+   g_return_val_if_fail(cache, FALSE);
+
+   key = postal_fp_cache_get_key(fingerprint);
+   bucket = postal_fp_cache_get_bucket(cache, now);
+   set = &cache->sets[fingerprint & cache->set_mask];
+
+   for (i = 0; i < POSTAL_FP_CACHE_WAYS; i++) {
+      entry = set->entries[i];
+
+      /*
+       * Empty and expired slots are equally good victims.
+       */
+      if (!entry ||
+          ((age = postal_fp_cache_get_age(entry, bucket)) >= cache->n_buckets)) {
+         if (victim_age < cache->n_buckets) {
+            victim = i;
+            victim_age = cache->n_buckets;
+         }
+         continue;
+      }
+
+      if ((entry & ~POSTAL_FP_CACHE_TAG_MASK) == key) {
+         return TRUE;
+      }
+
+      if (age >= victim_age) {
+         victim = i;
+         victim_age = age;
+      }
+   }
+
+   set->entries[victim] = key | bucket;
+
+   return FALSE;
+}
+
+/**
+ * postal_fp_cache_new:
+ * @n_entries: The minimum number of entries in the table.
+ * @bucket_size_sec: The number of seconds covered by each time bucket.
+ * @n_buckets: The number of buckets an entry lives for.
+ *
+ * Creates a new #PostalFpCache. Entries expire after roughly
+ * @bucket_size_sec * @n_buckets seconds. @n_entries is rounded up so
+ * that the number of sets is a power of two.
+ *
+ * Returns: (transfer full): A #PostalFpCache.
+ */
+PostalFpCache *
+postal_fp_cache_new (guint n_entries,
+                     guint bucket_size_sec,
+                     guint n_buckets)
+{
+   PostalFpCache *cache;
+   guint n_sets = 1;
+
+   g_return_val_if_fail(n_entries, NULL);
+   g_return_val_if_fail(bucket_size_sec, NULL);
+   g_return_val_if_fail(n_buckets, NULL);
+   g_return_val_if_fail(n_buckets <= POSTAL_FP_CACHE_TAG_MASK, NULL);
+
+   while ((n_sets * POSTAL_FP_CACHE_WAYS) < n_entries) {
+      g_return_val_if_fail(n_sets < (G_MAXUINT32 / POSTAL_FP_CACHE_LINE_SIZE / 2), NULL);
+      n_sets <<= 1;
+   }
+
+   cache = g_new0(PostalFpCache, 1);
+   cache->ref_count = 1;
+   cache->n_sets = n_sets;
+   cache->set_mask = n_sets - 1;
+   cache->n_buckets = n_buckets;
+   cache->bucket_usec = (gint64)bucket_size_sec * G_USEC_PER_SEC;
+
+   /*
+    * Align the sets to a cache line so that each probe touches exactly
+    * one line.
+    */
+   cache->allocated = g_malloc0((n_sets + 1) * POSTAL_FP_CACHE_LINE_SIZE);
+   cache->sets = (PostalFpCacheSet *)
+      (((gsize)cache->allocated + POSTAL_FP_CACHE_LINE_SIZE - 1) &
+       ~(gsize)(POSTAL_FP_CACHE_LINE_SIZE - 1));
+
+   return cache;
+}
+
+/**
+ * postal_fp_cache_ref:
+ * @cache: A #PostalFpCache.
+ *
+ * Increments the reference count of @cache by one.
+ *
+ * Returns: (transfer full): A #PostalFpCache.
+ */
+PostalFpCache *
+postal_fp_cache_ref (PostalFpCache *cache)
+{
+   g_return_val_if_fail(cache, NULL);
+   g_return_val_if_fail(cache->ref_count > 0, NULL);
+   g_atomic_int_inc(&cache->ref_count);
+   return cache;
+}
+
+/**
+ * postal_fp_cache_unref:
+ * @cache: A #PostalFpCache.
+ *
+ * Decrements the reference count of @cache by one. When the reference
+ * count reaches zero, the structure will be freed.
+ */
+void
+postal_fp_cache_unref (PostalFpCache *cache)
+{
+   g_return_if_fail(cache);
+   g_return_if_fail(cache->ref_count > 0);
+
+   if (g_atomic_int_dec_and_test(&cache->ref_count)) {
+      g_free(cache->allocated);
+      g_free(cache);
+   }
+}
+
+/**
+ * postal_fp_cache_get_type:
+ *
+ * Fetches the #GType for #PostalFpCache to be used with the GObject
+ * type system.
+ *
+ * Returns: The #GType for #PostalFpCache.
+ */
+GType
+postal_fp_cache_get_type (void)
+{
+   static volatile GType type_id;
+
+   if (g_once_init_enter(&type_id)) {
+      GType registered;
+      registered = g_boxed_type_register_static(
+            "PostalFpCache",
+            (GBoxedCopyFunc)postal_fp_cache_ref,
+            (GBoxedFreeFunc)postal_fp_cache_unref);
+      g_once_init_leave(&type_id, registered);
+   }
+
+   return type_id;
+}
@@ -0,0 +1,45 @@
+/* postal-fp-cache.h
+ *
+ * Copyright (C) 2012 Catch.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POSTAL_FP_CACHE_H
+#define POSTAL_FP_CACHE_H
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+typedef struct _PostalFpCache PostalFpCache;
+
+gboolean       postal_fp_cache_contains (PostalFpCache *cache,
+                                         guint64        fingerprint,
+                                         gint64         now);
+GType          postal_fp_cache_get_type (void) G_GNUC_CONST;
+guint64        postal_fp_cache_hash     (const gchar   *str1,
+                                         const gchar   *str2);
+gboolean       postal_fp_cache_insert   (PostalFpCache *cache,
+                                         guint64        fingerprint,
+                                         gint64         now);
+PostalFpCache *postal_fp_cache_new      (guint          n_entries,
+                                         guint          bucket_size_sec,
+                                         guint          n_buckets);
+PostalFpCache *postal_fp_cache_ref      (PostalFpCache *cache);
+void           postal_fp_cache_unref    (PostalFpCache *cache);
+
+G_END_DECLS
+
+#endif /* POSTAL_FP_CACHE_H */
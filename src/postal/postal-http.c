@@ -20,13 +20,16 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
 #include <glib/gi18n.h>
 #include <libsoup/soup.h>
 #include <json-glib/json-glib.h>
 #include <string.h>
+#include <sys/socket.h>
 
 #include "postal-debug.h"
 #include "postal-http.h"
+#include "postal-mailbox.h"
 #include "postal-metrics.h"
 #include "postal-service.h"
 
@@ -38,18 +41,91 @@
 #undef G_LOG_DOMAIN
 #define G_LOG_DOMAIN "http"
 
+/*
+ * Worker threads each listen on their own socket bound to the same port
+ * with SO_REUSEPORT, which requires soup_server_listen_socket().
+ */
+#if defined(SO_REUSEPORT) && defined(SOUP_CHECK_VERSION)
+#if SOUP_CHECK_VERSION(2, 48, 0)
+#define POSTAL_HTTP_HAVE_WORKERS 1
+#endif
+#endif
+
 G_DEFINE_TYPE(PostalHttp, postal_http, NEO_TYPE_SERVICE_BASE)
 
 struct _PostalHttpPrivate
 {
    gboolean       started;
    NeoLogger     *logger;
+   GMutex         logger_mutex;
    PostalMetrics *metrics;
    UrlRouter     *router;
    SoupServer    *server;
    PostalService *service;
+   GPtrArray     *workers;
 };
 
+/*
+ * A thread running its own SoupServer and GMainContext. Requests are
+ * parsed and answered on the worker while the calls into PostalService
+ * are submitted to the main context, with their results posted back to
+ * the worker's mailbox.
+ *
+ * in_flight counts the calls that have been submitted but not yet
+ * answered. Once stopping is set the worker refuses new requests, and
+ * stopped is set from the worker's own context so that every request
+ * routed before then has been counted.
+ */
+typedef struct
+{
+   PostalHttp    *http;
+   GThread       *thread;
+   GMainContext  *context;
+   GMainLoop     *main_loop;
+   PostalMailbox *mailbox;
+   GSocket       *socket;
+   SoupServer    *server;
+   volatile gint  in_flight;
+   volatile gint  stopping;
+   volatile gint  stopped;
+} PostalHttpWorker;
+
+typedef enum
+{
+   POSTAL_HTTP_CALL_ADD_DEVICE,
+   POSTAL_HTTP_CALL_FIND_DEVICE,
+   POSTAL_HTTP_CALL_FIND_DEVICES,
+   POSTAL_HTTP_CALL_NOTIFY,
+   POSTAL_HTTP_CALL_REMOVE_DEVICE,
+   POSTAL_HTTP_CALL_SET_USER_BADGE,
+} PostalHttpCallType;
+
+/*
+ * A call into PostalService on behalf of a SoupMessage. The arguments are
+ * owned by the call so that it can be run on another thread. callback
+ * receives the reference to message as its user data, like it would from
+ * calling PostalService directly.
+ */
+typedef struct
+{
+   PostalHttpCallType    type;
+   PostalService        *service;
+   PostalHttpWorker     *worker;
+   SoupMessage          *message;
+   GAsyncReadyCallback   callback;
+   GObject              *source;
+   GAsyncResult         *result;
+   gchar                *user;
+   gchar                *device_token;
+   PostalDevice         *device;
+   PostalNotification   *notification;
+   gchar               **users;
+   gchar               **device_tokens;
+   gsize                 offset;
+   gsize                 limit;
+   guint                 badge;
+} PostalHttpCall;
+
 PostalHttp *
 postal_http_new (void)
 {
@@ -73,6 +149,186 @@ get_int_param (GHashTable  *hashtable,
    return 0;
 }
 
+static PostalHttpCall *
+postal_http_call_new (PostalHttp          *http,
+                      SoupMessage         *message,
+                      PostalHttpCallType   type,
+                      GAsyncReadyCallback  callback)
+{
+   PostalHttpCall *call;
+
+   g_assert(POSTAL_IS_HTTP(http));
+   g_assert(SOUP_IS_MESSAGE(message));
+   g_assert(callback);
+
+   call = g_slice_new0(PostalHttpCall);
+   call->type = type;
+   call->service = http->priv->service;
+   call->worker = g_object_get_data(G_OBJECT(message), "worker");
+   call->message = g_object_ref(message);
+   call->callback = callback;
+
+   return call;
+}
+
+static void
+postal_http_call_free (PostalHttpCall *call)
+{
+   g_assert(call);
+
+   g_clear_object(&call->message);
+   g_clear_object(&call->source);
+   g_clear_object(&call->result);
+   g_clear_object(&call->device);
+   g_clear_object(&call->notification);
+   g_free(call->user);
+   g_free(call->device_token);
+   g_strfreev(call->users);
+   g_strfreev(call->device_tokens);
+   g_slice_free(PostalHttpCall, call);
+}
+
+static void
+postal_http_call_complete (gpointer data)
+{
+   PostalHttpCall *call = data;
+   SoupMessage *message;
+
+   g_assert(call);
+
+   /*
+    * The callback takes over our reference to the message.
+    */
+   message = call->message;
+   call->message = NULL;
+   call->callback(call->source, call->result, message);
+
+   /*
+    * A stopping worker is waited on from the main context, wake it up
+    * once the last call has been answered.
+    */
+   if (call->worker &&
+       g_atomic_int_dec_and_test(&call->worker->in_flight) &&
+       g_atomic_int_get(&call->worker->stopping)) {
+      g_main_context_wakeup(NULL);
+   }
+
+   postal_http_call_free(call);
+}
+
+static void
+postal_http_call_cb (GObject      *object,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+   PostalHttpCall *call = user_data;
+
+   g_assert(call);
+
+   call->source = g_object_ref(object);
+   call->result = g_object_ref(result);
+
+   /*
+    * The message belongs to the worker that received it, so the reply
+    * must be built there.
+    */
+   if (call->worker) {
+      postal_mailbox_post(call->worker->mailbox,
+                          postal_http_call_complete,
+                          call);
+   } else {
+      postal_http_call_complete(call);
+   }
+}
+
+static void
+postal_http_call_run (gpointer data)
+{
+   PostalHttpCall *call = data;
+
+   g_assert(call);
+
+   switch (call->type) {
+   case POSTAL_HTTP_CALL_ADD_DEVICE:
+      postal_service_add_device(call->service,
+                                call->device,
+                                NULL, /* TODO */
+                                postal_http_call_cb,
+                                call);
+      break;
+   case POSTAL_HTTP_CALL_FIND_DEVICE:
+      postal_service_find_device(call->service,
+                                 call->user,
+                                 call->device_token,
+                                 NULL, /* TODO */
+                                 postal_http_call_cb,
+                                 call);
+      break;
+   case POSTAL_HTTP_CALL_FIND_DEVICES:
+      postal_service_find_devices(call->service,
+                                  call->user,
+                                  call->offset,
+                                  call->limit,
+                                  NULL, /* TODO */
+                                  postal_http_call_cb,
+                                  call);
+      break;
+   case POSTAL_HTTP_CALL_NOTIFY:
+      postal_service_notify(call->service,
+                            call->notification,
+                            call->users,
+                            call->device_tokens,
+                            NULL, /* TODO: Cancellable/Timeout? */
+                            postal_http_call_cb,
+                            call);
+      break;
+   case POSTAL_HTTP_CALL_REMOVE_DEVICE:
+      postal_service_remove_device(call->service,
+                                   call->device,
+                                   NULL, /* TODO */
+                                   postal_http_call_cb,
+                                   call);
+      break;
+   case POSTAL_HTTP_CALL_SET_USER_BADGE:
+      postal_service_set_user_badge(call->service,
+                                    call->user,
+                                    call->badge,
+                                    NULL,
+                                    postal_http_call_cb,
+                                    call);
+      break;
+   default:
+      g_assert_not_reached();
+      break;
+   }
+}
+
+static void
+postal_http_call_submit (PostalHttpCall *call)
+{
+   g_assert(call);
+
+   if (call->worker) {
+      g_atomic_int_inc(&call->worker->in_flight);
+      postal_service_submit(call->service, postal_http_call_run, call);
+   } else {
+      postal_http_call_run(call);
+   }
+}
+
+static void
+postal_http_unpause (SoupMessage *message)
+{
+   SoupServer *server;
+
+   g_assert(SOUP_IS_MESSAGE(message));
+
+   server = g_object_get_data(G_OBJECT(message), "server");
+   g_assert(SOUP_IS_SERVER(server));
+
+   soup_server_unpause_message(server, message);
+}
+
 GQuark
 postal_json_error_quark (void)
 {
@@ -159,7 +415,7 @@ postal_http_reply_devices (PostalHttp  *http,
                              json_buf,
                              length);
    soup_message_set_status(message, status ?: SOUP_STATUS_OK);
-   soup_server_unpause_message(http->priv->server, message);
+   postal_http_unpause(message);
 }
 
 static guint
@@ -226,7 +482,7 @@ postal_http_reply_error (PostalHttp   *http,
                              json_buf,
                              length);
    soup_message_set_status(message, get_status_code(error));
-   soup_server_unpause_message(http->priv->server, message);
+   postal_http_unpause(message);
 }
 
 static void
@@ -235,7 +491,6 @@ postal_http_reply_device (PostalHttp   *http,
                           guint         status,
                           PostalDevice *device)
 {
-   PostalHttpPrivate *priv;
    JsonGenerator *g;
    JsonNode *node;
    GError *error = NULL;
@@ -248,11 +503,8 @@ postal_http_reply_device (PostalHttp   *http,
    g_assert(POSTAL_IS_DEVICE(device));
    g_assert(POSTAL_IS_HTTP(http));
 
-   priv = http->priv;
-
    if (!(node = postal_device_save_to_json(device, &error))) {
       postal_http_reply_error(http, message, error);
-      soup_server_unpause_message(priv->server, message);
       g_error_free(error);
       EXIT;
    }
@@ -270,7 +522,7 @@ postal_http_reply_device (PostalHttp   *http,
                                 length);
    }
    soup_message_set_status(message, status);
-   soup_server_unpause_message(priv->server, message);
+   postal_http_unpause(message);
    g_object_unref(g);
 
    EXIT;
@@ -335,7 +587,7 @@ postal_http_remove_device_cb (GObject      *object,
       soup_message_headers_append(message->response_headers,
                                   "Content-Type",
                                   "application/json");
-      soup_server_unpause_message(http->priv->server, message);
+      postal_http_unpause(message);
    }
 
 failure:
@@ -403,6 +655,7 @@ postal_http_handle_v1_users_user_devices_device (UrlRouter         *router,
                                                  SoupClientContext *client,
                                                  gpointer           user_data)
 {
+   PostalHttpCall *call;
    PostalDevice *pdev;
    const gchar *user;
    const gchar *device;
@@ -426,26 +679,24 @@ postal_http_handle_v1_users_user_devices_device (UrlRouter         *router,
    user = g_hash_table_lookup(params, "user");
 
    if (message->method == SOUP_METHOD_GET) {
-      postal_service_find_device(http->priv->service,
-                                 user,
-                                 device,
-                                 NULL, /* TODO */
-                                 postal_http_find_device_cb,
-                                 g_object_ref(message));
+      call = postal_http_call_new(http, message,
+                                  POSTAL_HTTP_CALL_FIND_DEVICE,
+                                  postal_http_find_device_cb);
+      call->user = g_strdup(user);
+      call->device_token = g_strdup(device);
+      postal_http_call_submit(call);
       soup_server_pause_message(server, message);
       EXIT;
    } else if (message->method == SOUP_METHOD_DELETE) {
-      pdev = g_object_new(POSTAL_TYPE_DEVICE,
-                          "device-token", device,
-                          "user", user,
-                          NULL);
-      postal_service_remove_device(http->priv->service,
-                                   pdev,
-                                   NULL, /* TODO */
-                                   postal_http_remove_device_cb,
-                                   g_object_ref(message));
+      call = postal_http_call_new(http, message,
+                                  POSTAL_HTTP_CALL_REMOVE_DEVICE,
+                                  postal_http_remove_device_cb);
+      call->device = g_object_new(POSTAL_TYPE_DEVICE,
+                                  "device-token", device,
+                                  "user", user,
+                                  NULL);
+      postal_http_call_submit(call);
       soup_server_pause_message(server, message);
-      g_object_unref(pdev);
       EXIT;
    } else if (message->method == SOUP_METHOD_PUT) {
       if (!(node = postal_http_parse_body(message, &error))) {
@@ -470,13 +721,12 @@ postal_http_handle_v1_users_user_devices_device (UrlRouter         *router,
                              "device",
                              g_object_ref(pdev),
                              g_object_unref);
-      postal_service_add_device(http->priv->service,
-                                pdev,
-                                NULL, /* TODO */
-                                postal_http_add_device_cb,
-                                g_object_ref(message));
+      call = postal_http_call_new(http, message,
+                                  POSTAL_HTTP_CALL_ADD_DEVICE,
+                                  postal_http_add_device_cb);
+      call->device = pdev;
+      postal_http_call_submit(call);
       soup_server_pause_message(server, message);
-      g_object_unref(pdev);
       EXIT;
    } else {
       soup_message_set_status(message, SOUP_STATUS_METHOD_NOT_ALLOWED);
@@ -530,6 +780,7 @@ postal_http_handle_v1_users_user_devices (UrlRouter         *router,
                                           SoupClientContext *client,
                                           gpointer           user_data)
 {
+   PostalHttpCall *call;
    const gchar *user;
    PostalHttp *http = user_data;
 
@@ -548,18 +799,18 @@ postal_http_handle_v1_users_user_devices (UrlRouter         *router,
    soup_server_pause_message(server, message);
 
    if (message->method == SOUP_METHOD_GET) {
-      postal_service_find_devices(http->priv->service,
-                                  user,
-                                  get_int_param(query, "offset"),
-                                  get_int_param(query, "limit"),
-                                  NULL, /* TODO */
-                                  devices_get_cb,
-                                  g_object_ref(message));
+      call = postal_http_call_new(http, message,
+                                  POSTAL_HTTP_CALL_FIND_DEVICES,
+                                  devices_get_cb);
+      call->user = g_strdup(user);
+      call->offset = get_int_param(query, "offset");
+      call->limit = get_int_param(query, "limit");
+      postal_http_call_submit(call);
       EXIT;
    }
 
    soup_message_set_status(message, SOUP_STATUS_METHOD_NOT_ALLOWED);
-   soup_server_unpause_message(server, message);
+   postal_http_unpause(message);
 
    EXIT;
 }
@@ -588,7 +839,7 @@ postal_http_set_user_badge_cb (GObject      *object,
    }
 
    soup_message_set_status(message, SOUP_STATUS_OK);
-   soup_server_unpause_message(http->priv->server, message);
+   postal_http_unpause(message);
    g_object_unref(message);
 
    EXIT;
@@ -604,11 +855,11 @@ postal_http_handle_v1_users_user_badge (UrlRouter         *router,
                                         SoupClientContext *client,
                                         gpointer           user_data)
 {
+   PostalHttpCall *call;
    const gchar *user;
    PostalHttp *http = user_data;
    JsonNode *node = NULL;
    GError *error = NULL;
-   guint badge;
 
    ENTRY;
 
@@ -634,15 +885,14 @@ postal_http_handle_v1_users_user_badge (UrlRouter         *router,
          postal_http_reply_error(http, message, error);
          GOTO(cleanup);
       }
-      badge = json_node_get_int(node);
-      g_object_set_data(G_OBJECT(message), "http", http);
-      postal_service_set_user_badge(http->priv->service,
-                                    user,
-                                    badge,
-                                    NULL,
-                                    postal_http_set_user_badge_cb,
-                                    g_object_ref(message));
+      call = postal_http_call_new(http, message,
+                                  POSTAL_HTTP_CALL_SET_USER_BADGE,
+                                  postal_http_set_user_badge_cb);
+      call->user = g_strdup(user);
+      call->badge = json_node_get_int(node);
+      postal_http_call_submit(call);
       soup_server_pause_message(server, message);
+      json_node_free(node);
       EXIT;
    }
 
@@ -682,7 +932,7 @@ postal_http_notify_cb (GObject      *object,
    }
 
    soup_message_set_status(message, SOUP_STATUS_OK);
-   soup_server_unpause_message(http->priv->server, message);
+   postal_http_unpause(message);
    soup_message_headers_append(message->response_headers,
                                "Content-Type",
                                "application/json");
@@ -702,6 +952,7 @@ postal_http_handle_v1_notify (UrlRouter         *router,
                               gpointer           user_data)
 {
    PostalNotification *notif;
+   PostalHttpCall *call;
    const gchar *collapse_key = NULL;
    const gchar *str;
    PostalHttp *http = user_data;
@@ -803,18 +1054,17 @@ postal_http_handle_v1_notify (UrlRouter         *router,
    }
    g_ptr_array_add(devices_ptr, NULL);
 
-   postal_service_notify(http->priv->service,
-                         notif,
-                         (gchar **)users_ptr->pdata,
-                         (gchar **)devices_ptr->pdata,
-                         NULL, /* TODO: Cancellable/Timeout? */
-                         postal_http_notify_cb,
-                         g_object_ref(message));
+   call = postal_http_call_new(http, message,
+                               POSTAL_HTTP_CALL_NOTIFY,
+                               postal_http_notify_cb);
+   call->notification = notif;
+   call->users = g_strdupv((gchar **)users_ptr->pdata);
+   call->device_tokens = g_strdupv((gchar **)devices_ptr->pdata);
+   postal_http_call_submit(call);
 
    g_ptr_array_unref(devices_ptr);
    g_ptr_array_unref(users_ptr);
    json_node_free(node);
-   g_object_unref(notif);
 }
 
 static void
@@ -876,6 +1126,11 @@ postal_http_log_message (PostalHttp        *http,
                                referrer,
                                user_agent);
 
+   /*
+    * Requests finish on every worker thread but the logger is not
+    * thread-safe.
+    */
+   g_mutex_lock(&http->priv->logger_mutex);
    neo_logger_log(http->priv->logger,
                   &event_time,
                   NULL,
@@ -885,6 +1140,7 @@ postal_http_log_message (PostalHttp        *http,
                   0,
                   NULL,
                   formatted);
+   g_mutex_unlock(&http->priv->logger_mutex);
 
    g_free(epath);
    g_free(referrer);
@@ -974,6 +1230,7 @@ postal_http_router (SoupServer        *server,
                           "http",
                           g_object_ref(http),
                           g_object_unref);
+   g_object_set_data(G_OBJECT(message), "server", server);
 
    if (!url_router_route(priv->router, server, message, path, query, client)) {
       soup_message_set_status(message, SOUP_STATUS_NOT_FOUND);
@@ -982,6 +1239,29 @@ postal_http_router (SoupServer        *server,
    EXIT;
 }
 
+#ifdef POSTAL_HTTP_HAVE_WORKERS
+static void
+postal_http_worker_router (SoupServer        *server,
+                           SoupMessage       *message,
+                           const gchar       *path,
+                           GHashTable        *query,
+                           SoupClientContext *client,
+                           gpointer           user_data)
+{
+   PostalHttpWorker *worker = user_data;
+
+   g_assert(worker);
+
+   if (g_atomic_int_get(&worker->stopping)) {
+      soup_message_set_status(message, SOUP_STATUS_SERVICE_UNAVAILABLE);
+      return;
+   }
+
+   g_object_set_data(G_OBJECT(message), "worker", worker);
+   postal_http_router(server, message, path, query, client, worker->http);
+}
+#endif
+
 static void
 postal_http_request_finished (SoupServer        *server,
                               SoupMessage       *message,
@@ -1000,6 +1280,175 @@ postal_http_request_finished (SoupServer        *server,
    }
 }
 
+#ifdef POSTAL_HTTP_HAVE_WORKERS
+static GSocket *
+postal_http_socket_new (guint    port,
+                        GError **error)
+{
+   GSocketAddress *address;
+   GInetAddress *any;
+   GSocket *socket;
+   gboolean ret;
+   gint on = 1;
+
+   ENTRY;
+
+   socket = g_socket_new(G_SOCKET_FAMILY_IPV4,
+                         G_SOCKET_TYPE_STREAM,
+                         G_SOCKET_PROTOCOL_TCP,
+                         error);
+   if (!socket) {
+      RETURN(NULL);
+   }
+
+   if (setsockopt(g_socket_get_fd(socket), SOL_SOCKET, SO_REUSEPORT,
+                  &on, sizeof on) != 0) {
+      g_set_error(error,
+                  G_IO_ERROR,
+                  g_io_error_from_errno(errno),
+                  "%s", g_strerror(errno));
+      g_object_unref(socket);
+      RETURN(NULL);
+   }
+
+   any = g_inet_address_new_any(G_SOCKET_FAMILY_IPV4);
+   address = g_inet_socket_address_new(any, port);
+   ret = (g_socket_bind(socket, address, TRUE, error) &&
+          g_socket_listen(socket, error));
+   g_object_unref(address);
+   g_object_unref(any);
+
+   if (!ret) {
+      g_object_unref(socket);
+      RETURN(NULL);
+   }
+
+   RETURN(socket);
+}
+
+static gpointer
+postal_http_worker_thread (gpointer data)
+{
+   PostalHttpWorker *worker = data;
+
+   g_assert(worker);
+
+   g_main_context_push_thread_default(worker->context);
+   g_main_loop_run(worker->main_loop);
+
+   soup_server_disconnect(worker->server);
+   g_main_context_pop_thread_default(worker->context);
+
+   return NULL;
+}
+
+static PostalHttpWorker *
+postal_http_worker_new (PostalHttp  *http,
+                        guint        port,
+                        gboolean     logging,
+                        GError     **error)
+{
+   PostalHttpWorker *worker;
+   GSocket *socket;
+   gboolean ret;
+
+   ENTRY;
+
+   g_assert(POSTAL_IS_HTTP(http));
+
+   if (!(socket = postal_http_socket_new(port, error))) {
+      RETURN(NULL);
+   }
+
+   worker = g_slice_new0(PostalHttpWorker);
+   worker->http = http;
+   worker->socket = socket;
+   worker->context = g_main_context_new();
+   worker->main_loop = g_main_loop_new(worker->context, FALSE);
+   worker->mailbox = postal_mailbox_new(worker->context);
+   worker->server = soup_server_new(SOUP_SERVER_SERVER_HEADER, "Postal/"VERSION,
+                                    NULL);
+
+   if (logging) {
+      g_signal_connect(worker->server,
+                       "request-finished",
+                       G_CALLBACK(postal_http_request_finished),
+                       http);
+   }
+
+   soup_server_add_handler(worker->server,
+                           NULL,
+                           postal_http_worker_router,
+                           worker,
+                           NULL);
+
+   /*
+    * The listener attaches to the thread-default context, so do it for
+    * the worker's context here where a failure can still be reported.
+    */
+   g_main_context_push_thread_default(worker->context);
+   ret = soup_server_listen_socket(worker->server, worker->socket, 0, error);
+   g_main_context_pop_thread_default(worker->context);
+
+   if (!ret) {
+      g_object_unref(worker->server);
+      g_object_unref(worker->socket);
+      postal_mailbox_unref(worker->mailbox);
+      g_main_loop_unref(worker->main_loop);
+      g_main_context_unref(worker->context);
+      g_slice_free(PostalHttpWorker, worker);
+      RETURN(NULL);
+   }
+
+   worker->thread = g_thread_new("http-worker",
+                                 postal_http_worker_thread,
+                                 worker);
+
+   RETURN(worker);
+}
+
+static void
+postal_http_worker_stopped (gpointer data)
+{
+   PostalHttpWorker *worker = data;
+
+   g_assert(worker);
+
+   g_atomic_int_set(&worker->stopped, TRUE);
+   g_main_context_wakeup(NULL);
+}
+
+static void
+postal_http_worker_free (gpointer data)
+{
+   PostalHttpWorker *worker = data;
+
+   g_assert(worker);
+
+   /*
+    * Calls in flight are run on this context and post their replies to
+    * the worker's mailbox. Keep both running until every call has been
+    * answered, so that none of them outlive the worker.
+    */
+   g_atomic_int_set(&worker->stopping, TRUE);
+   postal_mailbox_post(worker->mailbox, postal_http_worker_stopped, worker);
+   while (!g_atomic_int_get(&worker->stopped) ||
+          g_atomic_int_get(&worker->in_flight)) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+
+   g_main_loop_quit(worker->main_loop);
+   g_thread_join(worker->thread);
+
+   g_object_unref(worker->server);
+   g_object_unref(worker->socket);
+   postal_mailbox_unref(worker->mailbox);
+   g_main_loop_unref(worker->main_loop);
+   g_main_context_unref(worker->context);
+   g_slice_free(PostalHttpWorker, worker);
+}
+#endif
+
 static void
 postal_http_start (NeoServiceBase *base,
                    GKeyFile       *config)
@@ -1008,7 +1457,13 @@ postal_http_start (NeoServiceBase *base,
    NeoService *peer;
    gboolean nologging = FALSE;
    gchar *logfile = NULL;
+   guint workers = 0;
    guint port = 0;
+#ifdef POSTAL_HTTP_HAVE_WORKERS
+   PostalHttpWorker *worker;
+   GError *error = NULL;
+   guint i;
+#endif
 
    ENTRY;
 
@@ -1020,6 +1475,7 @@ postal_http_start (NeoServiceBase *base,
       port = g_key_file_get_integer(config, "http", "port", NULL);
       logfile = g_key_file_get_string(config, "http", "logfile", NULL);
       nologging = g_key_file_get_boolean(config, "http", "nologging", NULL);
+      workers = g_key_file_get_integer(config, "http", "workers", NULL);
    }
 
    if (!(peer = neo_service_get_peer(NEO_SERVICE(base), "metrics"))) {
@@ -1036,13 +1492,46 @@ postal_http_start (NeoServiceBase *base,
    g_assert(POSTAL_IS_SERVICE(peer));
    priv->service = g_object_ref(peer);
 
+   if (!nologging) {
+      logfile = logfile ?: g_strdup("postal.log");
+      priv->logger = neo_logger_daily_new(logfile);
+   }
+
+#ifdef POSTAL_HTTP_HAVE_WORKERS
+   if (workers) {
+      priv->workers = g_ptr_array_new_with_free_func(postal_http_worker_free);
+      for (i = 0; i < workers; i++) {
+         if (!(worker = postal_http_worker_new(POSTAL_HTTP(base),
+                                               port ?: 5300,
+                                               !nologging,
+                                               &error))) {
+            break;
+         }
+         g_ptr_array_add(priv->workers, worker);
+      }
+      if (!error) {
+         g_free(logfile);
+         EXIT;
+      }
+      g_warning("Failed to start HTTP worker: %s. "
+                "Serving requests from the main loop.",
+                error->message);
+      g_error_free(error);
+      g_ptr_array_unref(priv->workers);
+      priv->workers = NULL;
+   }
+#else
+   if (workers) {
+      g_warning("HTTP workers require libsoup 2.48 and SO_REUSEPORT. "
+                "Serving requests from the main loop.");
+   }
+#endif
+
    priv->server = soup_server_new(SOUP_SERVER_PORT, port ?: 5300,
                                   SOUP_SERVER_SERVER_HEADER, "Postal/"VERSION,
                                   NULL);
 
    if (!nologging) {
-      logfile = logfile ?: g_strdup("postal.log");
-      priv->logger = neo_logger_daily_new(logfile);
       g_signal_connect(priv->server,
                        "request-finished",
                        G_CALLBACK(postal_http_request_finished),
@@ -1079,6 +1568,11 @@ postal_http_stop (NeoServiceBase *base)
       g_clear_object(&priv->server);
    }
 
+   if (priv->workers) {
+      g_ptr_array_unref(priv->workers);
+      priv->workers = NULL;
+   }
+
    EXIT;
 }
 
@@ -1091,6 +1585,7 @@ postal_http_finalize (GObject *object)
 
    g_clear_object(&priv->logger);
    g_clear_object(&priv->server);
+   g_mutex_clear(&priv->logger_mutex);
 
    url_router_free(priv->router);
    priv->router = NULL;
@@ -1121,6 +1616,7 @@ postal_http_init (PostalHttp *http)
                                   POSTAL_TYPE_HTTP,
                                   PostalHttpPrivate);
 
+   g_mutex_init(&http->priv->logger_mutex);
    http->priv->router = url_router_new();
    url_router_add_handler(http->priv->router,
                           "/status",
@@ -0,0 +1,215 @@
+/* postal-mailbox.c
+ *
+ * Copyright (C) 2012 Catch.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "postal-mailbox.h"
+
+/**
+ * SECTION:postal-mailbox
+ * @title: PostalMailbox
+ * @short_description: Lock-free hand-off of work to a main context.
+ *
+ * #PostalMailbox lets any thread queue a function to be run on a
+ * particular #GMainContext. It is used to pass requests between the HTTP
+ * worker threads and the thread running #PostalService.
+ *
+ * Posting pushes onto an atomic singly-linked stack. Only the post that
+ * finds the stack empty attaches an idle source to wake the context,
+ * which then takes the whole stack in one exchange and runs it in the
+ * order it was posted. A burst of posts therefore costs a single wakeup.
+ */
+
+typedef struct _PostalMailboxItem PostalMailboxItem;
+
+struct _PostalMailboxItem
+{
+   PostalMailboxItem *next;
+   PostalMailboxFunc  func;
+   gpointer           data;
+};
+
+struct _PostalMailbox
+{
+   volatile gint      ref_count;
+   GMainContext      *context;
+   PostalMailboxItem *head;
+};
+
+static gboolean
+postal_mailbox_dispatch (gpointer user_data)
+{
+   PostalMailbox *mailbox = user_data;
+   PostalMailboxItem *items;
+   PostalMailboxItem *item;
+   PostalMailboxItem *fifo = NULL;
+
+   g_assert(mailbox);
+
+   do {
+      items = g_atomic_pointer_get(&mailbox->head);
+   } while (!g_atomic_pointer_compare_and_exchange(&mailbox->head,
+                                                   items,
+                                                   NULL));
+
+   /*
+    * The stack is newest first, reverse it to run in posted order.
+    */
+   while ((item = items)) {
+      items = item->next;
+      item->next = fifo;
+      fifo = item;
+   }
+
+   while ((item = fifo)) {
+      fifo = item->next;
+      item->func(item->data);
+      g_slice_free(PostalMailboxItem, item);
+   }
+
+   return FALSE;
+}
+
+/**
+ * postal_mailbox_post:
+ * @mailbox: A #PostalMailbox.
+ * @func: A #PostalMailboxFunc.
+ * @data: User data for @func.
+ *
+ * Queues @func to be called with @data on the main context of @mailbox.
+ * This function is thread-safe.
+ */
+void
+postal_mailbox_post (PostalMailbox     *mailbox,
+                     PostalMailboxFunc  func,
+                     gpointer           data)
+{
+   PostalMailboxItem *item;
+   PostalMailboxItem *head;
+   GSource *source;
+
+   g_return_if_fail(mailbox);
+   g_return_if_fail(func);
+
+   item = g_slice_new(PostalMailboxItem);
+   item->func = func;
+   item->data = data;
+
+   do {
+      head = g_atomic_pointer_get(&mailbox->head);
+      item->next = head;
+   } while (!g_atomic_pointer_compare_and_exchange(&mailbox->head,
+                                                   head,
+                                                   item));
+
+   /*
+    * If the stack was not empty, a wakeup is already pending and will
+    * pick up this item as well.
+    */
+   if (!head) {
+      source = g_idle_source_new();
+      g_source_set_priority(source, G_PRIORITY_DEFAULT);
+      g_source_set_callback(source,
+                            postal_mailbox_dispatch,
+                            postal_mailbox_ref(mailbox),
+                            (GDestroyNotify)postal_mailbox_unref);
+      g_source_attach(source, mailbox->context);
+      g_source_unref(source);
+   }
+}
+
+/**
+ * postal_mailbox_new:
+ * @context: (allow-none): A #GMainContext or %NULL for the default.
+ *
+ * Creates a new #PostalMailbox whose posted functions run on @context.
+ *
+ * Returns: (transfer full): A newly allocated #PostalMailbox.
+ */
+PostalMailbox *
+postal_mailbox_new (GMainContext *context)
+{
+   PostalMailbox *mailbox;
+
+   mailbox = g_slice_new0(PostalMailbox);
+   mailbox->ref_count = 1;
+   mailbox->context = g_main_context_ref(context ?: g_main_context_default());
+
+   return mailbox;
+}
+
+/**
+ * postal_mailbox_ref:
+ * @mailbox: A #PostalMailbox.
+ *
+ * Increments the reference count of @mailbox by one.
+ *
+ * Returns: (transfer full): A #PostalMailbox.
+ */
+PostalMailbox *
+postal_mailbox_ref (PostalMailbox *mailbox)
+{
+   g_return_val_if_fail(mailbox, NULL);
+   g_return_val_if_fail(mailbox->ref_count > 0, NULL);
+   g_atomic_int_inc(&mailbox->ref_count);
+   return mailbox;
+}
+
+/**
+ * postal_mailbox_unref:
+ * @mailbox: A #PostalMailbox.
+ *
+ * Decrements the reference count of @mailbox by one. When the reference
+ * count reaches zero, the structure will be freed. Since a pending wakeup
+ * holds a reference, nothing that was posted is dropped.
+ */
+void
+postal_mailbox_unref (PostalMailbox *mailbox)
+{
+   g_return_if_fail(mailbox);
+   g_return_if_fail(mailbox->ref_count > 0);
+
+   if (g_atomic_int_dec_and_test(&mailbox->ref_count)) {
+      g_assert(!mailbox->head);
+      g_main_context_unref(mailbox->context);
+      g_slice_free(PostalMailbox, mailbox);
+   }
+}
+
+/**
+ * postal_mailbox_get_type:
+ *
+ * Fetches the #GType for #PostalMailbox to be used with the GObject
+ * type system.
+ *
+ * Returns: The #GType for #PostalMailbox.
+ */
+GType
+postal_mailbox_get_type (void)
+{
+   static volatile GType type_id;
+
+   if (g_once_init_enter(&type_id)) {
+      GType registered;
+      registered = g_boxed_type_register_static(
+            "PostalMailbox",
+            (GBoxedCopyFunc)postal_mailbox_ref,
+            (GBoxedFreeFunc)postal_mailbox_unref);
+      g_once_init_leave(&type_id, registered);
+   }
+
+   return type_id;
+}
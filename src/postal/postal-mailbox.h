@@ -0,0 +1,40 @@
+/* postal-mailbox.h
+ *
+ * Copyright (C) 2012 Catch.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POSTAL_MAILBOX_H
+#define POSTAL_MAILBOX_H
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+typedef struct _PostalMailbox PostalMailbox;
+
+typedef void (*PostalMailboxFunc) (gpointer data);
+
+GType          postal_mailbox_get_type (void) G_GNUC_CONST;
+PostalMailbox *postal_mailbox_new      (GMainContext      *context);
+void           postal_mailbox_post     (PostalMailbox     *mailbox,
+                                        PostalMailboxFunc  func,
+                                        gpointer           data);
+PostalMailbox *postal_mailbox_ref      (PostalMailbox     *mailbox);
+void           postal_mailbox_unref    (PostalMailbox     *mailbox);
+
+G_END_DECLS
+
+#endif /* POSTAL_MAILBOX_H */
@@ -103,18 +103,18 @@ postal_metrics_device_updated (PostalMetrics *metrics,
 }
 
 void
-postal_metrics_device_notified (PostalMetrics *metrics,
-                                PostalDevice  *device)
+postal_metrics_device_notified (PostalMetrics    *metrics,
+                                PostalDeviceType  device_type,
+                                const gchar      *device_token,
+                                const gchar      *user)
 {
    PostalMetricsPrivate *priv;
-   PostalDeviceType device_type;
 
    g_return_if_fail(POSTAL_IS_METRICS(metrics));
+   g_return_if_fail(device_token);
 
    priv = metrics->priv;
 
-   device_type = postal_device_get_device_type(device);
-
    switch (device_type) {
    case POSTAL_DEVICE_APS:
       __sync_fetch_and_add(&priv->aps_notified, 1);
@@ -130,7 +130,10 @@ postal_metrics_device_notified (PostalMetrics *metrics,
    }
 
 #ifdef ENABLE_REDIS
-   postal_redis_device_notified(metrics->priv->redis, device);
+   postal_redis_device_notified(metrics->priv->redis,
+                                device_type,
+                                device_token,
+                                user);
 #endif
 }
 
@@ -166,6 +169,16 @@ postal_metrics_finalize (GObject *object)
    G_OBJECT_CLASS(postal_metrics_parent_class)->finalize(object);
 }
 
+static inline guint64
+postal_metrics_read (guint64 *counter)
+{
+   /*
+    * HTTP workers read the counters from other threads. Read atomically
+    * so that a 64-bit counter is never torn on 32-bit platforms.
+    */
+   return __sync_add_and_fetch(counter, 0);
+}
+
 static void
 postal_metrics_get_property (GObject    *object,
                              guint       prop_id,
@@ -176,22 +189,22 @@ postal_metrics_get_property (GObject    *object,
 
    switch (prop_id) {
    case PROP_APS_NOTIFIED:
-      g_value_set_uint64(value, metrics->priv->aps_notified);
+      g_value_set_uint64(value, postal_metrics_read(&metrics->priv->aps_notified));
       break;
    case PROP_C2DM_NOTIFIED:
-      g_value_set_uint64(value, metrics->priv->c2dm_notified);
+      g_value_set_uint64(value, postal_metrics_read(&metrics->priv->c2dm_notified));
       break;
    case PROP_DEVICES_ADDED:
-      g_value_set_uint64(value, metrics->priv->devices_added);
+      g_value_set_uint64(value, postal_metrics_read(&metrics->priv->devices_added));
       break;
    case PROP_DEVICES_REMOVED:
-      g_value_set_uint64(value, metrics->priv->devices_removed);
+      g_value_set_uint64(value, postal_metrics_read(&metrics->priv->devices_removed));
       break;
    case PROP_DEVICES_UPDATED:
-      g_value_set_uint64(value, metrics->priv->devices_updated);
+      g_value_set_uint64(value, postal_metrics_read(&metrics->priv->devices_updated));
       break;
    case PROP_GCM_NOTIFIED:
-      g_value_set_uint64(value, metrics->priv->gcm_notified);
+      g_value_set_uint64(value, postal_metrics_read(&metrics->priv->gcm_notified));
       break;
    default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
@@ -61,8 +61,10 @@ void           postal_metrics_device_removed  (PostalMetrics *metrics,
                                                PostalDevice  *device);
 void           postal_metrics_device_updated  (PostalMetrics *metrics,
                                                PostalDevice  *device);
-void           postal_metrics_device_notified (PostalMetrics *metrics,
-                                               PostalDevice  *device);
+void           postal_metrics_device_notified (PostalMetrics    *metrics,
+                                               PostalDeviceType  device_type,
+                                               const gchar      *device_token,
+                                               const gchar      *user);
 
 G_END_DECLS
 
@@ -150,22 +150,16 @@ postal_redis_stop (NeoServiceBase *service)
 }
 
 static gchar *
-postal_redis_build_message (PostalDevice *device,
-                            const gchar  *action)
+postal_redis_format_message (const gchar      *action,
+                             PostalDeviceType  device_type,
+                             const gchar      *device_token,
+                             const gchar      *user)
 {
-   PostalDeviceType device_type;
    const gchar *device_type_str;
-   const gchar *device_token;
-   const gchar *user;
    gchar *ret;
 
-   g_assert(POSTAL_IS_DEVICE(device));
    g_assert(action);
 
-   device_type = postal_device_get_device_type(device);
-   device_token = postal_device_get_device_token(device);
-   user = postal_device_get_user(device);
-
    switch (device_type) {
    case POSTAL_DEVICE_APS:
       device_type_str = "aps";
@@ -195,6 +189,19 @@ postal_redis_build_message (PostalDevice *device,
    return ret;
 }
 
+static gchar *
+postal_redis_build_message (PostalDevice *device,
+                            const gchar  *action)
+{
+   g_assert(POSTAL_IS_DEVICE(device));
+   g_assert(action);
+
+   return postal_redis_format_message(action,
+                                      postal_device_get_device_type(device),
+                                      postal_device_get_device_token(device),
+                                      postal_device_get_user(device));
+}
+
 static void
 postal_redis_publish_cb (GObject      *object,
                          GAsyncResult *result,
@@ -301,8 +308,10 @@ postal_redis_device_updated (PostalRedis  *redis,
 }
 
 void
-postal_redis_device_notified (PostalRedis  *redis,
-                              PostalDevice *device)
+postal_redis_device_notified (PostalRedis      *redis,
+                              PostalDeviceType  device_type,
+                              const gchar      *device_token,
+                              const gchar      *user)
 {
    PostalRedisPrivate *priv;
    gchar *message = NULL;
@@ -310,12 +319,15 @@ postal_redis_device_notified (PostalRedis  *redis,
    ENTRY;
 
    g_return_if_fail(POSTAL_IS_REDIS(redis));
-   g_return_if_fail(POSTAL_IS_DEVICE(device));
+   g_return_if_fail(device_token);
 
    priv = redis->priv;
 
    if (priv->redis) {
-      message = postal_redis_build_message(device, "device-notified");
+      message = postal_redis_format_message("device-notified",
+                                            device_type,
+                                            device_token,
+                                            user);
       redis_client_publish_async(priv->redis,
                                  priv->channel,
                                  message,
@@ -57,8 +57,10 @@ void         postal_redis_device_removed  (PostalRedis  *redis,
                                            PostalDevice *device);
 void         postal_redis_device_updated  (PostalRedis  *redis,
                                            PostalDevice *device);
-void         postal_redis_device_notified (PostalRedis  *redis,
-                                           PostalDevice *device);
+void         postal_redis_device_notified (PostalRedis      *redis,
+                                           PostalDeviceType  device_type,
+                                           const gchar      *device_token,
+                                           const gchar      *user);
 PostalRedis *postal_redis_new             (void);
 
 
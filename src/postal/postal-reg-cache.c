@@ -0,0 +1,370 @@
+/* postal-reg-cache.c
+ *
+ * Copyright (C) 2012 Catch.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "postal-fp-cache.h"
+#include "postal-reg-cache.h"
+
+/**
+ * SECTION:postal-reg-cache
+ * @title: PostalRegCache
+ * @short_description: Cache of recently registered devices
+ *
+ * #PostalRegCache remembers the devices that were recently written to
+ * the data store, keyed by user, device type and device token. Each entry
+ * holds a hash of the document that was written along with the creation
+ * time of the device, so that a registration of an unchanged document can
+ * be answered without another round trip.
+ *
+ * Entries expire after a fixed time so that changes made by other
+ * processes are eventually written over. Like #PostalFpCache, the table
+ * is set-associative and never allocates after creation.
+ */
+
+#ifndef POSTAL_REG_CACHE_WAYS
+#define POSTAL_REG_CACHE_WAYS 4
+#endif
+
+typedef struct
+{
+   guint64 key;
+   guint64 token_hash;
+   guint64 doc_hash;
+   gint64  created_at;
+   gint64  expires_at;
+} PostalRegCacheEntry;
+
+typedef struct
+{
+   PostalRegCacheEntry entries[POSTAL_REG_CACHE_WAYS];
+} PostalRegCacheSet;
+
+struct _PostalRegCache
+{
+   gint               ref_count;
+   guint              n_sets;
+   guint              set_mask;
+   gint64             ttl_usec;
+   PostalRegCacheSet *sets;
+};
+
+static guint64
+postal_reg_cache_get_key (const gchar      *user,
+                          PostalDeviceType  device_type,
+                          const gchar      *device_token)
+{
+   guint64 key;
+
+   key = postal_fp_cache_hash(user, device_token);
+   key ^= (guint64)device_type * G_GUINT64_CONSTANT(0x9e3779b97f4a7c15);
+
+   /*
+    * A key of zero denotes an empty slot.
+    */
+   return key ? key : 1;
+}
+
+static guint64
+postal_reg_cache_hash_doc (const MongoBson *doc)
+{
+   guint64 h = G_GUINT64_CONSTANT(0xcbf29ce484222325);
+   guint i;
+
+   for (i = 0; i < doc->len; i++) {
+      h = (h ^ doc->data[i]) * G_GUINT64_CONSTANT(0x100000001b3);
+   }
+
+   return h;
+}
+
+static PostalRegCacheEntry *
+postal_reg_cache_find (PostalRegCache *cache,
+                       guint64         key)
+{
+   PostalRegCacheSet *set;
+   guint i;
+
+   set = &cache->sets[key & cache->set_mask];
+
+   for (i = 0; i < POSTAL_REG_CACHE_WAYS; i++) {
+      if (set->entries[i].key == key) {
+         return &set->entries[i];
+      }
+   }
+
+   return NULL;
+}
+
+/**
+ * postal_reg_cache_insert:
+ * @cache: A #PostalRegCache.
+ * @user: The user owning the device.
+ * @device_type: The #PostalDeviceType of the device.
+ * @device_token: The device token.
+ * @doc: The document that was written for the device.
+ * @created_at: The creation time of the device.
+ * @now: The current monotonic time in microseconds.
+ *
+ * Records that @doc was written for the device. Any previous entry for
+ * the device is replaced. If the set is full, the entry closest to
+ * expiring is replaced.
+ */
+void
+postal_reg_cache_insert (PostalRegCache   *cache,
+                         const gchar      *user,
+                         PostalDeviceType  device_type,
+                         const gchar      *device_token,
+                         const MongoBson  *doc,
+                         const GTimeVal   *created_at,
+                         gint64            now)
+{
+   PostalRegCacheEntry *entry;
+   PostalRegCacheSet *set;
+   guint64 key;
+   guint i;
+
+   g_return_if_fail(cache);
+   g_return_if_fail(user);
+   g_return_if_fail(device_token);
+   g_return_if_fail(doc);
+   g_return_if_fail(created_at);
+
+   key = postal_reg_cache_get_key(user, device_type, device_token);
+
+   if (!(entry = postal_reg_cache_find(cache, key))) {
+      set = &cache->sets[key & cache->set_mask];
+      entry = &set->entries[0];
+      for (i = 1; i < POSTAL_REG_CACHE_WAYS; i++) {
+         if (set->entries[i].expires_at < entry->expires_at) {
+            entry = &set->entries[i];
+         }
+      }
+   }
+
+   entry->key = key;
+   entry->token_hash = postal_fp_cache_hash(device_token, NULL);
+   entry->doc_hash = postal_reg_cache_hash_doc(doc);
+   entry->created_at = ((gint64)created_at->tv_sec * G_USEC_PER_SEC) +
+                       created_at->tv_usec;
+   entry->expires_at = now + cache->ttl_usec;
+}
+
+/**
+ * postal_reg_cache_lookup:
+ * @cache: A #PostalRegCache.
+ * @user: The user owning the device.
+ * @device_type: The #PostalDeviceType of the device.
+ * @device_token: The device token.
+ * @doc: The document to be written for the device.
+ * @now: The current monotonic time in microseconds.
+ * @created_at: (out): A location for the creation time of the device.
+ *
+ * Checks to see if @doc is the same document that was last written for
+ * the device, within the lifetime of the entry.
+ *
+ * Returns: %TRUE if @doc is unchanged and @created_at was set.
+ */
+gboolean
+postal_reg_cache_lookup (PostalRegCache   *cache,
+                         const gchar      *user,
+                         PostalDeviceType  device_type,
+                         const gchar      *device_token,
+                         const MongoBson  *doc,
+                         gint64            now,
+                         GTimeVal         *created_at)
+{
+   PostalRegCacheEntry *entry;
+
+   g_return_val_if_fail(cache, FALSE);
+   g_return_val_if_fail(user, FALSE);
+   g_return_val_if_fail(device_token, FALSE);
+   g_return_val_if_fail(doc, FALSE);
+   g_return_val_if_fail(created_at, FALSE);
+
+   entry = postal_reg_cache_find(cache,
+                                 postal_reg_cache_get_key(user,
+                                                          device_type,
+                                                          device_token));
+   if (!entry || (entry->expires_at <= now)) {
+      return FALSE;
+   }
+
+   if (entry->doc_hash != postal_reg_cache_hash_doc(doc)) {
+      return FALSE;
+   }
+
+   created_at->tv_sec = entry->created_at / G_USEC_PER_SEC;
+   created_at->tv_usec = entry->created_at % G_USEC_PER_SEC;
+
+   return TRUE;
+}
+
+/**
+ * postal_reg_cache_remove:
+ * @cache: A #PostalRegCache.
+ * @user: (allow-none): The user owning the device, or %NULL.
+ * @device_token: The device token.
+ *
+ * Forgets the devices matching @device_token. If @user is %NULL, the
+ * devices of every user with @device_token are forgotten, which requires
+ * a scan of the table.
+ *
+ * Returns: The number of entries removed.
+ */
+guint
+postal_reg_cache_remove (PostalRegCache *cache,
+                         const gchar    *user,
+                         const gchar    *device_token)
+{
+   PostalRegCacheEntry *entry;
+   PostalDeviceType device_type;
+   guint64 token_hash;
+   guint ret = 0;
+   guint i;
+   guint j;
+
+   g_return_val_if_fail(cache, 0);
+   g_return_val_if_fail(device_token, 0);
+
+   if (user) {
+      for (device_type = POSTAL_DEVICE_APS;
+           device_type <= POSTAL_DEVICE_GCM;
+           device_type++) {
+         entry = postal_reg_cache_find(cache,
+                                       postal_reg_cache_get_key(user,
+                                                                device_type,
+                                                                device_token));
+         if (entry) {
+            memset(entry, 0, sizeof *entry);
+            ret++;
+         }
+      }
+      return ret;
+   }
+
+   token_hash = postal_fp_cache_hash(device_token, NULL);
+
+   for (i = 0; i < cache->n_sets; i++) {
+      for (j = 0; j < POSTAL_REG_CACHE_WAYS; j++) {
+         entry = &cache->sets[i].entries[j];
+         if (entry->key && (entry->token_hash == token_hash)) {
+            memset(entry, 0, sizeof *entry);
+            ret++;
+         }
+      }
+   }
+
+   return ret;
+}
+
+/**
+ * postal_reg_cache_new:
+ * @n_entries: The minimum number of entries in the table.
+ * @ttl_sec: The number of seconds an entry lives for.
+ *
+ * Creates a new #PostalRegCache. @n_entries is rounded up so that the
+ * number of sets is a power of two.
+ *
+ * Returns: (transfer full): A #PostalRegCache.
+ */
+PostalRegCache *
+postal_reg_cache_new (guint n_entries,
+                      guint ttl_sec)
+{
+   PostalRegCache *cache;
+   guint n_sets = 1;
+
+   g_return_val_if_fail(n_entries, NULL);
+   g_return_val_if_fail(ttl_sec, NULL);
+
+   while ((n_sets * POSTAL_REG_CACHE_WAYS) < n_entries) {
+      g_return_val_if_fail(n_sets < (G_MAXUINT32 / sizeof(PostalRegCacheSet) / 2), NULL);
+      n_sets <<= 1;
+   }
+
+   cache = g_new0(PostalRegCache, 1);
+   cache->ref_count = 1;
+   cache->n_sets = n_sets;
+   cache->set_mask = n_sets - 1;
+   cache->ttl_usec = (gint64)ttl_sec * G_USEC_PER_SEC;
+   cache->sets = g_new0(PostalRegCacheSet, n_sets);
+
+   return cache;
+}
+
+/**
+ * postal_reg_cache_ref:
+ * @cache: A #PostalRegCache.
+ *
+ * Increments the reference count of @cache by one.
+ *
+ * Returns: (transfer full): A #PostalRegCache.
+ */
+PostalRegCache *
+postal_reg_cache_ref (PostalRegCache *cache)
+{
+   g_return_val_if_fail(cache, NULL);
+   g_return_val_if_fail(cache->ref_count > 0, NULL);
+   g_atomic_int_inc(&cache->ref_count);
+   return cache;
+}
+
+/**
+ * postal_reg_cache_unref:
+ * @cache: A #PostalRegCache.
+ *
+ * Decrements the reference count of @cache by one. When the reference
+ * count reaches zero, the structure will be freed.
+ */
+void
+postal_reg_cache_unref (PostalRegCache *cache)
+{
+   g_return_if_fail(cache);
+   g_return_if_fail(cache->ref_count > 0);
+
+   if (g_atomic_int_dec_and_test(&cache->ref_count)) {
+      g_free(cache->sets);
+      g_free(cache);
+   }
+}
+
+/**
+ * postal_reg_cache_get_type:
+ *
+ * Fetches the #GType for #PostalRegCache to be used with the GObject
+ * type system.
+ *
+ * Returns: The #GType for #PostalRegCache.
+ */
+GType
+postal_reg_cache_get_type (void)
+{
+   static volatile GType type_id;
+
+   if (g_once_init_enter(&type_id)) {
+      GType registered;
+      registered = g_boxed_type_register_static(
+            "PostalRegCache",
+            (GBoxedCopyFunc)postal_reg_cache_ref,
+            (GBoxedFreeFunc)postal_reg_cache_unref);
+      g_once_init_leave(&type_id, registered);
+   }
+
+   return type_id;
+}
@@ -0,0 +1,56 @@
+/* postal-reg-cache.h
+ *
+ * Copyright (C) 2012 Catch.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POSTAL_REG_CACHE_H
+#define POSTAL_REG_CACHE_H
+
+#include <glib-object.h>
+#include <mongo-glib.h>
+
+#include "postal-device.h"
+
+G_BEGIN_DECLS
+
+typedef struct _PostalRegCache PostalRegCache;
+
+GType           postal_reg_cache_get_type (void) G_GNUC_CONST;
+void            postal_reg_cache_insert   (PostalRegCache   *cache,
+                                           const gchar      *user,
+                                           PostalDeviceType  device_type,
+                                           const gchar      *device_token,
+                                           const MongoBson  *doc,
+                                           const GTimeVal   *created_at,
+                                           gint64            now);
+gboolean        postal_reg_cache_lookup   (PostalRegCache   *cache,
+                                           const gchar      *user,
+                                           PostalDeviceType  device_type,
+                                           const gchar      *device_token,
+                                           const MongoBson  *doc,
+                                           gint64            now,
+                                           GTimeVal         *created_at);
+PostalRegCache *postal_reg_cache_new      (guint             n_entries,
+                                           guint             ttl_sec);
+PostalRegCache *postal_reg_cache_ref      (PostalRegCache   *cache);
+guint           postal_reg_cache_remove   (PostalRegCache   *cache,
+                                           const gchar      *user,
+                                           const gchar      *device_token);
+void            postal_reg_cache_unref    (PostalRegCache   *cache);
+
+G_END_DECLS
+
+#endif /* POSTAL_REG_CACHE_H */
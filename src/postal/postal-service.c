@@ -22,10 +22,14 @@
 
 #include <glib/gi18n.h>
 #include <push-glib.h>
+#include <string.h>
 
 #include "postal-debug.h"
-#include "postal-dm-cache.h"
+#include "postal-device-index.h"
+#include "postal-fp-cache.h"
+#include "postal-mailbox.h"
 #include "postal-metrics.h"
+#include "postal-reg-cache.h"
 #include "postal-service.h"
 
 #undef G_LOG_DOMAIN
@@ -39,10 +43,51 @@
 #define POSTAL_SERVICE_DM_CACHE_ENTRIES 16384
 #endif
 
+#define POSTAL_SERVICE_DM_CACHE_SIZE \
+   (POSTAL_SERVICE_DM_CACHES * POSTAL_SERVICE_DM_CACHE_ENTRIES)
+
 #ifndef POSTAL_SERVICE_BUCKET_SIZE_SEC
 #define POSTAL_SERVICE_BUCKET_SIZE_SEC 10
 #endif
 
+#ifndef POSTAL_SERVICE_NOTIFY_BATCH_SIZE
+#define POSTAL_SERVICE_NOTIFY_BATCH_SIZE 1000
+#endif
+
+#ifndef POSTAL_SERVICE_NOTIFY_MAX_IN_FLIGHT
+#define POSTAL_SERVICE_NOTIFY_MAX_IN_FLIGHT 10000
+#endif
+
+#ifndef POSTAL_SERVICE_CURSOR_PREFETCH
+#define POSTAL_SERVICE_CURSOR_PREFETCH 1
+#endif
+
+#ifndef POSTAL_SERVICE_GCM_CONNECTIONS
+#define POSTAL_SERVICE_GCM_CONNECTIONS 4
+#endif
+
+#ifndef POSTAL_SERVICE_OPLOG_RETRY_SEC
+#define POSTAL_SERVICE_OPLOG_RETRY_SEC 1
+#endif
+
+#ifndef POSTAL_SERVICE_SNAPSHOT_INTERVAL_SEC
+#define POSTAL_SERVICE_SNAPSHOT_INTERVAL_SEC 300
+#endif
+
+#ifndef POSTAL_SERVICE_REGISTER_WINDOW_MSEC
+#define POSTAL_SERVICE_REGISTER_WINDOW_MSEC 50
+#endif
+
+#ifndef POSTAL_SERVICE_REG_CACHE_ENTRIES
+#define POSTAL_SERVICE_REG_CACHE_ENTRIES 65536
+#endif
+
+#ifndef POSTAL_SERVICE_REG_CACHE_TTL_SEC
+#define POSTAL_SERVICE_REG_CACHE_TTL_SEC 3600
+#endif
+
+#define POSTAL_SERVICE_OPLOG "local.oplog.rs"
+
 G_DEFINE_TYPE(PostalService, postal_service, NEO_TYPE_SERVICE_BASE)
 
 struct _PostalServicePrivate
@@ -56,10 +101,101 @@ struct _PostalServicePrivate
    gchar            *collection;
    PostalMetrics    *metrics;
    MongoConnection  *mongo;
-   PostalDmCache   **caches;
-   guint             n_caches;
+   MongoWriteConcern *unacknowledged;
+   PostalFpCache    *dedup;
+   PostalRegCache   *registered;
+   GHashTable       *registrations;
+   PostalMailbox    *mailbox;
+   guint             notify_batch_size;
+   guint             notify_max_in_flight;
+   PostalDeviceIndex *index;
+   GCancellable     *index_cancellable;
+   gboolean          index_loaded;
+   guint32           oplog_time;
+   guint32           oplog_increment;
+   guint64           oplog_cursor;
+   guint             oplog_retry;
+   gchar            *snapshot_path;
+   guint             snapshot_interval;
+   guint             snapshot_source;
+   GBytes           *snapshot_bytes;
 };
 
+/*
+ * State for streaming a notification to every device matched by the
+ * notify query. Documents are delivered in batches from a MongoCursor and
+ * their tokens collected per push client, which are handed to the client
+ * as a single batch delivery. Each outstanding batch holds a reference so
+ * that we can pause the cursor when too many deliveries are in flight and
+ * resume it once they drain.
+ *
+ * When the device index is loaded, the matching devices are resolved up
+ * front into handles and walked in place of the cursor.
+ */
+typedef struct
+{
+   volatile gint       ref_count;
+   PostalService      *service;
+   PostalNotification *notification;
+   MongoCursor        *cursor;
+   GArray             *handles;
+   guint               next_handle;
+   GSimpleAsyncResult *simple;
+   PushApsMessage     *aps_message;
+   PushC2dmMessage    *c2dm_message;
+   PushGcmMessage     *gcm_message;
+   GArray             *aps_tokens;
+   GArray             *c2dm_tokens;
+   GArray             *gcm_tokens;
+   guint               in_flight;
+   gboolean            paused;
+   gint64              now;
+} Fanout;
+
+/*
+ * A device registration waiting to be written. Registrations of the same
+ * user and device token within POSTAL_SERVICE_REGISTER_WINDOW_MSEC are
+ * written as a single upsert of the most recent document, after which
+ * every waiting request is completed.
+ */
+typedef struct
+{
+   PostalService *service;
+   gchar         *key;
+   PostalDevice  *device;
+   MongoBson     *doc;
+   GPtrArray     *waiters;
+   guint          source;
+   gboolean       superseded;
+} Registration;
+
+/*
+ * A batch delivery of a Fanout. The tokens are kept so that failures,
+ * which refer to the tokens by index, can be logged.
+ */
+typedef struct
+{
+   Fanout *fanout;
+   GArray *tokens;
+} FanoutBatch;
+
+/*
+ * The fields of a device needed to deliver a notification. The strings
+ * point into the document the device was decoded from.
+ */
+typedef struct
+{
+   PostalDeviceType  device_type;
+   const gchar      *device_token;
+   const gchar      *user;
+   guint             badge;
+   gchar             user_buf[25];
+   gchar             token_buf[POSTAL_DEVICE_APS_TOKEN_SIZE * 2 + 1];
+} FanoutDevice;
+
+typedef void (*FanoutDeviceField) (FanoutDevice  *device,
+                                   MongoBsonIter *iter);
+
 PostalService *
 postal_service_new (void)
 {
@@ -70,115 +206,119 @@ postal_service_new (void)
 
 static gboolean
 postal_service_should_ignore (PostalService      *service,
-                              PostalDevice       *device,
-                              PostalNotification *notif)
+                              const gchar        *device_token,
+                              PostalNotification *notif,
+                              gint64              now)
 {
    PostalServicePrivate *priv;
    const gchar *collapse;
+   guint64 fingerprint;
    gboolean ret;
-   guint i;
-   guint idx;
-   guint oldest;
-   gchar *key;
 
    ENTRY;
 
    g_return_val_if_fail(POSTAL_IS_SERVICE(service), FALSE);
-   g_return_val_if_fail(POSTAL_IS_DEVICE(device), FALSE);
+   g_return_val_if_fail(device_token, FALSE);
    g_return_val_if_fail(POSTAL_IS_NOTIFICATION(notif), FALSE);
 
    priv = service->priv;
 
-   /*
-    * TODO: Some of this could be optimized fairly easily. Like doing the
-    *       hash once and performing a lookup using that.
-    *       Additionally, the call to g_get_monotonic_time() for each
-    *       message that is getting checked. Perhaps we could have an
-    *       input parameter for that.
-    */
-
    /*
     * Never ignore messages with a NULL collapse_key.
     */
    if (!(collapse = postal_notification_get_collapse_key(notif))) {
-      return FALSE;
+      RETURN(FALSE);
    }
 
    /*
-    * Build our collapse key for this device:message pair.
+    * Fingerprint the device:collapse_key pair and insert it into the
+    * dedup table. If it was already there within the window, this is
+    * a duplicate message.
     */
-   key = g_strdup_printf("%s:%s",
-                         postal_device_get_device_token(device),
-                         collapse);
+   fingerprint = postal_fp_cache_hash(device_token, collapse);
+   ret = postal_fp_cache_insert(priv->dedup, fingerprint, now);
 
-   /*
-    * Figure out the bucket for our active cache.
-    */
-   idx = (g_get_monotonic_time() / G_USEC_PER_SEC / POSTAL_SERVICE_BUCKET_SIZE_SEC) % priv->n_caches;
-   oldest = (idx + 1) % priv->n_caches;
+   RETURN(ret);
+}
 
-   /*
-    * Cleanup the oldest cache.
-    */
-   if (!postal_dm_cache_is_empty(priv->caches[oldest])) {
-      postal_dm_cache_remove_all(priv->caches[oldest]);
-   }
+/*
+ * Appends a match on @device_token to the query @q. APS tokens are stored
+ * packed, but documents written before that still hold hex strings, so
+ * APS tokens match either form.
+ */
+static void
+postal_service_append_token (MongoBson   *q,
+                             const gchar *device_token)
+{
+   guint8 packed[POSTAL_DEVICE_APS_TOKEN_SIZE];
+   guint field;
+   guint in;
 
-   /*
-    * See if any of the recent caches have this item.
-    */
-   for (i = 0; i < priv->n_caches; i++) {
-      if ((ret = postal_dm_cache_contains(priv->caches[i], key))) {
-         g_free(key);
-         RETURN(TRUE);
-      }
+   if (!postal_device_aps_token_pack(device_token, packed)) {
+      mongo_bson_append_string(q, "device_token", device_token);
+      return;
    }
 
-   /*
-    * Insert the key into the current cache.
-    */
-   ret = postal_dm_cache_insert(priv->caches[idx], key);
-   RETURN(ret);
+   field = mongo_bson_append_document_begin(q, "device_token");
+   in = mongo_bson_append_array_begin(q, "$in");
+   mongo_bson_append_binary(q, "0", 0, packed, sizeof packed);
+   mongo_bson_append_string(q, "1", device_token);
+   mongo_bson_append_array_end(q, in);
+   mongo_bson_append_document_end(q, field);
 }
 
 static void
-postal_service_add_device_cb (GObject      *object,
-                              GAsyncResult *result,
-                              gpointer      user_data)
+registration_free (Registration *reg)
 {
-   GSimpleAsyncResult *simple = user_data;
-   MongoMessageReply *reply = NULL;
+   g_object_unref(reg->service);
+   g_object_unref(reg->device);
+   mongo_bson_unref(reg->doc);
+   g_ptr_array_unref(reg->waiters);
+   g_free(reg->key);
+   g_slice_free(Registration, reg);
+}
+
+static void
+registration_flush_cb (GObject      *object,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+   GSimpleAsyncResult *simple;
+   MongoMessageReply *reply;
    MongoConnection *connection = (MongoConnection *)object;
+   PostalServicePrivate *priv;
+   Registration *reg = user_data;
+   MongoBsonIter iter;
+   MongoBsonIter citer;
+   MongoObjectId *oid = NULL;
+   PostalDevice *device;
+   MongoBson *bson;
+   gboolean updated_existing = FALSE;
    GError *error = NULL;
+   GTimeVal tv = { 0 };
+   GList *list;
+   guint i;
 
    ENTRY;
 
    g_assert(MONGO_IS_CONNECTION(connection));
    g_assert(G_IS_ASYNC_RESULT(result));
-   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+   g_assert(reg);
 
-   if (!(reply = mongo_connection_query_finish(connection, result, &error))) {
-      g_simple_async_result_take_error(simple, error);
-      GOTO(failure);
-   } else {
-      PostalService *service;
-      MongoBsonIter iter;
-      MongoBsonIter citer;
-      PostalDevice *device;
-      MongoBson *bson = NULL;
-      MongoBson *value;
-      gboolean updated_existing;
-      GList *list;
-
-      device = POSTAL_DEVICE(g_object_get_data(G_OBJECT(simple), "device"));
-      service = POSTAL_SERVICE(g_async_result_get_source_object(G_ASYNC_RESULT(simple)));
-      updated_existing = FALSE;
+   priv = reg->service->priv;
 
-      if (!(list = mongo_message_reply_get_documents(reply))) {
-         g_object_unref(reply);
-         GOTO(failure);
+   if (!(reply = mongo_connection_query_finish(connection, result, &error))) {
+      for (i = 0; i < reg->waiters->len; i++) {
+         simple = g_ptr_array_index(reg->waiters, i);
+         g_simple_async_result_set_from_error(simple, error);
+         g_simple_async_result_complete_in_idle(simple);
       }
+      g_error_free(error);
+      registration_free(reg);
+      EXIT;
+   }
 
+   if ((list = mongo_message_reply_get_documents(reply))) {
       bson = list->data;
 
       if (mongo_bson_iter_init_find(&iter, bson, "lastErrorObject") &&
@@ -187,108 +327,104 @@ postal_service_add_device_cb (GObject      *object,
           mongo_bson_iter_find(&citer, "updatedExisting") &&
           MONGO_BSON_ITER_HOLDS_BOOLEAN(&citer)) {
          updated_existing = mongo_bson_iter_get_value_boolean(&citer);
-         g_object_set_data(G_OBJECT(simple),
-                           "updated-existing",
-                           GINT_TO_POINTER(updated_existing));
       }
 
+      /*
+       * Only the _id is returned. The rest of the device is the document
+       * that we just wrote.
+       */
       if (mongo_bson_iter_init_find(&iter, bson, "value") &&
           MONGO_BSON_ITER_HOLDS_DOCUMENT(&iter) &&
-          (value = mongo_bson_iter_get_value_bson(&iter))) {
-         if (!postal_device_load_from_bson(device, value, &error)) {
-            mongo_bson_unref(value);
-            g_object_unref(reply);
-            GOTO(failure);
-         }
-         mongo_bson_unref(value);
+          mongo_bson_iter_recurse(&iter, &citer) &&
+          mongo_bson_iter_find(&citer, "_id") &&
+          MONGO_BSON_ITER_HOLDS_OBJECT_ID(&citer)) {
+         oid = mongo_bson_iter_get_value_object_id(&citer);
+         mongo_object_id_get_timeval(oid, &tv);
       }
+   }
 
-      if (service->priv->metrics) {
-         if (updated_existing) {
-            postal_metrics_device_added(service->priv->metrics, device);
-         } else {
-            postal_metrics_device_updated(service->priv->metrics, device);
-         }
+   if (oid) {
+      if (priv->index) {
+         bson = mongo_bson_dup(reg->doc);
+         mongo_bson_append_object_id(bson, "_id", oid);
+         postal_device_index_insert(priv->index, bson);
+         mongo_bson_unref(bson);
+      }
+      if (priv->registered && !reg->superseded) {
+         postal_reg_cache_insert(priv->registered,
+                                 postal_device_get_user(reg->device),
+                                 postal_device_get_device_type(reg->device),
+                                 postal_device_get_device_token(reg->device),
+                                 reg->doc,
+                                 &tv,
+                                 g_get_monotonic_time());
+      }
+      mongo_object_id_free(oid);
+   }
+
+   if (priv->metrics) {
+      if (updated_existing) {
+         postal_metrics_device_added(priv->metrics, reg->device);
+      } else {
+         postal_metrics_device_updated(priv->metrics, reg->device);
       }
+   }
 
-      g_object_unref(reply);
-      g_object_unref(service);
+   for (i = 0; i < reg->waiters->len; i++) {
+      simple = g_ptr_array_index(reg->waiters, i);
+      device = g_object_get_data(G_OBJECT(simple), "device");
+      if (tv.tv_sec) {
+         postal_device_set_created_at(device, &tv);
+      }
+      g_object_set_data(G_OBJECT(simple),
+                        "updated-existing",
+                        GINT_TO_POINTER(updated_existing));
+      g_simple_async_result_set_op_res_gboolean(simple, TRUE);
+      g_simple_async_result_complete_in_idle(simple);
    }
 
-failure:
-   g_simple_async_result_set_op_res_gboolean(simple, !!reply);
-   g_simple_async_result_complete_in_idle(simple);
-   g_object_unref(simple);
+   g_object_unref(reply);
+   registration_free(reg);
 
    EXIT;
 }
 
-/**
- * postal_service_add_device:
- * @service: (in): A #PostalService.
- * @device: (in): A #PostalDevice.
- * @cancellable: (in) (allow-none): A #GCancellable or %NULL.
- * @callback: (in): A callback to execute upon completion.
- * @user_data: (in): User data for @callback.
- *
- * Asynchronously adds @device to the configured data store. @callback
- * must call postal_service_add_device_finish() to complete the asynchronous
- * request.
+/*
+ * Writes the most recent document of @reg with a single upsert. Only the
+ * _id of the device is returned.
  */
-void
-postal_service_add_device (PostalService       *service,
-                           PostalDevice        *device,
-                           GCancellable        *cancellable,
-                           GAsyncReadyCallback  callback,
-                           gpointer             user_data)
+static void
+registration_flush (Registration *reg)
 {
    PostalServicePrivate *priv;
-   GSimpleAsyncResult *simple;
    MongoObjectId *oid;
    MongoBsonIter iter;
-   MongoBson *bson;
    MongoBson *cmd;
+   MongoBson *fields;
    MongoBson *q;
    MongoBson *set;
-   GError *error = NULL;
 
    ENTRY;
 
-   g_return_if_fail(POSTAL_IS_SERVICE(service));
-   g_return_if_fail(POSTAL_IS_DEVICE(device));
-   g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
-   g_return_if_fail(callback);
+   g_assert(reg);
 
-   priv = service->priv;
-
-   /*
-    * Serialize the device to a BSON document.
-    */
-   if (!(bson = postal_device_save_to_bson(device, &error))) {
-      g_simple_async_report_take_gerror_in_idle(G_OBJECT(service),
-                                                callback,
-                                                user_data,
-                                                error);
-      EXIT;
-   }
+   priv = reg->service->priv;
 
-   /*
-    * Make sure we have a removed_at field for querying active devices.
-    */
-   if (!mongo_bson_iter_init_find(&iter, bson, "removed_at")) {
-      mongo_bson_append_null(bson, "removed_at");
+   g_hash_table_remove(priv->registrations, reg->key);
+   if (reg->source) {
+      g_source_remove(reg->source);
+      reg->source = 0;
    }
 
    set = mongo_bson_new_empty();
-   mongo_bson_append_bson(set, "$set", bson);
+   mongo_bson_append_bson(set, "$set", reg->doc);
 
    /*
     * Build query so we can upsert the previous item if it exists.
     */
    q = mongo_bson_new_empty();
-   mongo_bson_append_string(q, "device_token",
-                            postal_device_get_device_token(device));
-   if (mongo_bson_iter_init_find(&iter, bson, "user")) {
+   postal_service_append_token(q, postal_device_get_device_token(reg->device));
+   if (mongo_bson_iter_init_find(&iter, reg->doc, "user")) {
       if (mongo_bson_iter_get_value_type(&iter) == MONGO_BSON_OBJECT_ID) {
          oid = mongo_bson_iter_get_value_object_id(&iter);
          mongo_bson_append_object_id(q, "user", oid);
@@ -301,24 +437,20 @@ postal_service_add_device (PostalService       *service,
       }
    }
 
+   fields = mongo_bson_new_empty();
+   mongo_bson_append_int(fields, "_id", 1);
+
    cmd = mongo_bson_new_empty();
    mongo_bson_append_string(cmd, "findAndModify", priv->collection);
    mongo_bson_append_bson(cmd, "query", q);
    mongo_bson_append_bson(cmd, "update", set);
+   mongo_bson_append_bson(cmd, "fields", fields);
    mongo_bson_append_boolean(cmd, "new", TRUE);
    mongo_bson_append_boolean(cmd, "upsert", TRUE);
 
    /*
     * Asynchronously upsert the document to Mongo.
     */
-   simple = g_simple_async_result_new(G_OBJECT(service), callback, user_data,
-                                      postal_service_add_device);
-   g_simple_async_result_set_check_cancellable(simple, cancellable);
-   g_object_set_data_full(G_OBJECT(simple),
-                          "device",
-                          g_object_ref(device),
-                          g_object_unref);
-
    mongo_connection_query_async(priv->mongo,
                                 priv->db_and_cmd,
                                 MONGO_QUERY_EXHAUST,
@@ -327,119 +459,333 @@ postal_service_add_device (PostalService       *service,
                                 cmd,
                                 NULL,
                                 NULL, /* TODO: */
-                                postal_service_add_device_cb,
-                                simple);
+                                registration_flush_cb,
+                                reg);
 
    mongo_bson_unref(cmd);
-   mongo_bson_unref(bson);
+   mongo_bson_unref(fields);
    mongo_bson_unref(q);
    mongo_bson_unref(set);
 
    EXIT;
 }
 
-/**
- * postal_service_add_device_finish:
- * @service: (in): A #PostalService.
- * @result: (in): A #GAsyncResult.
- * @updated_existing: (out) (allow-none): A location for a #gboolean.
- * @error: (out): A location for a #GError, or %NULL.
- *
- * Completes an asynchronous request to postal_service_add_device().
- *
- * If an existing device was updated, then @updated_existing is set to %TRUE.
- *
- * Returns: %TRUE if successful; otherwise %FALSE and @error is set.
- */
-gboolean
-postal_service_add_device_finish (PostalService  *service,
-                                  GAsyncResult   *result,
-                                  gboolean       *updated_existing,
-                                  GError        **error)
+static gboolean
+registration_timeout (gpointer user_data)
 {
-   GSimpleAsyncResult *simple = (GSimpleAsyncResult *)result;
-   gboolean ret;
+   Registration *reg = user_data;
 
-   ENTRY;
+   reg->source = 0;
+   registration_flush(reg);
 
-   g_return_val_if_fail(POSTAL_IS_SERVICE(service), FALSE);
-   g_return_val_if_fail(G_IS_SIMPLE_ASYNC_RESULT(simple), FALSE);
+   return FALSE;
+}
 
-   if (!(ret = g_simple_async_result_get_op_res_gboolean(simple))) {
-      g_simple_async_result_propagate_error(simple, error);
-   }
+/*
+ * Writes any registration of @user's device @device_token that is still
+ * waiting, so that it is ordered before a following write to the device.
+ * That write supersedes the document, so it is not added to the
+ * registration cache once written.
+ */
+static void
+postal_service_flush_registration (PostalService *service,
+                                   const gchar   *user,
+                                   const gchar   *device_token)
+{
+   Registration *reg;
+   gchar *key;
 
-   if (updated_existing) {
-      *updated_existing =
-            GPOINTER_TO_INT(g_object_get_data(G_OBJECT(result),
-                                              "updated-existing"));
+   key = g_strdup_printf("%s:%s", user, device_token);
+   if ((reg = g_hash_table_lookup(service->priv->registrations, key))) {
+      reg->superseded = TRUE;
+      registration_flush(reg);
    }
-
-   RETURN(ret);
+   g_free(key);
 }
 
-static void
-postal_service_remove_device_cb (GObject      *object,
-                                 GAsyncResult *result,
-                                 gpointer      user_data)
+/*
+ * Checks the device index, when it is loaded, to see if @device is still
+ * active. A device that is not is also dropped from the registration
+ * cache, since it was removed behind the cache's back.
+ */
+static gboolean
+postal_service_device_is_active (PostalService *service,
+                                 PostalDevice  *device)
 {
-   GSimpleAsyncResult *simple = user_data;
-   MongoConnection *connection = (MongoConnection *)object;
-   gboolean ret;
-   GError *error = NULL;
+   PostalServicePrivate *priv;
+   const gchar *device_token;
+   const gchar *user;
 
-   ENTRY;
+   g_assert(POSTAL_IS_SERVICE(service));
+   g_assert(POSTAL_IS_DEVICE(device));
 
-   g_assert(MONGO_IS_CONNECTION(connection));
-   g_assert(G_IS_ASYNC_RESULT(result));
-   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+   priv = service->priv;
 
-   if (!(ret = mongo_connection_update_finish(connection,
-                                              result,
-                                              NULL,
-                                              &error))) {
-      g_simple_async_result_take_error(simple, error);
-   } else {
-      PostalService *service;
-      PostalDevice *device;
+   if (!priv->index_loaded) {
+      return TRUE;
+   }
 
-      device = POSTAL_DEVICE(g_object_get_data(G_OBJECT(simple), "device"));
-      service = POSTAL_SERVICE(g_async_result_get_source_object(G_ASYNC_RESULT(simple)));
-      if (service->priv->metrics) {
-         postal_metrics_device_removed(service->priv->metrics, device);
-      }
-      g_object_unref(service);
+   user = postal_device_get_user(device);
+   device_token = postal_device_get_device_token(device);
+
+   if (postal_device_index_is_active(priv->index,
+                                     postal_device_index_find(priv->index,
+                                                              user,
+                                                              device_token))) {
+      return TRUE;
    }
 
-   g_simple_async_result_set_op_res_gboolean(simple, ret);
-   g_simple_async_result_complete_in_idle(simple);
-   g_object_unref(simple);
+   postal_reg_cache_remove(priv->registered, user, device_token);
 
-   EXIT;
+   return FALSE;
 }
 
 /**
- * postal_service_remove_device:
+ * postal_service_add_device:
  * @service: (in): A #PostalService.
  * @device: (in): A #PostalDevice.
  * @cancellable: (in) (allow-none): A #GCancellable or %NULL.
  * @callback: (in): A callback to execute upon completion.
- * @user_data: (in): User data for callback.
+ * @user_data: (in): User data for @callback.
  *
- * Removes a device from the underlying storage (MongoDB). @callback will
- * be executed upon completion of the request on the applications main
- * thread. @callback MUST call postal_service_remove_device_finish()
- * to complete the request.
+ * Asynchronously adds @device to the configured data store. @callback
+ * must call postal_service_add_device_finish() to complete the asynchronous
+ * request.
+ *
+ * If the same document was recently written for the device, the request
+ * completes without touching the data store. Otherwise, registrations of
+ * the device within a short window are written with a single upsert.
  */
 void
-postal_service_remove_device (PostalService       *service,
-                              PostalDevice        *device,
-                              GCancellable        *cancellable,
-                              GAsyncReadyCallback  callback,
-                              gpointer             user_data)
-{
-   PostalServicePrivate *priv;
-   GSimpleAsyncResult *simple;
+postal_service_add_device (PostalService       *service,
+                           PostalDevice        *device,
+                           GCancellable        *cancellable,
+                           GAsyncReadyCallback  callback,
+                           gpointer             user_data)
+{
+   PostalServicePrivate *priv;
+   GSimpleAsyncResult *simple;
+   Registration *reg;
+   MongoBsonIter iter;
+   MongoBson *bson;
+   GError *error = NULL;
+   GTimeVal tv;
+   gchar *key;
+
+   ENTRY;
+
+   g_return_if_fail(POSTAL_IS_SERVICE(service));
+   g_return_if_fail(POSTAL_IS_DEVICE(device));
+   g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
+   g_return_if_fail(callback);
+
+   priv = service->priv;
+
+   /*
+    * Serialize the device to a BSON document.
+    */
+   if (!(bson = postal_device_save_to_bson(device, &error))) {
+      g_simple_async_report_take_gerror_in_idle(G_OBJECT(service),
+                                                callback,
+                                                user_data,
+                                                error);
+      EXIT;
+   }
+
+   /*
+    * Make sure we have a removed_at field for querying active devices.
+    */
+   if (!mongo_bson_iter_init_find(&iter, bson, "removed_at")) {
+      mongo_bson_append_null(bson, "removed_at");
+   }
+
+   simple = g_simple_async_result_new(G_OBJECT(service), callback, user_data,
+                                      postal_service_add_device);
+   g_simple_async_result_set_check_cancellable(simple, cancellable);
+   g_object_set_data_full(G_OBJECT(simple),
+                          "device",
+                          g_object_ref(device),
+                          g_object_unref);
+
+   /*
+    * Coalesce with a registration of the same device that has not been
+    * written yet. The most recent document wins, so a pending write must
+    * not be overtaken by an answer from the cache.
+    */
+   key = g_strdup_printf("%s:%s",
+                         postal_device_get_user(device),
+                         postal_device_get_device_token(device));
+   if ((reg = g_hash_table_lookup(priv->registrations, key))) {
+      g_clear_object(&reg->device);
+      mongo_clear_bson(&reg->doc);
+      g_free(key);
+   } else if (priv->registered &&
+              postal_reg_cache_lookup(priv->registered,
+                                      postal_device_get_user(device),
+                                      postal_device_get_device_type(device),
+                                      postal_device_get_device_token(device),
+                                      bson,
+                                      g_get_monotonic_time(),
+                                      &tv) &&
+              postal_service_device_is_active(service, device)) {
+      /*
+       * Answer re-registrations of an unchanged device from the cache.
+       * The cache only hears about removals made through this instance,
+       * so when the index is loaded it also has to show the device as
+       * active. The index follows the oplog, which covers other
+       * instances.
+       */
+      postal_device_set_created_at(device, &tv);
+      g_object_set_data(G_OBJECT(simple),
+                        "updated-existing",
+                        GINT_TO_POINTER(TRUE));
+      if (priv->metrics) {
+         postal_metrics_device_added(priv->metrics, device);
+      }
+      g_simple_async_result_set_op_res_gboolean(simple, TRUE);
+      g_simple_async_result_complete_in_idle(simple);
+      g_object_unref(simple);
+      mongo_bson_unref(bson);
+      g_free(key);
+      EXIT;
+   } else {
+      reg = g_slice_new0(Registration);
+      reg->service = g_object_ref(service);
+      reg->key = key;
+      reg->waiters = g_ptr_array_new_with_free_func(g_object_unref);
+      reg->source = g_timeout_add(POSTAL_SERVICE_REGISTER_WINDOW_MSEC,
+                                  registration_timeout,
+                                  reg);
+      g_hash_table_insert(priv->registrations, reg->key, reg);
+   }
+
+   reg->device = g_object_ref(device);
+   reg->doc = bson;
+   g_ptr_array_add(reg->waiters, simple);
+
+   EXIT;
+}
+
+/**
+ * postal_service_add_device_finish:
+ * @service: (in): A #PostalService.
+ * @result: (in): A #GAsyncResult.
+ * @updated_existing: (out) (allow-none): A location for a #gboolean.
+ * @error: (out): A location for a #GError, or %NULL.
+ *
+ * Completes an asynchronous request to postal_service_add_device().
+ *
+ * If an existing device was updated, then @updated_existing is set to %TRUE.
+ *
+ * Returns: %TRUE if successful; otherwise %FALSE and @error is set.
+ */
+gboolean
+postal_service_add_device_finish (PostalService  *service,
+                                  GAsyncResult   *result,
+                                  gboolean       *updated_existing,
+                                  GError        **error)
+{
+   GSimpleAsyncResult *simple = (GSimpleAsyncResult *)result;
+   gboolean ret;
+
+   ENTRY;
+
+   g_return_val_if_fail(POSTAL_IS_SERVICE(service), FALSE);
+   g_return_val_if_fail(G_IS_SIMPLE_ASYNC_RESULT(simple), FALSE);
+
+   if (!(ret = g_simple_async_result_get_op_res_gboolean(simple))) {
+      g_simple_async_result_propagate_error(simple, error);
+   }
+
+   if (updated_existing) {
+      *updated_existing =
+            GPOINTER_TO_INT(g_object_get_data(G_OBJECT(result),
+                                              "updated-existing"));
+   }
+
+   RETURN(ret);
+}
+
+static void
+postal_service_remove_device_cb (GObject      *object,
+                                 GAsyncResult *result,
+                                 gpointer      user_data)
+{
+   GSimpleAsyncResult *simple = user_data;
+   MongoConnection *connection = (MongoConnection *)object;
+   gboolean ret;
+   GError *error = NULL;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_CONNECTION(connection));
+   g_assert(G_IS_ASYNC_RESULT(result));
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+
+   if (!(ret = mongo_connection_update_finish(connection,
+                                              result,
+                                              NULL,
+                                              &error))) {
+      g_simple_async_result_take_error(simple, error);
+   } else {
+      PostalService *service;
+      PostalDevice *device;
+      GTimeVal tv;
+
+      device = POSTAL_DEVICE(g_object_get_data(G_OBJECT(simple), "device"));
+      service = POSTAL_SERVICE(g_async_result_get_source_object(G_ASYNC_RESULT(simple)));
+      /*
+       * A registration that was already being written when the removal
+       * was requested may have cached the device since.
+       */
+      if (service->priv->registered) {
+         postal_reg_cache_remove(service->priv->registered,
+                                 postal_device_get_user(device),
+                                 postal_device_get_device_token(device));
+      }
+      if (service->priv->index) {
+         g_get_current_time(&tv);
+         postal_device_index_mark_removed(service->priv->index,
+                                          postal_device_get_user(device),
+                                          0,
+                                          postal_device_get_device_token(device),
+                                          &tv);
+      }
+      if (service->priv->metrics) {
+         postal_metrics_device_removed(service->priv->metrics, device);
+      }
+      g_object_unref(service);
+   }
+
+   g_simple_async_result_set_op_res_gboolean(simple, ret);
+   g_simple_async_result_complete_in_idle(simple);
+   g_object_unref(simple);
+
+   EXIT;
+}
+
+/**
+ * postal_service_remove_device:
+ * @service: (in): A #PostalService.
+ * @device: (in): A #PostalDevice.
+ * @cancellable: (in) (allow-none): A #GCancellable or %NULL.
+ * @callback: (in): A callback to execute upon completion.
+ * @user_data: (in): User data for callback.
+ *
+ * Removes a device from the underlying storage (MongoDB). @callback will
+ * be executed upon completion of the request on the applications main
+ * thread. @callback MUST call postal_service_remove_device_finish()
+ * to complete the request.
+ */
+void
+postal_service_remove_device (PostalService       *service,
+                              PostalDevice        *device,
+                              GCancellable        *cancellable,
+                              GAsyncReadyCallback  callback,
+                              gpointer             user_data)
+{
+   PostalServicePrivate *priv;
+   GSimpleAsyncResult *simple;
    MongoObjectId *user_id;
    const gchar *device_token;
    const gchar *user;
@@ -486,11 +832,20 @@ postal_service_remove_device (PostalService       *service,
       EXIT;
    }
 
+   /*
+    * A pending registration of the device must be written first, and the
+    * device may no longer be answered from the registration cache.
+    */
+   postal_service_flush_registration(service, user, device_token);
+   if (priv->registered) {
+      postal_reg_cache_remove(priv->registered, user, device_token);
+   }
+
    /*
     * Build our query for the device to remove.
     */
    q = mongo_bson_new_empty();
-   mongo_bson_append_string(q, "device_token", device_token);
+   postal_service_append_token(q, device_token);
    if ((user_id = mongo_object_id_new_from_string(user))) {
       mongo_bson_append_object_id(q, "user", user_id);
       mongo_object_id_free(user_id);
@@ -521,6 +876,7 @@ postal_service_remove_device (PostalService       *service,
                                  MONGO_UPDATE_NONE,
                                  q,
                                  u,
+                                 NULL,
                                  cancellable,
                                  postal_service_remove_device_cb,
                                  simple);
@@ -648,9 +1004,13 @@ postal_service_find_devices (PostalService       *service,
    PostalServicePrivate *priv;
    GSimpleAsyncResult *simple;
    MongoObjectId *id;
+   PostalDevice *device;
    MongoCursor *cursor;
    GPtrArray *devices;
    MongoBson *q;
+   GArray *handles;
+   gchar *users[2] = { NULL };
+   guint i;
 
    ENTRY;
 
@@ -661,6 +1021,39 @@ postal_service_find_devices (PostalService       *service,
 
    priv = service->priv;
 
+   /*
+    * Serve the request from the device index when it is available.
+    * Devices are paginated in slot order, which follows the initial
+    * collection scan until removed devices free slots for reuse.
+    */
+   if (priv->index_loaded) {
+      simple = g_simple_async_result_new(G_OBJECT(service), callback,
+                                         user_data,
+                                         postal_service_find_devices);
+      g_simple_async_result_set_check_cancellable(simple, cancellable);
+
+      devices = g_ptr_array_new_with_free_func(g_object_unref);
+      users[0] = (gchar *)user;
+      handles = postal_device_index_lookup(priv->index, users, NULL, FALSE);
+      for (i = offset;
+           (i < handles->len) && (!limit || (devices->len < limit));
+           i++) {
+         device = postal_device_index_get_device(
+               priv->index, g_array_index(handles, guint64, i));
+         if (device) {
+            g_ptr_array_add(devices, device);
+         }
+      }
+      g_array_unref(handles);
+
+      g_simple_async_result_set_op_res_gpointer(simple, devices,
+                                                (GDestroyNotify)g_ptr_array_unref);
+      g_simple_async_result_complete_in_idle(simple);
+      g_object_unref(simple);
+
+      EXIT;
+   }
+
    q = mongo_bson_new_empty();
 
    if ((id = mongo_object_id_new_from_string(user))) {
@@ -675,6 +1068,7 @@ postal_service_find_devices (PostalService       *service,
                          "collection", priv->collection,
                          "connection", priv->mongo,
                          "limit", (gint)limit,
+                         "prefetch", POSTAL_SERVICE_CURSOR_PREFETCH,
                          "query", q,
                          "skip", (gint)offset,
                          NULL);
@@ -794,7 +1188,9 @@ postal_service_find_device (PostalService       *service,
    PostalServicePrivate *priv;
    GSimpleAsyncResult *simple;
    MongoObjectId *oid;
+   PostalDevice *found;
    MongoBson *q;
+   guint64 handle;
 
    ENTRY;
 
@@ -806,9 +1202,29 @@ postal_service_find_device (PostalService       *service,
 
    priv = service->priv;
 
+   if (priv->index_loaded) {
+      simple = g_simple_async_result_new(G_OBJECT(service), callback,
+                                         user_data,
+                                         postal_service_find_device);
+      g_simple_async_result_set_check_cancellable(simple, cancellable);
+      handle = postal_device_index_find(priv->index, user, device);
+      if ((found = postal_device_index_get_device(priv->index, handle))) {
+         g_simple_async_result_set_op_res_gpointer(simple, found,
+                                                   g_object_unref);
+      } else {
+         g_simple_async_result_set_error(simple,
+                                         POSTAL_DEVICE_ERROR,
+                                         POSTAL_DEVICE_ERROR_NOT_FOUND,
+                                         _("The device could not be found."));
+      }
+      g_simple_async_result_complete_in_idle(simple);
+      g_object_unref(simple);
+      EXIT;
+   }
+
    q = mongo_bson_new_empty();
 
-   mongo_bson_append_string(q, "device_token", device);
+   postal_service_append_token(q, device);
 
    if ((oid = mongo_object_id_new_from_string(user))) {
       mongo_bson_append_object_id(q, "user", oid);
@@ -821,9 +1237,9 @@ postal_service_find_device (PostalService       *service,
                                       postal_service_find_device);
    mongo_connection_query_async(priv->mongo,
                                 priv->db_and_collection,
+                                MONGO_QUERY_NONE,
                                 0,
                                 0,
-                                MONGO_QUERY_NONE,
                                 q,
                                 NULL,
                                 cancellable,
@@ -996,206 +1412,600 @@ postal_service_build_aps (PostalNotification *notification)
 }
 
 static void
-postal_service_notify_c2dm_cb (GObject      *object,
-                               GAsyncResult *result,
-                               gpointer      user_data)
+fanout_token_clear (gpointer data)
 {
-   PushC2dmClient *client = (PushC2dmClient *)object;
-   GError *error = NULL;
+   PushBatchToken *token = data;
 
-   ENTRY;
+   g_free((gchar *)token->token);
+}
 
-   g_assert(PUSH_IS_C2DM_CLIENT(client));
+static GArray *
+fanout_tokens_new (void)
+{
+   GArray *tokens;
 
-   if (!push_c2dm_client_deliver_finish(client, result, &error)) {
-      g_warning("C2DM delivery failure: %s", error->message);
-      g_error_free(error);
-   }
+   tokens = g_array_new(FALSE, FALSE, sizeof(PushBatchToken));
+   g_array_set_clear_func(tokens, fanout_token_clear);
 
-   EXIT;
+   return tokens;
 }
 
-static void
-postal_service_notify_gcm_cb (GObject      *object,
-                              GAsyncResult *result,
-                              gpointer      user_data)
+static Fanout *
+fanout_ref (Fanout *fanout)
 {
-   PushGcmClient *client = (PushGcmClient *)object;
-   GError *error = NULL;
+   g_return_val_if_fail(fanout, NULL);
+   g_return_val_if_fail(fanout->ref_count > 0, NULL);
 
-   ENTRY;
+   g_atomic_int_inc(&fanout->ref_count);
 
-   g_assert(PUSH_IS_GCM_CLIENT(client));
+   return fanout;
+}
 
-   if (!push_gcm_client_deliver_finish(client, result, &error)) {
-      g_warning("GCM delivery failure: %s", error->message);
-      g_error_free(error);
+static void
+fanout_unref (Fanout *fanout)
+{
+   g_return_if_fail(fanout);
+   g_return_if_fail(fanout->ref_count > 0);
+
+   if (g_atomic_int_dec_and_test(&fanout->ref_count)) {
+      g_assert(!fanout->aps_tokens->len);
+      g_assert(!fanout->c2dm_tokens->len);
+      g_assert(!fanout->gcm_tokens->len);
+      g_assert(!fanout->cursor);
+      g_assert(!fanout->simple);
+      if (fanout->handles) {
+         g_array_unref(fanout->handles);
+      }
+      g_array_unref(fanout->aps_tokens);
+      g_array_unref(fanout->c2dm_tokens);
+      g_array_unref(fanout->gcm_tokens);
+      g_object_unref(fanout->service);
+      g_object_unref(fanout->notification);
+      g_object_unref(fanout->aps_message);
+      g_object_unref(fanout->c2dm_message);
+      g_object_unref(fanout->gcm_message);
+      g_slice_free(Fanout, fanout);
    }
-
-   EXIT;
 }
 
+static void fanout_drain_index (Fanout *fanout);
+static void fanout_flush       (Fanout *fanout);
+
 static void
-postal_service_notify_aps_cb (GObject      *object,
-                              GAsyncResult *result,
-                              gpointer      user_data)
+fanout_begin_request (Fanout *fanout,
+                      guint   n_tokens)
 {
-   PushApsClient *client = (PushApsClient *)object;
-   GError *error = NULL;
+   PostalServicePrivate *priv;
 
-   ENTRY;
+   g_assert(fanout);
 
-   g_assert(PUSH_IS_APS_CLIENT(client));
+   priv = fanout->service->priv;
 
-   if (!push_aps_client_deliver_finish(client, result, &error)) {
-      g_warning("APS delivery failure: %s", error->message);
-      g_error_free(error);
-   }
+   fanout_ref(fanout);
 
-   EXIT;
+   /*
+    * Stop fetching documents from Mongo if the push clients are falling
+    * behind. The remainder of the current batch is still dispatched, so
+    * memory is bounded by max-in-flight plus one batch.
+    */
+   fanout->in_flight += n_tokens;
+
+   if ((fanout->in_flight >= priv->notify_max_in_flight) &&
+       !fanout->paused &&
+       (fanout->cursor || fanout->simple)) {
+      fanout->paused = TRUE;
+      if (fanout->cursor) {
+         mongo_cursor_pause(fanout->cursor);
+      }
+   }
 }
 
 static void
-postal_service_notify_cb (GObject      *object,
-                          GAsyncResult *result,
-                          gpointer      user_data)
+fanout_end_request (Fanout *fanout,
+                    guint   n_tokens)
 {
    PostalServicePrivate *priv;
-   PostalNotification *notif;
-   GSimpleAsyncResult *simple = user_data;
-   MongoMessageReply *reply;
-   PushC2dmIdentity *c2dm;
-   PostalDeviceType device_type;
-   PushC2dmMessage *c2dm_message;
-   PushGcmIdentity *gcm;
-   PushGcmMessage *gcm_message;
-   MongoConnection *connection = (MongoConnection *)object;
-   PushApsIdentity *aps;
-   PushApsMessage *aps_message;
-   PostalService *service;
-   PostalDevice *device;
-   const gchar *device_token;
-   GObject *source;
-   GError *error = NULL;
-   GList *gcm_devices = NULL;
-   GList *list;
 
-   ENTRY;
+   g_assert(fanout);
+   g_assert_cmpint(fanout->in_flight, >=, n_tokens);
 
-   g_assert(MONGO_IS_CONNECTION(connection));
-   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+   priv = fanout->service->priv;
 
-   source = g_async_result_get_source_object(user_data);
-   service = POSTAL_SERVICE(source);
-   priv = service->priv;
-   g_object_unref(source);
+   /*
+    * Resume the cursor once we have drained to half of our limit so that
+    * we are not toggling on every completed request. The tokens collected
+    * from the rest of the batch dispatched while paused are sent first,
+    * in one request per provider.
+    */
+   fanout->in_flight -= n_tokens;
+
+   if ((fanout->in_flight <= (priv->notify_max_in_flight / 2)) &&
+       fanout->paused) {
+      fanout->paused = FALSE;
+      fanout_flush(fanout);
+      if (fanout->cursor) {
+         mongo_cursor_resume(fanout->cursor);
+      } else if (fanout->simple) {
+         fanout_drain_index(fanout);
+      }
+   }
 
-   if (!(reply = mongo_connection_query_finish(connection, result, &error))) {
-      g_simple_async_result_take_error(simple, error);
-      GOTO(failure);
-   }
+   fanout_unref(fanout);
+}
 
-   notif = g_object_get_data(G_OBJECT(simple), "notification");
-   aps_message = postal_service_build_aps(notif);
-   c2dm_message = postal_service_build_c2dm(notif);
-   gcm_message = postal_service_build_gcm(notif);
+static FanoutBatch *
+fanout_batch_new (Fanout  *fanout,
+                  GArray **tokens)
+{
+   FanoutBatch *batch;
 
-   list = mongo_message_reply_get_documents(reply);
-   for (; list; list = list->next) {
-      /*
-       * Inflate a PostalDevice for this MongoBson.
-       */
-      device = postal_device_new();
-      if (!postal_device_load_from_bson(device, list->data, NULL)) {
-         g_object_unref(device);
-         continue;
-      }
+   g_assert(fanout);
+   g_assert(tokens);
+   g_assert(*tokens);
 
-      /*
-       * Fetch the device type and device token.
-       */
-      device_type = postal_device_get_device_type(device);
-      device_token = postal_device_get_device_token(device);
-      if (!device_type || !device_token) {
-         g_object_unref(device);
-         continue;
+   batch = g_slice_new(FanoutBatch);
+   batch->fanout = fanout;
+   batch->tokens = *tokens;
+   *tokens = fanout_tokens_new();
+
+   fanout_begin_request(fanout, batch->tokens->len);
+
+   return batch;
+}
+
+static void
+fanout_batch_complete (FanoutBatch *batch,
+                       const gchar *provider,
+                       GPtrArray   *failures,
+                       GError      *error)
+{
+   PushBatchFailure *failure;
+   PushBatchToken *token;
+   guint i;
+
+   g_assert(batch);
+   g_assert(provider);
+
+   if (error) {
+      g_warning("%s delivery failure: %s", provider, error->message);
+   } else if (failures) {
+      for (i = 0; i < failures->len; i++) {
+         failure = g_ptr_array_index(failures, i);
+         token = &g_array_index(batch->tokens, PushBatchToken, failure->index);
+         g_warning("%s delivery failure to \"%s\": %s",
+                   provider, token->token, failure->error->message);
       }
+   }
 
-      /*
-       * See if we can ignore this message. This can happen if we have a
-       * matching collapse_key:device token in the array of direct-mapped
-       * caches. We only send the first message matching that pair (unless
-       * it has been evicted from cache).
-       */
-      if (!postal_service_should_ignore(service, device, notif)) {
-         /*
-          * Build the provider specific message.
-          */
-         switch (device_type) {
-         case POSTAL_DEVICE_APS:
-            aps = g_object_new(PUSH_TYPE_APS_IDENTITY,
-                               "device-token", device_token,
-                               NULL);
-            push_aps_message_set_badge(aps_message,
-                                       postal_device_get_badge(device));
-            push_aps_client_deliver_async(priv->aps,
-                                          aps,
-                                          aps_message,
+   fanout_end_request(batch->fanout, batch->tokens->len);
+   g_array_unref(batch->tokens);
+   g_slice_free(FanoutBatch, batch);
+}
+
+static void
+postal_service_notify_c2dm_cb (GObject      *object,
+                               GAsyncResult *result,
+                               gpointer      user_data)
+{
+   PushC2dmClient *client = (PushC2dmClient *)object;
+   FanoutBatch *batch = user_data;
+   GPtrArray *failures = NULL;
+   GError *error = NULL;
+
+   ENTRY;
+
+   g_assert(PUSH_IS_C2DM_CLIENT(client));
+   g_assert(batch);
+
+   push_c2dm_client_deliver_batch_finish(client, result, &failures, &error);
+   fanout_batch_complete(batch, "C2DM", failures, error);
+   g_clear_error(&error);
+   if (failures) {
+      g_ptr_array_unref(failures);
+   }
+
+   EXIT;
+}
+
+static void
+postal_service_notify_gcm_cb (GObject      *object,
+                              GAsyncResult *result,
+                              gpointer      user_data)
+{
+   PushGcmClient *client = (PushGcmClient *)object;
+   FanoutBatch *batch = user_data;
+   GPtrArray *failures = NULL;
+   GError *error = NULL;
+
+   ENTRY;
+
+   g_assert(PUSH_IS_GCM_CLIENT(client));
+   g_assert(batch);
+
+   push_gcm_client_deliver_batch_finish(client, result, &failures, &error);
+   fanout_batch_complete(batch, "GCM", failures, error);
+   g_clear_error(&error);
+   if (failures) {
+      g_ptr_array_unref(failures);
+   }
+
+   EXIT;
+}
+
+static void
+postal_service_notify_aps_cb (GObject      *object,
+                              GAsyncResult *result,
+                              gpointer      user_data)
+{
+   PushApsClient *client = (PushApsClient *)object;
+   FanoutBatch *batch = user_data;
+   GPtrArray *failures = NULL;
+   GError *error = NULL;
+
+   ENTRY;
+
+   g_assert(PUSH_IS_APS_CLIENT(client));
+   g_assert(batch);
+
+   push_aps_client_deliver_batch_finish(client, result, &failures, &error);
+   fanout_batch_complete(batch, "APS", failures, error);
+   g_clear_error(&error);
+   if (failures) {
+      g_ptr_array_unref(failures);
+   }
+
+   EXIT;
+}
+
+static void
+fanout_flush (Fanout *fanout)
+{
+   PostalServicePrivate *priv;
+   FanoutBatch *batch;
+
+   ENTRY;
+
+   g_assert(fanout);
+
+   priv = fanout->service->priv;
+
+   if (fanout->aps_tokens->len) {
+      batch = fanout_batch_new(fanout, &fanout->aps_tokens);
+      push_aps_client_deliver_batch_async(priv->aps,
+                                          (PushBatchToken *)batch->tokens->data,
+                                          batch->tokens->len,
+                                          fanout->aps_message,
                                           NULL, /* TODO: */
                                           postal_service_notify_aps_cb,
-                                          NULL);
-            postal_metrics_device_notified(priv->metrics, device);
-            g_object_unref(aps);
-            break;
-         case POSTAL_DEVICE_C2DM:
-            c2dm = g_object_new(PUSH_TYPE_C2DM_IDENTITY,
-                                "registration-id", device_token,
-                                NULL);
-            push_c2dm_client_deliver_async(priv->c2dm,
-                                           c2dm,
-                                           c2dm_message,
+                                          batch);
+   }
+
+   if (fanout->c2dm_tokens->len) {
+      batch = fanout_batch_new(fanout, &fanout->c2dm_tokens);
+      push_c2dm_client_deliver_batch_async(priv->c2dm,
+                                           (PushBatchToken *)batch->tokens->data,
+                                           batch->tokens->len,
+                                           fanout->c2dm_message,
                                            NULL, /* TODO: */
                                            postal_service_notify_c2dm_cb,
-                                           NULL);
-            postal_metrics_device_notified(priv->metrics, device);
-            g_object_unref(c2dm);
-            break;
-         case POSTAL_DEVICE_GCM:
-            gcm = push_gcm_identity_new(device_token);
-            gcm_devices = g_list_append(gcm_devices, gcm);
-            postal_metrics_device_notified(priv->metrics, device);
-            break;
-         default:
-            g_assert_not_reached();
+                                           batch);
+   }
+
+   if (fanout->gcm_tokens->len) {
+      batch = fanout_batch_new(fanout, &fanout->gcm_tokens);
+      push_gcm_client_deliver_batch_async(priv->gcm,
+                                          (PushBatchToken *)batch->tokens->data,
+                                          batch->tokens->len,
+                                          fanout->gcm_message,
+                                          NULL, /* TODO: */
+                                          postal_service_notify_gcm_cb,
+                                          batch);
+   }
+
+   /*
+    * A fan-out can run for minutes, so the dedup window of the next batch
+    * is measured from when it is collected rather than from the start.
+    */
+   fanout->now = g_get_monotonic_time();
+
+   EXIT;
+}
+
+static void
+fanout_device_badge (FanoutDevice  *device,
+                     MongoBsonIter *iter)
+{
+   if (MONGO_BSON_ITER_HOLDS_INT32(iter)) {
+      device->badge = MAX(0, mongo_bson_iter_get_value_int(iter));
+   }
+}
+
+static void
+fanout_device_device_token (FanoutDevice  *device,
+                            MongoBsonIter *iter)
+{
+   const guint8 *data;
+   gsize len;
+
+   /*
+    * Packed tokens stop at storage and the device index. The dedup and
+    * registration caches, the Redis messages, invalid token removal and
+    * the push clients all work with the printed token, so it is unpacked
+    * here once per device.
+    */
+   if (MONGO_BSON_ITER_HOLDS_UTF8(iter)) {
+      device->device_token = mongo_bson_iter_get_value_string(iter, NULL);
+   } else if (MONGO_BSON_ITER_HOLDS_BINARY(iter)) {
+      data = mongo_bson_iter_get_value_binary(iter, NULL, &len);
+      if (len == POSTAL_DEVICE_APS_TOKEN_SIZE) {
+         postal_device_aps_token_unpack(data, device->token_buf);
+         device->device_token = device->token_buf;
+      }
+   }
+}
+
+static void
+fanout_device_device_type (FanoutDevice  *device,
+                           MongoBsonIter *iter)
+{
+   const gchar *str;
+
+   if (MONGO_BSON_ITER_HOLDS_UTF8(iter)) {
+      str = mongo_bson_iter_get_value_string(iter, NULL);
+      if (!strcmp(str, "aps")) {
+         device->device_type = POSTAL_DEVICE_APS;
+      } else if (!strcmp(str, "gcm")) {
+         device->device_type = POSTAL_DEVICE_GCM;
+      } else if (!strcmp(str, "c2dm")) {
+         device->device_type = POSTAL_DEVICE_C2DM;
+      }
+   }
+}
+
+static void
+fanout_device_user (FanoutDevice  *device,
+                    MongoBsonIter *iter)
+{
+   MongoObjectId *oid;
+
+   if (MONGO_BSON_ITER_HOLDS_UTF8(iter)) {
+      device->user = mongo_bson_iter_get_value_string(iter, NULL);
+   } else if (MONGO_BSON_ITER_HOLDS_OBJECT_ID(iter)) {
+      oid = mongo_bson_iter_get_value_object_id(iter);
+      mongo_object_id_to_string_r(oid, device->user_buf);
+      device->user = device->user_buf;
+      mongo_object_id_free(oid);
+   }
+}
+
+/*
+ * The fields fetched for each device of a notification, which are also
+ * the projection sent with the notify query.
+ */
+static const struct
+{
+   const gchar       *key;
+   FanoutDeviceField  func;
+} gFanoutDeviceFields[] = {
+   { "device_type",  fanout_device_device_type },
+   { "device_token", fanout_device_device_token },
+   { "user",         fanout_device_user },
+   { "badge",        fanout_device_badge },
+};
+
+static MongoBson *
+fanout_device_fields (void)
+{
+   MongoBson *fields;
+   guint i;
+
+   fields = mongo_bson_new_empty();
+   mongo_bson_append_int(fields, "_id", 0);
+   for (i = 0; i < G_N_ELEMENTS(gFanoutDeviceFields); i++) {
+      mongo_bson_append_int(fields, gFanoutDeviceFields[i].key, 1);
+   }
+
+   return fields;
+}
+
+/*
+ * Decodes the fields of a device from @bson in a single pass. Fields
+ * other than those in gFanoutDeviceFields are skipped.
+ */
+static void
+fanout_device_load (FanoutDevice    *device,
+                    const MongoBson *bson)
+{
+   MongoBsonIter iter;
+   guint i;
+
+   memset(device, 0, sizeof *device);
+
+   mongo_bson_iter_init(&iter, bson);
+   while (mongo_bson_iter_next(&iter)) {
+      for (i = 0; i < G_N_ELEMENTS(gFanoutDeviceFields); i++) {
+         if (mongo_bson_iter_is_key(&iter, gFanoutDeviceFields[i].key)) {
+            gFanoutDeviceFields[i].func(device, &iter);
             break;
          }
-      } else {
-         g_message("Dropping duplicated message \"%s\" to device \"%s\"",
-                   postal_notification_get_collapse_key(notif),
-                   postal_device_get_device_token(device));
       }
+   }
+}
 
-      g_object_unref(device);
+static void
+fanout_add_device (Fanout             *fanout,
+                   const FanoutDevice *device)
+{
+   PostalServicePrivate *priv;
+   PushBatchToken token;
+   PostalService *service;
+   GArray *tokens;
+
+   ENTRY;
+
+   g_assert(fanout);
+   g_assert(device);
+
+   service = fanout->service;
+   priv = service->priv;
+
+   if (!device->device_type || !device->device_token || !device->user) {
+      EXIT;
+   }
+
+   /*
+    * See if we can ignore this message. This can happen if we have a
+    * matching collapse_key:device token in the dedup table. We only send
+    * the first message matching that pair (unless it has been evicted
+    * from the table).
+    */
+   if (postal_service_should_ignore(service,
+                                    device->device_token,
+                                    fanout->notification,
+                                    fanout->now)) {
+      g_message("Dropping duplicated message \"%s\" to device \"%s\"",
+                postal_notification_get_collapse_key(fanout->notification),
+                device->device_token);
+      EXIT;
    }
 
-   if (gcm_devices) {
-      push_gcm_client_deliver_async(priv->gcm,
-                                    gcm_devices,
-                                    gcm_message,
-                                    NULL, /* TODO: */
-                                    postal_service_notify_gcm_cb,
-                                    NULL);
-      g_list_foreach(gcm_devices, (GFunc)g_object_unref, NULL);
-      g_list_free(gcm_devices);
+   /*
+    * Queue the token for the provider specific batch. Only the token and
+    * badge are needed, so no identity is created for the device.
+    */
+   switch (device->device_type) {
+   case POSTAL_DEVICE_APS:
+      tokens = fanout->aps_tokens;
+      break;
+   case POSTAL_DEVICE_C2DM:
+      tokens = fanout->c2dm_tokens;
+      break;
+   case POSTAL_DEVICE_GCM:
+      tokens = fanout->gcm_tokens;
+      break;
+   default:
+      g_assert_not_reached();
+      EXIT;
    }
 
-   g_object_unref(aps_message);
-   g_object_unref(c2dm_message);
-   g_object_unref(gcm_message);
+   token.token = g_strdup(device->device_token);
+   token.badge = device->badge;
+   g_array_append_val(tokens, token);
+   postal_metrics_device_notified(priv->metrics,
+                                  device->device_type,
+                                  device->device_token,
+                                  device->user);
 
-   g_simple_async_result_set_op_res_gboolean(simple, TRUE);
+   if (tokens->len >= priv->notify_batch_size) {
+      fanout_flush(fanout);
+   }
+
+   EXIT;
+}
+
+static gboolean
+postal_service_notify_foreach (MongoCursor *cursor,
+                               MongoBson   *bson,
+                               gpointer     user_data)
+{
+   FanoutDevice device;
+   Fanout *fanout = user_data;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_CURSOR(cursor));
+   g_assert(bson);
+   g_assert(fanout);
+
+   fanout_device_load(&device, bson);
+   fanout_add_device(fanout, &device);
+
+   RETURN(TRUE);
+}
+
+static void
+fanout_drain_index (Fanout *fanout)
+{
+   PostalServicePrivate *priv;
+   GSimpleAsyncResult *simple;
+   FanoutDevice fdevice;
+   GString *token;
+   gboolean removed;
+   guint64 handle;
+
+   ENTRY;
+
+   g_assert(fanout);
+   g_assert(fanout->handles);
+
+   priv = fanout->service->priv;
+
+   /*
+    * Walk the handles until the push clients fall behind. Devices removed
+    * since the lookup are no longer found or are marked removed. The
+    * fields are read straight from the index.
+    */
+   token = g_string_sized_new(sizeof fdevice.token_buf);
+   while (!fanout->paused && (fanout->next_handle < fanout->handles->len)) {
+      handle = g_array_index(fanout->handles, guint64, fanout->next_handle++);
+      memset(&fdevice, 0, sizeof fdevice);
+      if (postal_device_index_peek_device(priv->index,
+                                          handle,
+                                          &fdevice.device_type,
+                                          &fdevice.user,
+                                          token,
+                                          &fdevice.badge,
+                                          &removed) &&
+          !removed) {
+         fdevice.device_token = token->str;
+         fanout_add_device(fanout, &fdevice);
+      }
+   }
+   g_string_free(token, TRUE);
+
+   if ((fanout->next_handle == fanout->handles->len) && fanout->simple) {
+      fanout_flush(fanout);
+      simple = fanout->simple;
+      fanout->simple = NULL;
+      g_simple_async_result_set_op_res_gboolean(simple, TRUE);
+      g_simple_async_result_complete_in_idle(simple);
+      g_object_unref(simple);
+   }
+
+   EXIT;
+}
+
+static void
+postal_service_notify_cb (GObject      *object,
+                          GAsyncResult *result,
+                          gpointer      user_data)
+{
+   GSimpleAsyncResult *simple = user_data;
+   MongoCursor *cursor = (MongoCursor *)object;
+   Fanout *fanout;
+   GError *error = NULL;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_CURSOR(cursor));
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+
+   fanout = g_object_get_data(G_OBJECT(simple), "fanout");
+   g_assert(fanout);
+
+   /*
+    * Deliver any tokens remaining from the last batch and detach the
+    * cursor so that in-flight requests do not try to resume it.
+    */
+   fanout_flush(fanout);
+   g_clear_object(&fanout->cursor);
+
+   if (!mongo_cursor_foreach_finish(cursor, result, &error)) {
+      g_simple_async_result_take_error(simple, error);
+   } else {
+      g_simple_async_result_set_op_res_gboolean(simple, TRUE);
+   }
 
-failure:
    g_simple_async_result_complete_in_idle(simple);
    g_object_unref(simple);
 
@@ -1214,12 +2024,19 @@ postal_service_notify (PostalService        *service,
    PostalServicePrivate *priv;
    GSimpleAsyncResult *simple;
    MongoObjectId *oid;
-   MongoBson *ar;
-   MongoBson *in;
-   MongoBson *or;
+   MongoBson *fields;
    MongoBson *q;
+   const gchar *key;
+   Fanout *fanout;
    gchar idxstr[12];
+   gsize size;
+   guint clause;
+   guint field;
+   guint in;
+   guint8 packed[POSTAL_DEVICE_APS_TOKEN_SIZE];
+   guint or;
    guint i;
+   guint j;
 
    ENTRY;
 
@@ -1230,500 +2047,1449 @@ postal_service_notify (PostalService        *service,
 
    priv = service->priv;
 
-   or = mongo_bson_new_empty();
-   q = mongo_bson_new_empty();
-   ar = mongo_bson_new_empty();
+   fanout = g_slice_new0(Fanout);
+   fanout->ref_count = 1;
+   fanout->service = g_object_ref(service);
+   fanout->notification = g_object_ref(notification);
+   fanout->now = g_get_monotonic_time();
+   fanout->aps_message = postal_service_build_aps(notification);
+   fanout->c2dm_message = postal_service_build_c2dm(notification);
+   fanout->gcm_message = postal_service_build_gcm(notification);
+   fanout->aps_tokens = fanout_tokens_new();
+   fanout->c2dm_tokens = fanout_tokens_new();
+   fanout->gcm_tokens = fanout_tokens_new();
 
-   for (i = 0; device_tokens[i]; i++) {
-      g_snprintf(idxstr, sizeof idxstr, "%u", i);
-      idxstr[sizeof idxstr - 1] = '\0';
-      mongo_bson_append_string(ar, idxstr, device_tokens[i]);
-   }
+   simple = g_simple_async_result_new(G_OBJECT(service), callback, user_data,
+                                      postal_service_notify);
+   g_simple_async_result_set_check_cancellable(simple, cancellable);
+   g_object_set_data_full(G_OBJECT(simple),
+                          "fanout",
+                          fanout_ref(fanout),
+                          (GDestroyNotify)fanout_unref);
 
-   in = mongo_bson_new_empty();
-   mongo_bson_append_array(in, "$in", ar);
-   mongo_bson_append_bson(q, "devices", in);
-   mongo_bson_append_bson(or, "0", q);
-   mongo_bson_unref(q);
-   mongo_bson_unref(ar);
-   mongo_bson_unref(in);
+   /*
+    * Resolve the audience from the device index when it is available.
+    * The fanout holds the result until every handle has been walked.
+    */
+   if (priv->index_loaded) {
+      fanout->handles = postal_device_index_lookup(priv->index,
+                                                   users,
+                                                   device_tokens,
+                                                   TRUE);
+      fanout->simple = simple;
+      fanout_drain_index(fanout);
+      fanout_unref(fanout);
+      EXIT;
+   }
 
-   q = mongo_bson_new_empty();
-   ar = mongo_bson_new_empty();
+   /*
+    * Build the query in place, sized up front for the two $in lists.
+    */
+   size = 64;
+   for (i = 0; device_tokens[i]; i++) {
+      size += strlen(device_tokens[i]) + 64;
+   }
+   for (i = 0; users[i]; i++) {
+      size += strlen(users[i]) + 16;
+   }
 
+   q = mongo_bson_new_sized(size);
+   or = mongo_bson_append_array_begin(q, "$or");
+
+   clause = mongo_bson_append_document_begin(q,
+                                             mongo_bson_index_key(0, idxstr));
+   field = mongo_bson_append_document_begin(q, "device_token");
+   in = mongo_bson_append_array_begin(q, "$in");
+   for (i = 0, j = 0; device_tokens[i]; i++) {
+      if (postal_device_aps_token_pack(device_tokens[i], packed)) {
+         mongo_bson_append_binary(q, mongo_bson_index_key(j++, idxstr), 0,
+                                  packed, sizeof packed);
+      }
+      mongo_bson_append_string(q, mongo_bson_index_key(j++, idxstr),
+                               device_tokens[i]);
+   }
+   mongo_bson_append_array_end(q, in);
+   mongo_bson_append_document_end(q, field);
+   mongo_bson_append_document_end(q, clause);
+
+   clause = mongo_bson_append_document_begin(q,
+                                             mongo_bson_index_key(1, idxstr));
+   field = mongo_bson_append_document_begin(q, "user");
+   in = mongo_bson_append_array_begin(q, "$in");
    for (i = 0; users[i]; i++) {
-      g_snprintf(idxstr, sizeof idxstr, "%u", i);
-      idxstr[sizeof idxstr - 1] = '\0';
+      key = mongo_bson_index_key(i, idxstr);
       if ((oid = mongo_object_id_new_from_string(users[i]))) {
-         mongo_bson_append_object_id(ar, idxstr, oid);
+         mongo_bson_append_object_id(q, key, oid);
          mongo_object_id_free(oid);
       } else {
-         mongo_bson_append_string(ar, idxstr, users[i]);
+         mongo_bson_append_string(q, key, users[i]);
       }
    }
+   mongo_bson_append_array_end(q, in);
+   mongo_bson_append_document_end(q, field);
+   mongo_bson_append_document_end(q, clause);
 
-   in = mongo_bson_new_empty();
-   mongo_bson_append_array(in, "$in", ar);
-   mongo_bson_append_bson(q, "user", in);
-   mongo_bson_append_bson(or, "1", q);
+   mongo_bson_append_array_end(q, or);
+   mongo_bson_append_null(q, "removed_at");
 
-   mongo_bson_unref(ar);
-   mongo_bson_unref(in);
-   mongo_bson_unref(q);
+   /*
+    * Only fetch the fields needed for delivery.
+    */
+   fields = fanout_device_fields();
+
+   fanout->cursor = g_object_new(MONGO_TYPE_CURSOR,
+                                 "batch-size", priv->notify_batch_size,
+                                 "collection", priv->collection,
+                                 "connection", priv->mongo,
+                                 "database", priv->db,
+                                 "fields", fields,
+                                 "flags", MONGO_QUERY_SLAVE_OK,
+                                 "prefetch", POSTAL_SERVICE_CURSOR_PREFETCH,
+                                 "query", q,
+                                 NULL);
+
+   mongo_cursor_foreach_async(fanout->cursor,
+                              postal_service_notify_foreach,
+                              fanout,
+                              (GDestroyNotify)fanout_unref,
+                              cancellable,
+                              postal_service_notify_cb,
+                              simple);
+
+   mongo_bson_unref(fields);
+   mongo_bson_unref(q);
+
+   EXIT;
+}
+
+gboolean
+postal_service_notify_finish (PostalService  *service,
+                              GAsyncResult   *result,
+                              GError        **error)
+{
+   GSimpleAsyncResult *simple = (GSimpleAsyncResult *)result;
+   gboolean ret;
+
+   g_return_val_if_fail(POSTAL_IS_SERVICE(service), FALSE);
+   g_return_val_if_fail(G_IS_SIMPLE_ASYNC_RESULT(simple), FALSE);
+
+   if (!(ret = g_simple_async_result_get_op_res_gboolean(simple))) {
+      g_simple_async_result_propagate_error(simple, error);
+   }
+
+   return ret;
+}
+
+static void
+postal_service_set_user_badge_cb3 (GObject      *object,
+                                   GAsyncResult *result,
+                                   gpointer      user_data)
+{
+   PushApsClient *client = (PushApsClient *)object;
+   GError *error = NULL;
+
+   ENTRY;
+
+   g_assert(PUSH_IS_APS_CLIENT(client));
+
+   if (!push_aps_client_deliver_finish(client, result, &error)) {
+      g_warning("%s", error->message);
+      g_error_free(error);
+      EXIT;
+   }
+
+   EXIT;
+}
+
+static void
+postal_service_set_user_badge_cb2 (GObject      *object,
+                                   GAsyncResult *result,
+                                   gpointer      user_data)
+{
+   MongoMessageReply *reply;
+   MongoConnection *connection = (MongoConnection *)object;
+   PushApsIdentity *identity;
+   PushApsMessage *message;
+   PostalService *service = user_data;
+   PostalDevice *device;
+   GList *list;
+
+   ENTRY;
+
+   if ((reply = mongo_connection_query_finish(connection, result, NULL))) {
+      message = push_aps_message_new();
+      list = mongo_message_reply_get_documents(reply);
+      for (; list; list = list->next) {
+         device = postal_device_new();
+         if (!postal_device_load_from_bson(device, list->data, NULL)) {
+            g_object_unref(device);
+            continue;
+         }
+         push_aps_message_set_badge(message,
+                                    postal_device_get_badge(device));
+         identity = push_aps_identity_new(postal_device_get_device_token(device));
+         push_aps_client_deliver_async(service->priv->aps,
+                                       identity,
+                                       message,
+                                       NULL,
+                                       postal_service_set_user_badge_cb3,
+                                       NULL);
+         postal_metrics_device_notified(service->priv->metrics,
+                                        postal_device_get_device_type(device),
+                                        postal_device_get_device_token(device),
+                                        postal_device_get_user(device));
+         g_object_unref(identity);
+         g_object_unref(device);
+      }
+      g_object_unref(message);
+      g_object_unref(reply);
+   }
+
+   g_object_unref(service);
+
+   EXIT;
+}
+
+static void
+postal_service_set_user_badge_cb (GObject      *object,
+                                  GAsyncResult *result,
+                                  gpointer      user_data)
+{
+   GSimpleAsyncResult *simple = user_data;
+   MongoConnection *connection = (MongoConnection *)object;
+   PostalService *service;
+   MongoBson *q;
+   GError *error = NULL;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_CONNECTION(connection));
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+
+   if (!mongo_connection_update_finish(connection, result, NULL, &error)) {
+      g_simple_async_result_take_error(simple, error);
+      GOTO(failure);
+   }
+
+   if ((q = g_object_get_data(G_OBJECT(simple), "query"))) {
+      service = POSTAL_SERVICE(g_async_result_get_source_object(G_ASYNC_RESULT(simple)));
+      mongo_connection_query_async(service->priv->mongo,
+                                   service->priv->db_and_collection,
+                                   MONGO_QUERY_NONE,
+                                   0,
+                                   0,
+                                   q,
+                                   NULL,
+                                   NULL,
+                                   postal_service_set_user_badge_cb2,
+                                   g_object_ref(service));
+      g_object_unref(service);
+   }
+
+   g_simple_async_result_set_op_res_gboolean(simple, TRUE);
+
+failure:
+   g_simple_async_result_complete_in_idle(simple);
+   g_object_unref(simple);
+
+   EXIT;
+}
+
+void
+postal_service_set_user_badge (PostalService       *service,
+                               const gchar         *user,
+                               guint                badge,
+                               GCancellable        *cancellable,
+                               GAsyncReadyCallback  callback,
+                               gpointer             user_data)
+{
+   PostalServicePrivate *priv;
+   GSimpleAsyncResult *simple;
+   MongoObjectId *oid;
+   MongoBson *q;
+   MongoBson *set;
+   MongoBson *u;
+   GTimeVal tv;
+
+   g_return_if_fail(POSTAL_IS_SERVICE(service));
+   g_return_if_fail(user);
+   g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
+   g_return_if_fail(callback);
+
+   priv = service->priv;
+
+   simple = g_simple_async_result_new(G_OBJECT(service), callback, user_data,
+                                      postal_service_set_user_badge);
+   g_simple_async_result_set_check_cancellable(simple, cancellable);
+
+   g_get_current_time(&tv);
+
+   q = mongo_bson_new_empty();
+   if ((oid = mongo_object_id_new_from_string(user))) {
+      mongo_bson_append_object_id(q, "user", oid);
+      mongo_object_id_free(oid);
+   } else {
+      mongo_bson_append_string(q, "user", user);
+   }
+   /*
+    * Currently, only APS supports the concept of a "badge".
+    * We can open this up to others eventually.
+    */
+   mongo_bson_append_string(q, "device_type", "aps");
+
+   set = mongo_bson_new_empty();
+   mongo_bson_append_int(set, "badge", badge);
+   mongo_bson_append_timeval(set, "modified_at", &tv);
+
+   u = mongo_bson_new_empty();
+   mongo_bson_append_bson(u, "$set", set);
+
+   g_object_set_data_full(G_OBJECT(simple),
+                          "query",
+                          mongo_bson_ref(q),
+                          (GDestroyNotify)mongo_bson_unref);
+
+   mongo_connection_update_async(priv->mongo,
+                                 priv->db_and_collection,
+                                 MONGO_UPDATE_MULTI_UPDATE,
+                                 q,
+                                 u,
+                                 NULL,
+                                 cancellable,
+                                 postal_service_set_user_badge_cb,
+                                 simple);
+
+   mongo_bson_unref(set);
+   mongo_bson_unref(u);
+   mongo_bson_unref(q);
+}
+
+gboolean
+postal_service_set_user_badge_finish (PostalService  *service,
+                                      GAsyncResult   *result,
+                                      GError        **error)
+{
+   GSimpleAsyncResult *simple = (GSimpleAsyncResult *)result;
+   gboolean ret;
+
+   ENTRY;
+
+   g_return_val_if_fail(POSTAL_IS_SERVICE(service), FALSE);
+   g_return_val_if_fail(G_IS_SIMPLE_ASYNC_RESULT(simple), FALSE);
+
+   if (!(ret = g_simple_async_result_get_op_res_gboolean(simple))) {
+      g_simple_async_result_propagate_error(simple, error);
+   }
+
+   RETURN(ret);
+}
+
+static void
+postal_service_aps_identity_removed_cb (GObject      *object,
+                                        GAsyncResult *result,
+                                        gpointer      user_data)
+{
+   MongoConnection *connection = (MongoConnection *)object;
+   GError *error = NULL;
+
+   ENTRY;
+
+   g_return_if_fail(MONGO_IS_CONNECTION(connection));
+
+   if (!mongo_connection_update_finish(connection,
+                                       result,
+                                       NULL,
+                                       &error)) {
+      g_warning("Device removal failed: %s\n", error->message);
+      g_error_free(error);
+   }
+
+   EXIT;
+}
+
+static void
+postal_service_aps_identity_removed (PostalService   *service,
+                                     PushApsIdentity *identity,
+                                     PushApsClient   *client)
+{
+   PostalServicePrivate *priv;
+   const gchar *device_token;
+   MongoBson *q;
+   MongoBson *set;
+   MongoBson *u;
+   GTimeVal tv;
+
+   ENTRY;
+
+   g_assert(POSTAL_IS_SERVICE(service));
+   g_assert(PUSH_IS_APS_IDENTITY(identity));
+
+   priv = service->priv;
+   device_token = push_aps_identity_get_device_token(identity);
+
+   q = mongo_bson_new_empty();
+   mongo_bson_append_string(q, "device_type", "aps");
+   postal_service_append_token(q, device_token);
+   mongo_bson_append_null(q, "removed_at");
+
+   g_get_current_time(&tv);
+
+   if (priv->index) {
+      postal_device_index_mark_removed(priv->index,
+                                       NULL,
+                                       POSTAL_DEVICE_APS,
+                                       device_token,
+                                       &tv);
+   }
+
+   if (priv->registered) {
+      postal_reg_cache_remove(priv->registered, NULL, device_token);
+   }
+
+   set = mongo_bson_new_empty();
+   mongo_bson_append_timeval(set, "removed_at", &tv);
+
+   u = mongo_bson_new_empty();
+   mongo_bson_append_bson(u, "$set", set);
+
+   mongo_connection_update_async(priv->mongo,
+                                 priv->db_and_collection,
+                                 MONGO_UPDATE_MULTI_UPDATE,
+                                 q,
+                                 u,
+                                 priv->unacknowledged,
+                                 NULL,
+                                 postal_service_aps_identity_removed_cb,
+                                 NULL);
+
+   mongo_bson_unref(q);
+   mongo_bson_unref(set);
+   mongo_bson_unref(u);
+
+   EXIT;
+}
+
+static void
+postal_service_c2dm_identity_removed_cb (GObject      *object,
+                                         GAsyncResult *result,
+                                         gpointer      user_data)
+{
+   MongoConnection *connection = (MongoConnection *)object;
+   GError *error = NULL;
+
+   ENTRY;
+
+   g_return_if_fail(MONGO_IS_CONNECTION(connection));
+
+   if (!mongo_connection_update_finish(connection,
+                                       result,
+                                       NULL,
+                                       &error)) {
+      g_warning("Device removal failed: %s\n", error->message);
+      g_error_free(error);
+   }
+
+   EXIT;
+}
+
+static void
+postal_service_c2dm_identity_removed (PostalService    *service,
+                                      PushC2dmIdentity *identity,
+                                      PushC2dmClient   *client)
+{
+   PostalServicePrivate *priv;
+   const gchar *device_token;
+   MongoBson *q;
+   MongoBson *set;
+   MongoBson *u;
+   GTimeVal tv;
+
+   ENTRY;
+
+   g_assert(POSTAL_IS_SERVICE(service));
+   g_assert(PUSH_IS_C2DM_IDENTITY(identity));
+
+   priv = service->priv;
+   device_token = push_c2dm_identity_get_registration_id(identity);
+
+   q = mongo_bson_new_empty();
+   mongo_bson_append_string(q, "device_type", "c2dm");
+   mongo_bson_append_string(q, "device_token", device_token);
+   mongo_bson_append_null(q, "removed_at");
+
+   g_get_current_time(&tv);
+
+   if (priv->index) {
+      postal_device_index_mark_removed(priv->index,
+                                       NULL,
+                                       POSTAL_DEVICE_C2DM,
+                                       device_token,
+                                       &tv);
+   }
+
+   if (priv->registered) {
+      postal_reg_cache_remove(priv->registered, NULL, device_token);
+   }
+
+   set = mongo_bson_new_empty();
+   mongo_bson_append_timeval(set, "removed_at", &tv);
+
+   u = mongo_bson_new_empty();
+   mongo_bson_append_bson(u, "$set", set);
+
+   mongo_connection_update_async(priv->mongo,
+                                 priv->db_and_collection,
+                                 MONGO_UPDATE_MULTI_UPDATE,
+                                 q,
+                                 u,
+                                 priv->unacknowledged,
+                                 NULL,
+                                 postal_service_c2dm_identity_removed_cb,
+                                 NULL);
+
+   mongo_bson_unref(q);
+   mongo_bson_unref(set);
+   mongo_bson_unref(u);
+
+   EXIT;
+}
+
+static void
+postal_service_gcm_identity_removed_cb (GObject      *object,
+                                        GAsyncResult *result,
+                                        gpointer      user_data)
+{
+   MongoConnection *connection = (MongoConnection *)object;
+   GError *error = NULL;
+
+   ENTRY;
+
+   g_return_if_fail(MONGO_IS_CONNECTION(connection));
+
+   if (!mongo_connection_update_finish(connection,
+                                       result,
+                                       NULL,
+                                       &error)) {
+      g_warning("Device removal failed: %s\n", error->message);
+      g_error_free(error);
+   }
+
+   EXIT;
+}
+
+static void
+postal_service_gcm_identity_removed (PostalService   *service,
+                                     PushGcmIdentity *identity,
+                                     PushGcmClient   *client)
+{
+   PostalServicePrivate *priv;
+   const gchar *device_token;
+   MongoBson *q;
+   MongoBson *set;
+   MongoBson *u;
+   GTimeVal tv;
+
+   ENTRY;
+
+   g_assert(POSTAL_IS_SERVICE(service));
+   g_assert(PUSH_IS_GCM_IDENTITY(identity));
+
+   priv = service->priv;
+   device_token = push_gcm_identity_get_registration_id(identity);
 
    q = mongo_bson_new_empty();
-   mongo_bson_append_array(q, "$or", or);
+   mongo_bson_append_string(q, "device_type", "gcm");
+   mongo_bson_append_string(q, "device_token", device_token);
    mongo_bson_append_null(q, "removed_at");
-   mongo_bson_unref(or);
 
-   simple = g_simple_async_result_new(G_OBJECT(service), callback, user_data,
-                                      postal_service_notify);
-   g_simple_async_result_set_check_cancellable(simple, cancellable);
-   g_object_set_data_full(G_OBJECT(simple),
-                          "notification",
-                          g_object_ref(notification),
-                          g_object_unref);
+   g_get_current_time(&tv);
+
+   if (priv->index) {
+      postal_device_index_mark_removed(priv->index,
+                                       NULL,
+                                       POSTAL_DEVICE_GCM,
+                                       device_token,
+                                       &tv);
+   }
+
+   if (priv->registered) {
+      postal_reg_cache_remove(priv->registered, NULL, device_token);
+   }
+
+   set = mongo_bson_new_empty();
+   mongo_bson_append_timeval(set, "removed_at", &tv);
+
+   u = mongo_bson_new_empty();
+   mongo_bson_append_bson(u, "$set", set);
+
+   mongo_connection_update_async(priv->mongo,
+                                 priv->db_and_collection,
+                                 MONGO_UPDATE_MULTI_UPDATE,
+                                 q,
+                                 u,
+                                 priv->unacknowledged,
+                                 NULL,
+                                 postal_service_gcm_identity_removed_cb,
+                                 NULL);
+
+   mongo_bson_unref(q);
+   mongo_bson_unref(set);
+   mongo_bson_unref(u);
+
+   EXIT;
+}
+
+static void
+postal_service_index_disable (PostalService *service)
+{
+   PostalServicePrivate *priv;
+
+   g_assert(POSTAL_IS_SERVICE(service));
+
+   priv = service->priv;
+
+   if (priv->index) {
+      postal_device_index_unref(priv->index);
+      priv->index = NULL;
+   }
+
+   priv->index_loaded = FALSE;
+}
+
+static void postal_service_index_tail       (PostalService *service);
+static void postal_service_index_getmore_cb (GObject       *object,
+                                             GAsyncResult  *result,
+                                             gpointer       user_data);
+
+static gboolean
+postal_service_index_tail_timeout (gpointer data)
+{
+   PostalService *service = data;
+
+   g_assert(POSTAL_IS_SERVICE(service));
+
+   service->priv->oplog_retry = 0;
+   postal_service_index_tail(service);
+
+   return FALSE;
+}
+
+static void
+postal_service_index_tail_reply (PostalService     *service,
+                                 MongoMessageReply *reply,
+                                 GError            *error)
+{
+   PostalServicePrivate *priv;
+   const MongoBson *documents;
+   MongoBsonIter iter;
+   gsize n_documents;
+   gsize i;
+
+   ENTRY;
+
+   g_assert(POSTAL_IS_SERVICE(service));
+
+   priv = service->priv;
+
+   if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED) ||
+       !priv->index) {
+      EXIT;
+   }
+
+   priv->oplog_cursor = 0;
+
+   if (!reply) {
+      g_warning("Failed to tail the oplog: %s", error->message);
+   } else if (!(mongo_message_reply_get_flags(reply) &
+                MONGO_REPLY_CURSOR_NOT_FOUND)) {
+      documents = mongo_message_reply_peek_documents(reply, &n_documents);
+      for (i = 0; i < n_documents; i++) {
+         if (mongo_bson_iter_init_find(&iter, &documents[i], "ts") &&
+             MONGO_BSON_ITER_HOLDS_TIMESTAMP(&iter)) {
+            mongo_bson_iter_get_value_timestamp(&iter,
+                                                &priv->oplog_time,
+                                                &priv->oplog_increment);
+         }
+         postal_device_index_replay(priv->index, &documents[i]);
+      }
+      priv->oplog_cursor = mongo_message_reply_get_cursor_id(reply);
+   }
+
+   /*
+    * Keep reading from the tailable cursor. If it has died, which happens
+    * when nothing matched or the connection was lost, query again from
+    * the last entry we saw after a short delay.
+    */
+   if (priv->oplog_cursor) {
+      mongo_connection_getmore_async(priv->mongo,
+                                     POSTAL_SERVICE_OPLOG,
+                                     0,
+                                     priv->oplog_cursor,
+                                     priv->index_cancellable,
+                                     postal_service_index_getmore_cb,
+                                     g_object_ref(service));
+   } else {
+      priv->oplog_retry =
+         g_timeout_add_seconds_full(G_PRIORITY_DEFAULT,
+                                    POSTAL_SERVICE_OPLOG_RETRY_SEC,
+                                    postal_service_index_tail_timeout,
+                                    g_object_ref(service),
+                                    g_object_unref);
+   }
+
+   EXIT;
+}
+
+static void
+postal_service_index_getmore_cb (GObject      *object,
+                                 GAsyncResult *result,
+                                 gpointer      user_data)
+{
+   MongoConnection *connection = (MongoConnection *)object;
+   MongoMessageReply *reply;
+   PostalService *service = user_data;
+   GError *error = NULL;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_CONNECTION(connection));
+   g_assert(POSTAL_IS_SERVICE(service));
+
+   reply = mongo_connection_getmore_finish(connection, result, &error);
+   postal_service_index_tail_reply(service, reply, error);
+
+   g_clear_error(&error);
+   if (reply) {
+      g_object_unref(reply);
+   }
+   g_object_unref(service);
+
+   EXIT;
+}
+
+static void
+postal_service_index_tail_cb (GObject      *object,
+                              GAsyncResult *result,
+                              gpointer      user_data)
+{
+   MongoConnection *connection = (MongoConnection *)object;
+   MongoMessageReply *reply;
+   PostalService *service = user_data;
+   GError *error = NULL;
+
+   ENTRY;
+
+   g_assert(MONGO_IS_CONNECTION(connection));
+   g_assert(POSTAL_IS_SERVICE(service));
+
+   reply = mongo_connection_query_finish(connection, result, &error);
+   postal_service_index_tail_reply(service, reply, error);
+
+   g_clear_error(&error);
+   if (reply) {
+      g_object_unref(reply);
+   }
+   g_object_unref(service);
+
+   EXIT;
+}
+
+static void
+postal_service_index_tail (PostalService *service)
+{
+   PostalServicePrivate *priv;
+   MongoBson *q;
+   guint ts;
+
+   ENTRY;
+
+   g_assert(POSTAL_IS_SERVICE(service));
+
+   priv = service->priv;
+
+   /*
+    * Query for {"ts": {"$gt": <last seen>}, "ns": "db.collection"}. The
+    * ts clause must come first for the server to seek with oplog replay.
+    */
+   q = mongo_bson_new_empty();
+   ts = mongo_bson_append_document_begin(q, "ts");
+   mongo_bson_append_timestamp(q, "$gt",
+                               priv->oplog_time,
+                               priv->oplog_increment);
+   mongo_bson_append_document_end(q, ts);
+   mongo_bson_append_string(q, "ns", priv->db_and_collection);
+
+   mongo_connection_query_async(priv->mongo,
+                                POSTAL_SERVICE_OPLOG,
+                                (MONGO_QUERY_TAILABLE_CURSOR |
+                                 MONGO_QUERY_AWAIT_DATA |
+                                 MONGO_QUERY_OPLOG_REPLAY),
+                                0,
+                                0,
+                                q,
+                                NULL,
+                                priv->index_cancellable,
+                                postal_service_index_tail_cb,
+                                g_object_ref(service));
+
+   mongo_bson_unref(q);
+
+   EXIT;
+}
+
+static void
+postal_service_index_snapshot_cb (GObject      *object,
+                                  GAsyncResult *result,
+                                  gpointer      user_data)
+{
+   PostalService *service = user_data;
+   GError *error = NULL;
+   GFile *file = (GFile *)object;
+
+   ENTRY;
+
+   g_assert(G_IS_FILE(file));
+   g_assert(POSTAL_IS_SERVICE(service));
 
-   mongo_connection_query_async(priv->mongo,
-                                priv->db_and_collection,
-                                MONGO_QUERY_NONE,
-                                0,
-                                100,
-                                q,
-                                NULL,
-                                cancellable,
-                                postal_service_notify_cb,
-                                simple);
+   if (!g_file_replace_contents_finish(file, result, NULL, &error)) {
+      if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+         g_warning("Failed to write device index snapshot: %s",
+                   error->message);
+      }
+      g_error_free(error);
+   }
 
-   mongo_bson_unref(q);
+   g_bytes_unref(service->priv->snapshot_bytes);
+   service->priv->snapshot_bytes = NULL;
+   g_object_unref(service);
 
    EXIT;
 }
 
-gboolean
-postal_service_notify_finish (PostalService  *service,
-                              GAsyncResult   *result,
-                              GError        **error)
+static gboolean
+postal_service_index_snapshot (gpointer data)
 {
-   GSimpleAsyncResult *simple = (GSimpleAsyncResult *)result;
-   gboolean ret;
+   PostalServicePrivate *priv;
+   PostalService *service = data;
+   GFile *file;
 
-   g_return_val_if_fail(POSTAL_IS_SERVICE(service), FALSE);
-   g_return_val_if_fail(G_IS_SIMPLE_ASYNC_RESULT(simple), FALSE);
+   ENTRY;
 
-   if (!(ret = g_simple_async_result_get_op_res_gboolean(simple))) {
-      g_simple_async_result_propagate_error(simple, error);
+   g_assert(POSTAL_IS_SERVICE(service));
+
+   priv = service->priv;
+
+   /*
+    * Skip this round if the previous snapshot is still being written.
+    * The contents are serialized here since the index is not thread-safe,
+    * and written to disk asynchronously.
+    */
+   if (!priv->snapshot_bytes && priv->index) {
+      priv->snapshot_bytes =
+         postal_device_index_save_to_bytes(priv->index,
+                                           priv->oplog_time,
+                                           priv->oplog_increment);
+      file = g_file_new_for_path(priv->snapshot_path);
+      g_file_replace_contents_async(file,
+                                    g_bytes_get_data(priv->snapshot_bytes,
+                                                     NULL),
+                                    g_bytes_get_size(priv->snapshot_bytes),
+                                    NULL,
+                                    FALSE,
+                                    G_FILE_CREATE_NONE,
+                                    priv->index_cancellable,
+                                    postal_service_index_snapshot_cb,
+                                    g_object_ref(service));
+      g_object_unref(file);
    }
 
-   return ret;
+   RETURN(TRUE);
 }
 
 static void
-postal_service_set_user_badge_cb3 (GObject      *object,
-                                   GAsyncResult *result,
-                                   gpointer      user_data)
+postal_service_index_ready (PostalService *service)
 {
-   PushApsClient *client = (PushApsClient *)object;
-   GError *error = NULL;
+   PostalServicePrivate *priv;
 
    ENTRY;
 
-   g_assert(PUSH_IS_APS_CLIENT(client));
+   g_assert(POSTAL_IS_SERVICE(service));
 
-   if (!push_aps_client_deliver_finish(client, result, &error)) {
-      g_warning("%s", error->message);
-      g_error_free(error);
-      EXIT;
+   priv = service->priv;
+
+   priv->index_loaded = TRUE;
+   postal_service_index_tail(service);
+
+   if (priv->snapshot_path) {
+      priv->snapshot_source =
+         g_timeout_add_seconds_full(G_PRIORITY_LOW,
+                                    priv->snapshot_interval,
+                                    postal_service_index_snapshot,
+                                    g_object_ref(service),
+                                    g_object_unref);
    }
 
    EXIT;
 }
 
+static gboolean
+postal_service_index_load_foreach (MongoCursor *cursor,
+                                   MongoBson   *bson,
+                                   gpointer     user_data)
+{
+   PostalDeviceIndex *index = user_data;
+
+   g_assert(MONGO_IS_CURSOR(cursor));
+   g_assert(bson);
+   g_assert(index);
+
+   postal_device_index_insert(index, bson);
+
+   return TRUE;
+}
+
 static void
-postal_service_set_user_badge_cb2 (GObject      *object,
-                                   GAsyncResult *result,
-                                   gpointer      user_data)
+postal_service_index_load_cb (GObject      *object,
+                              GAsyncResult *result,
+                              gpointer      user_data)
 {
-   MongoMessageReply *reply;
-   MongoConnection *connection = (MongoConnection *)object;
-   PushApsIdentity *identity;
-   PushApsMessage *message;
+   PostalServicePrivate *priv;
    PostalService *service = user_data;
-   PostalDevice *device;
-   GList *list;
+   MongoCursor *cursor = (MongoCursor *)object;
+   GError *error = NULL;
 
    ENTRY;
 
-   if ((reply = mongo_connection_query_finish(connection, result, NULL))) {
-      message = push_aps_message_new();
-      list = mongo_message_reply_get_documents(reply);
-      for (; list; list = list->next) {
-         device = postal_device_new();
-         if (!postal_device_load_from_bson(device, list->data, NULL)) {
-            g_object_unref(device);
-            continue;
-         }
-         push_aps_message_set_badge(message,
-                                    postal_device_get_badge(device));
-         identity = push_aps_identity_new(postal_device_get_device_token(device));
-         push_aps_client_deliver_async(service->priv->aps,
-                                       identity,
-                                       message,
-                                       NULL,
-                                       postal_service_set_user_badge_cb3,
-                                       NULL);
-         postal_metrics_device_notified(service->priv->metrics, device);
-         g_object_unref(identity);
-         g_object_unref(device);
+   g_assert(MONGO_IS_CURSOR(cursor));
+   g_assert(POSTAL_IS_SERVICE(service));
+
+   priv = service->priv;
+
+   if (!mongo_cursor_foreach_finish(cursor, result, &error)) {
+      if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+         g_warning("Failed to load the device index: %s", error->message);
+         postal_service_index_disable(service);
       }
-      g_object_unref(message);
-      g_object_unref(reply);
+      g_error_free(error);
+      GOTO(cleanup);
    }
 
+   g_message("Loaded %u devices into the device index.",
+             postal_device_index_get_size(priv->index));
+
+   postal_service_index_ready(service);
+
+cleanup:
    g_object_unref(service);
 
    EXIT;
 }
 
 static void
-postal_service_set_user_badge_cb (GObject      *object,
+postal_service_index_position_cb (GObject      *object,
                                   GAsyncResult *result,
                                   gpointer      user_data)
 {
-   GSimpleAsyncResult *simple = user_data;
+   PostalServicePrivate *priv;
    MongoConnection *connection = (MongoConnection *)object;
-   PostalService *service;
+   MongoMessageReply *reply;
+   const MongoBson *documents;
+   PostalService *service = user_data;
+   MongoBsonIter iter;
+   MongoCursor *cursor;
    MongoBson *q;
    GError *error = NULL;
+   gsize n_documents = 0;
 
    ENTRY;
 
    g_assert(MONGO_IS_CONNECTION(connection));
-   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+   g_assert(POSTAL_IS_SERVICE(service));
 
-   if (!mongo_connection_update_finish(connection, result, NULL, &error)) {
-      g_simple_async_result_take_error(simple, error);
-      GOTO(failure);
+   priv = service->priv;
+
+   if (!(reply = mongo_connection_query_finish(connection, result, &error))) {
+      if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+         g_warning("Failed to read the oplog, device index disabled: %s",
+                   error->message);
+         postal_service_index_disable(service);
+      }
+      g_error_free(error);
+      GOTO(cleanup);
    }
 
-   if ((q = g_object_get_data(G_OBJECT(simple), "query"))) {
-      service = POSTAL_SERVICE(g_async_result_get_source_object(G_ASYNC_RESULT(simple)));
-      mongo_connection_query_async(service->priv->mongo,
-                                   service->priv->db_and_collection,
-                                   MONGO_QUERY_NONE,
-                                   0,
-                                   0,
-                                   q,
-                                   NULL,
-                                   NULL,
-                                   postal_service_set_user_badge_cb2,
-                                   g_object_ref(service));
-      g_object_unref(service);
+   /*
+    * Without an oplog we would not see writes made by other instances,
+    * so the index cannot be used.
+    */
+   documents = mongo_message_reply_peek_documents(reply, &n_documents);
+   if (!n_documents ||
+       !mongo_bson_iter_init_find(&iter, &documents[0], "ts") ||
+       !MONGO_BSON_ITER_HOLDS_TIMESTAMP(&iter)) {
+      g_warning("No replica set oplog was found, device index disabled.");
+      postal_service_index_disable(service);
+      g_object_unref(reply);
+      GOTO(cleanup);
    }
 
-   g_simple_async_result_set_op_res_gboolean(simple, TRUE);
+   /*
+    * Remember where the oplog was before scanning the collection. Writes
+    * made during the scan are replayed once we start tailing, which is
+    * harmless for those the scan already saw.
+    */
+   mongo_bson_iter_get_value_timestamp(&iter,
+                                       &priv->oplog_time,
+                                       &priv->oplog_increment);
+   g_object_unref(reply);
 
-failure:
-   g_simple_async_result_complete_in_idle(simple);
-   g_object_unref(simple);
+   q = mongo_bson_new_empty();
+   cursor = g_object_new(MONGO_TYPE_CURSOR,
+                         "batch-size", priv->notify_batch_size,
+                         "collection", priv->collection,
+                         "connection", priv->mongo,
+                         "database", priv->db,
+                         "prefetch", POSTAL_SERVICE_CURSOR_PREFETCH,
+                         "query", q,
+                         NULL);
+   mongo_cursor_foreach_async(cursor,
+                              postal_service_index_load_foreach,
+                              postal_device_index_ref(priv->index),
+                              (GDestroyNotify)postal_device_index_unref,
+                              priv->index_cancellable,
+                              postal_service_index_load_cb,
+                              g_object_ref(service));
+   mongo_bson_unref(q);
+   g_object_unref(cursor);
+
+cleanup:
+   g_object_unref(service);
 
    EXIT;
 }
 
-void
-postal_service_set_user_badge (PostalService       *service,
-                               const gchar         *user,
-                               guint                badge,
-                               GCancellable        *cancellable,
-                               GAsyncReadyCallback  callback,
-                               gpointer             user_data)
+static void
+postal_service_index_query_oplog (PostalService       *service,
+                                  gint                 order,
+                                  GAsyncReadyCallback  callback)
 {
    PostalServicePrivate *priv;
-   GSimpleAsyncResult *simple;
-   MongoObjectId *oid;
    MongoBson *q;
-   MongoBson *set;
-   MongoBson *u;
-   GTimeVal tv;
-
-   g_return_if_fail(POSTAL_IS_SERVICE(service));
-   g_return_if_fail(user);
-   g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
-   g_return_if_fail(callback);
+   guint doc;
 
-   priv = service->priv;
+   ENTRY;
 
-   simple = g_simple_async_result_new(G_OBJECT(service), callback, user_data,
-                                      postal_service_set_user_badge);
-   g_simple_async_result_set_check_cancellable(simple, cancellable);
+   g_assert(POSTAL_IS_SERVICE(service));
+   g_assert(callback);
 
-   g_get_current_time(&tv);
+   priv = service->priv;
 
-   q = mongo_bson_new_empty();
-   if ((oid = mongo_object_id_new_from_string(user))) {
-      mongo_bson_append_object_id(q, "user", oid);
-      mongo_object_id_free(oid);
-   } else {
-      mongo_bson_append_string(q, "user", user);
-   }
    /*
-    * Currently, only APS supports the concept of a "badge".
-    * We can open this up to others eventually.
+    * Fetch the oldest or newest entry of the oplog, depending on @order.
+    * The oplog position, the collection scan and the tailing cursor all
+    * run against the primary so that they see the same history.
     */
-   mongo_bson_append_string(q, "device_type", "aps");
-
-   set = mongo_bson_new_empty();
-   mongo_bson_append_int(set, "badge", badge);
-   mongo_bson_append_timeval(set, "modified_at", &tv);
-
-   u = mongo_bson_new_empty();
-   mongo_bson_append_bson(u, "$set", set);
-
-   g_object_set_data_full(G_OBJECT(simple),
-                          "query",
-                          mongo_bson_ref(q),
-                          (GDestroyNotify)mongo_bson_unref);
+   q = mongo_bson_new_empty();
+   doc = mongo_bson_append_document_begin(q, "$query");
+   mongo_bson_append_document_end(q, doc);
+   doc = mongo_bson_append_document_begin(q, "$orderby");
+   mongo_bson_append_int(q, "$natural", order);
+   mongo_bson_append_document_end(q, doc);
 
-   mongo_connection_update_async(priv->mongo,
-                                 priv->db_and_collection,
-                                 MONGO_UPDATE_MULTI_UPDATE,
-                                 q,
-                                 u,
-                                 cancellable,
-                                 postal_service_set_user_badge_cb,
-                                 simple);
+   mongo_connection_query_async(priv->mongo,
+                                POSTAL_SERVICE_OPLOG,
+                                MONGO_QUERY_NONE,
+                                0,
+                                1,
+                                q,
+                                NULL,
+                                priv->index_cancellable,
+                                callback,
+                                g_object_ref(service));
 
-   mongo_bson_unref(set);
-   mongo_bson_unref(u);
    mongo_bson_unref(q);
-}
-
-gboolean
-postal_service_set_user_badge_finish (PostalService  *service,
-                                      GAsyncResult   *result,
-                                      GError        **error)
-{
-   GSimpleAsyncResult *simple = (GSimpleAsyncResult *)result;
-   gboolean ret;
 
-   ENTRY;
-
-   g_return_val_if_fail(POSTAL_IS_SERVICE(service), FALSE);
-   g_return_val_if_fail(G_IS_SIMPLE_ASYNC_RESULT(simple), FALSE);
-
-   if (!(ret = g_simple_async_result_get_op_res_gboolean(simple))) {
-      g_simple_async_result_propagate_error(simple, error);
-   }
-
-   RETURN(ret);
+   EXIT;
 }
 
 static void
-postal_service_aps_identity_removed_cb (GObject      *object,
-                                        GAsyncResult *result,
-                                        gpointer      user_data)
+postal_service_index_window_cb (GObject      *object,
+                                GAsyncResult *result,
+                                gpointer      user_data)
 {
+   PostalServicePrivate *priv;
    MongoConnection *connection = (MongoConnection *)object;
+   MongoMessageReply *reply;
+   const MongoBson *documents;
+   PostalService *service = user_data;
+   MongoBsonIter iter;
    GError *error = NULL;
+   guint32 oldest_time;
+   guint32 oldest_increment;
+   gsize n_documents = 0;
 
    ENTRY;
 
-   g_return_if_fail(MONGO_IS_CONNECTION(connection));
+   g_assert(MONGO_IS_CONNECTION(connection));
+   g_assert(POSTAL_IS_SERVICE(service));
 
-   if (!mongo_connection_update_finish(connection,
-                                       result,
-                                       NULL,
-                                       &error)) {
-      g_warning("Device removal failed: %s\n", error->message);
+   priv = service->priv;
+
+   if (!(reply = mongo_connection_query_finish(connection, result, &error))) {
+      if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+         g_warning("Failed to read the oplog, device index disabled: %s",
+                   error->message);
+         postal_service_index_disable(service);
+      }
       g_error_free(error);
+      GOTO(cleanup);
+   }
+
+   documents = mongo_message_reply_peek_documents(reply, &n_documents);
+   if (!n_documents ||
+       !mongo_bson_iter_init_find(&iter, &documents[0], "ts") ||
+       !MONGO_BSON_ITER_HOLDS_TIMESTAMP(&iter)) {
+      g_warning("No replica set oplog was found, device index disabled.");
+      postal_service_index_disable(service);
+      g_object_unref(reply);
+      GOTO(cleanup);
+   }
+
+   mongo_bson_iter_get_value_timestamp(&iter,
+                                       &oldest_time,
+                                       &oldest_increment);
+   g_object_unref(reply);
+
+   /*
+    * The snapshot can only be brought up to date if the oplog still
+    * holds every entry since its high-water mark. Otherwise fall back
+    * to scanning the collection.
+    */
+   if ((oldest_time > priv->oplog_time) ||
+       ((oldest_time == priv->oplog_time) &&
+        (oldest_increment > priv->oplog_increment))) {
+      g_message("Device index snapshot is older than the oplog, "
+                "rescanning the collection.");
+      postal_device_index_unref(priv->index);
+      priv->index = postal_device_index_new();
+      postal_service_index_query_oplog(service, -1,
+                                       postal_service_index_position_cb);
+      GOTO(cleanup);
    }
 
+   g_message("Loaded %u devices from the device index snapshot.",
+             postal_device_index_get_size(priv->index));
+
+   postal_service_index_ready(service);
+
+cleanup:
+   g_object_unref(service);
+
    EXIT;
 }
 
+/*
+ * Loads the device index, either from a snapshot or by scanning the
+ * devices collection, and keeps it up to date by tailing the replica set
+ * oplog. Requests are served from Mongo until the load has completed.
+ */
 static void
-postal_service_aps_identity_removed (PostalService   *service,
-                                     PushApsIdentity *identity,
-                                     PushApsClient   *client)
+postal_service_index_load (PostalService *service)
 {
    PostalServicePrivate *priv;
-   MongoBson *q;
-   MongoBson *set;
-   MongoBson *u;
-   GTimeVal tv;
+   GError *error = NULL;
 
    ENTRY;
 
    g_assert(POSTAL_IS_SERVICE(service));
-   g_assert(PUSH_IS_APS_IDENTITY(identity));
 
    priv = service->priv;
 
-   q = mongo_bson_new_empty();
-   mongo_bson_append_string(q, "device_type", "aps");
-   mongo_bson_append_string(q, "device_token",
-                            push_aps_identity_get_device_token(identity));
-   mongo_bson_append_null(q, "removed_at");
+   priv->index_cancellable = g_cancellable_new();
+
+   if (priv->snapshot_path) {
+      priv->index = postal_device_index_new_from_file(priv->snapshot_path,
+                                                      &priv->oplog_time,
+                                                      &priv->oplog_increment,
+                                                      &error);
+      if (priv->index) {
+         postal_service_index_query_oplog(service, 1,
+                                          postal_service_index_window_cb);
+         EXIT;
+      }
+      if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+         g_warning("Failed to load device index snapshot: %s",
+                   error->message);
+      }
+      g_error_free(error);
+   }
 
-   g_get_current_time(&tv);
-   set = mongo_bson_new_empty();
-   mongo_bson_append_timeval(set, "removed_at", &tv);
+   /*
+    * Fetch the newest oplog entry so that we know where to start tailing
+    * once the collection has been scanned.
+    */
+   priv->index = postal_device_index_new();
+   postal_service_index_query_oplog(service, -1,
+                                    postal_service_index_position_cb);
 
-   u = mongo_bson_new_empty();
-   mongo_bson_append_bson(u, "$set", set);
+   EXIT;
+}
 
-   mongo_connection_update_async(priv->mongo,
-                                 priv->db_and_collection,
-                                 MONGO_UPDATE_MULTI_UPDATE,
-                                 q,
-                                 u,
-                                 NULL,
-                                 postal_service_aps_identity_removed_cb,
-                                 NULL);
+/*
+ * State for rewriting APS tokens stored as hex strings into their packed
+ * form. Like a fan-out, each outstanding update holds a reference and the
+ * cursor is paused while too many updates are waiting to be acknowledged.
+ */
+typedef struct
+{
+   volatile gint  ref_count;
+   PostalService *service;
+   MongoCursor   *cursor;
+   guint          in_flight;
+   gboolean       paused;
+   guint          n_migrated;
+   guint          n_failed;
+} TokenMigration;
+
+static TokenMigration *
+token_migration_ref (TokenMigration *migration)
+{
+   g_assert(migration);
+   g_assert_cmpint(migration->ref_count, >, 0);
 
-   mongo_bson_unref(q);
-   mongo_bson_unref(set);
-   mongo_bson_unref(u);
+   g_atomic_int_inc(&migration->ref_count);
 
-   EXIT;
+   return migration;
 }
 
 static void
-postal_service_c2dm_identity_removed_cb (GObject      *object,
+token_migration_unref (TokenMigration *migration)
+{
+   g_assert(migration);
+   g_assert_cmpint(migration->ref_count, >, 0);
+
+   if (g_atomic_int_dec_and_test(&migration->ref_count)) {
+      g_message("Packed %u APS device tokens, %u failed.",
+                migration->n_migrated, migration->n_failed);
+      g_clear_object(&migration->cursor);
+      g_object_unref(migration->service);
+      g_slice_free(TokenMigration, migration);
+   }
+}
+
+static void
+postal_service_migrate_tokens_update_cb (GObject      *object,
                                          GAsyncResult *result,
                                          gpointer      user_data)
 {
    MongoConnection *connection = (MongoConnection *)object;
+   TokenMigration *migration = user_data;
    GError *error = NULL;
 
    ENTRY;
 
    g_return_if_fail(MONGO_IS_CONNECTION(connection));
+   g_assert(migration);
+   g_assert_cmpint(migration->in_flight, >, 0);
 
    if (!mongo_connection_update_finish(connection,
                                        result,
                                        NULL,
                                        &error)) {
-      g_warning("Device removal failed: %s\n", error->message);
+      g_warning("Device token migration failed: %s", error->message);
       g_error_free(error);
+      migration->n_failed++;
+   } else {
+      migration->n_migrated++;
+   }
+
+   /*
+    * Resume the cursor once we have drained to half of our limit.
+    */
+   migration->in_flight--;
+   if (migration->paused &&
+       (migration->in_flight <=
+        (migration->service->priv->notify_max_in_flight / 2))) {
+      migration->paused = FALSE;
+      if (migration->cursor) {
+         mongo_cursor_resume(migration->cursor);
+      }
    }
 
+   token_migration_unref(migration);
+
    EXIT;
 }
 
-static void
-postal_service_c2dm_identity_removed (PostalService    *service,
-                                      PushC2dmIdentity *identity,
-                                      PushC2dmClient   *client)
+static gboolean
+postal_service_migrate_tokens_foreach (MongoCursor *cursor,
+                                       MongoBson   *bson,
+                                       gpointer     user_data)
 {
    PostalServicePrivate *priv;
+   TokenMigration *migration = user_data;
+   MongoObjectId *oid = NULL;
+   MongoBsonIter iter;
+   const gchar *device_token = NULL;
    MongoBson *q;
-   MongoBson *set;
    MongoBson *u;
-   GTimeVal tv;
+   guint8 packed[POSTAL_DEVICE_APS_TOKEN_SIZE];
+   guint set;
 
-   ENTRY;
+   g_assert(MONGO_IS_CURSOR(cursor));
+   g_assert(bson);
+   g_assert(migration);
 
-   g_assert(POSTAL_IS_SERVICE(service));
-   g_assert(PUSH_IS_C2DM_IDENTITY(identity));
+   priv = migration->service->priv;
 
-   priv = service->priv;
+   mongo_bson_iter_init(&iter, bson);
+   while (mongo_bson_iter_next(&iter)) {
+      if (mongo_bson_iter_is_key(&iter, "_id") &&
+          MONGO_BSON_ITER_HOLDS_OBJECT_ID(&iter)) {
+         mongo_clear_object_id(&oid);
+         oid = mongo_bson_iter_get_value_object_id(&iter);
+      } else if (mongo_bson_iter_is_key(&iter, "device_token") &&
+                 MONGO_BSON_ITER_HOLDS_UTF8(&iter)) {
+         device_token = mongo_bson_iter_get_value_string(&iter, NULL);
+      }
+   }
 
-   q = mongo_bson_new_empty();
-   mongo_bson_append_string(q, "device_type", "c2dm");
-   mongo_bson_append_string(q, "device_token",
-                            push_c2dm_identity_get_registration_id(identity));
-   mongo_bson_append_null(q, "removed_at");
+   if (!oid ||
+       !device_token ||
+       !postal_device_aps_token_pack(device_token, packed)) {
+      mongo_clear_object_id(&oid);
+      return TRUE;
+   }
 
-   g_get_current_time(&tv);
-   set = mongo_bson_new_empty();
-   mongo_bson_append_timeval(set, "removed_at", &tv);
+   /*
+    * Only rewrite the token if the device was not changed since it was
+    * read.
+    */
+   q = mongo_bson_new_empty();
+   mongo_bson_append_object_id(q, "_id", oid);
+   mongo_bson_append_string(q, "device_token", device_token);
 
    u = mongo_bson_new_empty();
-   mongo_bson_append_bson(u, "$set", set);
+   set = mongo_bson_append_document_begin(u, "$set");
+   mongo_bson_append_binary(u, "device_token", 0, packed, sizeof packed);
+   mongo_bson_append_document_end(u, set);
 
+   /*
+    * Updates are acknowledged so that the cursor can be paused while
+    * Mongo falls behind, rather than queueing the whole collection. The
+    * remainder of the current batch is still dispatched.
+    */
    mongo_connection_update_async(priv->mongo,
                                  priv->db_and_collection,
-                                 MONGO_UPDATE_MULTI_UPDATE,
+                                 MONGO_UPDATE_NONE,
                                  q,
                                  u,
                                  NULL,
-                                 postal_service_c2dm_identity_removed_cb,
-                                 NULL);
+                                 NULL,
+                                 postal_service_migrate_tokens_update_cb,
+                                 token_migration_ref(migration));
+
+   migration->in_flight++;
+   if ((migration->in_flight >= priv->notify_max_in_flight) &&
+       !migration->paused &&
+       migration->cursor) {
+      migration->paused = TRUE;
+      mongo_cursor_pause(migration->cursor);
+   }
 
    mongo_bson_unref(q);
-   mongo_bson_unref(set);
    mongo_bson_unref(u);
+   mongo_object_id_free(oid);
 
-   EXIT;
+   return TRUE;
 }
 
 static void
-postal_service_gcm_identity_removed_cb (GObject      *object,
-                                        GAsyncResult *result,
-                                        gpointer      user_data)
+postal_service_migrate_tokens_cb (GObject      *object,
+                                  GAsyncResult *result,
+                                  gpointer      user_data)
 {
-   MongoConnection *connection = (MongoConnection *)object;
+   TokenMigration *migration = user_data;
+   MongoCursor *cursor = (MongoCursor *)object;
    GError *error = NULL;
 
    ENTRY;
 
-   g_return_if_fail(MONGO_IS_CONNECTION(connection));
+   g_assert(MONGO_IS_CURSOR(cursor));
+   g_assert(migration);
 
-   if (!mongo_connection_update_finish(connection,
-                                       result,
-                                       NULL,
-                                       &error)) {
-      g_warning("Device removal failed: %s\n", error->message);
+   if (!mongo_cursor_foreach_finish(cursor, result, &error)) {
+      g_warning("Device token migration stopped: %s", error->message);
       g_error_free(error);
    }
 
+   /*
+    * Detach the cursor so that outstanding updates do not try to resume
+    * it. The summary is logged once they have all completed.
+    */
+   g_clear_object(&migration->cursor);
+   token_migration_unref(migration);
+
    EXIT;
 }
 
+/*
+ * Rewrites the APS device tokens that are still stored as hex strings
+ * into their packed form. Reads accept either form, so this may run
+ * while serving requests.
+ */
 static void
-postal_service_gcm_identity_removed (PostalService   *service,
-                                     PushGcmIdentity *identity,
-                                     PushGcmClient   *client)
+postal_service_migrate_tokens (PostalService *service)
 {
    PostalServicePrivate *priv;
+   TokenMigration *migration;
+   MongoCursor *cursor;
+   MongoBson *fields;
    MongoBson *q;
-   MongoBson *set;
-   MongoBson *u;
-   GTimeVal tv;
+   guint field;
 
    ENTRY;
 
    g_assert(POSTAL_IS_SERVICE(service));
-   g_assert(PUSH_IS_GCM_IDENTITY(identity));
 
    priv = service->priv;
 
+   /*
+    * {"device_type": "aps", "device_token": {"$type": 2}}
+    */
    q = mongo_bson_new_empty();
-   mongo_bson_append_string(q, "device_type", "gcm");
-   mongo_bson_append_string(q, "device_token",
-                            push_gcm_identity_get_registration_id(identity));
-   mongo_bson_append_null(q, "removed_at");
-
-   g_get_current_time(&tv);
-   set = mongo_bson_new_empty();
-   mongo_bson_append_timeval(set, "removed_at", &tv);
+   mongo_bson_append_string(q, "device_type", "aps");
+   field = mongo_bson_append_document_begin(q, "device_token");
+   mongo_bson_append_int(q, "$type", MONGO_BSON_UTF8);
+   mongo_bson_append_document_end(q, field);
 
-   u = mongo_bson_new_empty();
-   mongo_bson_append_bson(u, "$set", set);
+   fields = mongo_bson_new_empty();
+   mongo_bson_append_int(fields, "device_token", 1);
 
-   mongo_connection_update_async(priv->mongo,
-                                 priv->db_and_collection,
-                                 MONGO_UPDATE_MULTI_UPDATE,
-                                 q,
-                                 u,
-                                 NULL,
-                                 postal_service_gcm_identity_removed_cb,
-                                 NULL);
+   migration = g_slice_new0(TokenMigration);
+   migration->ref_count = 1;
+   migration->service = g_object_ref(service);
 
+   cursor = g_object_new(MONGO_TYPE_CURSOR,
+                         "batch-size", priv->notify_batch_size,
+                         "collection", priv->collection,
+                         "connection", priv->mongo,
+                         "database", priv->db,
+                         "fields", fields,
+                         "prefetch", POSTAL_SERVICE_CURSOR_PREFETCH,
+                         "query", q,
+                         NULL);
+   migration->cursor = g_object_ref(cursor);
+   mongo_cursor_foreach_async(cursor,
+                              postal_service_migrate_tokens_foreach,
+                              migration,
+                              NULL,
+                              NULL,
+                              postal_service_migrate_tokens_cb,
+                              migration);
+
+   mongo_bson_unref(fields);
    mongo_bson_unref(q);
-   mongo_bson_unref(set);
-   mongo_bson_unref(u);
+   g_object_unref(cursor);
 
    EXIT;
 }
@@ -1757,6 +3523,13 @@ postal_service_start (NeoServiceBase *base,
    gchar *ssl_key_file = NULL;
    gchar *uri = NULL;
    guint feedback_interval_sec;
+   gint aps_connections;
+   gint gcm_connections;
+   gint notify_batch_size;
+   gint notify_max_in_flight;
+   gboolean index_enabled;
+   gboolean migrate_tokens;
+   gint snapshot_interval;
 
    ENTRY;
 
@@ -1773,6 +3546,13 @@ postal_service_start (NeoServiceBase *base,
    ssl_cert_file = NULL;
    ssl_key_file = NULL;
    feedback_interval_sec = 10;
+   aps_connections = 1;
+   gcm_connections = POSTAL_SERVICE_GCM_CONNECTIONS;
+   notify_batch_size = POSTAL_SERVICE_NOTIFY_BATCH_SIZE;
+   notify_max_in_flight = POSTAL_SERVICE_NOTIFY_MAX_IN_FLIGHT;
+   index_enabled = FALSE;
+   migrate_tokens = FALSE;
+   snapshot_interval = POSTAL_SERVICE_SNAPSHOT_INTERVAL_SEC;
 
 #define GET_STRING_KEY(g,n) g_key_file_get_string(config, g, n, NULL)
    /*
@@ -1783,6 +3563,16 @@ postal_service_start (NeoServiceBase *base,
          aps_mode = PUSH_APS_CLIENT_SANDBOX;
       }
 
+      if (g_key_file_has_key(config, "aps", "connections", NULL)) {
+         aps_connections =
+            g_key_file_get_integer(config, "aps", "connections", NULL);
+      }
+
+      if (g_key_file_has_key(config, "gcm", "connections", NULL)) {
+         gcm_connections =
+            g_key_file_get_integer(config, "gcm", "connections", NULL);
+      }
+
       ssl_cert_file = GET_STRING_KEY("aps", "ssl-cert-file");
       ssl_key_file = GET_STRING_KEY("aps", "ssl-key-file");
       c2dm_auth_token = GET_STRING_KEY("c2dm", "auth-token");
@@ -1802,20 +3592,55 @@ postal_service_start (NeoServiceBase *base,
 
       g_free(priv->db_and_cmd);
       priv->db_and_cmd = g_strdup_printf("%s.$cmd", priv->db);
+
+      migrate_tokens =
+         g_key_file_get_boolean(config, "mongo", "migrate-tokens", NULL);
+
+      if (g_key_file_has_key(config, "notify", "batch-size", NULL)) {
+         notify_batch_size =
+            g_key_file_get_integer(config, "notify", "batch-size", NULL);
+      }
+
+      if (g_key_file_has_key(config, "notify", "max-in-flight", NULL)) {
+         notify_max_in_flight =
+            g_key_file_get_integer(config, "notify", "max-in-flight", NULL);
+      }
+
+      index_enabled = g_key_file_get_boolean(config, "index", "enabled", NULL);
+
+      g_free(priv->snapshot_path);
+      priv->snapshot_path = GET_STRING_KEY("index", "snapshot");
+      if (priv->snapshot_path && !*priv->snapshot_path) {
+         g_free(priv->snapshot_path);
+         priv->snapshot_path = NULL;
+      }
+
+      if (g_key_file_has_key(config, "index", "snapshot-interval", NULL)) {
+         snapshot_interval =
+            g_key_file_get_integer(config, "index", "snapshot-interval", NULL);
+      }
    }
 #undef GET_STRING_KEY
 
+   priv->notify_batch_size = MAX(1, notify_batch_size);
+   priv->notify_max_in_flight = MAX(1, notify_max_in_flight);
+   priv->snapshot_interval = MAX(1, snapshot_interval);
+
    priv->aps = g_object_new(PUSH_TYPE_APS_CLIENT,
                             "feedback-interval", feedback_interval_sec,
                             "mode", aps_mode,
+                            "pool-size", MAX(1, aps_connections),
                             "ssl-cert-file", ssl_cert_file,
                             "ssl-key-file", ssl_key_file,
                             NULL);
    priv->c2dm = g_object_new(PUSH_TYPE_C2DM_CLIENT,
                              "auth-token", c2dm_auth_token,
                              NULL);
+   gcm_connections = MAX(1, gcm_connections);
    priv->gcm = g_object_new(PUSH_TYPE_GCM_CLIENT,
                             "auth-token", gcm_auth_token,
+                            SOUP_SESSION_MAX_CONNS, gcm_connections,
+                            SOUP_SESSION_MAX_CONNS_PER_HOST, gcm_connections,
                             NULL);
 
    priv->mongo = mongo_connection_new_from_uri(uri);
@@ -1843,6 +3668,14 @@ postal_service_start (NeoServiceBase *base,
                             G_CALLBACK(postal_service_gcm_identity_removed),
                             service);
 
+   if (index_enabled) {
+      postal_service_index_load(service);
+   }
+
+   if (migrate_tokens) {
+      postal_service_migrate_tokens(service);
+   }
+
    g_free(ssl_cert_file);
    g_free(ssl_key_file);
    g_free(c2dm_auth_token);
@@ -1852,11 +3685,77 @@ postal_service_start (NeoServiceBase *base,
    EXIT;
 }
 
+/**
+ * postal_service_submit:
+ * @service: A #PostalService.
+ * @func: A #PostalMailboxFunc.
+ * @data: User data for @func.
+ *
+ * Queues @func to be called with @data on the main context of @service.
+ * Other threads must use this to call into @service, which is not
+ * thread-safe itself. Results of calls made from @func are delivered on
+ * the main context of @service as well.
+ *
+ * This function is thread-safe.
+ */
+void
+postal_service_submit (PostalService     *service,
+                       PostalMailboxFunc  func,
+                       gpointer           data)
+{
+   g_return_if_fail(POSTAL_IS_SERVICE(service));
+   g_return_if_fail(func);
+
+   postal_mailbox_post(service->priv->mailbox, func, data);
+}
+
+static void
+postal_service_stop (NeoServiceBase *base)
+{
+   PostalServicePrivate *priv;
+   PostalService *service = (PostalService *)base;
+   GList *list;
+   GList *iter;
+
+   ENTRY;
+
+   g_assert(POSTAL_IS_SERVICE(service));
+
+   priv = service->priv;
+
+   /*
+    * Stop tailing the oplog so that the service may be released.
+    */
+   if (priv->index_cancellable) {
+      g_cancellable_cancel(priv->index_cancellable);
+   }
+
+   if (priv->oplog_retry) {
+      g_source_remove(priv->oplog_retry);
+      priv->oplog_retry = 0;
+   }
+
+   if (priv->snapshot_source) {
+      g_source_remove(priv->snapshot_source);
+      priv->snapshot_source = 0;
+   }
+
+   /*
+    * Write any registrations still waiting out their window.
+    */
+   list = g_hash_table_get_values(priv->registrations);
+   for (iter = list; iter; iter = iter->next) {
+      registration_flush(iter->data);
+   }
+   g_list_free(list);
+
+   EXIT;
+}
+
 static void
 postal_service_finalize (GObject *object)
 {
    PostalServicePrivate *priv;
-   guint i;
 
    ENTRY;
 
@@ -1872,15 +3771,32 @@ postal_service_finalize (GObject *object)
    g_free(priv->db_and_cmd);
    g_free(priv->db_and_collection);
 
-   for (i = 0; i < priv->n_caches; i++) {
-      postal_dm_cache_unref(priv->caches[i]);
-      priv->caches[i] = NULL;
+   postal_fp_cache_unref(priv->dedup);
+   priv->dedup = NULL;
+
+   postal_reg_cache_unref(priv->registered);
+   priv->registered = NULL;
+
+   g_hash_table_unref(priv->registrations);
+   priv->registrations = NULL;
+
+   postal_mailbox_unref(priv->mailbox);
+   priv->mailbox = NULL;
+
+   mongo_write_concern_free(priv->unacknowledged);
+   priv->unacknowledged = NULL;
+
+   if (priv->index) {
+      postal_device_index_unref(priv->index);
+      priv->index = NULL;
    }
 
-   g_free(priv->caches);
+   g_clear_object(&priv->index_cancellable);
 
-   priv->n_caches = 0;
-   priv->caches = NULL;
+   g_free(priv->snapshot_path);
+   if (priv->snapshot_bytes) {
+      g_bytes_unref(priv->snapshot_bytes);
+   }
 
    G_OBJECT_CLASS(postal_service_parent_class)->finalize(object);
 
@@ -1901,6 +3817,7 @@ postal_service_class_init (PostalServiceClass *klass)
 
    service_base_class = NEO_SERVICE_BASE_CLASS(klass);
    service_base_class->start = postal_service_start;
+   service_base_class->stop = postal_service_stop;
 
    EXIT;
 }
@@ -1908,8 +3825,6 @@ postal_service_class_init (PostalServiceClass *klass)
 static void
 postal_service_init (PostalService *service)
 {
-   guint i;
-
    ENTRY;
 
    service->priv = G_TYPE_INSTANCE_GET_PRIVATE(service,
@@ -1919,16 +3834,27 @@ postal_service_init (PostalService *service)
    service->priv->db_and_collection = g_strdup("test.devices");
    service->priv->db = g_strdup("test");
    service->priv->collection = g_strdup("devices");
+   service->priv->notify_batch_size = POSTAL_SERVICE_NOTIFY_BATCH_SIZE;
+   service->priv->notify_max_in_flight = POSTAL_SERVICE_NOTIFY_MAX_IN_FLIGHT;
 
-   service->priv->n_caches = POSTAL_SERVICE_DM_CACHES;
-   service->priv->caches = g_new0(PostalDmCache*, service->priv->n_caches);
-   for (i = 0; i < service->priv->n_caches; i++) {
-      service->priv->caches[i] =
-         postal_dm_cache_new(POSTAL_SERVICE_DM_CACHE_ENTRIES,
-                             g_str_hash,
-                             g_str_equal,
-                             g_free);
-   }
+   service->priv->dedup =
+      postal_fp_cache_new(POSTAL_SERVICE_DM_CACHE_SIZE,
+                          POSTAL_SERVICE_BUCKET_SIZE_SEC,
+                          POSTAL_SERVICE_DM_CACHES);
+
+   service->priv->registered =
+      postal_reg_cache_new(POSTAL_SERVICE_REG_CACHE_ENTRIES,
+                           POSTAL_SERVICE_REG_CACHE_TTL_SEC);
+   service->priv->registrations = g_hash_table_new(g_str_hash, g_str_equal);
+
+   service->priv->mailbox =
+      postal_mailbox_new(g_main_context_get_thread_default());
+
+   /*
+    * Marking devices removed is best-effort, so those updates are sent
+    * without a getlasterror.
+    */
+   service->priv->unacknowledged = mongo_write_concern_new_unsafe();
 
    EXIT;
 }
@@ -24,6 +24,7 @@
 #include <neo.h>
 
 #include "postal-device.h"
+#include "postal-mailbox.h"
 #include "postal-notification.h"
 
 G_BEGIN_DECLS
@@ -103,6 +104,9 @@ void           postal_service_set_user_badge       (PostalService        *servic
 gboolean       postal_service_set_user_badge_finish(PostalService        *service,
                                                     GAsyncResult         *result,
                                                     GError              **error);
+void           postal_service_submit               (PostalService        *service,
+                                                    PostalMailboxFunc     func,
+                                                    gpointer              data);
 void           postal_service_notify               (PostalService        *service,
                                                     PostalNotification   *notification,
                                                     gchar               **users,
@@ -34,10 +34,57 @@
  * It is important that consumers connect to the "identity-removed" signal
  * so that they may remove devices that are no longer valid. Failure to do
  * so may cause Apple to revoke your access to APS for a period of time.
+ *
+ * The client keeps a pool of "pool-size" connections to the gateway, each
+ * with its own read loop for error responses. Each notification is queued
+ * on the connection with the smallest backlog, so a connection that is
+ * reconnecting does not hold up the others.
+ *
+ * Frames are written to the gateway asynchronously from a bounded queue
+ * of "queue-size" frames per connection. The "congested" property is set
+ * once the queues fill past three quarters of their size and cleared once
+ * they drain below one quarter. Consumers should stop submitting
+ * notifications while the client is congested. Requests that arrive while
+ * the queue is full fail with %PUSH_APS_CLIENT_ERROR_QUEUE_FULL.
+ *
+ * Apple only replies when a notification fails, so a delivery is considered
+ * successful once it has been written and no error response arrived within
+ * %PUSH_APS_CLIENT_ACK_WINDOW_MSEC. Notifications written on the same
+ * connection after a failed one are dropped by Apple and are sent again.
+ *
+ * Queued frames are coalesced into a single contiguous buffer so that many
+ * notifications share one TLS record and one syscall. The buffer is
+ * flushed once it fills, at the next main loop iteration, or after
+ * "coalesce-delay" milliseconds if that is non-zero.
  */
 
 #define PUSH_APS_CLIENT_TIMEOUT_SECONDS 2
 
+#ifndef PUSH_APS_CLIENT_QUEUE_SIZE
+#define PUSH_APS_CLIENT_QUEUE_SIZE 16384
+#endif
+
+#ifndef PUSH_APS_CLIENT_ACK_WINDOW_MSEC
+#define PUSH_APS_CLIENT_ACK_WINDOW_MSEC 1000
+#endif
+
+/*
+ * Must be a power of two so that request ids wrap cleanly.
+ */
+#ifndef PUSH_APS_CLIENT_IN_FLIGHT_SIZE
+#define PUSH_APS_CLIENT_IN_FLIGHT_SIZE 65536
+#endif
+
+#define PUSH_APS_CLIENT_IN_FLIGHT_MASK (PUSH_APS_CLIENT_IN_FLIGHT_SIZE - 1)
+
+#ifndef PUSH_APS_CLIENT_POOL_SIZE
+#define PUSH_APS_CLIENT_POOL_SIZE 1
+#endif
+
+#ifndef PUSH_APS_CLIENT_COALESCE_SIZE
+#define PUSH_APS_CLIENT_COALESCE_SIZE 16384
+#endif
+
 #ifndef g_str_empty0
 #define g_str_empty0(s) (!(s) || !(s)[0])
 #endif
@@ -53,6 +100,47 @@ typedef struct
 } FeedbackMessage;
 #pragma pack()
 
+/*
+ * A single connection to the gateway along with its queue of encoded
+ * frames. The first out_frames frames starting at queue_head have been
+ * copied into out, of which out_offset bytes have been written so far.
+ * queue_bytes is the size of the frames not yet copied into out.
+ */
+typedef struct
+{
+   PushApsClient *client;
+   guint state;
+   GIOStream *stream;
+   guint8 read_buf[6];
+   GByteArray **queue;
+   guint queue_head;
+   guint queue_length;
+   gsize queue_bytes;
+   GByteArray *out;
+   gsize out_offset;
+   guint out_frames;
+   gboolean writing;
+   guint flush_handler;
+} PushApsConnection;
+
+/*
+ * A delivery awaiting its ack window. Entries live in a ring indexed by
+ * request id. Deliveries from push_aps_client_deliver_async() complete
+ * simple while those from push_aps_client_deliver_batch_async() report to
+ * batch instead. written_at is zero until the frame has been written to
+ * conn and is cleared again if the frame has to be sent again.
+ */
+typedef struct
+{
+   guint32 id;
+   GSimpleAsyncResult *simple;
+   PushBatch *batch;
+   guint index;
+   GByteArray *frame;
+   PushApsConnection *conn;
+   gint64 written_at;
+} PushApsInFlight;
+
 struct _PushApsClientPrivate
 {
    PushApsClientMode mode;
@@ -60,18 +148,25 @@ struct _PushApsClientPrivate
    GError *tls_error;
    gchar *ssl_cert_file;
    gchar *ssl_key_file;
-   GIOStream *gateway_stream;
-   GHashTable *results;
-   guint last_id;
+   PushApsInFlight *in_flight;
+   guint32 in_flight_head;
+   guint32 last_id;
+   guint sweep_handler;
    FeedbackMessage fb_msg;
-   guint8 gw_read_buf[6];
    guint feedback_interval;
    guint feedback_handler;
 
    GCancellable *dispose_cancellable;
 
-   guint state;
-   GQueue *queue;
+   PushApsConnection *pool;
+   guint pool_size;
+   guint queue_size;
+   guint queue_length;
+   gboolean congested;
+
+   guint coalesce_delay;
+   guint64 flush_count;
+   guint64 flush_frames;
 };
 
 enum
@@ -82,6 +177,12 @@ enum
    PROP_SSL_KEY_FILE,
    PROP_TLS_CERTIFICATE,
    PROP_FEEDBACK_INTERVAL,
+   PROP_AVERAGE_BATCH_SIZE,
+   PROP_COALESCE_DELAY,
+   PROP_CONGESTED,
+   PROP_FLUSH_COUNT,
+   PROP_POOL_SIZE,
+   PROP_QUEUE_SIZE,
    LAST_PROP
 };
 
@@ -102,23 +203,41 @@ enum
 static GParamSpec *gParamSpecs[LAST_PROP];
 static guint       gSignals[LAST_SIGNAL];
 
-static void push_aps_client_try_load_tls (PushApsClient *client);
+static void push_aps_client_try_load_tls  (PushApsClient     *client);
+static void push_aps_client_write_next    (PushApsConnection *conn);
+static void push_aps_client_reset         (PushApsConnection *conn);
+static gboolean push_aps_client_queue     (PushApsConnection *conn,
+                                           GByteArray        *buffer);
+static PushApsConnection *push_aps_client_select (PushApsClient     *client,
+                                                  PushApsConnection *exclude);
+static void push_aps_client_connect_async (PushApsClient       *client,
+                                           PushApsConnection   *conn,
+                                           GCancellable        *cancellable,
+                                           GAsyncReadyCallback  callback,
+                                           gpointer             user_data);
+static void push_aps_client_connect_gateway_cb2 (GObject      *object,
+                                                 GAsyncResult *result,
+                                                 gpointer      user_data);
 
 static gchar *
 _hex_encode (const guint8 *buffer,
              gsize         len)
 {
-   GString *str;
+   static const gchar hex[] = "0123456789abcdef";
+   gchar *str;
    guint i;
 
    g_assert(buffer);
    g_assert(len);
 
-   str = g_string_new(NULL);
+   str = g_malloc((len * 2) + 1);
    for (i = 0; i < len; i++) {
-      g_string_append_printf(str, "%02x", buffer[i]);
+      str[i * 2] = hex[buffer[i] >> 4];
+      str[i * 2 + 1] = hex[buffer[i] & 0xF];
    }
-   return g_string_free(str, FALSE);
+   str[len * 2] = '\0';
+
+   return str;
 }
 
 static const gchar *
@@ -141,69 +260,290 @@ get_error_message (PushApsClientError error)
       return _("Invalid Payload Size");
    case PUSH_APS_CLIENT_ERROR_INVALID_TOKEN:
       return _("Invalid Token");
+   case PUSH_APS_CLIENT_ERROR_QUEUE_FULL:
+      return _("The delivery queue is full.");
+   case PUSH_APS_CLIENT_ERROR_CANCELLED:
+      return _("Request was cancelled due to shutting down.");
    default:
       return _("An unknown error ocurred during delivery.");
    }
    g_assert_not_reached();
 }
 
+static PushApsInFlight *
+push_aps_client_lookup (PushApsClient *client,
+                        guint32        request_id)
+{
+   PushApsInFlight *entry;
+
+   g_assert(PUSH_IS_APS_CLIENT(client));
+
+   entry = &client->priv->in_flight[request_id & PUSH_APS_CLIENT_IN_FLIGHT_MASK];
+   if (entry->frame && (entry->id == request_id)) {
+      return entry;
+   }
+
+   return NULL;
+}
+
+static gchar *
+push_aps_client_get_frame_token (GByteArray *frame)
+{
+   guint16 len;
+
+   g_assert(frame);
+   g_assert_cmpint(frame->len, >=, 11);
+
+   /*
+    * The token length follows the command, identifier and expiry.
+    */
+   memcpy(&len, frame->data + 9, sizeof len);
+   len = GUINT16_FROM_BE(len);
+   g_assert_cmpint(frame->len, >=, 11 + len);
+
+   return len ? _hex_encode(frame->data + 11, len) : NULL;
+}
+
+static void
+push_aps_client_complete (PushApsClient      *client,
+                          PushApsInFlight    *entry,
+                          PushApsClientError  code)
+{
+   PushApsIdentity *identity;
+   gchar *device_token;
+
+   ENTRY;
+
+   g_assert(PUSH_IS_APS_CLIENT(client));
+   g_assert(entry);
+   g_assert(entry->frame);
+   g_assert(entry->simple || entry->batch);
+
+   if (code == PUSH_APS_CLIENT_ERROR_INVALID_TOKEN) {
+      if ((device_token = push_aps_client_get_frame_token(entry->frame))) {
+         identity = g_object_new(PUSH_TYPE_APS_IDENTITY,
+                                 "device-token", device_token,
+                                 NULL);
+         g_signal_emit(client, gSignals[IDENTITY_REMOVED], 0, identity);
+         g_object_unref(identity);
+         g_free(device_token);
+      }
+   }
+
+   if (entry->batch) {
+      if (code) {
+         push_batch_fail(entry->batch,
+                         entry->index,
+                         g_error_new(PUSH_APS_CLIENT_ERROR,
+                                     code,
+                                     "%s",
+                                     get_error_message(code)));
+      }
+      push_batch_complete(entry->batch, 1);
+   } else {
+      if (!code) {
+         g_simple_async_result_set_op_res_gboolean(entry->simple, TRUE);
+      } else {
+         g_simple_async_result_set_error(entry->simple,
+                                         PUSH_APS_CLIENT_ERROR,
+                                         code,
+                                         "%s",
+                                         get_error_message(code));
+      }
+      g_simple_async_result_complete_in_idle(entry->simple);
+      g_object_unref(entry->simple);
+   }
+
+   g_byte_array_unref(entry->frame);
+   memset(entry, 0, sizeof *entry);
+
+   EXIT;
+}
+
 static void
-push_aps_client_dispatch_error (PushApsClient      *client,
+push_aps_client_dispatch_error (PushApsConnection  *failed,
                                 guint32             result_id,
                                 PushApsClientError  code)
 {
    PushApsClientPrivate *priv;
-   GSimpleAsyncResult *simple;
-   PushApsIdentity *identity;
-   const gchar *device_token;
+   PushApsConnection *conn;
+   PushApsInFlight *entry;
+   PushApsClient *client;
+   guint32 request_id;
 
    ENTRY;
 
-   g_assert(PUSH_IS_APS_CLIENT(client));
+   g_assert(failed);
+   g_assert(PUSH_IS_APS_CLIENT(failed->client));
 
+   client = failed->client;
    priv = client->priv;
 
-   if ((simple = g_hash_table_lookup(priv->results, &result_id))) {
-      if (code == PUSH_APS_CLIENT_ERROR_INVALID_TOKEN) {
-         device_token = g_object_get_data(G_OBJECT(simple), "device-token");
-         if (device_token) {
-            identity = g_object_new(PUSH_TYPE_APS_IDENTITY,
-                                    "device-token", device_token,
-                                    NULL);
-            g_signal_emit(client, gSignals[IDENTITY_REMOVED], 0, identity);
-            g_object_unref(identity);
-         }
+   /*
+    * The gateway closes the connection after an error response, so stop
+    * writing to it now. This retires whatever part of the output buffer
+    * made it onto the wire, so it is handled along with the rest below.
+    */
+   push_aps_client_reset(failed);
+
+   if (!(entry = push_aps_client_lookup(client, result_id)) ||
+       (entry->conn != failed)) {
+      EXIT;
+   }
+
+   push_aps_client_complete(client, entry, code);
+
+   /*
+    * The gateway silently drops everything written on this connection
+    * after the failed notification. Queue those frames again so they are
+    * delivered on another connection of the pool, or on this one once it
+    * has reconnected if it is the only one.
+    */
+   for (request_id = result_id + 1;
+        request_id != (priv->last_id + 1);
+        request_id++) {
+      entry = push_aps_client_lookup(client, request_id);
+      if (!entry || (entry->conn != failed) || !entry->written_at) {
+         continue;
+      }
+      conn = push_aps_client_select(client, failed);
+      if (!push_aps_client_queue(conn, entry->frame)) {
+         push_aps_client_complete(client, entry,
+                                  PUSH_APS_CLIENT_ERROR_QUEUE_FULL);
+         continue;
+      }
+      entry->conn = conn;
+      entry->written_at = 0;
+      if (conn->state == STATE_0) {
+         push_aps_client_connect_async(client,
+                                       conn,
+                                       priv->dispose_cancellable,
+                                       push_aps_client_connect_gateway_cb2,
+                                       conn);
       }
+   }
 
-      g_simple_async_result_set_error(simple,
-                                      PUSH_APS_CLIENT_ERROR,
-                                      code,
-                                      "%s",
-                                      get_error_message(code));
-      g_simple_async_result_complete_in_idle(simple);
-      g_hash_table_remove(priv->results, &result_id);
+   EXIT;
+}
+
+static void
+push_aps_client_set_congested (PushApsClient *client,
+                               gboolean       congested)
+{
+   g_assert(PUSH_IS_APS_CLIENT(client));
+
+   if (client->priv->congested != congested) {
+      client->priv->congested = congested;
+      g_object_notify_by_pspec(G_OBJECT(client), gParamSpecs[PROP_CONGESTED]);
+   }
+}
+
+/*
+ * Removes the first @n_frames frames from the queue of @conn once they
+ * have been written, and starts the ack window of their deliveries.
+ */
+static void
+push_aps_client_retire (PushApsConnection *conn,
+                        guint              n_frames)
+{
+   PushApsClientPrivate *priv;
+   PushApsInFlight *entry;
+   GByteArray *buffer;
+   guint32 request_id;
+   gint64 now;
+   guint i;
+
+   ENTRY;
+
+   g_assert(conn);
+   g_assert_cmpint(n_frames, <=, conn->queue_length);
+
+   priv = conn->client->priv;
+   now = g_get_monotonic_time();
+
+   for (i = 0; i < n_frames; i++) {
+      /*
+       * The request id is stored in network order after the command.
+       */
+      buffer = conn->queue[conn->queue_head];
+      memcpy(&request_id, buffer->data + 1, sizeof request_id);
+      request_id = GUINT32_FROM_BE(request_id);
+      if ((entry = push_aps_client_lookup(conn->client, request_id)) &&
+          (entry->frame == buffer)) {
+         entry->conn = conn;
+         entry->written_at = now;
+      }
+      g_byte_array_unref(buffer);
+      conn->queue[conn->queue_head] = NULL;
+      conn->queue_head = (conn->queue_head + 1) % priv->queue_size;
+   }
+
+   conn->queue_length -= n_frames;
+   priv->queue_length -= n_frames;
+
+   if (priv->queue_length <= ((priv->queue_size / 4) * priv->pool_size)) {
+      push_aps_client_set_congested(conn->client, FALSE);
    }
 
    EXIT;
 }
 
 static void
-push_aps_client_dispatch (PushApsClient *client)
+push_aps_client_reset (PushApsConnection *conn)
 {
    PushApsClientPrivate *priv;
-   GSimpleAsyncResult *simple;
-   GHashTableIter iter;
+   GByteArray *buffer;
+   gsize written = 0;
+   guint n_written;
+   guint i;
 
    ENTRY;
 
-   g_assert(PUSH_IS_APS_CLIENT(client));
+   g_assert(conn);
+   g_assert(PUSH_IS_APS_CLIENT(conn->client));
 
-   priv = client->priv;
+   priv = conn->client->priv;
 
-   g_hash_table_iter_init(&iter, priv->results);
-   while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&simple)) {
-      g_simple_async_result_set_op_res_gboolean(simple, TRUE);
-      g_simple_async_result_complete_in_idle(simple);
+   /*
+    * Frames of the output buffer that were written completely are on the
+    * wire already, so retire them rather than deliver them twice. They
+    * stay in the in-flight ring to match error responses. The rest of the
+    * buffer, including a frame that was only partly written, stays queued
+    * and is coalesced again on the new connection.
+    */
+   for (n_written = 0; n_written < conn->out_frames; n_written++) {
+      buffer = conn->queue[(conn->queue_head + n_written) % priv->queue_size];
+      if ((written + buffer->len) > conn->out_offset) {
+         break;
+      }
+      written += buffer->len;
+   }
+   for (i = n_written; i < conn->out_frames; i++) {
+      buffer = conn->queue[(conn->queue_head + i) % priv->queue_size];
+      conn->queue_bytes += buffer->len;
+   }
+   push_aps_client_retire(conn, n_written);
+   g_byte_array_set_size(conn->out, 0);
+   conn->out_offset = 0;
+   conn->out_frames = 0;
+
+   if (conn->stream) {
+      g_io_stream_close(conn->stream, NULL, NULL);
+      g_clear_object(&conn->stream);
+   }
+
+   /*
+    * Only this connection is torn down, the rest of the pool keeps
+    * writing. Reconnect right away if we still have frames to send,
+    * otherwise wait for the next delivery.
+    */
+   conn->state = STATE_0;
+   if (conn->queue_length) {
+      push_aps_client_connect_async(conn->client,
+                                    conn,
+                                    priv->dispose_cancellable,
+                                    push_aps_client_connect_gateway_cb2,
+                                    conn);
    }
 
    EXIT;
@@ -214,7 +554,8 @@ push_aps_client_read_gateway_cb (GObject      *object,
                                  GAsyncResult *result,
                                  gpointer      user_data)
 {
-   PushApsClient *client = user_data;
+   PushApsConnection *conn = user_data;
+   PushApsClient *client;
    const guint8 *buffer;
    GInputStream *input = (GInputStream *)object;
    guint32 result_id;
@@ -225,36 +566,62 @@ push_aps_client_read_gateway_cb (GObject      *object,
 
    ENTRY;
 
-   g_assert(PUSH_IS_APS_CLIENT(client));
    g_assert(G_IS_INPUT_STREAM(input));
 
-   buffer = client->priv->gw_read_buf;
    ret = g_input_stream_read_finish(input, result, &error);
 
+   /*
+    * The client may already be gone if we were cancelled from dispose.
+    */
+   if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      g_error_free(error);
+      EXIT;
+   }
+
+   g_clear_error(&error);
+
+   g_assert(conn);
+   g_assert(PUSH_IS_APS_CLIENT(conn->client));
+
+   client = conn->client;
+   buffer = conn->read_buf;
+
+   /*
+    * Ignore results from a stream we have already replaced.
+    */
+   if (!conn->stream ||
+       (g_io_stream_get_input_stream(conn->stream) != input)) {
+      EXIT;
+   }
+
    switch (ret) {
    case -1:
-      /* TODO: push_aps_client_fail(client); */
+      push_aps_client_reset(conn);
       EXIT;
    case 0:
       /* EOF */
-      push_aps_client_dispatch(client);
+      push_aps_client_reset(conn);
       EXIT;
    default:
-      DUMP_BYTES(gateway, ((guint8 *)&client->priv->gw_read_buf), ret);
+      DUMP_BYTES(gateway, conn->read_buf, ret);
       g_assert_cmpint(ret, ==, 6);
       command = buffer[0];
       g_assert_cmpint(command, ==, 8);
       status = buffer[1];
       g_assert(status <= 8 || status == 255);
       result_id = GUINT32_FROM_BE(*(guint32 *)&buffer[2]);
-      push_aps_client_dispatch_error(client, result_id, status);
+      push_aps_client_dispatch_error(conn, result_id, status);
+      if (!conn->stream ||
+          (g_io_stream_get_input_stream(conn->stream) != input)) {
+         EXIT;
+      }
       g_input_stream_read_async(input,
-                                client->priv->gw_read_buf,
-                                sizeof client->priv->gw_read_buf,
+                                conn->read_buf,
+                                sizeof conn->read_buf,
                                 G_PRIORITY_DEFAULT,
-                                NULL, /* priv->shutdown, */
+                                client->priv->dispose_cancellable,
                                 push_aps_client_read_gateway_cb,
-                                client);
+                                conn);
       EXIT;
    }
 
@@ -421,67 +788,248 @@ push_aps_client_feedback_cb (gpointer data)
 }
 
 static void
-push_aps_client_write (PushApsClient *client,
-                       GByteArray    *buffer)
+push_aps_client_write_cb (GObject      *object,
+                          GAsyncResult *result,
+                          gpointer      user_data)
 {
-   PushApsClientPrivate *priv;
-   GOutputStream *stream;
+   PushApsConnection *conn = user_data;
+   GOutputStream *stream = (GOutputStream *)object;
+   PushApsClient *client;
    GError *error = NULL;
-   gsize bytes_written;
+   gssize ret;
 
    ENTRY;
 
-   g_assert(PUSH_IS_APS_CLIENT(client));
-   g_assert(client->priv->gateway_stream);
-   g_assert(buffer);
+   g_assert(G_IS_OUTPUT_STREAM(stream));
+   g_assert(conn);
+   g_assert(PUSH_IS_APS_CLIENT(conn->client));
 
-   priv = client->priv;
+   client = conn->client;
 
-   stream = g_io_stream_get_output_stream(priv->gateway_stream);
-   g_assert(stream);
+   conn->writing = FALSE;
+   ret = g_output_stream_write_finish(stream, result, &error);
+
+   if (conn->state == STATE_DISPOSED) {
+      g_clear_error(&error);
+      GOTO(cleanup);
+   }
 
    /*
-    * TODO: Probably should do this asynchronously.
+    * The connection was reset while this write was in flight. Its output
+    * buffer has been accounted for already, so just start writing to the
+    * new stream if there is one.
     */
+   if (!conn->stream ||
+       (g_io_stream_get_output_stream(conn->stream) != stream)) {
+      g_clear_error(&error);
+      push_aps_client_write_next(conn);
+      GOTO(cleanup);
+   }
 
-   DUMP_BYTES(buffer, buffer->data, buffer->len);
+   if (ret <= 0) {
+      g_warning("Failed to write to APS stream: %s",
+                error ? error->message : "EOF");
+      g_clear_error(&error);
+      push_aps_client_reset(conn);
+      GOTO(cleanup);
+   }
 
-   if (!g_output_stream_write_all(stream,
-                                  (gconstpointer)buffer->data,
-                                  buffer->len,
-                                  &bytes_written,
-                                  NULL,
-                                  &error)) {
-      g_warning("Failed to write to APS stream: %s", error->message);
-      g_error_free(error);
-      EXIT;
+   conn->out_offset += ret;
+   g_assert_cmpint(conn->out_offset, <=, conn->out->len);
+
+   if (conn->out_offset == conn->out->len) {
+      push_aps_client_retire(conn, conn->out_frames);
+      g_byte_array_set_size(conn->out, 0);
+      conn->out_offset = 0;
+      conn->out_frames = 0;
    }
 
-   g_assert_cmpint(bytes_written, ==, buffer->len);
+   /*
+    * Anything queued while this write was in flight has been coalescing
+    * in the meantime, so send it right away.
+    */
+   push_aps_client_write_next(conn);
+
+cleanup:
+   g_object_unref(client);
+
+   EXIT;
+}
+
+static void
+push_aps_client_fill (PushApsConnection *conn)
+{
+   PushApsClientPrivate *priv;
+   GByteArray *buffer;
+   guint idx;
+
+   ENTRY;
+
+   g_assert(conn);
+   g_assert_cmpint(conn->out->len, ==, 0);
+   g_assert_cmpint(conn->out_frames, ==, 0);
+
+   priv = conn->client->priv;
+
+   /*
+    * Copy as many queued frames as fit into the output buffer. A frame
+    * larger than the buffer is still sent, on its own.
+    */
+   while (conn->out_frames < conn->queue_length) {
+      idx = (conn->queue_head + conn->out_frames) % priv->queue_size;
+      buffer = conn->queue[idx];
+      if (conn->out->len &&
+          ((conn->out->len + buffer->len) > PUSH_APS_CLIENT_COALESCE_SIZE)) {
+         break;
+      }
+      DUMP_BYTES(buffer, buffer->data, buffer->len);
+      g_byte_array_append(conn->out, buffer->data, buffer->len);
+      conn->queue_bytes -= buffer->len;
+      conn->out_frames++;
+   }
+
+   priv->flush_count++;
+   priv->flush_frames += conn->out_frames;
 
    EXIT;
 }
 
 static void
-push_aps_client_queue (PushApsClient *client,
-                       GByteArray    *buffer)
+push_aps_client_write_next (PushApsConnection *conn)
+{
+   GOutputStream *stream;
+
+   ENTRY;
+
+   g_assert(conn);
+
+   if (conn->writing ||
+       !conn->queue_length ||
+       (conn->state != STATE_CONNECTED)) {
+      EXIT;
+   }
+
+   if (conn->flush_handler) {
+      g_source_remove(conn->flush_handler);
+      conn->flush_handler = 0;
+   }
+
+   g_assert(conn->stream);
+
+   stream = g_io_stream_get_output_stream(conn->stream);
+   g_assert(stream);
+
+   if (!conn->out->len) {
+      push_aps_client_fill(conn);
+   }
+
+   conn->writing = TRUE;
+   g_output_stream_write_async(stream,
+                               conn->out->data + conn->out_offset,
+                               conn->out->len - conn->out_offset,
+                               G_PRIORITY_DEFAULT,
+                               conn->client->priv->dispose_cancellable,
+                               push_aps_client_write_cb,
+                               conn);
+   g_object_ref(conn->client);
+
+   EXIT;
+}
+
+static gboolean
+push_aps_client_flush_cb (gpointer data)
+{
+   PushApsConnection *conn = data;
+
+   ENTRY;
+
+   g_assert(conn);
+
+   conn->flush_handler = 0;
+   push_aps_client_write_next(conn);
+
+   RETURN(FALSE);
+}
+
+static PushApsConnection *
+push_aps_client_select (PushApsClient     *client,
+                        PushApsConnection *exclude)
 {
    PushApsClientPrivate *priv;
+   PushApsConnection *conn = NULL;
+   guint i;
+
+   ENTRY;
 
    g_assert(PUSH_IS_APS_CLIENT(client));
+
+   priv = client->priv;
+
+   /*
+    * Pick the connection with the smallest backlog, other than @exclude
+    * unless it is all we have. A connection that is reconnecting is not
+    * draining, so it naturally falls behind the rest.
+    */
+   for (i = 0; i < priv->pool_size; i++) {
+      if ((&priv->pool[i] == exclude) && (priv->pool_size > 1)) {
+         continue;
+      }
+      if (!conn || (priv->pool[i].queue_length < conn->queue_length)) {
+         conn = &priv->pool[i];
+      }
+   }
+
+   RETURN(conn);
+}
+
+static gboolean
+push_aps_client_queue (PushApsConnection *conn,
+                       GByteArray        *buffer)
+{
+   PushApsClientPrivate *priv;
+   guint idx;
+
+   g_assert(conn);
    g_assert(buffer);
 
    ENTRY;
 
-   priv = client->priv;
+   priv = conn->client->priv;
 
-   if (priv->state == STATE_CONNECTED) {
-      push_aps_client_write(client, buffer);
-   } else {
-      g_queue_push_tail(priv->queue, g_byte_array_ref(buffer));
+   if (conn->queue_length == priv->queue_size) {
+      RETURN(FALSE);
    }
 
-   EXIT;
+   idx = (conn->queue_head + conn->queue_length) % priv->queue_size;
+   conn->queue[idx] = g_byte_array_ref(buffer);
+   conn->queue_length++;
+   conn->queue_bytes += buffer->len;
+   priv->queue_length++;
+
+   if (priv->queue_length >= (((priv->queue_size / 4) * 3) * priv->pool_size)) {
+      push_aps_client_set_congested(conn->client, TRUE);
+   }
+
+   /*
+    * Write immediately if we have enough to fill the output buffer,
+    * otherwise give other frames a chance to coalesce with this one.
+    */
+   if (conn->queue_bytes >= PUSH_APS_CLIENT_COALESCE_SIZE) {
+      push_aps_client_write_next(conn);
+   } else if (!conn->flush_handler && !conn->writing) {
+      if (priv->coalesce_delay) {
+         conn->flush_handler = g_timeout_add(priv->coalesce_delay,
+                                             push_aps_client_flush_cb,
+                                             conn);
+      } else {
+         conn->flush_handler = g_idle_add_full(G_PRIORITY_DEFAULT,
+                                               push_aps_client_flush_cb,
+                                               conn,
+                                               NULL);
+      }
+   }
+
+   RETURN(TRUE);
 }
 
 static void
@@ -490,11 +1038,11 @@ push_aps_client_connect_gateway_cb (GObject      *object,
                                     gpointer      user_data)
 {
    GSimpleAsyncResult *simple = user_data;
-   GSocketConnection *conn;
+   PushApsConnection *conn;
+   GSocketConnection *sconn;
    GSocketClient *socket_client = (GSocketClient *)object;
    PushApsClient *client;
    GInputStream *input;
-   GByteArray *buffer;
    GError *error = NULL;
 
    ENTRY;
@@ -503,30 +1051,41 @@ push_aps_client_connect_gateway_cb (GObject      *object,
    g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
 
    client = PUSH_APS_CLIENT(g_async_result_get_source_object(user_data));
-
-   if (!(conn = g_socket_client_connect_to_host_finish(socket_client,
-                                                       result,
-                                                       &error))) {
-      if (client->priv->state != STATE_DISPOSED) {
-         client->priv->state = STATE_0;
+   conn = g_object_get_data(G_OBJECT(simple), "connection");
+   g_assert(conn);
+
+   if (!(sconn = g_socket_client_connect_to_host_finish(socket_client,
+                                                        result,
+                                                        &error))) {
+      if (conn->state != STATE_DISPOSED) {
+         conn->state = STATE_0;
       }
       g_simple_async_result_take_error(simple, error);
+   } else if (conn->state == STATE_DISPOSED) {
+      g_io_stream_close(G_IO_STREAM(sconn), NULL, NULL);
+      g_object_unref(sconn);
+      sconn = NULL;
+      g_simple_async_result_set_error(simple,
+                                      PUSH_APS_CLIENT_ERROR,
+                                      PUSH_APS_CLIENT_ERROR_CANCELLED,
+                                      _("Request was cancelled due to "
+                                        "shutting down."));
    } else {
-      client->priv->state = STATE_CONNECTED;
-      g_clear_object(&client->priv->gateway_stream);
-      client->priv->gateway_stream = G_IO_STREAM(conn);
+      conn->state = STATE_CONNECTED;
+      g_clear_object(&conn->stream);
+      conn->stream = G_IO_STREAM(sconn);
 
       /*
        * Start reading responses from the TLS stream.
        */
-      input = g_io_stream_get_input_stream(G_IO_STREAM(conn));
+      input = g_io_stream_get_input_stream(G_IO_STREAM(sconn));
       g_input_stream_read_async(input,
-                                client->priv->gw_read_buf,
-                                sizeof client->priv->gw_read_buf,
+                                conn->read_buf,
+                                sizeof conn->read_buf,
                                 G_PRIORITY_DEFAULT,
-                                NULL, /* priv->shutdown, */
+                                client->priv->dispose_cancellable,
                                 push_aps_client_read_gateway_cb,
-                                client);
+                                conn);
 
       /*
        * Setup our timeout to connect to feedback on interval.
@@ -541,13 +1100,10 @@ push_aps_client_connect_gateway_cb (GObject      *object,
       /*
        * Flush any pending requests.
        */
-      while ((buffer = g_queue_pop_head(client->priv->queue))) {
-         push_aps_client_write(client, buffer);
-         g_byte_array_unref(buffer);
-      }
+      push_aps_client_write_next(conn);
    }
 
-   g_simple_async_result_set_op_res_gboolean(simple, !!conn);
+   g_simple_async_result_set_op_res_gboolean(simple, !!sconn);
    g_simple_async_result_complete_in_idle(simple);
    g_object_unref(simple);
    g_object_unref(client);
@@ -558,13 +1114,14 @@ push_aps_client_connect_gateway_cb (GObject      *object,
 /**
  * push_aps_client_connect_async:
  * @client: (in): A #PushApsClient.
+ * @conn: (in): The #PushApsConnection to connect.
  * @cancellable: (allow-none): A #GCancellable, or %NULL.
  * @callback: A callback to execute.
  * @user_data: User data for @callback.
  *
- * Asynchronously connects to the Apple Push Notification gateway. A TLS
- * connection is used using the TLS certificate provided. This will have
- * been loaded using the "ssl-cert-file" and "ssl-key-file" properties
+ * Asynchronously connects @conn to the Apple Push Notification gateway.
+ * A TLS connection is used using the TLS certificate provided. This will
+ * have been loaded using the "ssl-cert-file" and "ssl-key-file" properties
  * or the "tls-certificate" property.
  *
  * Upon success or error, @callback will be executed and should call
@@ -575,6 +1132,7 @@ push_aps_client_connect_gateway_cb (GObject      *object,
  */
 static void
 push_aps_client_connect_async (PushApsClient       *client,
+                               PushApsConnection   *conn,
                                GCancellable        *cancellable,
                                GAsyncReadyCallback  callback,
                                gpointer             user_data)
@@ -587,12 +1145,13 @@ push_aps_client_connect_async (PushApsClient       *client,
    ENTRY;
 
    g_return_if_fail(PUSH_IS_APS_CLIENT(client));
+   g_return_if_fail(conn);
    g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
-   g_return_if_fail(client->priv->state == STATE_0);
+   g_return_if_fail(conn->state == STATE_0);
 
    priv = client->priv;
 
-   priv->state = STATE_CONNECTING;
+   conn->state = STATE_CONNECTING;
 
    if (priv->tls_error) {
       g_simple_async_report_gerror_in_idle(G_OBJECT(client),
@@ -612,7 +1171,7 @@ push_aps_client_connect_async (PushApsClient       *client,
       EXIT;
    }
 
-   if (priv->gateway_stream) {
+   if (conn->stream) {
       g_simple_async_report_error_in_idle(G_OBJECT(client),
                                           callback,
                                           user_data,
@@ -624,6 +1183,7 @@ push_aps_client_connect_async (PushApsClient       *client,
 
    simple = g_simple_async_result_new(G_OBJECT(client), callback, user_data,
                                       push_aps_client_connect_async);
+   g_object_set_data(G_OBJECT(simple), "connection", conn);
 
    socket_client = g_object_new(G_TYPE_SOCKET_CLIENT,
                                 "family", G_SOCKET_FAMILY_IPV4,
@@ -680,30 +1240,6 @@ push_aps_client_connect_finish (PushApsClient  *client,
    RETURN(ret);
 }
 
-static inline guint8
-from_hex (guint8 c)
-{
-   switch (c) {
-   case '0': return 0;
-   case '1': return 1;
-   case '2': return 2;
-   case '3': return 3;
-   case '4': return 4;
-   case '5': return 5;
-   case '6': return 6;
-   case '7': return 7;
-   case '8': return 8;
-   case '9': return 9;
-   case 'a': return 0xa;
-   case 'b': return 0xb;
-   case 'c': return 0xc;
-   case 'd': return 0xd;
-   case 'e': return 0xe;
-   case 'f': return 0xf;
-   default: return 0;
-   }
-}
-
 static GByteArray *
 push_aps_client_encode (PushApsClient *client,
                         const gchar   *device_token,
@@ -714,9 +1250,8 @@ push_aps_client_encode (PushApsClient *client,
    GByteArray *ret = NULL;
    guint32 b32;
    guint16 b16;
-   guchar *data;
    guint8 b8;
-   guint i;
+   guint offset;
    gsize len;
 
    ENTRY;
@@ -725,7 +1260,12 @@ push_aps_client_encode (PushApsClient *client,
    g_return_val_if_fail(device_token, NULL);
    g_return_val_if_fail(message, NULL);
 
-   ret = g_byte_array_sized_new(64);
+   /*
+    * Size the frame up front: command, identifier, expiry, and the length
+    * prefixed token and payload.
+    */
+   ret = g_byte_array_sized_new(13 + (strlen(device_token) / 2) +
+                                strlen(message));
 
    /*
     * Command (we talk enhanced notification format).
@@ -752,29 +1292,25 @@ push_aps_client_encode (PushApsClient *client,
    g_byte_array_append(ret, (guint8 *)&b32, 4);
 
    /*
-    * Get token length.
+    * Add the token length, then decode the token from hex directly into
+    * the frame.
     */
    len = strlen(device_token) / 2;
    b16 = GUINT16_TO_BE(len);
-   g_assert_cmpint(len % 2, ==, 0);
+   g_byte_array_append(ret, (guint8 *)&b16, 2);
 
-   /*
-    * Encode the token from hex.
-    */
-   data = g_malloc0(len);
-   for (i = 0; i < len; i++) {
-      guint8 v = (from_hex(device_token[i*2]) << 4)
-               | (from_hex(device_token[i*2+1]));
-      data[i] = v;
+   offset = ret->len;
+   g_byte_array_set_size(ret, offset + len);
+   if (!push_aps_identity_decode_token(device_token,
+                                       ret->data + offset,
+                                       len)) {
+      /*
+       * Let the gateway reject the malformed token so that the identity
+       * is removed like any other invalid token.
+       */
+      memset(ret->data + offset, 0, len);
    }
 
-   /*
-    * Add token length and token to buffer.
-    */
-   g_byte_array_append(ret, (guint8 *)&b16, 2);
-   g_byte_array_append(ret, (guint8 *)data, len);
-   g_free(data);
-
    /*
     * Payload length and payload.
     */
@@ -787,33 +1323,54 @@ push_aps_client_encode (PushApsClient *client,
 }
 
 static gboolean
-push_aps_client_complete_result (GSimpleAsyncResult *simple)
+push_aps_client_sweep_cb (gpointer data)
 {
-   PushApsClient *client;
+   PushApsClientPrivate *priv;
+   PushApsInFlight *entry;
+   PushApsClient *client = data;
+   gboolean advance = TRUE;
    guint32 request_id;
+   gint64 expire_at;
 
    ENTRY;
 
-   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
-   client = PUSH_APS_CLIENT(
-         g_async_result_get_source_object(
-               G_ASYNC_RESULT(simple)));
    g_assert(PUSH_IS_APS_CLIENT(client));
-   request_id = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(simple),
-                                                  "request-id"));
-
-   if (client->priv->results) {
-      if (g_hash_table_lookup(client->priv->results, &request_id)) {
-         g_simple_async_result_set_op_res_gboolean(simple, TRUE);
-         g_simple_async_result_complete_in_idle(simple);
-         g_hash_table_remove(client->priv->results, &request_id);
+
+   priv = client->priv;
+
+   /*
+    * Anything written before expire_at without an error response has
+    * been accepted by the gateway. Advance the head of the ring past
+    * completed entries as we go.
+    */
+   expire_at = g_get_monotonic_time() -
+               (PUSH_APS_CLIENT_ACK_WINDOW_MSEC * 1000);
+
+   for (request_id = priv->in_flight_head;
+        request_id != (priv->last_id + 1);
+        request_id++) {
+      if ((entry = push_aps_client_lookup(client, request_id))) {
+         if (entry->written_at && (entry->written_at <= expire_at)) {
+            push_aps_client_complete(client, entry, 0);
+         } else {
+            advance = FALSE;
+         }
+      }
+      if (advance) {
+         priv->in_flight_head = request_id + 1;
       }
    }
 
-   g_object_unref(simple);
-   g_object_unref(client);
+   /*
+    * Stop sweeping once the ring is empty. The next submission starts
+    * the sweep again.
+    */
+   if (priv->in_flight_head == (priv->last_id + 1)) {
+      priv->sweep_handler = 0;
+      RETURN(FALSE);
+   }
 
-   RETURN(FALSE);
+   RETURN(TRUE);
 }
 
 static void
@@ -822,28 +1379,144 @@ push_aps_client_connect_gateway_cb2 (GObject      *object,
                                      gpointer      user_data)
 {
    PushApsClientPrivate *priv;
+   PushApsConnection *conn = user_data;
    PushApsClient *client = (PushApsClient *)object;
    GError *error = NULL;
 
    g_assert(PUSH_IS_APS_CLIENT(client));
    g_assert(G_IS_SIMPLE_ASYNC_RESULT(result));
+   g_assert(conn);
 
    priv = client->priv;
 
    if (!push_aps_client_connect_finish(client, result, &error)) {
-      if (priv->state == STATE_0) {
+      g_clear_error(&error);
+      if (conn->state == STATE_0) {
          /*
           * TODO: Add exponential backoff.
           */
          push_aps_client_connect_async(client,
+                                       conn,
                                        priv->dispose_cancellable,
                                        push_aps_client_connect_gateway_cb2,
-                                       NULL);
+                                       conn);
          EXIT;
       }
    }
 
-   EXIT;
+   EXIT;
+}
+
+static PushApsClientError
+push_aps_client_submit (PushApsClient      *client,
+                        const gchar        *device_token,
+                        PushApsMessage     *message,
+                        GSimpleAsyncResult *simple,
+                        PushBatch          *batch,
+                        guint               index)
+{
+   PushApsClientPrivate *priv;
+   PushApsConnection *conn;
+   PushApsInFlight *entry;
+   GByteArray *buffer;
+   guint32 request_id;
+
+   ENTRY;
+
+   g_assert(PUSH_IS_APS_CLIENT(client));
+   g_assert(device_token);
+   g_assert(PUSH_IS_APS_MESSAGE(message));
+   g_assert(simple || batch);
+
+   priv = client->priv;
+
+   /*
+    * The gateway closes the connection on an oversized payload, which
+    * would also drop everything written after it. Fail it here instead.
+    */
+   if (push_aps_message_get_oversized(message)) {
+      RETURN(PUSH_APS_CLIENT_ERROR_INVALID_PAYLOAD_SIZE);
+   }
+
+   conn = push_aps_client_select(client, NULL);
+
+   if (conn->queue_length == priv->queue_size) {
+      RETURN(PUSH_APS_CLIENT_ERROR_QUEUE_FULL);
+   }
+
+   /*
+    * If the ring has wrapped onto a delivery that is still waiting, it was
+    * submitted a full ring ago. One that was written has had far longer
+    * than its ack window and is considered delivered. One that was never
+    * written means the ring is full of unsent frames, so refuse this one
+    * rather than report the other as delivered.
+    */
+   request_id = priv->last_id + 1;
+   entry = &priv->in_flight[request_id & PUSH_APS_CLIENT_IN_FLIGHT_MASK];
+   if (entry->frame) {
+      if (!entry->written_at) {
+         RETURN(PUSH_APS_CLIENT_ERROR_QUEUE_FULL);
+      }
+      push_aps_client_complete(client, entry, 0);
+   }
+
+   /*
+    * Start connecting if needed.
+    */
+   if (conn->state == STATE_0) {
+      push_aps_client_connect_async(client,
+                                    conn,
+                                    priv->dispose_cancellable,
+                                    push_aps_client_connect_gateway_cb2,
+                                    conn);
+   }
+
+   /*
+    * Build buffer to deliver to gateway.
+    */
+   priv->last_id = request_id;
+   buffer = push_aps_client_encode(client,
+                                   device_token,
+                                   push_aps_message_get_expires_at(message),
+                                   push_aps_message_get_json(message),
+                                   request_id);
+
+   if ((guint32)(request_id - priv->in_flight_head) >=
+       PUSH_APS_CLIENT_IN_FLIGHT_SIZE) {
+      priv->in_flight_head = request_id - PUSH_APS_CLIENT_IN_FLIGHT_SIZE + 1;
+   }
+
+   entry->id = request_id;
+   entry->simple = simple ? g_object_ref(simple) : NULL;
+   entry->batch = batch;
+   entry->index = index;
+   entry->frame = g_byte_array_ref(buffer);
+   entry->conn = conn;
+   entry->written_at = 0;
+
+   /*
+    * A single periodic sweep completes deliveries once their ack window
+    * has passed without an error response.
+    */
+   if (!priv->sweep_handler) {
+      priv->sweep_handler =
+         g_timeout_add(PUSH_APS_CLIENT_ACK_WINDOW_MSEC,
+                       push_aps_client_sweep_cb,
+                       client);
+   }
+
+   /*
+    * Queue the frame for the gateway. It is written as soon as the
+    * connection is established and any frames ahead of it are written.
+    * We checked for room above, so this cannot fail.
+    */
+   if (!push_aps_client_queue(conn, buffer)) {
+      g_assert_not_reached();
+   }
+
+   g_byte_array_unref(buffer);
+
+   RETURN(0);
 }
 
 /**
@@ -871,10 +1544,8 @@ push_aps_client_deliver_async (PushApsClient       *client,
                                gpointer             user_data)
 {
    PushApsClientPrivate *priv;
+   PushApsClientError code;
    GSimpleAsyncResult *simple;
-   const gchar *device_token;
-   GByteArray *buffer;
-   guint32 *request_id;
 
    ENTRY;
 
@@ -894,55 +1565,149 @@ push_aps_client_deliver_async (PushApsClient       *client,
       EXIT;
    }
 
-   /*
-    * Start connecting if needed.
-    */
-   if (priv->state == STATE_0) {
-      push_aps_client_connect_async(client,
-                                    priv->dispose_cancellable,
-                                    push_aps_client_connect_gateway_cb2,
-                                    NULL);
-   }
-
-   /*
-    * Build buffer to deliver to gateway and async result for
-    * completion of asynchronous request.
-    */
-   device_token = push_aps_identity_get_device_token(identity);
-   request_id = g_new0(guint32, 1);
-   *request_id = ++priv->last_id;
    simple = g_simple_async_result_new(G_OBJECT(client), callback, user_data,
                                       push_aps_client_deliver_async);
    g_simple_async_result_set_check_cancellable(simple, cancellable);
-   g_object_set_data_full(G_OBJECT(simple), "device-token",
-                          g_strdup(device_token), g_free);
-   g_object_set_data(G_OBJECT(simple), "request-id",
-                     GINT_TO_POINTER(*request_id));
-   buffer = push_aps_client_encode(client,
-                                   device_token,
-                                   push_aps_message_get_expires_at(message),
-                                   push_aps_message_get_json(message),
-                                   *request_id);
-   g_hash_table_insert(priv->results, request_id, simple);
 
-   /*
-    * Add a timeout to complete the request if we don't get notified of
-    * success (which is what usually happens).
-    */
-   g_timeout_add_seconds(1,
-                         (GSourceFunc)push_aps_client_complete_result,
-                         g_object_ref(simple));
+   code = push_aps_client_submit(client,
+                                 push_aps_identity_get_device_token(identity),
+                                 message,
+                                 simple,
+                                 NULL,
+                                 0);
+
+   if (code) {
+      g_simple_async_result_set_error(simple,
+                                      PUSH_APS_CLIENT_ERROR,
+                                      code,
+                                      "%s",
+                                      get_error_message(code));
+      g_simple_async_result_complete_in_idle(simple);
+   }
+
+   g_object_unref(simple);
+
+   EXIT;
+}
+
+/**
+ * push_aps_client_deliver_batch_async:
+ * @client: A #PushApsClient.
+ * @tokens: (array length=n_tokens): An array of #PushBatchToken.
+ * @n_tokens: The number of elements in @tokens.
+ * @message: A #PushApsMessage.
+ * @cancellable: (allow-none): A #GCancellable or %NULL.
+ * @callback: A #GAsyncReadyCallback to execute upon completion.
+ * @user_data: User data for @callback.
+ *
+ * Asynchronously requests that @message be delivered to every device
+ * token in @tokens. The "badge" of each #PushBatchToken is used as the
+ * badge of @message for that device. No identity or async result is
+ * created per device, and @tokens only needs to remain valid for the
+ * duration of this call.
+ *
+ * @callback is executed once every delivery has completed and MUST call
+ * push_aps_client_deliver_batch_finish() with the provided #GAsyncResult.
+ */
+void
+push_aps_client_deliver_batch_async (PushApsClient        *client,
+                                     const PushBatchToken *tokens,
+                                     guint                 n_tokens,
+                                     PushApsMessage       *message,
+                                     GCancellable         *cancellable,
+                                     GAsyncReadyCallback   callback,
+                                     gpointer              user_data)
+{
+   PushApsClientPrivate *priv;
+   PushApsClientError code;
+   GSimpleAsyncResult *simple;
+   PushBatch *batch;
+   guint i;
+
+   ENTRY;
+
+   g_return_if_fail(PUSH_IS_APS_CLIENT(client));
+   g_return_if_fail(tokens || !n_tokens);
+   g_return_if_fail(PUSH_IS_APS_MESSAGE(message));
+   g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
+   g_return_if_fail(callback);
+
+   priv = client->priv;
+
+   if (priv->tls_error) {
+      g_simple_async_report_gerror_in_idle(G_OBJECT(client),
+                                           callback,
+                                           user_data,
+                                           priv->tls_error);
+      EXIT;
+   }
+
+   simple = g_simple_async_result_new(G_OBJECT(client), callback, user_data,
+                                      push_aps_client_deliver_batch_async);
+   g_simple_async_result_set_check_cancellable(simple, cancellable);
 
    /*
-    * Write bytes to gateway immediately if we can, otherwise queue them.
+    * Hold an extra pending delivery so the batch cannot complete while
+    * we are still submitting it.
     */
-   push_aps_client_queue(client, buffer);
+   batch = push_batch_new(simple, n_tokens + 1);
+
+   for (i = 0; i < n_tokens; i++) {
+      push_aps_message_set_badge(message, tokens[i].badge);
+      code = push_aps_client_submit(client,
+                                    tokens[i].token,
+                                    message,
+                                    NULL,
+                                    batch,
+                                    i);
+      if (code) {
+         push_batch_fail(batch,
+                         i,
+                         g_error_new(PUSH_APS_CLIENT_ERROR,
+                                     code,
+                                     "%s",
+                                     get_error_message(code)));
+         push_batch_complete(batch, 1);
+      }
+   }
 
-   g_byte_array_unref(buffer);
+   push_batch_complete(batch, 1);
+   g_object_unref(simple);
 
    EXIT;
 }
 
+/**
+ * push_aps_client_deliver_batch_finish:
+ * @client: A #PushApsClient.
+ * @result: A #GAsyncResult.
+ * @failures: (out) (allow-none) (element-type PushBatchFailure*): A location
+ *   for the tokens that failed, or %NULL.
+ * @error: (out) (allow-none): A location for a #GError, or %NULL.
+ *
+ * Completes an asynchronous request to push_aps_client_deliver_batch_async().
+ * See push_batch_finish() for details on @failures.
+ *
+ * Returns: %TRUE unless the whole batch failed.
+ */
+gboolean
+push_aps_client_deliver_batch_finish (PushApsClient  *client,
+                                      GAsyncResult   *result,
+                                      GPtrArray     **failures,
+                                      GError        **error)
+{
+   gboolean ret;
+
+   ENTRY;
+
+   g_return_val_if_fail(PUSH_IS_APS_CLIENT(client), FALSE);
+   g_return_val_if_fail(G_IS_SIMPLE_ASYNC_RESULT(result), FALSE);
+
+   ret = push_batch_finish(G_SIMPLE_ASYNC_RESULT(result), failures, error);
+
+   RETURN(ret);
+}
+
 /**
  * push_aps_client_deliver_finish:
  * @client: A #PushApsClient.
@@ -973,6 +1738,232 @@ push_aps_client_deliver_finish (PushApsClient  *client,
    RETURN(ret);
 }
 
+/**
+ * push_aps_client_get_congested:
+ * @client: (in): A #PushApsClient.
+ *
+ * Fetches the "congested" property. This is %TRUE when the queue of
+ * frames waiting to be written to the gateway has passed its high
+ * watermark and remains %TRUE until it drains below its low watermark.
+ *
+ * Returns: %TRUE if the client is congested.
+ */
+gboolean
+push_aps_client_get_congested (PushApsClient *client)
+{
+   g_return_val_if_fail(PUSH_IS_APS_CLIENT(client), FALSE);
+   return client->priv->congested;
+}
+
+/**
+ * push_aps_client_get_average_batch_size:
+ * @client: (in): A #PushApsClient.
+ *
+ * Fetches the "average-batch-size" property, the average number of
+ * frames written to the gateway per flush.
+ *
+ * Returns: A #gdouble.
+ */
+gdouble
+push_aps_client_get_average_batch_size (PushApsClient *client)
+{
+   PushApsClientPrivate *priv;
+
+   g_return_val_if_fail(PUSH_IS_APS_CLIENT(client), 0.0);
+
+   priv = client->priv;
+
+   if (!priv->flush_count) {
+      return 0.0;
+   }
+
+   return (gdouble)priv->flush_frames / (gdouble)priv->flush_count;
+}
+
+/**
+ * push_aps_client_get_coalesce_delay:
+ * @client: (in): A #PushApsClient.
+ *
+ * Fetches the "coalesce-delay" property, the number of milliseconds
+ * queued frames may wait for others to coalesce with before being
+ * flushed. Zero means they are flushed on the next main loop iteration.
+ *
+ * Returns: A #guint.
+ */
+guint
+push_aps_client_get_coalesce_delay (PushApsClient *client)
+{
+   g_return_val_if_fail(PUSH_IS_APS_CLIENT(client), 0);
+   return client->priv->coalesce_delay;
+}
+
+/**
+ * push_aps_client_set_coalesce_delay:
+ * @client: (in): A #PushApsClient.
+ * @coalesce_delay: The delay in milliseconds.
+ *
+ * Sets the "coalesce-delay" property. See
+ * push_aps_client_get_coalesce_delay().
+ */
+void
+push_aps_client_set_coalesce_delay (PushApsClient *client,
+                                    guint          coalesce_delay)
+{
+   g_return_if_fail(PUSH_IS_APS_CLIENT(client));
+   client->priv->coalesce_delay = coalesce_delay;
+   g_object_notify_by_pspec(G_OBJECT(client),
+                            gParamSpecs[PROP_COALESCE_DELAY]);
+}
+
+/**
+ * push_aps_client_get_flush_count:
+ * @client: (in): A #PushApsClient.
+ *
+ * Fetches the "flush-count" property, the number of coalesced writes
+ * made to the gateway.
+ *
+ * Returns: A #guint64.
+ */
+guint64
+push_aps_client_get_flush_count (PushApsClient *client)
+{
+   g_return_val_if_fail(PUSH_IS_APS_CLIENT(client), 0);
+   return client->priv->flush_count;
+}
+
+/**
+ * push_aps_client_get_queue_length:
+ * @client: (in): A #PushApsClient.
+ *
+ * Fetches the number of frames waiting to be written to the gateway,
+ * summed across all connections in the pool.
+ *
+ * Returns: A #guint.
+ */
+guint
+push_aps_client_get_queue_length (PushApsClient *client)
+{
+   g_return_val_if_fail(PUSH_IS_APS_CLIENT(client), 0);
+   return client->priv->queue_length;
+}
+
+/**
+ * push_aps_client_get_queue_size:
+ * @client: (in): A #PushApsClient.
+ *
+ * Fetches the "queue-size" property, the maximum number of frames that
+ * may be waiting to be written to each gateway connection.
+ *
+ * Returns: A #guint.
+ */
+guint
+push_aps_client_get_queue_size (PushApsClient *client)
+{
+   g_return_val_if_fail(PUSH_IS_APS_CLIENT(client), 0);
+   return client->priv->queue_size;
+}
+
+static void
+push_aps_client_free_pool (PushApsClient *client)
+{
+   PushApsClientPrivate *priv;
+   PushApsConnection *conn;
+   guint i;
+
+   ENTRY;
+
+   g_assert(PUSH_IS_APS_CLIENT(client));
+
+   priv = client->priv;
+
+   for (i = 0; i < priv->pool_size; i++) {
+      conn = &priv->pool[i];
+      g_assert(!conn->stream);
+      g_assert(!conn->queue_length);
+      g_free(conn->queue);
+      g_byte_array_unref(conn->out);
+   }
+
+   g_free(priv->pool);
+   priv->pool = NULL;
+
+   EXIT;
+}
+
+static void
+push_aps_client_alloc_pool (PushApsClient *client,
+                            guint          pool_size,
+                            guint          queue_size)
+{
+   PushApsClientPrivate *priv;
+   PushApsConnection *conn;
+   guint i;
+
+   ENTRY;
+
+   g_assert(PUSH_IS_APS_CLIENT(client));
+   g_assert(pool_size);
+   g_assert(queue_size);
+
+   priv = client->priv;
+
+   g_assert(!priv->queue_length);
+
+   push_aps_client_free_pool(client);
+
+   priv->pool = g_new0(PushApsConnection, pool_size);
+   priv->pool_size = pool_size;
+   priv->queue_size = queue_size;
+
+   for (i = 0; i < pool_size; i++) {
+      conn = &priv->pool[i];
+      conn->client = client;
+      conn->state = STATE_0;
+      conn->queue = g_new0(GByteArray *, queue_size);
+      conn->out = g_byte_array_sized_new(PUSH_APS_CLIENT_COALESCE_SIZE);
+   }
+
+   EXIT;
+}
+
+/**
+ * push_aps_client_get_pool_size:
+ * @client: (in): A #PushApsClient.
+ *
+ * Fetches the "pool-size" property, the number of connections made to
+ * the gateway.
+ *
+ * Returns: A #guint.
+ */
+guint
+push_aps_client_get_pool_size (PushApsClient *client)
+{
+   g_return_val_if_fail(PUSH_IS_APS_CLIENT(client), 0);
+   return client->priv->pool_size;
+}
+
+static void
+push_aps_client_set_pool_size (PushApsClient *client,
+                               guint          pool_size)
+{
+   ENTRY;
+   g_return_if_fail(PUSH_IS_APS_CLIENT(client));
+   g_return_if_fail(pool_size > 0);
+   push_aps_client_alloc_pool(client, pool_size, client->priv->queue_size);
+   EXIT;
+}
+
+static void
+push_aps_client_set_queue_size (PushApsClient *client,
+                                guint          queue_size)
+{
+   ENTRY;
+   g_return_if_fail(PUSH_IS_APS_CLIENT(client));
+   g_return_if_fail(queue_size > 0);
+   push_aps_client_alloc_pool(client, client->priv->pool_size, queue_size);
+   EXIT;
+}
+
 PushApsClientMode
 push_aps_client_get_mode (PushApsClient *client)
 {
@@ -1133,47 +2124,56 @@ static void
 push_aps_client_dispose (GObject *object)
 {
    PushApsClientPrivate *priv;
-   GHashTableIter iter;
-   GHashTable *hash;
-   GByteArray *array;
-   gpointer key;
-   gpointer value;
+   PushApsConnection *conn;
+   PushApsInFlight *entry;
+   guint i;
 
    ENTRY;
 
    priv = PUSH_APS_CLIENT(object)->priv;
 
-   priv->state = STATE_DISPOSED;
+   for (i = 0; i < priv->pool_size; i++) {
+      priv->pool[i].state = STATE_DISPOSED;
+   }
 
    if (priv->dispose_cancellable) {
       g_cancellable_cancel(priv->dispose_cancellable);
       g_clear_object(&priv->dispose_cancellable);
    }
 
-   if (priv->gateway_stream) {
-      g_io_stream_close(priv->gateway_stream, NULL, NULL);
-      g_clear_object(&priv->gateway_stream);
-   }
+   for (i = 0; i < priv->pool_size; i++) {
+      conn = &priv->pool[i];
+
+      if (conn->stream) {
+         g_io_stream_close(conn->stream, NULL, NULL);
+         g_clear_object(&conn->stream);
+      }
+
+      if (conn->flush_handler) {
+         g_source_remove(conn->flush_handler);
+         conn->flush_handler = 0;
+      }
 
-   while ((array = g_queue_pop_head(priv->queue))) {
-      g_byte_array_free(array, TRUE);
+      while (conn->queue_length) {
+         g_byte_array_unref(conn->queue[conn->queue_head]);
+         conn->queue[conn->queue_head] = NULL;
+         conn->queue_head = (conn->queue_head + 1) % priv->queue_size;
+         conn->queue_length--;
+         priv->queue_length--;
+      }
    }
 
-   g_queue_free(priv->queue);
-   priv->queue = NULL;
+   if (priv->sweep_handler) {
+      g_source_remove(priv->sweep_handler);
+      priv->sweep_handler = 0;
+   }
 
-   if ((hash = priv->results)) {
-      priv->results = NULL;
-      g_hash_table_iter_init(&iter, hash);
-      while (g_hash_table_iter_next(&iter, &key, &value)) {
-         g_simple_async_result_set_error(value,
-                                         PUSH_APS_CLIENT_ERROR,
-                                         PUSH_APS_CLIENT_ERROR_CANCELLED,
-                                         _("Request was cancelled due to "
-                                           "shutting down."));
-         g_simple_async_result_complete_in_idle(value);
+   for (i = 0; i < PUSH_APS_CLIENT_IN_FLIGHT_SIZE; i++) {
+      entry = &priv->in_flight[i];
+      if (entry->frame) {
+         push_aps_client_complete(PUSH_APS_CLIENT(object), entry,
+                                  PUSH_APS_CLIENT_ERROR_CANCELLED);
       }
-      g_hash_table_unref(hash);
    }
 
    if (priv->feedback_handler) {
@@ -1203,6 +2203,11 @@ push_aps_client_finalize (GObject *object)
 
    g_clear_error(&priv->tls_error);
 
+   push_aps_client_free_pool(PUSH_APS_CLIENT(object));
+
+   g_free(priv->in_flight);
+   priv->in_flight = NULL;
+
    G_OBJECT_CLASS(push_aps_client_parent_class)->finalize(object);
 
    EXIT;
@@ -1217,12 +2222,30 @@ push_aps_client_get_property (GObject    *object,
    PushApsClient *client = PUSH_APS_CLIENT(object);
 
    switch (prop_id) {
+   case PROP_AVERAGE_BATCH_SIZE:
+      g_value_set_double(value, push_aps_client_get_average_batch_size(client));
+      break;
+   case PROP_COALESCE_DELAY:
+      g_value_set_uint(value, push_aps_client_get_coalesce_delay(client));
+      break;
+   case PROP_CONGESTED:
+      g_value_set_boolean(value, push_aps_client_get_congested(client));
+      break;
    case PROP_FEEDBACK_INTERVAL:
       g_value_set_uint(value, push_aps_client_get_feedback_interval(client));
       break;
+   case PROP_FLUSH_COUNT:
+      g_value_set_uint64(value, push_aps_client_get_flush_count(client));
+      break;
    case PROP_MODE:
       g_value_set_enum(value, push_aps_client_get_mode(client));
       break;
+   case PROP_POOL_SIZE:
+      g_value_set_uint(value, push_aps_client_get_pool_size(client));
+      break;
+   case PROP_QUEUE_SIZE:
+      g_value_set_uint(value, push_aps_client_get_queue_size(client));
+      break;
    case PROP_SSL_CERT_FILE:
       g_value_set_string(value, push_aps_client_get_ssl_cert_file(client));
       break;
@@ -1246,12 +2269,21 @@ push_aps_client_set_property (GObject      *object,
    PushApsClient *client = PUSH_APS_CLIENT(object);
 
    switch (prop_id) {
+   case PROP_COALESCE_DELAY:
+      push_aps_client_set_coalesce_delay(client, g_value_get_uint(value));
+      break;
    case PROP_FEEDBACK_INTERVAL:
       push_aps_client_set_feedback_interval(client, g_value_get_uint(value));
       break;
    case PROP_MODE:
       push_aps_client_set_mode(client, g_value_get_enum(value));
       break;
+   case PROP_POOL_SIZE:
+      push_aps_client_set_pool_size(client, g_value_get_uint(value));
+      break;
+   case PROP_QUEUE_SIZE:
+      push_aps_client_set_queue_size(client, g_value_get_uint(value));
+      break;
    case PROP_SSL_CERT_FILE:
       push_aps_client_set_ssl_cert_file(client, g_value_get_string(value));
       break;
@@ -1280,6 +2312,37 @@ push_aps_client_class_init (PushApsClientClass *klass)
    object_class->set_property = push_aps_client_set_property;
    g_type_class_add_private(object_class, sizeof(PushApsClientPrivate));
 
+   gParamSpecs[PROP_AVERAGE_BATCH_SIZE] =
+      g_param_spec_double("average-batch-size",
+                          _("Average Batch Size"),
+                          _("The average number of frames per gateway write."),
+                          0.0,
+                          G_MAXDOUBLE,
+                          0.0,
+                          G_PARAM_READABLE);
+   g_object_class_install_property(object_class, PROP_AVERAGE_BATCH_SIZE,
+                                   gParamSpecs[PROP_AVERAGE_BATCH_SIZE]);
+
+   gParamSpecs[PROP_COALESCE_DELAY] =
+      g_param_spec_uint("coalesce-delay",
+                        _("Coalesce Delay"),
+                        _("Milliseconds to wait for frames to coalesce."),
+                        0,
+                        G_MAXUINT,
+                        0,
+                        G_PARAM_READWRITE);
+   g_object_class_install_property(object_class, PROP_COALESCE_DELAY,
+                                   gParamSpecs[PROP_COALESCE_DELAY]);
+
+   gParamSpecs[PROP_CONGESTED] =
+      g_param_spec_boolean("congested",
+                           _("Congested"),
+                           _("If the gateway write queue is congested."),
+                           FALSE,
+                           G_PARAM_READABLE);
+   g_object_class_install_property(object_class, PROP_CONGESTED,
+                                   gParamSpecs[PROP_CONGESTED]);
+
    gParamSpecs[PROP_FEEDBACK_INTERVAL] =
       g_param_spec_uint("feedback-interval",
                         _("Feedback Interval"),
@@ -1291,6 +2354,17 @@ push_aps_client_class_init (PushApsClientClass *klass)
    g_object_class_install_property(object_class, PROP_FEEDBACK_INTERVAL,
                                    gParamSpecs[PROP_FEEDBACK_INTERVAL]);
 
+   gParamSpecs[PROP_FLUSH_COUNT] =
+      g_param_spec_uint64("flush-count",
+                          _("Flush Count"),
+                          _("The number of coalesced gateway writes."),
+                          0,
+                          G_MAXUINT64,
+                          0,
+                          G_PARAM_READABLE);
+   g_object_class_install_property(object_class, PROP_FLUSH_COUNT,
+                                   gParamSpecs[PROP_FLUSH_COUNT]);
+
    gParamSpecs[PROP_MODE] =
       g_param_spec_enum("mode",
                         _("Mode"),
@@ -1301,6 +2375,28 @@ push_aps_client_class_init (PushApsClientClass *klass)
    g_object_class_install_property(object_class, PROP_MODE,
                                    gParamSpecs[PROP_MODE]);
 
+   gParamSpecs[PROP_POOL_SIZE] =
+      g_param_spec_uint("pool-size",
+                        _("Pool Size"),
+                        _("The number of connections to the gateway."),
+                        1,
+                        G_MAXUINT,
+                        PUSH_APS_CLIENT_POOL_SIZE,
+                        G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+   g_object_class_install_property(object_class, PROP_POOL_SIZE,
+                                   gParamSpecs[PROP_POOL_SIZE]);
+
+   gParamSpecs[PROP_QUEUE_SIZE] =
+      g_param_spec_uint("queue-size",
+                        _("Queue Size"),
+                        _("The maximum number of frames awaiting each connection."),
+                        1,
+                        G_MAXUINT,
+                        PUSH_APS_CLIENT_QUEUE_SIZE,
+                        G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+   g_object_class_install_property(object_class, PROP_QUEUE_SIZE,
+                                   gParamSpecs[PROP_QUEUE_SIZE]);
+
    gParamSpecs[PROP_SSL_CERT_FILE] =
       g_param_spec_string("ssl-cert-file",
                           _("SSL Certificate File"),
@@ -1351,12 +2447,15 @@ push_aps_client_init (PushApsClient *client)
                                               PUSH_TYPE_APS_CLIENT,
                                               PushApsClientPrivate);
    client->priv->mode = PUSH_APS_CLIENT_PRODUCTION;
-   client->priv->results =
-      g_hash_table_new_full(g_int_hash, g_int_equal,
-                            g_free, g_object_unref);
+   client->priv->in_flight = g_new0(PushApsInFlight,
+                                    PUSH_APS_CLIENT_IN_FLIGHT_SIZE);
    client->priv->last_id = g_random_int();
+   client->priv->in_flight_head = client->priv->last_id + 1;
    client->priv->feedback_interval = 10;
-   client->priv->queue = g_queue_new();
+   client->priv->dispose_cancellable = g_cancellable_new();
+   push_aps_client_alloc_pool(client,
+                              PUSH_APS_CLIENT_POOL_SIZE,
+                              PUSH_APS_CLIENT_QUEUE_SIZE);
    EXIT;
 }
 
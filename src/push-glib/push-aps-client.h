@@ -23,6 +23,7 @@
 
 #include "push-aps-identity.h"
 #include "push-aps-message.h"
+#include "push-batch.h"
 
 G_BEGIN_DECLS
 
@@ -57,6 +58,7 @@ enum _PushApsClientError
    PUSH_APS_CLIENT_ERROR_ALREADY_CONNECTED    = 257,
    PUSH_APS_CLIENT_ERROR_TLS_NOT_AVAILABLE    = 258,
    PUSH_APS_CLIENT_ERROR_CANCELLED            = 259,
+   PUSH_APS_CLIENT_ERROR_QUEUE_FULL           = 260,
 };
 
 enum _PushApsClientMode
@@ -78,18 +80,38 @@ struct _PushApsClientClass
    GObjectClass parent_class;
 };
 
-void     push_aps_client_deliver_async  (PushApsClient        *client,
-                                         PushApsIdentity      *identity,
-                                         PushApsMessage       *message,
-                                         GCancellable         *cancellable,
-                                         GAsyncReadyCallback   callback,
-                                         gpointer              user_data);
-gboolean push_aps_client_deliver_finish (PushApsClient        *client,
-                                         GAsyncResult         *result,
-                                         GError              **error);
-GQuark   push_aps_client_error_quark    (void) G_GNUC_CONST;
-GType    push_aps_client_get_type       (void) G_GNUC_CONST;
-GType    push_aps_client_mode_get_type  (void) G_GNUC_CONST;
+void     push_aps_client_deliver_async          (PushApsClient         *client,
+                                                 PushApsIdentity       *identity,
+                                                 PushApsMessage        *message,
+                                                 GCancellable          *cancellable,
+                                                 GAsyncReadyCallback    callback,
+                                                 gpointer               user_data);
+void     push_aps_client_deliver_batch_async    (PushApsClient         *client,
+                                                 const PushBatchToken  *tokens,
+                                                 guint                  n_tokens,
+                                                 PushApsMessage        *message,
+                                                 GCancellable          *cancellable,
+                                                 GAsyncReadyCallback    callback,
+                                                 gpointer               user_data);
+gboolean push_aps_client_deliver_batch_finish   (PushApsClient         *client,
+                                                 GAsyncResult          *result,
+                                                 GPtrArray            **failures,
+                                                 GError               **error);
+gboolean push_aps_client_deliver_finish         (PushApsClient         *client,
+                                                 GAsyncResult          *result,
+                                                 GError               **error);
+GQuark   push_aps_client_error_quark            (void) G_GNUC_CONST;
+gdouble  push_aps_client_get_average_batch_size (PushApsClient         *client);
+guint    push_aps_client_get_coalesce_delay     (PushApsClient         *client);
+gboolean push_aps_client_get_congested          (PushApsClient         *client);
+guint64  push_aps_client_get_flush_count        (PushApsClient         *client);
+guint    push_aps_client_get_pool_size          (PushApsClient         *client);
+guint    push_aps_client_get_queue_length       (PushApsClient         *client);
+guint    push_aps_client_get_queue_size         (PushApsClient         *client);
+GType    push_aps_client_get_type               (void) G_GNUC_CONST;
+GType    push_aps_client_mode_get_type          (void) G_GNUC_CONST;
+void     push_aps_client_set_coalesce_delay     (PushApsClient         *client,
+                                                 guint                  coalesce_delay);
 
 G_END_DECLS
 
@@ -46,6 +46,51 @@ enum
 
 static GParamSpec *gParamSpecs[LAST_PROP];
 
+/**
+ * push_aps_identity_decode_token:
+ * @device_token: (in): A device token printed as hex.
+ * @data: (out caller-allocates) (array length=len): A location for the
+ *   decoded token.
+ * @len: The number of bytes to decode.
+ *
+ * Decodes the first @len bytes of @device_token, which is printed as hex
+ * characters of either case, into @data. This is the form the token takes
+ * on the wire and in storage.
+ *
+ * Returns: %TRUE if @device_token started with @len bytes of hex.
+ */
+gboolean
+push_aps_identity_decode_token (const gchar *device_token,
+                                guint8      *data,
+                                gsize        len)
+{
+   guint8 hi;
+   guint8 lo;
+   gsize i;
+
+   g_return_val_if_fail(device_token, FALSE);
+   g_return_val_if_fail(data || !len, FALSE);
+
+   for (i = 0; i < len; i++) {
+      hi = device_token[i * 2];
+      if (!g_ascii_isxdigit(hi)) {
+         return FALSE;
+      }
+      lo = device_token[i * 2 + 1];
+      if (!g_ascii_isxdigit(lo)) {
+         return FALSE;
+      }
+      /*
+       * Maps '0'-'9', 'a'-'f' and 'A'-'F' to their values without
+       * branching on the character.
+       */
+      data[i] = (((hi & 0xF) + 9 * (hi >> 6)) << 4) |
+                ((lo & 0xF) + 9 * (lo >> 6));
+   }
+
+   return TRUE;
+}
+
 /**
  * push_aps_identity_new:
  * @device_token: (allow-none): The APS device token as base64.
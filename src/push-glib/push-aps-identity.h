@@ -48,6 +48,9 @@ struct _PushApsIdentityClass
    GObjectClass parent_class;
 };
 
+gboolean         push_aps_identity_decode_token     (const gchar     *device_token,
+                                                     guint8          *data,
+                                                     gsize            len);
 PushApsIdentity *push_aps_identity_new              (const gchar     *device_token);
 GType            push_aps_identity_get_type         (void) G_GNUC_CONST;
 const gchar     *push_aps_identity_get_device_token (PushApsIdentity *identity);
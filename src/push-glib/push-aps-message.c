@@ -39,6 +39,11 @@
  *
  * Use push_aps_client_deliver_async() to deliver a message to a
  * #PushApsIdentity.
+ *
+ * The JSON encoding is generated once as a template with a hole where the
+ * badge number goes. Changing only the badge, as is done when the same
+ * message is sent to many devices, splices the new digits into a reused
+ * buffer instead of generating the JSON again.
  */
 
 G_DEFINE_TYPE(PushApsMessage, push_aps_message, G_TYPE_OBJECT)
@@ -51,7 +56,12 @@ struct _PushApsMessagePrivate
    gchar *alert;
    guint badge;
    gchar *sound;
-   gchar *json;
+
+   gchar *template;
+   gsize template_len;
+   gssize badge_offset;
+   GString *json;
+   gboolean json_valid;
 };
 
 enum
@@ -119,74 +129,212 @@ push_aps_message_new_from_json (JsonObject *object)
    RETURN(message);
 }
 
-/**
- * push_aps_message_get_json:
- * @message: (in): A #PushApsMessage.
- *
- * Retrieves the message as a JSON encoded message. The resulting string
- * is owned by the #PushApsMessage instance and should not be freed.
- *
- * The string may be cached for future calls to this function.
- *
- * Returns: The message as a JSON encoded string.
- */
-const gchar *
-push_aps_message_get_json (PushApsMessage *message)
+static void
+push_aps_message_invalidate (PushApsMessage *message,
+                             gboolean        template)
 {
    PushApsMessagePrivate *priv;
-   GHashTableIter iter;
+
+   g_assert(PUSH_IS_APS_MESSAGE(message));
+
+   priv = message->priv;
+
+   priv->json_valid = FALSE;
+
+   if (template) {
+      g_free(priv->template);
+      priv->template = NULL;
+      priv->template_len = 0;
+      priv->badge_offset = -1;
+   }
+}
+
+static gchar *
+push_aps_message_generate (JsonObject *obj,
+                           gsize      *len)
+{
    JsonGenerator *json;
+   JsonNode *root;
+   gchar *ret;
+
+   g_assert(obj);
+   g_assert(len);
+
+   root = json_node_new(JSON_NODE_OBJECT);
+   json_node_take_object(root, obj);
+
+   json = json_generator_new();
+   json_generator_set_root(json, root);
+   ret = json_generator_to_data(json, len);
+
+   json_node_free(root);
+   g_object_unref(json);
+
+   return ret;
+}
+
+static void
+push_aps_message_build_template (PushApsMessage *message)
+{
+   PushApsMessagePrivate *priv;
+   GHashTableIter iter;
    JsonObject *obj;
    JsonObject *aps;
-   JsonNode *root;
    gpointer key;
    gpointer value;
-   gchar *ret = NULL;
+   GString *str;
+   gchar *extra_json;
+   gchar *aps_json;
+   gsize extra_len;
+   gsize aps_len;
 
    ENTRY;
 
-   g_return_val_if_fail(PUSH_IS_APS_MESSAGE(message), NULL);
+   g_assert(PUSH_IS_APS_MESSAGE(message));
 
    priv = message->priv;
 
-   if (priv->json) {
-      RETURN(priv->json);
-   }
-
    obj = json_object_new();
-   root = json_node_new(JSON_NODE_OBJECT);
-   json_node_take_object(root, obj);
-
    if (priv->extra) {
       g_hash_table_iter_init(&iter, priv->extra);
       while (g_hash_table_iter_next(&iter, &key, &value)) {
          json_object_set_member(obj, key, json_node_copy(value));
       }
    }
+   extra_json = push_aps_message_generate(obj, &extra_len);
 
    aps = json_object_new();
    if (priv->alert) {
       json_object_set_string_member(aps, "alert", priv->alert);
    }
-   if (priv->badge_set || (!priv->alert && !priv->sound)) {
-      json_object_set_int_member(aps, "badge", priv->badge);
-   }
    if (priv->sound) {
       json_object_set_string_member(aps, "sound", priv->sound);
    }
-   json_object_set_object_member(obj, "aps", aps);
+   aps_json = push_aps_message_generate(aps, &aps_len);
+
+   /*
+    * Join the two objects by hand, with "aps" as the last member, so we
+    * know exactly where the badge goes rather than searching the output
+    * for it. The badge leads the "aps" object and the offset points just
+    * past its key.
+    */
+   str = g_string_sized_new(extra_len + aps_len + 16);
+   g_string_append_len(str, extra_json, extra_len - 1);
+   if (extra_len > 2) {
+      g_string_append_c(str, ',');
+   }
+   g_string_append(str, "\"aps\":");
 
-   json = json_generator_new();
-   json_generator_set_root(json, root);
-   ret = json_generator_to_data(json, NULL);
+   priv->badge_offset = -1;
 
-   json_node_free(root);
-   g_object_unref(json);
+   if (priv->badge_set || (!priv->alert && !priv->sound)) {
+      g_string_append(str, "{\"badge\":");
+      priv->badge_offset = str->len;
+      if (aps_len > 2) {
+         g_string_append_c(str, ',');
+         g_string_append_len(str, aps_json + 1, aps_len - 1);
+      } else {
+         g_string_append_c(str, '}');
+      }
+   } else {
+      g_string_append_len(str, aps_json, aps_len);
+   }
+
+   g_string_append_c(str, '}');
+
+   g_free(extra_json);
+   g_free(aps_json);
+
+   g_free(priv->template);
+   priv->template_len = str->len;
+   priv->template = g_string_free(str, FALSE);
+
+   EXIT;
+}
+
+/**
+ * push_aps_message_get_json:
+ * @message: (in): A #PushApsMessage.
+ *
+ * Retrieves the message as a JSON encoded message. The resulting string
+ * is owned by the #PushApsMessage instance and should not be freed.
+ *
+ * The string may be cached for future calls to this function. It is only
+ * valid until the message is next modified.
+ *
+ * Returns: The message as a JSON encoded string.
+ */
+const gchar *
+push_aps_message_get_json (PushApsMessage *message)
+{
+   PushApsMessagePrivate *priv;
+
+   ENTRY;
+
+   g_return_val_if_fail(PUSH_IS_APS_MESSAGE(message), NULL);
+
+   priv = message->priv;
 
-   g_free(priv->json);
-   priv->json = ret;
+   if (priv->json_valid) {
+      RETURN(priv->json->str);
+   }
+
+   if (!priv->template) {
+      push_aps_message_build_template(message);
+   }
+
+   g_string_truncate(priv->json, 0);
 
-   RETURN(ret);
+   if (priv->badge_offset < 0) {
+      g_string_append_len(priv->json, priv->template, priv->template_len);
+   } else {
+      g_string_append_len(priv->json, priv->template, priv->badge_offset);
+      g_string_append_printf(priv->json, "%u", priv->badge);
+      g_string_append_len(priv->json,
+                          priv->template + priv->badge_offset,
+                          priv->template_len - priv->badge_offset);
+   }
+
+   priv->json_valid = TRUE;
+
+   RETURN(priv->json->str);
+}
+
+/**
+ * push_aps_message_get_oversized:
+ * @message: (in): A #PushApsMessage.
+ *
+ * Checks if the JSON encoded message is larger than the
+ * %PUSH_APS_MESSAGE_MAX_PAYLOAD bytes accepted by the gateway. The length
+ * is known from the template plus the badge digits, so this does not
+ * generate or scan the JSON again.
+ *
+ * Returns: %TRUE if the message is too large to be delivered.
+ */
+gboolean
+push_aps_message_get_oversized (PushApsMessage *message)
+{
+   PushApsMessagePrivate *priv;
+   gsize len;
+   guint badge;
+
+   g_return_val_if_fail(PUSH_IS_APS_MESSAGE(message), FALSE);
+
+   priv = message->priv;
+
+   if (!priv->template) {
+      push_aps_message_build_template(message);
+   }
+
+   len = priv->template_len;
+
+   if (priv->badge_offset >= 0) {
+      for (badge = priv->badge, len++; badge >= 10; badge /= 10) {
+         len++;
+      }
+   }
+
+   return (len > PUSH_APS_MESSAGE_MAX_PAYLOAD);
 }
 
 /**
@@ -225,8 +373,7 @@ push_aps_message_add_extra (PushApsMessage *message,
 
    g_hash_table_insert(priv->extra, g_strdup(key), json_node_copy(value));
 
-   g_free(priv->json);
-   priv->json = NULL;
+   push_aps_message_invalidate(message, TRUE);
 
    EXIT;
 }
@@ -343,8 +490,7 @@ push_aps_message_set_alert (PushApsMessage *message,
 
    g_free(message->priv->alert);
    message->priv->alert = g_strdup(alert);
-   g_free(message->priv->json);
-   message->priv->json = NULL;
+   push_aps_message_invalidate(message, TRUE);
    g_object_notify_by_pspec(G_OBJECT(message), gParamSpecs[PROP_ALERT]);
 }
 
@@ -363,10 +509,13 @@ push_aps_message_set_badge (PushApsMessage *message,
 {
    g_return_if_fail(PUSH_IS_APS_MESSAGE(message));
 
+   /*
+    * Only the badge digits change, so the template can be reused unless
+    * this is the first time the badge is set.
+    */
+   push_aps_message_invalidate(message, !message->priv->badge_set);
    message->priv->badge = badge;
    message->priv->badge_set = TRUE;
-   g_free(message->priv->json);
-   message->priv->json = NULL;
    g_object_notify_by_pspec(G_OBJECT(message), gParamSpecs[PROP_BADGE]);
 }
 
@@ -410,8 +559,7 @@ push_aps_message_set_sound (PushApsMessage *message,
 
    g_free(message->priv->sound);
    message->priv->sound = g_strdup(sound);
-   g_free(message->priv->json);
-   message->priv->json = NULL;
+   push_aps_message_invalidate(message, TRUE);
    g_object_notify_by_pspec(G_OBJECT(message), gParamSpecs[PROP_SOUND]);
 }
 
@@ -430,7 +578,10 @@ push_aps_message_finalize (GObject *object)
    g_free(priv->sound);
    priv->sound = NULL;
 
-   g_free(priv->json);
+   g_free(priv->template);
+   priv->template = NULL;
+
+   g_string_free(priv->json, TRUE);
    priv->json = NULL;
 
    if (priv->expires_at) {
@@ -566,4 +717,6 @@ push_aps_message_init (PushApsMessage *message)
    message->priv = G_TYPE_INSTANCE_GET_PRIVATE(message,
                                                PUSH_TYPE_APS_MESSAGE,
                                                PushApsMessagePrivate);
+   message->priv->json = g_string_sized_new(PUSH_APS_MESSAGE_MAX_PAYLOAD);
+   message->priv->badge_offset = -1;
 }
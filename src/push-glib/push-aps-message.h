@@ -24,6 +24,8 @@
 
 G_BEGIN_DECLS
 
+#define PUSH_APS_MESSAGE_MAX_PAYLOAD     256
+
 #define PUSH_TYPE_APS_MESSAGE            (push_aps_message_get_type())
 #define PUSH_APS_MESSAGE(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), PUSH_TYPE_APS_MESSAGE, PushApsMessage))
 #define PUSH_APS_MESSAGE_CONST(obj)      (G_TYPE_CHECK_INSTANCE_CAST ((obj), PUSH_TYPE_APS_MESSAGE, PushApsMessage const))
@@ -60,6 +62,7 @@ const gchar    *push_aps_message_get_alert        (PushApsMessage *message);
 guint           push_aps_message_get_badge        (PushApsMessage *message);
 GDateTime      *push_aps_message_get_expires_at   (PushApsMessage *message);
 const gchar    *push_aps_message_get_json         (PushApsMessage *message);
+gboolean        push_aps_message_get_oversized    (PushApsMessage *message);
 const gchar    *push_aps_message_get_sound        (PushApsMessage *message);
 PushApsMessage *push_aps_message_new              (void);
 PushApsMessage *push_aps_message_new_from_json    (JsonObject     *object);
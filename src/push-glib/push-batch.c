@@ -0,0 +1,176 @@
+/* push-batch.c
+ *
+ * Copyright (C) 2012 Christian Hergert <chris@dronelabs.com>
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "push-batch.h"
+#include "push-debug.h"
+
+/**
+ * SECTION:push-batch
+ * @title: PushBatch
+ * @short_description: Aggregate completion for batch deliveries.
+ *
+ * The push clients provide a deliver_batch_async() variant that takes a
+ * plain array of #PushBatchToken rather than an identity object per
+ * device. The whole batch completes once with a single #GAsyncResult.
+ * Per-token failures are returned from the matching deliver_batch_finish()
+ * as a #GPtrArray of #PushBatchFailure, whose index refers to the position
+ * of the token in the array given to deliver_batch_async().
+ *
+ * #PushBatch is used by the clients to count outstanding deliveries and
+ * collect failures until the last one completes.
+ */
+
+struct _PushBatch
+{
+   GSimpleAsyncResult *simple;
+   GPtrArray          *failures;
+   guint               n_pending;
+};
+
+/**
+ * push_batch_new:
+ * @simple: (transfer none): A #GSimpleAsyncResult to complete.
+ * @n_pending: The number of deliveries to wait for.
+ *
+ * Creates a new #PushBatch that completes @simple once @n_pending
+ * deliveries have been reported with push_batch_complete(). The batch is
+ * freed upon completion.
+ *
+ * Returns: A newly allocated #PushBatch.
+ */
+PushBatch *
+push_batch_new (GSimpleAsyncResult *simple,
+                guint               n_pending)
+{
+   PushBatch *batch;
+
+   g_return_val_if_fail(G_IS_SIMPLE_ASYNC_RESULT(simple), NULL);
+   g_return_val_if_fail(n_pending, NULL);
+
+   batch = g_slice_new0(PushBatch);
+   batch->simple = g_object_ref(simple);
+   batch->failures =
+      g_ptr_array_new_with_free_func((GDestroyNotify)push_batch_failure_free);
+   batch->n_pending = n_pending;
+
+   return batch;
+}
+
+/**
+ * push_batch_fail:
+ * @batch: A #PushBatch.
+ * @index: The index of the failed token.
+ * @error: (transfer full): A #GError describing the failure.
+ *
+ * Records that delivery to the token at @index failed. The delivery must
+ * still be reported with push_batch_complete().
+ */
+void
+push_batch_fail (PushBatch *batch,
+                 guint      index,
+                 GError    *error)
+{
+   PushBatchFailure *failure;
+
+   g_return_if_fail(batch);
+   g_return_if_fail(error);
+
+   failure = g_slice_new(PushBatchFailure);
+   failure->index = index;
+   failure->error = error;
+   g_ptr_array_add(batch->failures, failure);
+}
+
+/**
+ * push_batch_complete:
+ * @batch: A #PushBatch.
+ * @n_completed: The number of deliveries that completed.
+ *
+ * Reports that @n_completed deliveries have completed. Once all pending
+ * deliveries have completed, the async result is completed and @batch
+ * is freed.
+ */
+void
+push_batch_complete (PushBatch *batch,
+                     guint      n_completed)
+{
+   g_return_if_fail(batch);
+   g_return_if_fail(n_completed <= batch->n_pending);
+
+   if (!(batch->n_pending -= n_completed)) {
+      g_simple_async_result_set_op_res_gpointer(
+            batch->simple,
+            batch->failures,
+            (GDestroyNotify)g_ptr_array_unref);
+      g_simple_async_result_complete_in_idle(batch->simple);
+      g_object_unref(batch->simple);
+      g_slice_free(PushBatch, batch);
+   }
+}
+
+/**
+ * push_batch_finish:
+ * @simple: A #GSimpleAsyncResult.
+ * @failures: (out) (allow-none) (element-type PushBatchFailure*): A location
+ *   for the per-token failures, or %NULL.
+ * @error: (out) (allow-none): A location for a #GError, or %NULL.
+ *
+ * Completes a batch delivery for one of the push clients. @error is only
+ * set if the batch as a whole could not be delivered. Otherwise @failures
+ * is set to the possibly empty array of tokens that failed, which should
+ * be freed with g_ptr_array_unref().
+ *
+ * Returns: %TRUE unless the whole batch failed.
+ */
+gboolean
+push_batch_finish (GSimpleAsyncResult  *simple,
+                   GPtrArray          **failures,
+                   GError             **error)
+{
+   GPtrArray *ar;
+
+   ENTRY;
+
+   g_return_val_if_fail(G_IS_SIMPLE_ASYNC_RESULT(simple), FALSE);
+
+   if (g_simple_async_result_propagate_error(simple, error)) {
+      RETURN(FALSE);
+   }
+
+   if (failures) {
+      ar = g_simple_async_result_get_op_res_gpointer(simple);
+      *failures = ar ? g_ptr_array_ref(ar) : NULL;
+   }
+
+   RETURN(TRUE);
+}
+
+/**
+ * push_batch_failure_free:
+ * @failure: A #PushBatchFailure.
+ *
+ * Frees @failure and its error.
+ */
+void
+push_batch_failure_free (PushBatchFailure *failure)
+{
+   if (failure) {
+      g_clear_error(&failure->error);
+      g_slice_free(PushBatchFailure, failure);
+   }
+}
@@ -0,0 +1,56 @@
+/* push-batch.h
+ *
+ * Copyright (C) 2012 Christian Hergert <chris@dronelabs.com>
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PUSH_BATCH_H
+#define PUSH_BATCH_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _PushBatch        PushBatch;
+typedef struct _PushBatchFailure PushBatchFailure;
+typedef struct _PushBatchToken   PushBatchToken;
+
+struct _PushBatchToken
+{
+   const gchar *token;
+   guint        badge;
+};
+
+struct _PushBatchFailure
+{
+   guint   index;
+   GError *error;
+};
+
+void       push_batch_complete     (PushBatch          *batch,
+                                    guint               n_completed);
+void       push_batch_fail         (PushBatch          *batch,
+                                    guint               index,
+                                    GError             *error);
+void       push_batch_failure_free (PushBatchFailure   *failure);
+gboolean   push_batch_finish       (GSimpleAsyncResult *simple,
+                                    GPtrArray         **failures,
+                                    GError            **error);
+PushBatch *push_batch_new          (GSimpleAsyncResult *simple,
+                                    guint               n_pending);
+
+G_END_DECLS
+
+#endif /* PUSH_BATCH_H */
@@ -105,50 +105,58 @@ push_c2dm_client_set_auth_token (PushC2dmClient *client,
    EXIT;
 }
 
-static void
-push_c2dm_client_message_cb (SoupSession *session,
-                             SoupMessage *message,
-                             gpointer     user_data)
+/*
+ * A single request of a batch started with
+ * push_c2dm_client_deliver_batch_async().
+ */
+typedef struct
+{
+   PushBatch *batch;
+   guint      index;
+   gchar     *registration_id;
+} PushC2dmBatchRequest;
+
+static gboolean
+push_c2dm_client_parse_response (PushC2dmClient  *client,
+                                 SoupMessage     *message,
+                                 const gchar     *registration_id,
+                                 GError         **error)
 {
-   GSimpleAsyncResult *simple = user_data;
    PushC2dmIdentity *identity;
-   PushC2dmClient *client = (PushC2dmClient *)session;
    const guint8 *data;
    const gchar *code_str;
-   const gchar *registration_id;
    SoupBuffer *buffer;
    gboolean removed = FALSE;
+   gboolean ret = FALSE;
    gsize length;
    guint code;
 
    ENTRY;
 
-   g_return_if_fail(PUSH_IS_C2DM_CLIENT(client));
-   g_return_if_fail(SOUP_IS_MESSAGE(message));
-   g_return_if_fail(G_IS_SIMPLE_ASYNC_RESULT(simple));
+   g_assert(PUSH_IS_C2DM_CLIENT(client));
+   g_assert(SOUP_IS_MESSAGE(message));
 
    buffer = soup_message_body_flatten(message->response_body);
    soup_buffer_get_data(buffer, &data, &length);
 
    if (message->status_code == SOUP_STATUS_UNAUTHORIZED) {
-      g_simple_async_result_set_error(
-         simple,
-         PUSH_C2DM_CLIENT_ERROR,
-         PUSH_C2DM_CLIENT_ERROR_UNAUTHORIZED,
-         _("C2DM request unauthorized. Check credentials."));
+      g_set_error(error,
+                  PUSH_C2DM_CLIENT_ERROR,
+                  PUSH_C2DM_CLIENT_ERROR_UNAUTHORIZED,
+                  _("C2DM request unauthorized. Check credentials."));
       GOTO(failure);
    }
 
    if (!g_utf8_validate((gchar *)data, length, NULL)) {
-      g_simple_async_result_set_error(simple,
-                                      PUSH_C2DM_CLIENT_ERROR,
-                                      PUSH_C2DM_CLIENT_ERROR_UNKNOWN,
-                                      _("Received invalid result from C2DM."));
+      g_set_error(error,
+                  PUSH_C2DM_CLIENT_ERROR,
+                  PUSH_C2DM_CLIENT_ERROR_UNKNOWN,
+                  _("Received invalid result from C2DM."));
       GOTO(failure);
    }
 
    if (g_str_has_prefix((gchar *)data, "id=")) {
-      g_simple_async_result_set_op_res_gboolean(simple, TRUE);
+      ret = TRUE;
    } else {
       if (g_str_equal(data, "Error=QuotaExceeded")) {
          code = PUSH_C2DM_CLIENT_ERROR_QUOTA_EXCEEDED;
@@ -181,12 +189,8 @@ push_c2dm_client_message_cb (SoupSession *session,
          code = PUSH_C2DM_CLIENT_ERROR_UNKNOWN;
          code_str = _("An unknown error occurred.");
       }
-      g_simple_async_result_set_error(simple,
-                                      PUSH_C2DM_CLIENT_ERROR,
-                                      code, "%s", code_str);
+      g_set_error(error, PUSH_C2DM_CLIENT_ERROR, code, "%s", code_str);
       if (removed) {
-         registration_id = g_object_get_data(G_OBJECT(simple),
-                                             "registration-id");
          identity = g_object_new(PUSH_TYPE_C2DM_IDENTITY,
                                  "registration-id", registration_id,
                                  NULL);
@@ -197,12 +201,100 @@ push_c2dm_client_message_cb (SoupSession *session,
 
 failure:
    soup_buffer_free(buffer);
+
+   RETURN(ret);
+}
+
+static void
+push_c2dm_client_message_cb (SoupSession *session,
+                             SoupMessage *message,
+                             gpointer     user_data)
+{
+   GSimpleAsyncResult *simple = user_data;
+   PushC2dmClient *client = (PushC2dmClient *)session;
+   const gchar *registration_id;
+   GError *error = NULL;
+
+   ENTRY;
+
+   g_return_if_fail(PUSH_IS_C2DM_CLIENT(client));
+   g_return_if_fail(SOUP_IS_MESSAGE(message));
+   g_return_if_fail(G_IS_SIMPLE_ASYNC_RESULT(simple));
+
+   registration_id = g_object_get_data(G_OBJECT(simple), "registration-id");
+
+   if (push_c2dm_client_parse_response(client, message,
+                                       registration_id, &error)) {
+      g_simple_async_result_set_op_res_gboolean(simple, TRUE);
+   } else {
+      g_simple_async_result_take_error(simple, error);
+   }
+
    g_simple_async_result_complete_in_idle(simple);
    g_object_unref(simple);
 
    EXIT;
 }
 
+static void
+push_c2dm_client_batch_message_cb (SoupSession *session,
+                                   SoupMessage *message,
+                                   gpointer     user_data)
+{
+   PushC2dmBatchRequest *request = user_data;
+   PushC2dmClient *client = (PushC2dmClient *)session;
+   GError *error = NULL;
+
+   ENTRY;
+
+   g_return_if_fail(PUSH_IS_C2DM_CLIENT(client));
+   g_return_if_fail(SOUP_IS_MESSAGE(message));
+   g_return_if_fail(request);
+
+   if (!push_c2dm_client_parse_response(client, message,
+                                        request->registration_id, &error)) {
+      push_batch_fail(request->batch, request->index, error);
+   }
+
+   push_batch_complete(request->batch, 1);
+   g_free(request->registration_id);
+   g_slice_free(PushC2dmBatchRequest, request);
+
+   EXIT;
+}
+
+static SoupMessage *
+push_c2dm_client_build_request (PushC2dmClient  *client,
+                                PushC2dmMessage *message,
+                                const gchar     *registration_id)
+{
+   PushC2dmClientPrivate *priv;
+   SoupMessage *request;
+   GHashTable *params;
+   gchar *auth_header;
+
+   g_assert(PUSH_IS_C2DM_CLIENT(client));
+   g_assert(PUSH_IS_C2DM_MESSAGE(message));
+
+   priv = client->priv;
+
+   params = push_c2dm_message_build_params(message);
+   g_hash_table_insert(params,
+                       g_strdup("registration_id"),
+                       g_strdup(registration_id));
+   request = soup_form_request_new_from_hash(SOUP_METHOD_POST,
+                                             PUSH_C2DM_CLIENT_URL,
+                                             params);
+   auth_header = g_strdup_printf("GoogleLogin auth=%s", priv->auth_token);
+   soup_message_headers_append(request->request_headers,
+                               "Authorization",
+                               auth_header);
+   g_free(auth_header);
+   g_hash_table_unref(params);
+
+   return request;
+}
+
 /**
  * push_c2dm_client_deliver_async:
  * @client: A #PushC2dmClient.
@@ -224,12 +316,9 @@ push_c2dm_client_deliver_async (PushC2dmClient      *client,
                                 GAsyncReadyCallback  callback,
                                 gpointer             user_data)
 {
-   PushC2dmClientPrivate *priv;
    GSimpleAsyncResult *simple;
-   const gchar *auth_header;
    const gchar *registration_id;
    SoupMessage *request;
-   GHashTable *params;
 
    ENTRY;
 
@@ -239,20 +328,8 @@ push_c2dm_client_deliver_async (PushC2dmClient      *client,
    g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
    g_return_if_fail(callback);
 
-   priv = client->priv;
-
    registration_id = push_c2dm_identity_get_registration_id(identity);
-   params = push_c2dm_message_build_params(message);
-   g_hash_table_insert(params,
-                       g_strdup("registration_id"),
-                       g_strdup(registration_id));
-   request = soup_form_request_new_from_hash(SOUP_METHOD_POST,
-                                             PUSH_C2DM_CLIENT_URL,
-                                             params);
-   auth_header = g_strdup_printf("GoogleLogin auth=%s", priv->auth_token);
-   soup_message_headers_append(request->request_headers,
-                               "Authorization",
-                               auth_header);
+   request = push_c2dm_client_build_request(client, message, registration_id);
    simple = g_simple_async_result_new(G_OBJECT(client), callback, user_data,
                                       push_c2dm_client_deliver_async);
    g_simple_async_result_set_check_cancellable(simple, cancellable);
@@ -262,11 +339,113 @@ push_c2dm_client_deliver_async (PushC2dmClient      *client,
                               request,
                               push_c2dm_client_message_cb,
                               simple);
-   g_hash_table_unref(params);
 
    EXIT;
 }
 
+/**
+ * push_c2dm_client_deliver_batch_async:
+ * @client: A #PushC2dmClient.
+ * @tokens: (array length=n_tokens): An array of #PushBatchToken.
+ * @n_tokens: The number of elements in @tokens.
+ * @message: A #PushC2dmMessage.
+ * @cancellable: (allow-none): A #GCancellable, or %NULL.
+ * @callback: A callback to execute upon completion.
+ * @user_data: User data for @callback.
+ *
+ * Requests that @message is pushed to every registration id in @tokens.
+ * C2DM only accepts a single recipient per request, so a request is
+ * queued per token, but no identity or async result is created for each
+ * of them. @tokens only needs to remain valid for the duration of this
+ * call.
+ *
+ * Upon completion of every request, @callback will be executed and is
+ * expected to call push_c2dm_client_deliver_batch_finish().
+ */
+void
+push_c2dm_client_deliver_batch_async (PushC2dmClient       *client,
+                                      const PushBatchToken *tokens,
+                                      guint                 n_tokens,
+                                      PushC2dmMessage      *message,
+                                      GCancellable         *cancellable,
+                                      GAsyncReadyCallback   callback,
+                                      gpointer              user_data)
+{
+   PushC2dmBatchRequest *request;
+   GSimpleAsyncResult *simple;
+   SoupMessage *soup_message;
+   PushBatch *batch;
+   guint i;
+
+   ENTRY;
+
+   g_return_if_fail(PUSH_IS_C2DM_CLIENT(client));
+   g_return_if_fail(tokens || !n_tokens);
+   g_return_if_fail(PUSH_IS_C2DM_MESSAGE(message));
+   g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
+   g_return_if_fail(callback);
+
+   simple = g_simple_async_result_new(G_OBJECT(client), callback, user_data,
+                                      push_c2dm_client_deliver_batch_async);
+   g_simple_async_result_set_check_cancellable(simple, cancellable);
+
+   /*
+    * Hold an extra pending request so the batch cannot complete while
+    * we are still queuing it.
+    */
+   batch = push_batch_new(simple, n_tokens + 1);
+
+   for (i = 0; i < n_tokens; i++) {
+      request = g_slice_new(PushC2dmBatchRequest);
+      request->batch = batch;
+      request->index = i;
+      request->registration_id = g_strdup(tokens[i].token);
+      soup_message = push_c2dm_client_build_request(client,
+                                                    message,
+                                                    tokens[i].token);
+      soup_session_queue_message(SOUP_SESSION(client),
+                                 soup_message,
+                                 push_c2dm_client_batch_message_cb,
+                                 request);
+   }
+
+   push_batch_complete(batch, 1);
+   g_object_unref(simple);
+
+   EXIT;
+}
+
+/**
+ * push_c2dm_client_deliver_batch_finish:
+ * @client: A #PushC2dmClient.
+ * @result: A #GAsyncResult.
+ * @failures: (out) (allow-none) (element-type PushBatchFailure*): A location
+ *   for the tokens that failed, or %NULL.
+ * @error: (out) (allow-none): A location for a #GError, or %NULL.
+ *
+ * Completes a request to push_c2dm_client_deliver_batch_async(). See
+ * push_batch_finish() for details on @failures.
+ *
+ * Returns: %TRUE unless the whole batch failed.
+ */
+gboolean
+push_c2dm_client_deliver_batch_finish (PushC2dmClient  *client,
+                                       GAsyncResult    *result,
+                                       GPtrArray      **failures,
+                                       GError         **error)
+{
+   gboolean ret;
+
+   ENTRY;
+
+   g_return_val_if_fail(PUSH_IS_C2DM_CLIENT(client), FALSE);
+   g_return_val_if_fail(G_IS_SIMPLE_ASYNC_RESULT(result), FALSE);
+
+   ret = push_batch_finish(G_SIMPLE_ASYNC_RESULT(result), failures, error);
+
+   RETURN(ret);
+}
+
 /**
  * push_c2dm_client_deliver_finish:
  * @client: A #PushC2dmClient.
@@ -24,6 +24,7 @@
 
 #include "push-c2dm-identity.h"
 #include "push-c2dm-message.h"
+#include "push-batch.h"
 
 G_BEGIN_DECLS
 
@@ -68,17 +69,28 @@ struct _PushC2dmClientClass
    SoupSessionAsyncClass parent_class;
 };
 
-void     push_c2dm_client_deliver_async  (PushC2dmClient       *client,
-                                          PushC2dmIdentity     *identity,
-                                          PushC2dmMessage      *message,
-                                          GCancellable         *cancellable,
-                                          GAsyncReadyCallback   callback,
-                                          gpointer              user_data);
-gboolean push_c2dm_client_deliver_finish (PushC2dmClient       *client,
-                                          GAsyncResult         *result,
-                                          GError              **error);
-GQuark   push_c2dm_client_error_quark    (void) G_GNUC_CONST;
-GType    push_c2dm_client_get_type       (void) G_GNUC_CONST;
+void     push_c2dm_client_deliver_async        (PushC2dmClient        *client,
+                                                PushC2dmIdentity      *identity,
+                                                PushC2dmMessage       *message,
+                                                GCancellable          *cancellable,
+                                                GAsyncReadyCallback    callback,
+                                                gpointer               user_data);
+void     push_c2dm_client_deliver_batch_async  (PushC2dmClient        *client,
+                                                const PushBatchToken  *tokens,
+                                                guint                  n_tokens,
+                                                PushC2dmMessage       *message,
+                                                GCancellable          *cancellable,
+                                                GAsyncReadyCallback    callback,
+                                                gpointer               user_data);
+gboolean push_c2dm_client_deliver_batch_finish (PushC2dmClient        *client,
+                                                GAsyncResult          *result,
+                                                GPtrArray            **failures,
+                                                GError               **error);
+gboolean push_c2dm_client_deliver_finish       (PushC2dmClient        *client,
+                                                GAsyncResult          *result,
+                                                GError               **error);
+GQuark   push_c2dm_client_error_quark          (void) G_GNUC_CONST;
+GType    push_c2dm_client_get_type             (void) G_GNUC_CONST;
 
 G_END_DECLS
 
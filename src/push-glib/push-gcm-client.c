@@ -23,6 +23,15 @@
 
 #define PUSH_GCM_CLIENT_URL "https://android.googleapis.com/gcm/send"
 
+/*
+ * GCM rejects multicast requests with more registration ids than this.
+ */
+#define PUSH_GCM_CLIENT_MAX_REGISTRATION_IDS 1000
+
+#ifndef PUSH_GCM_CLIENT_MAX_CONNS_PER_HOST
+#define PUSH_GCM_CLIENT_MAX_CONNS_PER_HOST 4
+#endif
+
 /**
  * SECTION:push-gcm-client
  * @title: PushGcmClient
@@ -39,6 +48,12 @@
  * :identity-removed single will be emitted. It is important that consumers
  * connect to this signal and remove the device from their database to
  * prevent further communication with the service.
+ *
+ * GCM accepts at most 1000 registration ids per request, so larger
+ * deliveries are split into multiple requests whose results are merged
+ * into a single completion. The requests run concurrently over up to
+ * #SoupSession:max-conns-per-host persistent connections, which are kept
+ * open and reused for subsequent requests.
  */
 
 G_DEFINE_TYPE(PushGcmClient, push_gcm_client, SOUP_TYPE_SESSION_ASYNC)
@@ -95,13 +110,26 @@ push_gcm_client_set_auth_token (PushGcmClient *client,
    EXIT;
 }
 
+/*
+ * A single request to GCM carrying up to
+ * PUSH_GCM_CLIENT_MAX_REGISTRATION_IDS of the registration ids of a
+ * delivery. offset is the position of the first of them within the
+ * delivery.
+ */
+typedef struct
+{
+   PushBatch           *batch;
+   GSimpleAsyncResult  *simple;
+   gchar              **registration_ids;
+   guint                offset;
+} PushGcmRequest;
+
 static void
-_push_gcm_identities_free (gpointer data)
+push_gcm_request_free (PushGcmRequest *request)
 {
-   ENTRY;
-   g_list_foreach(data, (GFunc)g_object_unref, NULL);
-   g_list_free(data);
-   EXIT;
+   g_object_unref(request->simple);
+   g_strfreev(request->registration_ids);
+   g_slice_free(PushGcmRequest, request);
 }
 
 static void
@@ -109,24 +137,34 @@ push_gcm_client_deliver_cb (SoupSession *session,
                             SoupMessage *message,
                             gpointer     user_data)
 {
-   GSimpleAsyncResult *simple = user_data;
+   PushGcmRequest *request = user_data;
+   PushGcmIdentity *identity;
    const gchar *str;
    JsonObject *obj;
    JsonParser *p = NULL;
    JsonArray *ar;
    JsonNode *root;
    JsonNode *node;
+   gboolean is_batch;
    gboolean removed;
    GError *error = NULL;
-   GList *list;
    gsize length;
+   guint n_registration_ids;
+   guint code;
    guint i;
 
    ENTRY;
 
    g_assert(SOUP_IS_SESSION(session));
    g_assert(SOUP_IS_MESSAGE(message));
-   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+   g_assert(request);
+
+   /*
+    * Batch deliveries report failures per registration id rather than
+    * only emitting "identity-removed".
+    */
+   is_batch = (g_simple_async_result_get_source_tag(request->simple) ==
+               push_gcm_client_deliver_batch_async);
 
    switch (message->status_code) {
    case SOUP_STATUS_OK:
@@ -137,11 +175,10 @@ push_gcm_client_deliver_cb (SoupSession *session,
        */
       break;
    case SOUP_STATUS_UNAUTHORIZED:
-      g_simple_async_result_set_error(
-         simple,
-         SOUP_HTTP_ERROR,
-         message->status_code,
-         _("GCM request unauthorized. Check credentials."));
+      g_set_error(&error,
+                  SOUP_HTTP_ERROR,
+                  message->status_code,
+                  _("GCM request unauthorized. Check credentials."));
       GOTO(failure);
    default:
       if (SOUP_STATUS_IS_SERVER_ERROR(message->status_code) &&
@@ -151,18 +188,18 @@ push_gcm_client_deliver_cb (SoupSession *session,
           * TODO: Implement exponential back-off.
           */
       }
-      g_simple_async_result_set_error(simple,
-                                      SOUP_HTTP_ERROR,
-                                      message->status_code,
-                                      _("Unknown failure occurred."));
-      break;
+      g_set_error(&error,
+                  SOUP_HTTP_ERROR,
+                  message->status_code,
+                  _("Unknown failure occurred."));
+      GOTO(failure);
    }
 
    if (!message->response_body->data || !message->response_body->length) {
-      g_simple_async_result_set_error(simple,
-                                      SOUP_HTTP_ERROR,
-                                      SOUP_STATUS_IO_ERROR,
-                                      _("No data was received from GCM."));
+      g_set_error(&error,
+                  SOUP_HTTP_ERROR,
+                  SOUP_STATUS_IO_ERROR,
+                  _("No data was received from GCM."));
       GOTO(failure);
    }
 
@@ -172,11 +209,10 @@ push_gcm_client_deliver_cb (SoupSession *session,
                                    message->response_body->data,
                                    message->response_body->length,
                                    &error)) {
-      g_simple_async_result_take_error(simple, error);
       GOTO(failure);
    }
 
-   list = g_object_get_data(G_OBJECT(simple), "identities");
+   n_registration_ids = g_strv_length(request->registration_ids);
 
    if ((root = json_parser_get_root(p)) &&
        JSON_NODE_HOLDS_OBJECT(root) &&
@@ -186,7 +222,7 @@ push_gcm_client_deliver_cb (SoupSession *session,
        JSON_NODE_HOLDS_ARRAY(node) &&
        (ar = json_node_get_array(node))) {
       length = json_array_get_length(ar);
-      for (i = 0; i < length && list; i++, list = list->next) {
+      for (i = 0; i < length && i < n_registration_ids; i++) {
          /*
           * TODO: Handle the case that the device_token has been renamed.
           */
@@ -197,30 +233,69 @@ push_gcm_client_deliver_cb (SoupSession *session,
              JSON_NODE_HOLDS_VALUE(node) &&
              (str = json_node_get_string(node))) {
             if (!g_strcmp0(str, "MissingRegistration")) {
+               code = PUSH_GCM_CLIENT_ERROR_MISSING_REGISTRATION;
                removed = TRUE;
             } else if (!g_strcmp0(str, "InvalidRegistration")) {
+               code = PUSH_GCM_CLIENT_ERROR_INVALID_REGISTRATION;
                removed = TRUE;
             } else if (!g_strcmp0(str, "MismatchSenderId")) {
+               code = PUSH_GCM_CLIENT_ERROR_MISMATCH_SENDER_ID;
             } else if (!g_strcmp0(str, "NotRegistered")) {
+               code = PUSH_GCM_CLIENT_ERROR_NOT_REGISTERED;
                removed = TRUE;
             } else if (!g_strcmp0(str, "MessageTooBig")) {
+               code = PUSH_GCM_CLIENT_ERROR_MESSAGE_TOO_BIG;
             } else if (!g_strcmp0(str, "InvalidDataKey")) {
+               code = PUSH_GCM_CLIENT_ERROR_INVALID_DATA_KEY;
             } else if (!g_strcmp0(str, "InvalidTtl")) {
+               code = PUSH_GCM_CLIENT_ERROR_INVALID_TTL;
+            } else if (!g_strcmp0(str, "Unavailable")) {
+               code = PUSH_GCM_CLIENT_ERROR_UNAVAILABLE;
+            } else {
+               code = PUSH_GCM_CLIENT_ERROR_UNKNOWN;
+            }
+
+            if (is_batch) {
+               push_batch_fail(request->batch,
+                               request->offset + i,
+                               g_error_new(PUSH_GCM_CLIENT_ERROR,
+                                           code,
+                                           _("GCM delivery failed: %s"),
+                                           str));
             }
 
             if (removed) {
-               g_assert(PUSH_IS_GCM_IDENTITY(list->data));
-               g_signal_emit(session, gSignals[IDENTITY_REMOVED], 0, list->data);
+               identity =
+                  push_gcm_identity_new(request->registration_ids[i]);
+               g_signal_emit(session, gSignals[IDENTITY_REMOVED], 0, identity);
+               g_object_unref(identity);
             }
          }
       }
    }
 
-   g_simple_async_result_set_op_res_gboolean(simple, TRUE);
-
 failure:
-   g_simple_async_result_complete_in_idle(simple);
-   g_object_unref(simple);
+   /*
+    * A request failing as a whole fails each of its registration ids for
+    * batch deliveries. Otherwise it fails the delivery, while the other
+    * requests of it are still allowed to complete.
+    */
+   if (error) {
+      if (is_batch) {
+         for (i = 0; request->registration_ids[i]; i++) {
+            push_batch_fail(request->batch,
+                            request->offset + i,
+                            g_error_copy(error));
+         }
+      } else {
+         g_simple_async_result_set_from_error(request->simple, error);
+      }
+      g_error_free(error);
+   }
+
+   push_batch_complete(request->batch, 1);
+   push_gcm_request_free(request);
+
    if (p) {
       g_object_unref(p);
    }
@@ -228,30 +303,13 @@ failure:
    EXIT;
 }
 
-/**
- * push_gcm_client_deliver_async:
- * @client: (in): A #PushGcmClient.
- * @identities: (element-type PushGcmIdentity*): A #GList of #PushGcmIdentity.
- * @message: A #PushGcmMessage.
- * @cancellable: (allow-none): A #GCancellable or %NULL.
- * @callback: A #GAsyncReadyCallback.
- * @user_data: User data for @callback.
- *
- * Asynchronously deliver a #PushGcmMessage to one or more GCM enabled
- * devices.
- */
-void
-push_gcm_client_deliver_async (PushGcmClient       *client,
-                               GList               *identities,
-                               PushGcmMessage      *message,
-                               GCancellable        *cancellable,
-                               GAsyncReadyCallback  callback,
-                               gpointer             user_data)
+static SoupMessage *
+push_gcm_client_build_request (PushGcmClient  *client,
+                               gchar         **registration_ids,
+                               PushGcmMessage *message)
 {
    PushGcmClientPrivate *priv;
-   GSimpleAsyncResult *simple;
    SoupMessage *request;
-   const gchar *registration_id;
    const gchar *collapse_key;
    JsonGenerator *g;
    JsonObject *obj;
@@ -259,29 +317,22 @@ push_gcm_client_deliver_async (PushGcmClient       *client,
    JsonObject *mdata;
    JsonArray *ar;
    JsonNode *node;
-   GList *iter;
-   GList *list;
    gchar *str;
    gsize length;
    guint time_to_live;
+   guint i;
 
-   ENTRY;
-
-   g_return_if_fail(PUSH_IS_GCM_CLIENT(client));
-   g_return_if_fail(identities);
-   g_return_if_fail(PUSH_IS_GCM_MESSAGE(message));
-   g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
-   g_return_if_fail(callback);
+   g_assert(PUSH_IS_GCM_CLIENT(client));
+   g_assert(registration_ids);
+   g_assert(PUSH_IS_GCM_MESSAGE(message));
 
    priv = client->priv;
 
    request = soup_message_new("POST", PUSH_GCM_CLIENT_URL);
    ar = json_array_new();
 
-   for (iter = identities; iter; iter = iter->next) {
-      g_assert(PUSH_IS_GCM_IDENTITY(iter->data));
-      registration_id = push_gcm_identity_get_registration_id(iter->data);
-      json_array_add_string_element(ar, registration_id);
+   for (i = 0; registration_ids[i]; i++) {
+      json_array_add_string_element(ar, registration_ids[i]);
    }
 
    str = g_strdup_printf("key=%s", priv->auth_token);
@@ -311,7 +362,7 @@ push_gcm_client_deliver_async (PushGcmClient       *client,
    }
 
    if ((mdata = push_gcm_message_get_data(message))) {
-      json_object_set_object_member(data, "data", mdata);
+      json_object_set_object_member(data, "data", json_object_ref(mdata));
    }
 
    obj = json_object_new();
@@ -336,28 +387,207 @@ push_gcm_client_deliver_async (PushGcmClient       *client,
                             str,
                             length);
 
-   simple = g_simple_async_result_new(G_OBJECT(client), callback, user_data,
-                                      push_gcm_client_deliver_async);
+   return request;
+}
+
+static void
+push_gcm_client_queue (PushGcmClient       *client,
+                       gchar              **registration_ids,
+                       guint                n_registration_ids,
+                       PushGcmMessage      *message,
+                       GSimpleAsyncResult  *simple)
+{
+   PushGcmRequest *request;
+   SoupMessage *soup_message;
+   PushBatch *batch;
+   guint n_requests;
+   guint offset;
+   guint count;
+
+   ENTRY;
+
+   g_assert(PUSH_IS_GCM_CLIENT(client));
+   g_assert(registration_ids);
+   g_assert(n_registration_ids);
+   g_assert(PUSH_IS_GCM_MESSAGE(message));
+   g_assert(G_IS_SIMPLE_ASYNC_RESULT(simple));
+
+   n_requests = (n_registration_ids + PUSH_GCM_CLIENT_MAX_REGISTRATION_IDS - 1) /
+                PUSH_GCM_CLIENT_MAX_REGISTRATION_IDS;
+   batch = push_batch_new(simple, n_requests);
+
+   /*
+    * Split the registration ids into requests GCM will accept. They are
+    * queued at once and the session runs as many of them concurrently as
+    * it has connections to GCM.
+    */
+   for (offset = 0; offset < n_registration_ids; offset += count) {
+      count = MIN(n_registration_ids - offset,
+                  PUSH_GCM_CLIENT_MAX_REGISTRATION_IDS);
+      request = g_slice_new(PushGcmRequest);
+      request->batch = batch;
+      request->simple = g_object_ref(simple);
+      request->registration_ids = g_new(gchar *, count + 1);
+      memcpy(request->registration_ids,
+             registration_ids + offset,
+             count * sizeof(gchar *));
+      request->registration_ids[count] = NULL;
+      request->offset = offset;
+      soup_message = push_gcm_client_build_request(client,
+                                                   request->registration_ids,
+                                                   message);
+      soup_session_queue_message(SOUP_SESSION(client),
+                                 soup_message,
+                                 push_gcm_client_deliver_cb,
+                                 request);
+   }
 
    /*
-    * Keep the list of identities around until we receive our result.
-    * We need them to key with the resulting array.
+    * The requests took ownership of the strings.
     */
-   list = g_list_copy(identities);
-   g_list_foreach(list, (GFunc)g_object_ref, NULL);
-   g_object_set_data_full(G_OBJECT(simple),
-                          "identities",
-                          list,
-                          _push_gcm_identities_free);
-
-   soup_session_queue_message(SOUP_SESSION(client),
-                              request,
-                              push_gcm_client_deliver_cb,
-                              simple);
+   g_free(registration_ids);
+
+   EXIT;
+}
+
+/**
+ * push_gcm_client_deliver_async:
+ * @client: (in): A #PushGcmClient.
+ * @identities: (element-type PushGcmIdentity*): A #GList of #PushGcmIdentity.
+ * @message: A #PushGcmMessage.
+ * @cancellable: (allow-none): A #GCancellable or %NULL.
+ * @callback: A #GAsyncReadyCallback.
+ * @user_data: User data for @callback.
+ *
+ * Asynchronously deliver a #PushGcmMessage to one or more GCM enabled
+ * devices. Deliveries to more than 1000 devices are split into multiple
+ * requests to GCM.
+ */
+void
+push_gcm_client_deliver_async (PushGcmClient       *client,
+                               GList               *identities,
+                               PushGcmMessage      *message,
+                               GCancellable        *cancellable,
+                               GAsyncReadyCallback  callback,
+                               gpointer             user_data)
+{
+   GSimpleAsyncResult *simple;
+   gchar **registration_ids;
+   GList *iter;
+   guint n_registration_ids;
+   guint i;
+
+   ENTRY;
+
+   g_return_if_fail(PUSH_IS_GCM_CLIENT(client));
+   g_return_if_fail(identities);
+   g_return_if_fail(PUSH_IS_GCM_MESSAGE(message));
+   g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
+   g_return_if_fail(callback);
+
+   n_registration_ids = g_list_length(identities);
+   registration_ids = g_new0(gchar *, n_registration_ids + 1);
+   for (iter = identities, i = 0; iter; iter = iter->next, i++) {
+      g_assert(PUSH_IS_GCM_IDENTITY(iter->data));
+      registration_ids[i] =
+         g_strdup(push_gcm_identity_get_registration_id(iter->data));
+   }
+
+   simple = g_simple_async_result_new(G_OBJECT(client), callback, user_data,
+                                      push_gcm_client_deliver_async);
+   g_simple_async_result_set_check_cancellable(simple, cancellable);
+   push_gcm_client_queue(client, registration_ids, n_registration_ids,
+                         message, simple);
+   g_object_unref(simple);
+
+   EXIT;
+}
+
+/**
+ * push_gcm_client_deliver_batch_async:
+ * @client: (in): A #PushGcmClient.
+ * @tokens: (array length=n_tokens): An array of #PushBatchToken.
+ * @n_tokens: The number of elements in @tokens.
+ * @message: A #PushGcmMessage.
+ * @cancellable: (allow-none): A #GCancellable or %NULL.
+ * @callback: A #GAsyncReadyCallback.
+ * @user_data: User data for @callback.
+ *
+ * Like push_gcm_client_deliver_async() but takes the registration ids
+ * directly rather than a #PushGcmIdentity per device. @tokens only needs
+ * to remain valid for the duration of this call.
+ *
+ * @callback should call push_gcm_client_deliver_batch_finish() to retrieve
+ * the registration ids that GCM rejected.
+ */
+void
+push_gcm_client_deliver_batch_async (PushGcmClient        *client,
+                                     const PushBatchToken *tokens,
+                                     guint                 n_tokens,
+                                     PushGcmMessage       *message,
+                                     GCancellable         *cancellable,
+                                     GAsyncReadyCallback   callback,
+                                     gpointer              user_data)
+{
+   GSimpleAsyncResult *simple;
+   gchar **registration_ids;
+   guint i;
+
+   ENTRY;
+
+   g_return_if_fail(PUSH_IS_GCM_CLIENT(client));
+   g_return_if_fail(tokens);
+   g_return_if_fail(n_tokens);
+   g_return_if_fail(PUSH_IS_GCM_MESSAGE(message));
+   g_return_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable));
+   g_return_if_fail(callback);
+
+   registration_ids = g_new0(gchar *, n_tokens + 1);
+   for (i = 0; i < n_tokens; i++) {
+      registration_ids[i] = g_strdup(tokens[i].token);
+   }
+
+   simple = g_simple_async_result_new(G_OBJECT(client), callback, user_data,
+                                      push_gcm_client_deliver_batch_async);
+   g_simple_async_result_set_check_cancellable(simple, cancellable);
+   push_gcm_client_queue(client, registration_ids, n_tokens, message, simple);
+   g_object_unref(simple);
 
    EXIT;
 }
 
+/**
+ * push_gcm_client_deliver_batch_finish:
+ * @client: (in): A #PushGcmClient.
+ * @result: A #GAsyncResult.
+ * @failures: (out) (allow-none) (element-type PushBatchFailure*): A location
+ *   for the tokens that failed, or %NULL.
+ * @error: (out) (allow-none): A location for a #GError, or %NULL.
+ *
+ * Completes a request to push_gcm_client_deliver_batch_async(). @error is
+ * set if the request to GCM failed as a whole. See push_batch_finish() for
+ * details on @failures.
+ *
+ * Returns: %TRUE unless the whole batch failed.
+ */
+gboolean
+push_gcm_client_deliver_batch_finish (PushGcmClient  *client,
+                                      GAsyncResult   *result,
+                                      GPtrArray     **failures,
+                                      GError        **error)
+{
+   gboolean ret;
+
+   ENTRY;
+
+   g_return_val_if_fail(PUSH_IS_GCM_CLIENT(client), FALSE);
+   g_return_val_if_fail(G_IS_SIMPLE_ASYNC_RESULT(result), FALSE);
+
+   ret = push_batch_finish(G_SIMPLE_ASYNC_RESULT(result), failures, error);
+
+   RETURN(ret);
+}
+
 gboolean
 push_gcm_client_deliver_finish (PushGcmClient  *client,
                                 GAsyncResult   *result,
@@ -371,9 +601,7 @@ push_gcm_client_deliver_finish (PushGcmClient  *client,
    g_return_val_if_fail(PUSH_IS_GCM_CLIENT(client), FALSE);
    g_return_val_if_fail(G_IS_SIMPLE_ASYNC_RESULT(simple), FALSE);
 
-   if (!(ret = g_simple_async_result_get_op_res_gboolean(simple))) {
-      g_simple_async_result_propagate_error(simple, error);
-   }
+   ret = !g_simple_async_result_propagate_error(simple, error);
 
    RETURN(ret);
 }
@@ -469,5 +697,21 @@ push_gcm_client_init (PushGcmClient *client)
       G_TYPE_INSTANCE_GET_PRIVATE(client,
                                   PUSH_TYPE_GCM_CLIENT,
                                   PushGcmClientPrivate);
+
+   /*
+    * Allow multiple requests of a large delivery to run concurrently.
+    * These may still be overridden at construction.
+    */
+   g_object_set(client,
+                SOUP_SESSION_MAX_CONNS, PUSH_GCM_CLIENT_MAX_CONNS_PER_HOST,
+                SOUP_SESSION_MAX_CONNS_PER_HOST,
+                PUSH_GCM_CLIENT_MAX_CONNS_PER_HOST,
+                NULL);
    EXIT;
 }
+
+GQuark
+push_gcm_client_error_quark (void)
+{
+   return g_quark_from_static_string("PushGcmClientError");
+}
@@ -21,12 +21,14 @@
 
 #include <libsoup/soup.h>
 
+#include "push-batch.h"
 #include "push-gcm-identity.h"
 #include "push-gcm-message.h"
 
 G_BEGIN_DECLS
 
 #define PUSH_TYPE_GCM_CLIENT            (push_gcm_client_get_type())
+#define PUSH_GCM_CLIENT_ERROR           (push_gcm_client_error_quark())
 #define PUSH_GCM_CLIENT(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), PUSH_TYPE_GCM_CLIENT, PushGcmClient))
 #define PUSH_GCM_CLIENT_CONST(obj)      (G_TYPE_CHECK_INSTANCE_CAST ((obj), PUSH_TYPE_GCM_CLIENT, PushGcmClient const))
 #define PUSH_GCM_CLIENT_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass),  PUSH_TYPE_GCM_CLIENT, PushGcmClientClass))
@@ -37,6 +39,20 @@ G_BEGIN_DECLS
 typedef struct _PushGcmClient        PushGcmClient;
 typedef struct _PushGcmClientClass   PushGcmClientClass;
 typedef struct _PushGcmClientPrivate PushGcmClientPrivate;
+typedef enum   _PushGcmClientError   PushGcmClientError;
+
+enum _PushGcmClientError
+{
+   PUSH_GCM_CLIENT_ERROR_UNKNOWN,
+   PUSH_GCM_CLIENT_ERROR_MISSING_REGISTRATION,
+   PUSH_GCM_CLIENT_ERROR_INVALID_REGISTRATION,
+   PUSH_GCM_CLIENT_ERROR_MISMATCH_SENDER_ID,
+   PUSH_GCM_CLIENT_ERROR_NOT_REGISTERED,
+   PUSH_GCM_CLIENT_ERROR_MESSAGE_TOO_BIG,
+   PUSH_GCM_CLIENT_ERROR_INVALID_DATA_KEY,
+   PUSH_GCM_CLIENT_ERROR_INVALID_TTL,
+   PUSH_GCM_CLIENT_ERROR_UNAVAILABLE,
+};
 
 struct _PushGcmClient
 {
@@ -51,17 +67,29 @@ struct _PushGcmClientClass
    SoupSessionAsyncClass parent_class;
 };
 
-GType          push_gcm_client_get_type      (void) G_GNUC_CONST;
-PushGcmClient *push_gcm_client_new           (const gchar          *auth_token);
-void           push_gcm_client_deliver_async (PushGcmClient        *client,
-                                              GList                *identities,
-                                              PushGcmMessage       *message,
-                                              GCancellable         *cancellable,
-                                              GAsyncReadyCallback   callback,
-                                              gpointer              user_data);
-gboolean       push_gcm_client_deliver_finish (PushGcmClient       *client,
-                                               GAsyncResult        *result,
-                                               GError             **error);
+GQuark         push_gcm_client_error_quark          (void) G_GNUC_CONST;
+GType          push_gcm_client_get_type             (void) G_GNUC_CONST;
+PushGcmClient *push_gcm_client_new                  (const gchar           *auth_token);
+void           push_gcm_client_deliver_async        (PushGcmClient         *client,
+                                                     GList                 *identities,
+                                                     PushGcmMessage        *message,
+                                                     GCancellable          *cancellable,
+                                                     GAsyncReadyCallback    callback,
+                                                     gpointer               user_data);
+void           push_gcm_client_deliver_batch_async  (PushGcmClient         *client,
+                                                     const PushBatchToken  *tokens,
+                                                     guint                  n_tokens,
+                                                     PushGcmMessage        *message,
+                                                     GCancellable          *cancellable,
+                                                     GAsyncReadyCallback    callback,
+                                                     gpointer               user_data);
+gboolean       push_gcm_client_deliver_batch_finish (PushGcmClient         *client,
+                                                     GAsyncResult          *result,
+                                                     GPtrArray            **failures,
+                                                     GError               **error);
+gboolean       push_gcm_client_deliver_finish       (PushGcmClient         *client,
+                                                     GAsyncResult          *result,
+                                                     GError               **error);
 
 G_END_DECLS
 
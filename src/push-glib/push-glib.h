@@ -28,6 +28,7 @@ G_BEGIN_DECLS
 #include "push-aps-client.h"
 #include "push-aps-identity.h"
 #include "push-aps-message.h"
+#include "push-batch.h"
 #include "push-c2dm-client.h"
 #include "push-c2dm-identity.h"
 #include "push-c2dm-message.h"
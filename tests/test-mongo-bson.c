@@ -539,6 +539,8 @@ invalid_tests (void)
    static const guint8 short_data[] = { 6, 0, 0, 0, 0 };
    static const guint8 bad_key[] = { 5, 0, 0, 0, 1 };
    static const guint8 empty_key[] = { 11, 0, 0, 0, 16, 0, 9, 0, 0, 0, 0 };
+   static const guint8 utf8_key[] = { 12, 0, 0, 0, 16, 0xFF, 0, 9, 0, 0, 0, 0 };
+   static const guint8 unterminated_key[] = { 7, 0, 0, 0, 16, 'a', 'b' };
    MongoBsonIter iter;
    MongoBson *b;
 
@@ -559,6 +561,19 @@ invalid_tests (void)
    g_assert_cmpint(mongo_bson_iter_get_value_int(&iter), ==, 9);
    mongo_bson_unref(b);
 
+   b = mongo_bson_new_from_data(utf8_key, G_N_ELEMENTS(utf8_key));
+   g_assert(b);
+   mongo_bson_iter_init(&iter, b);
+   g_assert(!mongo_bson_iter_next(&iter));
+   mongo_bson_unref(b);
+
+   b = mongo_bson_new_from_data(unterminated_key,
+                                G_N_ELEMENTS(unterminated_key));
+   g_assert(b);
+   mongo_bson_iter_init(&iter, b);
+   g_assert(!mongo_bson_iter_next(&iter));
+   mongo_bson_unref(b);
+
    /*
     * TODO: Work on fuzzing tests.
     */
@@ -578,6 +593,126 @@ null_string (void)
    mongo_bson_unref(b);
 }
 
+static void
+binary (void)
+{
+   static const guint8 data[] = { 0x00, 0x01, 0xfe, 0xff };
+   const guint8 *value;
+   MongoBsonIter i;
+   MongoBson *b;
+   guint8 subtype = 0xff;
+   gsize len = 0;
+
+   b = mongo_bson_new_empty();
+   mongo_bson_append_binary(b, "key", 0, data, sizeof data);
+   mongo_bson_append_binary(b, "empty", 0x80, NULL, 0);
+   mongo_bson_append_int(b, "after", 1);
+
+   g_assert(mongo_bson_iter_init_find(&i, b, "key"));
+   g_assert(MONGO_BSON_ITER_HOLDS_BINARY(&i));
+   value = mongo_bson_iter_get_value_binary(&i, &subtype, &len);
+   g_assert_cmpint(subtype, ==, 0);
+   g_assert_cmpint(len, ==, sizeof data);
+   g_assert(!memcmp(value, data, sizeof data));
+
+   g_assert(mongo_bson_iter_next(&i));
+   g_assert(MONGO_BSON_ITER_HOLDS_BINARY(&i));
+   mongo_bson_iter_get_value_binary(&i, &subtype, &len);
+   g_assert_cmpint(subtype, ==, 0x80);
+   g_assert_cmpint(len, ==, 0);
+
+   g_assert(mongo_bson_iter_next(&i));
+   g_assert_cmpint(mongo_bson_iter_get_value_int(&i), ==, 1);
+
+   mongo_bson_unref(b);
+}
+
+static void
+nested_in_place (void)
+{
+   MongoBson *expected;
+   MongoBson *child;
+   MongoBson *array;
+   MongoBson *b;
+   gchar idxstr[12];
+   guint doc;
+   guint ar;
+   guint i;
+
+   array = mongo_bson_new_empty();
+   for (i = 0; i < 1200; i++) {
+      g_snprintf(idxstr, sizeof idxstr, "%u", i);
+      mongo_bson_append_int(array, idxstr, i);
+   }
+   child = mongo_bson_new_empty();
+   mongo_bson_append_array(child, "$in", array);
+   mongo_bson_append_string(child, "$ne", "abc");
+   expected = mongo_bson_new_empty();
+   mongo_bson_append_int(expected, "before", 1);
+   mongo_bson_append_bson(expected, "key", child);
+   mongo_bson_append_int(expected, "after", 2);
+
+   b = mongo_bson_new_sized(16);
+   mongo_bson_append_int(b, "before", 1);
+   doc = mongo_bson_append_document_begin(b, "key");
+   ar = mongo_bson_append_array_begin(b, "$in");
+   for (i = 0; i < 1200; i++) {
+      mongo_bson_append_int(b, mongo_bson_index_key(i, idxstr), i);
+   }
+   mongo_bson_append_array_end(b, ar);
+   mongo_bson_append_string(b, "$ne", "abc");
+   mongo_bson_append_document_end(b, doc);
+   mongo_bson_append_int(b, "after", 2);
+
+   g_assert_cmpint(b->len, ==, expected->len);
+   g_assert(!memcmp(b->data, expected->data, b->len));
+
+   g_assert_cmpstr(mongo_bson_index_key(0, idxstr), ==, "0");
+   g_assert_cmpstr(mongo_bson_index_key(999, idxstr), ==, "999");
+   g_assert_cmpstr(mongo_bson_index_key(1000, idxstr), ==, "1000");
+
+   mongo_bson_unref(array);
+   mongo_bson_unref(child);
+   mongo_bson_unref(expected);
+   mongo_bson_unref(b);
+}
+
+static void
+iter_perf (void)
+{
+   MongoBsonIter iter;
+   MongoBson *corpus[17];
+   gchar name[32];
+   gdouble elapsed;
+   guint n_fields = 0;
+   guint i;
+   guint j;
+
+   for (i = 0; i < G_N_ELEMENTS(corpus); i++) {
+      g_snprintf(name, sizeof name, "test%u.bson", i + 1);
+      corpus[i] = get_bson(name);
+   }
+
+   g_test_timer_start();
+   for (j = 0; j < 100000; j++) {
+      for (i = 0; i < G_N_ELEMENTS(corpus); i++) {
+         mongo_bson_iter_init(&iter, corpus[i]);
+         while (mongo_bson_iter_next(&iter)) {
+            n_fields++;
+         }
+         mongo_bson_iter_init(&iter, corpus[i]);
+         mongo_bson_iter_find(&iter, "missing");
+      }
+   }
+   elapsed = g_test_timer_elapsed();
+   g_test_minimized_result(elapsed, "iterated %u fields in %.3f seconds",
+                           n_fields, elapsed);
+
+   for (i = 0; i < G_N_ELEMENTS(corpus); i++) {
+      mongo_bson_unref(corpus[i]);
+   }
+}
+
 gint
 main (gint   argc,
       gchar *argv[])
@@ -588,5 +723,10 @@ main (gint   argc,
    g_test_add_func("/MongoBson/join", join);
    g_test_add_func("/MongoBson/invalid", invalid_tests);
    g_test_add_func("/MongoBson/null_string", null_string);
+   g_test_add_func("/MongoBson/nested_in_place", nested_in_place);
+   g_test_add_func("/MongoBson/binary", binary);
+   if (g_test_perf()) {
+      g_test_add_func("/MongoBson/iter_perf", iter_perf);
+   }
    return g_test_run();
 }
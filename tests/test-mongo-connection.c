@@ -1,9 +1,36 @@
 #include "test-helper.h"
 
 #include <mongo-glib/mongo-glib.h>
+#include <string.h>
 
 static GMainLoop *gMainLoop;
 
+/*
+ * TODO: Move this to shared private header.
+ */
+struct _MongoServerPrivate
+{
+   GHashTable *client_contexts;
+};
+
+/*
+ * A MongoServer that answers like a replica set member. Every document
+ * it returns names the member and the client socket that asked, and
+ * every query opens a cursor so that getmore can check it arrives on the
+ * socket that owns the cursor.
+ */
+typedef struct
+{
+   MongoServer *server;
+   gchar       *host;
+   gchar       *secondary;
+   gboolean     is_secondary;
+   GHashTable  *cursors;
+   guint64      next_cursor;
+   guint        n_ismaster;
+   guint        n_getmores;
+} FakeMongo;
+
 static void
 test1_insert_cb (GObject      *object,
                  GAsyncResult *result,
@@ -32,7 +59,7 @@ test1 (void)
    mongo_bson_append_int(bson, "key1", 1234);
    mongo_bson_append_string(bson, "key2", "Some test string");
    mongo_connection_insert_async(connection, "dbtest1.dbcollection1",
-                                 MONGO_INSERT_NONE, &bson, 1, NULL,
+                                 MONGO_INSERT_NONE, &bson, 1, NULL, NULL,
                                  test1_insert_cb, &success);
    mongo_bson_unref(bson);
 
@@ -118,6 +145,7 @@ test3 (void)
                              MONGO_DELETE_NONE,
                              selector,
                              NULL,
+                             NULL,
                              test3_query_cb,
                              &success);
    mongo_bson_unref(selector);
@@ -209,6 +237,441 @@ test5 (void)
 #undef TEST_URI
 }
 
+static void
+test6 (void)
+{
+   MongoConnection *connection;
+
+   connection = mongo_connection_new_from_uri("mongodb://127.0.0.1:27017");
+   g_assert_cmpint(mongo_connection_get_max_pool_size(connection), ==, 1);
+   g_assert_cmpint(mongo_connection_get_pool_size(connection), ==, 0);
+   g_assert_cmpint(mongo_connection_get_in_flight(connection), ==, 0);
+   g_object_unref(connection);
+
+   connection = mongo_connection_new_from_uri("mongodb://127.0.0.1:27017/"
+                                              "?maxPoolSize=4");
+   g_assert_cmpint(mongo_connection_get_max_pool_size(connection), ==, 4);
+   g_object_unref(connection);
+}
+
+static void
+test7 (void)
+{
+   MongoConnection *connection;
+
+   connection = mongo_connection_new_from_uri("mongodb://127.0.0.1:27017");
+   g_assert_cmpint(mongo_connection_get_read_preference(connection),
+                   ==,
+                   MONGO_READ_PRIMARY);
+   g_object_unref(connection);
+
+   connection = mongo_connection_new_from_uri("mongodb://127.0.0.1:27017/"
+                                              "?readPreference=secondaryPreferred");
+   g_assert_cmpint(mongo_connection_get_read_preference(connection),
+                   ==,
+                   MONGO_READ_SECONDARY_PREFERRED);
+   g_object_unref(connection);
+
+   connection = mongo_connection_new_from_uri("mongodb://127.0.0.1:27017/"
+                                              "?readPreference=nearest");
+   g_assert_cmpint(mongo_connection_get_read_preference(connection),
+                   ==,
+                   MONGO_READ_NEAREST);
+   g_object_unref(connection);
+}
+
+static void
+fake_mongo_reply (FakeMongo          *fake,
+                  MongoClientContext *client,
+                  MongoMessage       *message,
+                  guint64             cursor_id,
+                  MongoBson          *bson)
+{
+   MongoMessageReply *reply;
+   GList list = { 0 };
+   gchar *uri;
+
+   uri = mongo_client_context_get_uri(client);
+   mongo_bson_append_string(bson, "server", fake->host);
+   mongo_bson_append_string(bson, "client", uri);
+   g_free(uri);
+
+   reply = g_object_new(MONGO_TYPE_MESSAGE_REPLY,
+                        "cursor-id", cursor_id,
+                        "response-to", mongo_message_get_request_id(message),
+                        NULL);
+   list.data = bson;
+   mongo_message_reply_set_documents(reply, &list);
+   mongo_message_set_reply(message, MONGO_MESSAGE(reply));
+   g_object_unref(reply);
+   mongo_bson_unref(bson);
+}
+
+static gboolean
+fake_mongo_query_cb (MongoServer        *server,
+                     MongoClientContext *client,
+                     MongoMessage       *message,
+                     FakeMongo          *fake)
+{
+   MongoMessageQuery *query = (MongoMessageQuery *)message;
+   MongoBson *bson;
+   guint64 cursor_id = 0;
+   guint offset;
+
+   bson = mongo_bson_new_empty();
+
+   if (mongo_message_query_is_command(query)) {
+      if (!g_strcmp0(mongo_message_query_get_command_name(query),
+                     "ismaster")) {
+         fake->n_ismaster++;
+         mongo_bson_append_boolean(bson, "ismaster", !fake->is_secondary);
+         mongo_bson_append_boolean(bson, "secondary", fake->is_secondary);
+         if (!fake->is_secondary) {
+            mongo_bson_append_string(bson, "primary", fake->host);
+         }
+         if (fake->secondary) {
+            offset = mongo_bson_append_array_begin(bson, "hosts");
+            mongo_bson_append_string(bson, "0", fake->host);
+            mongo_bson_append_string(bson, "1", fake->secondary);
+            mongo_bson_append_array_end(bson, offset);
+         }
+      }
+      mongo_bson_append_double(bson, "ok", 1.0);
+   } else {
+      cursor_id = ++fake->next_cursor;
+      g_hash_table_insert(fake->cursors,
+                          g_memdup(&cursor_id, sizeof cursor_id),
+                          mongo_client_context_get_uri(client));
+   }
+
+   fake_mongo_reply(fake, client, message, cursor_id, bson);
+
+   return TRUE;
+}
+
+static gboolean
+fake_mongo_getmore_cb (MongoServer        *server,
+                       MongoClientContext *client,
+                       MongoMessage       *message,
+                       FakeMongo          *fake)
+{
+   const gchar *owner;
+   guint64 cursor_id;
+   gchar *uri;
+
+   g_object_get(message, "cursor-id", &cursor_id, NULL);
+   owner = g_hash_table_lookup(fake->cursors, &cursor_id);
+   uri = mongo_client_context_get_uri(client);
+   g_assert_cmpstr(owner, ==, uri);
+   g_free(uri);
+
+   fake->n_getmores++;
+   fake_mongo_reply(fake, client, message, 0, mongo_bson_new_empty());
+
+   return TRUE;
+}
+
+static FakeMongo *
+fake_mongo_new (gboolean is_secondary)
+{
+   FakeMongo *fake;
+   guint16 port;
+
+   fake = g_new0(FakeMongo, 1);
+   fake->is_secondary = is_secondary;
+   fake->cursors = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                         g_free, g_free);
+   fake->server = g_object_new(MONGO_TYPE_SERVER,
+                               "listen-backlog", 10,
+                               NULL);
+   port = g_socket_listener_add_any_inet_port(G_SOCKET_LISTENER(fake->server),
+                                              NULL,
+                                              NULL);
+   g_assert(port);
+   fake->host = g_strdup_printf("127.0.0.1:%u", port);
+   g_signal_connect(fake->server, "request-query",
+                    G_CALLBACK(fake_mongo_query_cb), fake);
+   g_signal_connect(fake->server, "request-getmore",
+                    G_CALLBACK(fake_mongo_getmore_cb), fake);
+   g_socket_service_start(G_SOCKET_SERVICE(fake->server));
+
+   return fake;
+}
+
+static void
+fake_mongo_free (FakeMongo *fake)
+{
+   g_socket_service_stop(G_SOCKET_SERVICE(fake->server));
+   g_object_unref(fake->server);
+   g_hash_table_unref(fake->cursors);
+   g_free(fake->secondary);
+   g_free(fake->host);
+   g_free(fake);
+}
+
+static gchar *
+reply_get_string (MongoMessageReply *reply,
+                  const gchar       *key)
+{
+   const MongoBson *docs;
+   MongoBsonIter iter;
+   gsize n_docs = 0;
+
+   docs = mongo_message_reply_peek_documents(reply, &n_docs);
+   g_assert_cmpint(n_docs, ==, 1);
+   g_assert(mongo_bson_iter_init_find(&iter, &docs[0], key));
+
+   return g_strdup(mongo_bson_iter_get_value_string(&iter, NULL));
+}
+
+static void
+pool_query_cb (GObject      *object,
+               GAsyncResult *result,
+               gpointer      user_data)
+{
+   MongoMessageReply *reply;
+   GPtrArray *replies = user_data;
+   GError *error = NULL;
+
+   reply = mongo_connection_query_finish(MONGO_CONNECTION(object),
+                                         result,
+                                         &error);
+   g_assert_no_error(error);
+   g_assert(reply);
+   g_ptr_array_add(replies, reply);
+}
+
+static void
+pool_getmore_cb (GObject      *object,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+   MongoMessageReply *reply;
+   GPtrArray *replies = user_data;
+   GError *error = NULL;
+
+   reply = mongo_connection_getmore_finish(MONGO_CONNECTION(object),
+                                           result,
+                                           &error);
+   g_assert_no_error(error);
+   g_assert(reply);
+   g_ptr_array_add(replies, reply);
+}
+
+static void
+pool_query (MongoConnection *connection,
+            const gchar     *db_and_collection,
+            MongoQueryFlags  flags,
+            GPtrArray       *replies)
+{
+   MongoBson *bson;
+
+   bson = mongo_bson_new_empty();
+   mongo_connection_query_async(connection, db_and_collection, flags,
+                                0, 0, bson, NULL, NULL,
+                                pool_query_cb, replies);
+   mongo_bson_unref(bson);
+}
+
+static void
+pool_wait (GPtrArray *replies,
+           guint      count)
+{
+   while (replies->len < count) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+}
+
+static MongoConnection *
+pool_connection_new (FakeMongo   *fake,
+                     const gchar *options)
+{
+   MongoConnection *connection;
+   GPtrArray *replies;
+   gchar *uri;
+
+   uri = g_strdup_printf("mongodb://%s/?%s", fake->host, options);
+   connection = mongo_connection_new_from_uri(uri);
+   g_free(uri);
+
+   /*
+    * The first request connects, then wait for the rest of the pool.
+    */
+   replies = g_ptr_array_new_with_free_func(g_object_unref);
+   pool_query(connection, "test.$cmd", MONGO_QUERY_NONE, replies);
+   pool_wait(replies, 1);
+   g_ptr_array_unref(replies);
+
+   while (mongo_connection_get_pool_size(connection) <
+          mongo_connection_get_max_pool_size(connection)) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+
+   return connection;
+}
+
+static void
+test8 (void)
+{
+   MongoConnection *connection;
+   MongoMessageReply *reply;
+   GPtrArray *replies;
+   FakeMongo *fake;
+   guint64 cursors[2];
+   gchar *clients[2];
+   guint i;
+
+   fake = fake_mongo_new(FALSE);
+   connection = pool_connection_new(fake, "maxPoolSize=2");
+
+   /*
+    * Queries sent together go to the least loaded sockets, so the second
+    * does not wait behind the first.
+    */
+   replies = g_ptr_array_new_with_free_func(g_object_unref);
+   pool_query(connection, "test.test", MONGO_QUERY_NONE, replies);
+   pool_query(connection, "test.test", MONGO_QUERY_NONE, replies);
+   pool_wait(replies, 2);
+
+   for (i = 0; i < 2; i++) {
+      reply = g_ptr_array_index(replies, i);
+      cursors[i] = mongo_message_reply_get_cursor_id(reply);
+      clients[i] = reply_get_string(reply, "client");
+      g_assert(cursors[i]);
+   }
+   g_assert_cmpstr(clients[0], !=, clients[1]);
+
+   /*
+    * Follow the cursors in the other order. Without pinning, both would
+    * go to the first idle socket; the server asserts that each arrives on
+    * the socket that opened it.
+    */
+   g_ptr_array_set_size(replies, 0);
+   mongo_connection_getmore_async(connection, "test.test", 0, cursors[1],
+                                  NULL, pool_getmore_cb, replies);
+   mongo_connection_getmore_async(connection, "test.test", 0, cursors[0],
+                                  NULL, pool_getmore_cb, replies);
+   pool_wait(replies, 2);
+   g_assert_cmpint(fake->n_getmores, ==, 2);
+
+   g_free(clients[0]);
+   g_free(clients[1]);
+   g_ptr_array_unref(replies);
+   g_object_unref(connection);
+   fake_mongo_free(fake);
+}
+
+static gboolean
+protocol_failure_is_fatal (const gchar    *log_domain,
+                           GLogLevelFlags  log_level,
+                           const gchar    *message,
+                           gpointer        user_data)
+{
+   return !strstr(message, "Mongo protocol failure");
+}
+
+static void
+test9 (void)
+{
+   MongoConnection *connection;
+   GHashTableIter iter;
+   GPtrArray *replies;
+   FakeMongo *fake;
+   GIOStream *stream;
+
+   g_test_log_set_fatal_handler(protocol_failure_is_fatal, NULL);
+
+   fake = fake_mongo_new(FALSE);
+   connection = pool_connection_new(fake, "maxPoolSize=2");
+
+   /*
+    * Drop one of the sockets from the server side. It is replaced while
+    * the rest of the pool keeps serving requests.
+    */
+   g_hash_table_iter_init(&iter, fake->server->priv->client_contexts);
+   g_assert(g_hash_table_iter_next(&iter, (gpointer *)&stream, NULL));
+   g_io_stream_close(stream, NULL, NULL);
+
+   while (mongo_connection_get_pool_size(connection) == 2) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+   g_assert_cmpint(mongo_connection_get_pool_size(connection), ==, 1);
+
+   replies = g_ptr_array_new_with_free_func(g_object_unref);
+   pool_query(connection, "test.test", MONGO_QUERY_NONE, replies);
+   pool_wait(replies, 1);
+
+   while (mongo_connection_get_pool_size(connection) < 2) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+
+   g_ptr_array_unref(replies);
+   g_object_unref(connection);
+   fake_mongo_free(fake);
+
+   g_test_log_set_fatal_handler(NULL, NULL);
+}
+
+static void
+test10 (void)
+{
+   MongoConnection *connection;
+   GPtrArray *replies;
+   FakeMongo *primary;
+   FakeMongo *secondary;
+   gchar *server;
+   guint i;
+
+   secondary = fake_mongo_new(TRUE);
+   primary = fake_mongo_new(FALSE);
+   primary->secondary = g_strdup(secondary->host);
+   connection = pool_connection_new(primary,
+                                    "readPreference=secondaryPreferred");
+   replies = g_ptr_array_new_with_free_func(g_object_unref);
+
+   /*
+    * The secondary is connected to in the background, so slave-ok reads
+    * go to the primary until it has answered ismaster.
+    */
+   for (i = 0; ; i++) {
+      g_assert_cmpint(i, <, 1000);
+      pool_query(connection, "test.test", MONGO_QUERY_SLAVE_OK, replies);
+      pool_wait(replies, i + 1);
+      server = reply_get_string(g_ptr_array_index(replies, i), "server");
+      if (!g_strcmp0(server, secondary->host)) {
+         g_free(server);
+         break;
+      }
+      g_assert_cmpstr(server, ==, primary->host);
+      g_free(server);
+   }
+   g_assert_cmpint(secondary->n_ismaster, ==, 1);
+
+   /*
+    * Reads without slave-ok and commands stay on the primary.
+    */
+   g_ptr_array_set_size(replies, 0);
+   pool_query(connection, "test.test", MONGO_QUERY_SLAVE_OK, replies);
+   pool_query(connection, "test.test", MONGO_QUERY_NONE, replies);
+   pool_query(connection, "test.$cmd", MONGO_QUERY_SLAVE_OK, replies);
+   pool_wait(replies, 3);
+
+   server = reply_get_string(g_ptr_array_index(replies, 0), "server");
+   g_assert_cmpstr(server, ==, secondary->host);
+   g_free(server);
+   server = reply_get_string(g_ptr_array_index(replies, 1), "server");
+   g_assert_cmpstr(server, ==, primary->host);
+   g_free(server);
+   server = reply_get_string(g_ptr_array_index(replies, 2), "server");
+   g_assert_cmpstr(server, ==, primary->host);
+   g_free(server);
+
+   g_ptr_array_unref(replies);
+   g_object_unref(connection);
+   fake_mongo_free(primary);
+   fake_mongo_free(secondary);
+}
+
 gint
 main (gint   argc,
       gchar *argv[])
@@ -221,5 +684,10 @@ main (gint   argc,
    g_test_add_func("/MongoConnection/delete_async", test3);
    g_test_add_func("/MongoConnection/command_async", test4);
    g_test_add_func("/MongoConnection/uri", test5);
+   g_test_add_func("/MongoConnection/max_pool_size", test6);
+   g_test_add_func("/MongoConnection/read_preference", test7);
+   g_test_add_func("/MongoConnection/pool_routing", test8);
+   g_test_add_func("/MongoConnection/pool_failure", test9);
+   g_test_add_func("/MongoConnection/secondary", test10);
    return g_test_run();
 }
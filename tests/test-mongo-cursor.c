@@ -5,6 +5,72 @@
 static GMainLoop *gMainLoop;
 static MongoConnection *gConnection;
 
+static void
+seed_delete_cb (GObject      *object,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+   GError *error = NULL;
+
+   mongo_collection_delete_finish(MONGO_COLLECTION(object), result, &error);
+   g_assert_no_error(error);
+   g_main_loop_quit(gMainLoop);
+}
+
+static void
+seed_insert_cb (GObject      *object,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+   GError *error = NULL;
+
+   mongo_collection_insert_finish(MONGO_COLLECTION(object), result, &error);
+   g_assert_no_error(error);
+   g_main_loop_quit(gMainLoop);
+}
+
+/*
+ * Replaces the contents of dbtest1.@name with @n_docs documents so that
+ * tests can check exactly how many were delivered.
+ */
+static MongoCollection *
+seed_collection (const gchar *name,
+                 guint        n_docs)
+{
+   MongoCollection *col;
+   MongoDatabase *db;
+   MongoBson *selector;
+   MongoBson **docs;
+   guint i;
+
+   db = mongo_connection_get_database(gConnection, "dbtest1");
+   g_assert(db);
+
+   col = mongo_database_get_collection(db, name);
+   g_assert(col);
+
+   selector = mongo_bson_new_empty();
+   mongo_collection_delete_async(col, selector, MONGO_DELETE_NONE, NULL,
+                                 seed_delete_cb, NULL);
+   g_main_loop_run(gMainLoop);
+   mongo_bson_unref(selector);
+
+   docs = g_new0(MongoBson *, n_docs);
+   for (i = 0; i < n_docs; i++) {
+      docs[i] = mongo_bson_new();
+      mongo_bson_append_int(docs[i], "n", i);
+   }
+   mongo_collection_insert_async(col, docs, n_docs, MONGO_INSERT_NONE, NULL,
+                                 seed_insert_cb, NULL);
+   g_main_loop_run(gMainLoop);
+   for (i = 0; i < n_docs; i++) {
+      mongo_bson_unref(docs[i]);
+   }
+   g_free(docs);
+
+   return col;
+}
+
 static void
 test1_count_cb (GObject      *object,
                 GAsyncResult *result,
@@ -120,6 +186,129 @@ test2 (void)
    g_assert_cmpint(count, ==, 1);
 }
 
+static guint gPaused;
+
+static gboolean
+test3_resume (gpointer data)
+{
+   MongoCursor *cursor = data;
+
+   /*
+    * Nothing may be requested while the consumer holds the cursor paused.
+    */
+   g_assert_cmpint(mongo_connection_get_in_flight(gConnection), ==, 0);
+
+   mongo_cursor_resume(cursor);
+   g_object_unref(cursor);
+   gPaused--;
+
+   return FALSE;
+}
+
+static gboolean
+test3_foreach_func (MongoCursor *cursor,
+                    MongoBson   *bson,
+                    gpointer     user_data)
+{
+   guint *count = user_data;
+
+   /*
+    * Pause after every document so that the next batch is only
+    * fetched after we resume from the main loop.
+    */
+   mongo_cursor_pause(cursor);
+   g_timeout_add(10, test3_resume, g_object_ref(cursor));
+   gPaused++;
+
+   (*count)++;
+
+   return TRUE;
+}
+
+static void
+test3 (void)
+{
+   MongoCollection *col;
+   MongoCursor *cursor;
+   guint count = 0;
+
+   gConnection = mongo_connection_new();
+
+   col = seed_collection("cursor_paused", 11);
+
+   cursor = mongo_collection_find(col, NULL, NULL, 0, 0, MONGO_QUERY_NONE);
+   g_assert(cursor);
+
+   mongo_cursor_set_batch_size(cursor, 2);
+
+   mongo_cursor_foreach_async(cursor,
+                              test3_foreach_func,
+                              &count,
+                              NULL,
+                              NULL,
+                              test2_foreach_cb,
+                              &count);
+
+   g_main_loop_run(gMainLoop);
+
+   g_assert_cmpint(count, ==, 11);
+
+   while (gPaused) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+}
+
+static gboolean
+test4_foreach_func (MongoCursor *cursor,
+                    MongoBson   *bson,
+                    gpointer     user_data)
+{
+   guint *count = user_data;
+
+   /*
+    * The following batch must already have been requested while we are
+    * still handling this one. Only the last batch has nothing after it.
+    */
+   if (*count < 10) {
+      g_assert_cmpint(mongo_connection_get_in_flight(gConnection), >, 0);
+   }
+
+   (*count)++;
+
+   return TRUE;
+}
+
+static void
+test4 (void)
+{
+   MongoCollection *col;
+   MongoCursor *cursor;
+   guint count = 0;
+
+   gConnection = mongo_connection_new();
+
+   col = seed_collection("cursor_prefetch", 11);
+
+   cursor = mongo_collection_find(col, NULL, NULL, 0, 0, MONGO_QUERY_NONE);
+   g_assert(cursor);
+
+   mongo_cursor_set_batch_size(cursor, 2);
+   mongo_cursor_set_prefetch(cursor, 2);
+   g_assert_cmpint(mongo_cursor_get_prefetch(cursor), ==, 2);
+
+   mongo_cursor_foreach_async(cursor,
+                              test4_foreach_func,
+                              &count,
+                              NULL,
+                              NULL,
+                              test2_foreach_cb,
+                              &count);
+
+   g_main_loop_run(gMainLoop);
+
+   g_assert_cmpint(count, ==, 11);
+}
+
 gint
 main (gint   argc,
       gchar *argv[])
@@ -131,6 +320,8 @@ main (gint   argc,
 
    g_test_add_func("/MongoCursor/count", test1);
    g_test_add_func("/MongoCursor/foreach", test2);
+   g_test_add_func("/MongoCursor/foreach_paused", test3);
+   g_test_add_func("/MongoCursor/foreach_prefetch", test4);
 
    return g_test_run();
 }
@@ -0,0 +1,256 @@
+#include <mongo-glib/mongo-glib.h>
+#include <string.h>
+
+/*
+ * A base stream that hands out at most chunk bytes per read, so that
+ * tests can control how messages are split across reads.
+ */
+typedef struct
+{
+   GInputStream  parent;
+   guint8       *data;
+   gsize         length;
+   gsize         offset;
+   gsize         chunk;
+} ChunkedInputStream;
+
+typedef struct
+{
+   GInputStreamClass parent_class;
+} ChunkedInputStreamClass;
+
+G_DEFINE_TYPE(ChunkedInputStream, chunked_input_stream, G_TYPE_INPUT_STREAM)
+
+static gssize
+chunked_input_stream_read (GInputStream  *stream,
+                           void          *buffer,
+                           gsize          count,
+                           GCancellable  *cancellable,
+                           GError       **error)
+{
+   ChunkedInputStream *chunked = (ChunkedInputStream *)stream;
+
+   count = MIN(count, chunked->chunk);
+   count = MIN(count, chunked->length - chunked->offset);
+   memcpy(buffer, chunked->data + chunked->offset, count);
+   chunked->offset += count;
+
+   return count;
+}
+
+static void
+chunked_input_stream_finalize (GObject *object)
+{
+   g_free(((ChunkedInputStream *)object)->data);
+
+   G_OBJECT_CLASS(chunked_input_stream_parent_class)->finalize(object);
+}
+
+static void
+chunked_input_stream_class_init (ChunkedInputStreamClass *klass)
+{
+   G_OBJECT_CLASS(klass)->finalize = chunked_input_stream_finalize;
+   G_INPUT_STREAM_CLASS(klass)->read_fn = chunked_input_stream_read;
+}
+
+static void
+chunked_input_stream_init (ChunkedInputStream *stream)
+{
+}
+
+static MongoInputStream *
+input_stream_new (GByteArray *data,
+                  gsize       chunk)
+{
+   ChunkedInputStream *base;
+   MongoInputStream *stream;
+
+   base = g_object_new(chunked_input_stream_get_type(), NULL);
+   base->length = data->len;
+   base->data = g_byte_array_free(data, FALSE);
+   base->chunk = chunk;
+
+   stream = mongo_input_stream_new(G_INPUT_STREAM(base));
+   g_object_unref(base);
+
+   return stream;
+}
+
+static void
+append_reply (GByteArray *data,
+              gint        request_id)
+{
+   MongoMessageReply *reply;
+   MongoBson *bson;
+   GList *list;
+   guint8 *buf;
+   gsize buflen;
+
+   reply = g_object_new(MONGO_TYPE_MESSAGE_REPLY,
+                        "request-id", request_id,
+                        "response-to", request_id,
+                        NULL);
+   bson = mongo_bson_new_empty();
+   mongo_bson_append_int(bson, "i", request_id);
+   list = g_list_append(NULL, bson);
+   mongo_message_reply_set_documents(reply, list);
+   buf = mongo_message_save_to_data(MONGO_MESSAGE(reply), &buflen);
+   g_assert(buf);
+   g_byte_array_append(data, buf, buflen);
+   g_free(buf);
+   g_list_free(list);
+   mongo_bson_unref(bson);
+   g_object_unref(reply);
+}
+
+static void
+append_header (GByteArray *data,
+               guint32     msg_len)
+{
+   guint32 header[4];
+
+   header[0] = GUINT32_TO_LE(msg_len);
+   header[1] = 0;
+   header[2] = 0;
+   header[3] = GUINT32_TO_LE(MONGO_OPERATION_REPLY);
+   g_byte_array_append(data, (guint8 *)header, sizeof header);
+}
+
+static void
+assert_reply (MongoInputStream *stream,
+              gint              request_id)
+{
+   MongoMessage *message;
+   GError *error = NULL;
+
+   message = mongo_input_stream_read_message(stream, NULL, &error);
+   g_assert_no_error(error);
+   g_assert(MONGO_IS_MESSAGE_REPLY(message));
+   g_assert_cmpint(mongo_message_get_request_id(message), ==, request_id);
+   g_assert_cmpint(mongo_message_reply_get_count(MONGO_MESSAGE_REPLY(message)), ==, 1);
+   g_object_unref(message);
+}
+
+static void
+assert_error (MongoInputStream *stream,
+              GQuark            domain,
+              gint              code)
+{
+   MongoMessage *message;
+   GError *error = NULL;
+
+   message = mongo_input_stream_read_message(stream, NULL, &error);
+   g_assert(!message);
+   g_assert_error(error, domain, code);
+   g_error_free(error);
+}
+
+static void
+test1 (void)
+{
+   MongoInputStream *stream;
+   GByteArray *data;
+
+   /*
+    * Every message arrives over several reads, and the second starts in
+    * the middle of a read.
+    */
+   data = g_byte_array_new();
+   append_reply(data, 1);
+   append_reply(data, 2);
+   stream = input_stream_new(data, 7);
+
+   assert_reply(stream, 1);
+   assert_reply(stream, 2);
+   assert_error(stream, G_IO_ERROR, G_IO_ERROR_CLOSED);
+
+   g_object_unref(stream);
+}
+
+static void
+test2 (void)
+{
+   MongoInputStream *stream;
+   GByteArray *data;
+   gint i;
+
+   /*
+    * All of the messages arrive in one read and are handed out in order.
+    */
+   data = g_byte_array_new();
+   for (i = 1; i <= 5; i++) {
+      append_reply(data, i);
+   }
+   stream = input_stream_new(data, G_MAXSIZE);
+
+   for (i = 1; i <= 5; i++) {
+      assert_reply(stream, i);
+   }
+   assert_error(stream, G_IO_ERROR, G_IO_ERROR_CLOSED);
+
+   g_object_unref(stream);
+}
+
+static void
+test3 (void)
+{
+   MongoInputStream *stream;
+   GByteArray *data;
+
+   /*
+    * A length beyond the limit is rejected without growing the buffer
+    * to fit it, once the message before it has been handed out.
+    */
+   data = g_byte_array_new();
+   append_reply(data, 1);
+   append_header(data, G_MAXINT32);
+   stream = input_stream_new(data, G_MAXSIZE);
+
+   assert_reply(stream, 1);
+   assert_error(stream,
+                MONGO_INPUT_STREAM_ERROR,
+                MONGO_INPUT_STREAM_ERROR_INVALID_MESSAGE);
+
+   g_object_unref(stream);
+}
+
+static void
+test4 (void)
+{
+   MongoInputStream *stream;
+   GByteArray *data;
+
+   /*
+    * Once the stream is poisoned, every later read fails the same way
+    * instead of decoding what follows the bad message.
+    */
+   data = g_byte_array_new();
+   append_header(data, 16);
+   append_reply(data, 1);
+   stream = input_stream_new(data, 5);
+
+   assert_error(stream,
+                MONGO_INPUT_STREAM_ERROR,
+                MONGO_INPUT_STREAM_ERROR_INSUFFICIENT_DATA);
+   assert_error(stream,
+                MONGO_INPUT_STREAM_ERROR,
+                MONGO_INPUT_STREAM_ERROR_INSUFFICIENT_DATA);
+   assert_error(stream,
+                MONGO_INPUT_STREAM_ERROR,
+                MONGO_INPUT_STREAM_ERROR_INSUFFICIENT_DATA);
+
+   g_object_unref(stream);
+}
+
+gint
+main (gint   argc,
+      gchar *argv[])
+{
+   g_type_init();
+   g_test_init(&argc, &argv, NULL);
+   g_test_add_func("/MongoInputStream/split_reads", test1);
+   g_test_add_func("/MongoInputStream/pipelined", test2);
+   g_test_add_func("/MongoInputStream/oversized", test3);
+   g_test_add_func("/MongoInputStream/read_after_error", test4);
+   return g_test_run();
+}
@@ -22,6 +22,72 @@ test1 (void)
    g_list_foreach(list, (GFunc)mongo_bson_unref, NULL);
 }
 
+static void
+test2 (void)
+{
+   MongoMessageReply *reply;
+   MongoMessageReply *copy;
+   const MongoBson *docs;
+   MongoBsonIter iter;
+   MongoBson *bson;
+   GList *list = NULL;
+   guint8 *buf;
+   gsize buflen;
+   gsize n_docs;
+   guint i;
+
+   reply = g_object_new(MONGO_TYPE_MESSAGE_REPLY,
+                        "cursor-id", G_GUINT64_CONSTANT(1234),
+                        "request-id", 1,
+                        "response-to", 2,
+                        NULL);
+   for (i = 0; i < 3; i++) {
+      bson = mongo_bson_new_empty();
+      mongo_bson_append_int(bson, "i", i);
+      list = g_list_append(list, bson);
+   }
+   mongo_message_reply_set_documents(reply, list);
+   buf = mongo_message_save_to_data(MONGO_MESSAGE(reply), &buflen);
+   g_assert(buf);
+
+   copy = g_object_new(MONGO_TYPE_MESSAGE_REPLY, NULL);
+   g_assert(mongo_message_load_from_data(MONGO_MESSAGE(copy),
+                                         buf + 16,
+                                         buflen - 16));
+   g_assert_cmpint(mongo_message_reply_get_count(copy), ==, 3);
+   g_assert_cmpint(mongo_message_reply_get_cursor_id(copy), ==, 1234);
+
+   docs = mongo_message_reply_peek_documents(copy, &n_docs);
+   g_assert(docs);
+   g_assert_cmpint(n_docs, ==, 3);
+
+   /*
+    * The views should be laid out back to back in a single buffer.
+    */
+   for (i = 0; i < n_docs; i++) {
+      if (i) {
+         g_assert(docs[i].data == docs[i - 1].data + docs[i - 1].len);
+      }
+      g_assert(mongo_bson_iter_init_find(&iter, &docs[i], "i"));
+      g_assert_cmpint(mongo_bson_iter_get_value_int(&iter), ==, i);
+   }
+
+   g_assert_cmpint(g_list_length(mongo_message_reply_get_documents(copy)), ==, 3);
+
+   /*
+    * Truncated documents must be rejected.
+    */
+   g_assert(!mongo_message_load_from_data(MONGO_MESSAGE(copy),
+                                          buf + 16,
+                                          buflen - 17));
+
+   g_free(buf);
+   g_object_unref(copy);
+   g_object_unref(reply);
+   g_list_foreach(list, (GFunc)mongo_bson_unref, NULL);
+   g_list_free(list);
+}
+
 gint
 main (gint   argc,
       gchar *argv[])
@@ -29,5 +95,6 @@ main (gint   argc,
    g_type_init();
    g_test_init(&argc, &argv, NULL);
    g_test_add_func("/MongoMessageReply/new", test1);
+   g_test_add_func("/MongoMessageReply/peek_documents", test2);
    return g_test_run();
 }
@@ -1,4 +1,5 @@
 #include <mongo-glib/mongo-glib.h>
+#include <string.h>
 
 #ifdef G_DISABLE_ASSERT
 #undef G_DISABLE_ASSERT
@@ -38,6 +39,82 @@ message_cb (MongoProtocol *protocol,
    (*count)++;
 }
 
+/*
+ * A MongoProtocol connected to a plain socket, so tests can inspect
+ * what the protocol writes and reply to it by hand.
+ */
+typedef struct
+{
+   GSocketListener    *listener;
+   GSocketClient      *client;
+   GSocketConnectable *connectable;
+   GSocketConnection  *connection;
+   GSocketConnection  *peer;
+   MongoProtocol      *protocol;
+} Fixture;
+
+static void
+fixture_init (Fixture *fixture)
+{
+   GError *error = NULL;
+   guint16 port;
+
+   fixture->listener = g_socket_listener_new();
+   port = g_socket_listener_add_any_inet_port(fixture->listener, NULL, &error);
+   g_assert_no_error(error);
+
+   fixture->client = g_socket_client_new();
+   fixture->connectable = g_network_address_new("localhost", port);
+   fixture->connection = g_socket_client_connect(fixture->client,
+                                                 fixture->connectable,
+                                                 NULL,
+                                                 &error);
+   g_assert_no_error(error);
+   fixture->peer = g_socket_listener_accept(fixture->listener,
+                                            NULL,
+                                            NULL,
+                                            &error);
+   g_assert_no_error(error);
+
+   fixture->protocol = g_object_new(MONGO_TYPE_PROTOCOL,
+                                    "io-stream", fixture->connection,
+                                    NULL);
+}
+
+/*
+ * Lets the protocol write, then appends whatever the peer received to
+ * @received.
+ */
+static void
+fixture_read (Fixture    *fixture,
+              GByteArray *received)
+{
+   GInputStream *input;
+   GError *error = NULL;
+   guint8 buf[4096];
+   gssize r;
+
+   PUMP_MAIN_LOOP;
+
+   input = g_io_stream_get_input_stream(G_IO_STREAM(fixture->peer));
+   r = g_input_stream_read(input, buf, sizeof buf, NULL, &error);
+   g_assert_no_error(error);
+   g_assert_cmpint(r, >, 0);
+   g_byte_array_append(received, buf, r);
+}
+
+static void
+fixture_clear (Fixture *fixture)
+{
+   g_clear_object(&fixture->protocol);
+   g_clear_object(&fixture->peer);
+   g_clear_object(&fixture->connection);
+   g_clear_object(&fixture->connectable);
+   g_clear_object(&fixture->client);
+   g_socket_listener_close(fixture->listener);
+   g_clear_object(&fixture->listener);
+}
+
 static void
 test_MongoProtocol_replies (void)
 {
@@ -238,6 +315,257 @@ test_MongoProtocol_replies (void)
    g_assert(!server);
 }
 
+static void
+msg_cb (GObject      *object,
+        GAsyncResult *result,
+        gpointer      user_data)
+{
+   g_assert_not_reached();
+}
+
+static void
+test_MongoProtocol_corked (void)
+{
+   const gchar *text = "Hello, corked!";
+   GByteArray *received;
+   gboolean failed = FALSE;
+   Fixture fixture;
+   gsize expected;
+   guint i;
+
+   fixture_init(&fixture);
+   g_signal_connect(fixture.protocol, "failed", G_CALLBACK(failed_cb), &failed);
+
+   /*
+    * Enough messages to cross the cork threshold while a write is
+    * already in flight.
+    */
+   for (i = 0; i < 10000; i++) {
+      mongo_protocol_msg_async(fixture.protocol, text, NULL, msg_cb, NULL);
+   }
+
+   expected = 10000 * (16 + strlen(text) + 1);
+   received = g_byte_array_new();
+
+   while (received->len < expected) {
+      fixture_read(&fixture, received);
+   }
+
+   g_assert_cmpint(received->len, ==, expected);
+   g_assert_cmpint(failed, !=, TRUE);
+
+   PUMP_MAIN_LOOP;
+
+   g_object_add_weak_pointer(G_OBJECT(fixture.protocol),
+                             (gpointer *)&fixture.protocol);
+   g_object_unref(fixture.protocol);
+   g_assert(!fixture.protocol);
+
+   g_byte_array_free(received, TRUE);
+   fixture_clear(&fixture);
+}
+
+static void
+insert_cb (GObject      *object,
+           GAsyncResult *result,
+           gpointer      user_data)
+{
+   gboolean *success = user_data;
+   GError *error = NULL;
+
+   *success = mongo_protocol_insert_finish(MONGO_PROTOCOL(object),
+                                           result,
+                                           &error);
+   g_assert_no_error(error);
+   g_main_loop_quit(gMainLoop);
+}
+
+static void
+test_MongoProtocol_unacknowledged (void)
+{
+   MongoWriteConcern *concern;
+   const gchar *ns = "dbtest1.dbcollection1";
+   GByteArray *received;
+   MongoBson *bson;
+   gboolean success = FALSE;
+   Fixture fixture;
+   gsize expected;
+
+   fixture_init(&fixture);
+
+   /*
+    * The peer never replies, so the insert can only complete if no
+    * getlasterror was sent.
+    */
+   bson = mongo_bson_new();
+   mongo_bson_append_int(bson, "key1", 1234);
+   concern = mongo_write_concern_new_unsafe();
+   mongo_protocol_insert_async(fixture.protocol, ns, MONGO_INSERT_NONE,
+                               &bson, 1, concern, NULL, insert_cb, &success);
+   g_main_loop_run(gMainLoop);
+
+   g_assert_cmpint(success, ==, TRUE);
+   g_assert_cmpint(mongo_protocol_get_n_pending(fixture.protocol), ==, 0);
+
+   expected = 16 + 4 + strlen(ns) + 1 + bson->len;
+   received = g_byte_array_new();
+
+   while (received->len < expected) {
+      fixture_read(&fixture, received);
+   }
+
+   g_assert_cmpint(received->len, ==, expected);
+
+   g_byte_array_free(received, TRUE);
+   mongo_write_concern_free(concern);
+   mongo_bson_unref(bson);
+   fixture_clear(&fixture);
+}
+
+static void
+bulk_write_cb (GObject      *object,
+               GAsyncResult *result,
+               gpointer      user_data)
+{
+   gssize *failed_index = user_data;
+   GError *error = NULL;
+   gboolean ret;
+
+   ret = mongo_protocol_bulk_write_finish(MONGO_PROTOCOL(object),
+                                          result,
+                                          failed_index,
+                                          &error);
+   g_assert_error(error, MONGO_PROTOCOL_ERROR,
+                  MONGO_PROTOCOL_ERROR_WRITE_FAILED);
+   g_assert_cmpstr(error->message, ==, "E11000 duplicate key error");
+   g_assert(!ret);
+   g_error_free(error);
+   g_main_loop_quit(gMainLoop);
+}
+
+static void
+write_getlasterror_reply (GSocketConnection *peer,
+                          gint32             response_to,
+                          const gchar       *errmsg)
+{
+   MongoMessage *message;
+   MongoBson *reply;
+   GError *error = NULL;
+   GList *list;
+   guint8 *data;
+   gsize datalen;
+
+   reply = mongo_bson_new_empty();
+   if (errmsg) {
+      mongo_bson_append_string(reply, "err", errmsg);
+   } else {
+      mongo_bson_append_null(reply, "err");
+   }
+   message = g_object_new(MONGO_TYPE_MESSAGE_REPLY,
+                          "request-id", 4321,
+                          "response-to", response_to,
+                          NULL);
+   list = g_list_append(NULL, reply);
+   mongo_message_reply_set_documents(MONGO_MESSAGE_REPLY(message), list);
+   g_list_free(list);
+   data = mongo_message_save_to_data(message, &datalen);
+   g_output_stream_write_all(g_io_stream_get_output_stream(G_IO_STREAM(peer)),
+                             data, datalen, NULL, NULL, &error);
+   g_assert_no_error(error);
+
+   g_free(data);
+   g_object_unref(message);
+   mongo_bson_unref(reply);
+}
+
+static void
+test_MongoProtocol_bulk_write (void)
+{
+   static const MongoOperation expected[] = {
+      MONGO_OPERATION_INSERT,
+      MONGO_OPERATION_QUERY,
+      MONGO_OPERATION_UPDATE,
+      MONGO_OPERATION_QUERY,
+      MONGO_OPERATION_DELETE,
+      MONGO_OPERATION_QUERY,
+   };
+   MongoBulkOperation operations[3] = { { 0 } };
+   const gchar *ns = "dbtest1.dbcollection1";
+   GByteArray *received;
+   MongoBson *bson;
+   gssize failed_index = -1;
+   Fixture fixture;
+   gsize offset = 0;
+   gint32 msg_len;
+   gint32 request_id = 0;
+   gint32 gle_ids[3];
+   gint32 op_code;
+   guint n_messages = 0;
+
+   fixture_init(&fixture);
+
+   bson = mongo_bson_new();
+   mongo_bson_append_int(bson, "key1", 1234);
+
+   operations[0].oper = MONGO_OPERATION_INSERT;
+   operations[0].document = bson;
+   operations[1].oper = MONGO_OPERATION_UPDATE;
+   operations[1].selector = bson;
+   operations[1].document = bson;
+   operations[2].oper = MONGO_OPERATION_DELETE;
+   operations[2].selector = bson;
+
+   mongo_protocol_bulk_write_async(fixture.protocol, ns, operations, 3, NULL,
+                                   bulk_write_cb, &failed_index);
+
+   /*
+    * Every operation waits on its own getlasterror.
+    */
+   g_assert_cmpint(mongo_protocol_get_n_pending(fixture.protocol), ==, 3);
+
+   received = g_byte_array_new();
+
+   while (n_messages < G_N_ELEMENTS(expected)) {
+      fixture_read(&fixture, received);
+
+      while ((received->len - offset) >= 16) {
+         memcpy(&msg_len, received->data + offset, sizeof msg_len);
+         msg_len = GINT32_FROM_LE(msg_len);
+         if ((received->len - offset) < msg_len) {
+            break;
+         }
+         memcpy(&request_id, received->data + offset + 4, sizeof request_id);
+         memcpy(&op_code, received->data + offset + 12, sizeof op_code);
+         g_assert_cmpint(n_messages, <, G_N_ELEMENTS(expected));
+         g_assert_cmpint(GINT32_FROM_LE(op_code), ==, expected[n_messages]);
+         if (expected[n_messages] == MONGO_OPERATION_QUERY) {
+            gle_ids[n_messages / 2] = GINT32_FROM_LE(request_id);
+         }
+         offset += msg_len;
+         n_messages++;
+      }
+   }
+
+   g_assert_cmpint(offset, ==, received->len);
+
+   /*
+    * Both the update and the delete fail, and the update is reported.
+    */
+   write_getlasterror_reply(fixture.peer, gle_ids[0], NULL);
+   write_getlasterror_reply(fixture.peer, gle_ids[1],
+                            "E11000 duplicate key error");
+   write_getlasterror_reply(fixture.peer, gle_ids[2], "cannot delete");
+
+   g_main_loop_run(gMainLoop);
+
+   g_assert_cmpint(failed_index, ==, 1);
+   g_assert_cmpint(mongo_protocol_get_n_pending(fixture.protocol), ==, 0);
+
+   g_byte_array_free(received, TRUE);
+   mongo_bson_unref(bson);
+   fixture_clear(&fixture);
+}
+
 gint
 main (gint argc,
       gchar *argv[])
@@ -246,5 +574,10 @@ main (gint argc,
    g_test_init(&argc, &argv, NULL);
    gMainLoop = g_main_loop_new(NULL, FALSE);
    g_test_add_func("/MongoProtocol/replies", test_MongoProtocol_replies);
+   g_test_add_func("/MongoProtocol/corked", test_MongoProtocol_corked);
+   g_test_add_func("/MongoProtocol/unacknowledged",
+                   test_MongoProtocol_unacknowledged);
+   g_test_add_func("/MongoProtocol/bulk_write",
+                   test_MongoProtocol_bulk_write);
    return g_test_run();
 }
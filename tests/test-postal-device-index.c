@@ -0,0 +1,544 @@
+#include <glib/gstdio.h>
+#include <postal/postal-device-index.h>
+#include <unistd.h>
+
+static MongoBson *
+device_new (const gchar *id,
+            const gchar *user,
+            const gchar *device_type,
+            const gchar *device_token)
+{
+   MongoObjectId *oid;
+   MongoBson *bson;
+
+   bson = mongo_bson_new_empty();
+   oid = mongo_object_id_new_from_string(id);
+   mongo_bson_append_object_id(bson, "_id", oid);
+   mongo_object_id_free(oid);
+   mongo_bson_append_string(bson, "device_type", device_type);
+   mongo_bson_append_string(bson, "device_token", device_token);
+   mongo_bson_append_string(bson, "user", user);
+   mongo_bson_append_null(bson, "removed_at");
+
+   return bson;
+}
+
+static void
+index_add (PostalDeviceIndex *index,
+           const gchar       *id,
+           const gchar       *user,
+           const gchar       *device_type,
+           const gchar       *device_token)
+{
+   MongoBson *bson;
+
+   bson = device_new(id, user, device_type, device_token);
+   g_assert(postal_device_index_insert(index, bson));
+   mongo_bson_unref(bson);
+}
+
+static void
+test1 (void)
+{
+   PostalDeviceIndex *index;
+   PostalDevice *device;
+   GArray *handles;
+   gchar *users[] = { "user1", NULL };
+   gchar *tokens[] = { "AbC", "0123456789abcdef", NULL };
+
+   index = postal_device_index_new();
+
+   index_add(index, "000000000000000000000001", "user1", "aps",
+             "0123456789abcdef");
+   index_add(index, "000000000000000000000002", "user1", "gcm", "AbC");
+   index_add(index, "000000000000000000000003", "user2", "c2dm", "AbC");
+   g_assert_cmpint(postal_device_index_get_size(index), ==, 3);
+
+   handles = postal_device_index_lookup(index, users, NULL, TRUE);
+   g_assert_cmpint(handles->len, ==, 2);
+   g_array_unref(handles);
+
+   /*
+    * Devices matched by both user and token are returned once.
+    */
+   handles = postal_device_index_lookup(index, users, tokens, TRUE);
+   g_assert_cmpint(handles->len, ==, 3);
+
+   device = postal_device_index_get_device(index,
+                                           g_array_index(handles, guint64, 0));
+   g_assert(device);
+   g_assert_cmpstr(postal_device_get_device_token(device), ==,
+                   "0123456789abcdef");
+   g_assert_cmpstr(postal_device_get_user(device), ==, "user1");
+   g_assert_cmpint(postal_device_get_device_type(device), ==,
+                   POSTAL_DEVICE_APS);
+   g_assert(!postal_device_get_removed_at(device));
+   g_object_unref(device);
+
+   g_array_unref(handles);
+
+   postal_device_index_unref(index);
+}
+
+static void
+test2 (void)
+{
+   PostalDeviceIndex *index;
+   PostalDevice *device;
+   MongoObjectId *oid;
+   GTimeVal tv = { 1000, 0 };
+   GArray *handles;
+   guint64 handle;
+   gchar *tokens[] = { "abcd", NULL };
+
+   index = postal_device_index_new();
+
+   index_add(index, "000000000000000000000001", "user1", "aps", "abcd");
+   index_add(index, "000000000000000000000002", "user2", "aps", "abcd");
+
+   g_assert_cmpint(0, ==,
+                   postal_device_index_mark_removed(index, NULL,
+                                                    POSTAL_DEVICE_GCM,
+                                                    "abcd", &tv));
+   g_assert_cmpint(1, ==,
+                   postal_device_index_mark_removed(index, "user1", 0,
+                                                    "abcd", &tv));
+
+   handles = postal_device_index_lookup(index, NULL, tokens, TRUE);
+   g_assert_cmpint(handles->len, ==, 1);
+   g_array_unref(handles);
+
+   /*
+    * Removed devices can still be found directly.
+    */
+   handle = postal_device_index_find(index, "user1", "abcd");
+   device = postal_device_index_get_device(index, handle);
+   g_assert(device);
+   g_assert(postal_device_get_removed_at(device));
+   g_assert_cmpint(postal_device_get_removed_at(device)->tv_sec, ==, 1000);
+   g_object_unref(device);
+
+   /*
+    * A handle does not resolve once its device is gone, even if the slot
+    * has been reused.
+    */
+   oid = mongo_object_id_new_from_string("000000000000000000000001");
+   g_assert(postal_device_index_remove(index, oid));
+   g_assert(!postal_device_index_remove(index, oid));
+   mongo_object_id_free(oid);
+   index_add(index, "000000000000000000000003", "user3", "aps", "ef01");
+   g_assert(!postal_device_index_get_device(index, handle));
+   g_assert(!postal_device_index_find(index, "user1", "abcd"));
+
+   postal_device_index_unref(index);
+}
+
+static void
+test3 (void)
+{
+   PostalDeviceIndex *index;
+   PostalDevice *device;
+   MongoObjectId *oid;
+   MongoBson *entry;
+   MongoBson *doc;
+   MongoBson *set;
+   GTimeVal tv = { 1000, 0 };
+   guint64 handle;
+   guint offset;
+
+   index = postal_device_index_new();
+   oid = mongo_object_id_new_from_string("000000000000000000000001");
+
+   doc = device_new("000000000000000000000001", "user1", "gcm", "token1");
+   entry = mongo_bson_new_empty();
+   mongo_bson_append_string(entry, "op", "i");
+   mongo_bson_append_bson(entry, "o", doc);
+   g_assert(postal_device_index_replay(index, entry));
+   mongo_bson_unref(entry);
+   mongo_bson_unref(doc);
+   g_assert(postal_device_index_find(index, "user1", "token1"));
+
+   /*
+    * {"$set": {"removed_at": <date>}}
+    */
+   set = mongo_bson_new_empty();
+   mongo_bson_append_timeval(set, "removed_at", &tv);
+   doc = mongo_bson_new_empty();
+   mongo_bson_append_bson(doc, "$set", set);
+   mongo_bson_unref(set);
+   set = mongo_bson_new_empty();
+   mongo_bson_append_object_id(set, "_id", oid);
+   entry = mongo_bson_new_empty();
+   mongo_bson_append_string(entry, "op", "u");
+   mongo_bson_append_bson(entry, "o2", set);
+   mongo_bson_append_bson(entry, "o", doc);
+   g_assert(postal_device_index_replay(index, entry));
+   mongo_bson_unref(entry);
+   mongo_bson_unref(doc);
+
+   handle = postal_device_index_find(index, "user1", "token1");
+   device = postal_device_index_get_device(index, handle);
+   g_assert(postal_device_get_removed_at(device));
+   g_object_unref(device);
+
+   /*
+    * {"$set": {"device_token": "token2"}}
+    */
+   doc = mongo_bson_new_empty();
+   offset = mongo_bson_append_document_begin(doc, "$set");
+   mongo_bson_append_string(doc, "device_token", "token2");
+   mongo_bson_append_document_end(doc, offset);
+   entry = mongo_bson_new_empty();
+   mongo_bson_append_string(entry, "op", "u");
+   mongo_bson_append_bson(entry, "o2", set);
+   mongo_bson_append_bson(entry, "o", doc);
+   g_assert(postal_device_index_replay(index, entry));
+   mongo_bson_unref(entry);
+   mongo_bson_unref(doc);
+
+   g_assert(!postal_device_index_find(index, "user1", "token1"));
+   g_assert(postal_device_index_find(index, "user1", "token2"));
+   g_assert_cmpint(postal_device_index_get_size(index), ==, 1);
+
+   entry = mongo_bson_new_empty();
+   mongo_bson_append_string(entry, "op", "d");
+   mongo_bson_append_bson(entry, "o", set);
+   g_assert(postal_device_index_replay(index, entry));
+   mongo_bson_unref(entry);
+   mongo_bson_unref(set);
+
+   g_assert_cmpint(postal_device_index_get_size(index), ==, 0);
+   g_assert(!postal_device_index_find(index, "user1", "token2"));
+
+   mongo_object_id_free(oid);
+   postal_device_index_unref(index);
+}
+
+static void
+test4 (void)
+{
+   PostalDeviceIndex *index;
+   PostalDevice *device;
+   GTimeVal tv = { 1000, 0 };
+   guint32 oplog_time = 0;
+   guint32 oplog_increment = 0;
+   GError *error = NULL;
+   GArray *handles;
+   GBytes *bytes;
+   gchar *filename;
+   gchar *users[] = { "user1", NULL };
+   gint fd;
+
+   index = postal_device_index_new();
+   index_add(index, "000000000000000000000001", "user1", "aps", "abcd");
+   index_add(index, "000000000000000000000002", "user1", "gcm", "Token2");
+   index_add(index, "000000000000000000000003", "user2", "c2dm", "token3");
+   postal_device_index_mark_removed(index, "user2", 0, "token3", &tv);
+
+   fd = g_file_open_tmp("test-postal-device-index-XXXXXX", &filename, NULL);
+   g_assert_cmpint(fd, !=, -1);
+   close(fd);
+
+   bytes = postal_device_index_save_to_bytes(index, 1234, 5);
+   g_assert(g_file_set_contents(filename,
+                                g_bytes_get_data(bytes, NULL),
+                                g_bytes_get_size(bytes),
+                                NULL));
+   postal_device_index_unref(index);
+
+   index = postal_device_index_new_from_file(filename,
+                                             &oplog_time,
+                                             &oplog_increment,
+                                             &error);
+   g_assert_no_error(error);
+   g_assert(index);
+   g_assert_cmpint(oplog_time, ==, 1234);
+   g_assert_cmpint(oplog_increment, ==, 5);
+   g_assert_cmpint(postal_device_index_get_size(index), ==, 3);
+
+   handles = postal_device_index_lookup(index, users, NULL, TRUE);
+   g_assert_cmpint(handles->len, ==, 2);
+   g_array_unref(handles);
+
+   device = postal_device_index_get_device(
+         index, postal_device_index_find(index, "user2", "token3"));
+   g_assert(device);
+   g_assert_cmpint(postal_device_get_removed_at(device)->tv_sec, ==, 1000);
+   g_assert_cmpint(postal_device_get_device_type(device), ==,
+                   POSTAL_DEVICE_C2DM);
+   g_object_unref(device);
+
+   postal_device_index_unref(index);
+
+   /*
+    * A truncated snapshot must be rejected.
+    */
+   g_assert(g_file_set_contents(filename,
+                                g_bytes_get_data(bytes, NULL),
+                                g_bytes_get_size(bytes) - 1,
+                                NULL));
+   index = postal_device_index_new_from_file(filename,
+                                             &oplog_time,
+                                             &oplog_increment,
+                                             &error);
+   g_assert(!index);
+   g_assert_error(error,
+                  POSTAL_DEVICE_INDEX_ERROR,
+                  POSTAL_DEVICE_INDEX_ERROR_INVALID_SNAPSHOT);
+   g_clear_error(&error);
+
+   g_unlink(filename);
+   g_free(filename);
+   g_bytes_unref(bytes);
+}
+
+static void
+test5 (void)
+{
+   static const gchar upper[] =
+      "0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF";
+   static const gchar lower[] =
+      "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef";
+   PostalDeviceIndex *index;
+   PostalDevice *device;
+   GArray *handles;
+   guint64 handle;
+   gchar *tokens[] = { (gchar *)lower, NULL };
+
+   index = postal_device_index_new();
+
+   /*
+    * APS tokens match regardless of the case they were registered or
+    * looked up with, and read back as lowercase like stored tokens.
+    */
+   index_add(index, "000000000000000000000001", "user1", "aps", upper);
+   handles = postal_device_index_lookup(index, NULL, tokens, TRUE);
+   g_assert_cmpint(handles->len, ==, 1);
+   g_array_unref(handles);
+
+   handle = postal_device_index_find(index, "user1", lower);
+   g_assert(handle);
+   g_assert_cmpint(handle, ==, postal_device_index_find(index, "user1", upper));
+   device = postal_device_index_get_device(index, handle);
+   g_assert_cmpstr(postal_device_get_device_token(device), ==, lower);
+   g_object_unref(device);
+
+   /*
+    * Other tokens keep their case.
+    */
+   index_add(index, "000000000000000000000002", "user1", "gcm", "ABCD");
+   g_assert(postal_device_index_find(index, "user1", "ABCD"));
+   g_assert(!postal_device_index_find(index, "user1", "abcd"));
+
+   postal_device_index_unref(index);
+}
+
+static void
+test6 (void)
+{
+   PostalDeviceIndex *index;
+   MongoObjectId *oid;
+   GArray *handles;
+   guint64 handle;
+   gchar *users[] = { "user1", NULL };
+
+   index = postal_device_index_new();
+
+   index_add(index, "000000000000000000000001", "user2", "aps", "abcd");
+   index_add(index, "000000000000000000000002", "user1", "aps", "bcde");
+   index_add(index, "000000000000000000000003", "user1", "aps", "cdef");
+
+   /*
+    * The new device reuses the first slot with a newer generation, and
+    * is still returned before the devices in later slots.
+    */
+   oid = mongo_object_id_new_from_string("000000000000000000000001");
+   g_assert(postal_device_index_remove(index, oid));
+   mongo_object_id_free(oid);
+   index_add(index, "000000000000000000000004", "user1", "aps", "defa");
+
+   handle = postal_device_index_find(index, "user1", "defa");
+   handles = postal_device_index_lookup(index, users, NULL, TRUE);
+   g_assert_cmpint(handles->len, ==, 3);
+   g_assert_cmpint(g_array_index(handles, guint64, 0), ==, handle);
+   g_assert_cmpint(g_array_index(handles, guint64, 1), ==,
+                   postal_device_index_find(index, "user1", "bcde"));
+   g_assert_cmpint(g_array_index(handles, guint64, 2), ==,
+                   postal_device_index_find(index, "user1", "cdef"));
+   g_array_unref(handles);
+
+   postal_device_index_unref(index);
+}
+
+static void
+test7 (void)
+{
+   static const gchar lower[] =
+      "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef";
+   PostalDeviceIndex *index;
+   PostalDeviceType device_type;
+   MongoObjectId *oid;
+   const gchar *user;
+   GTimeVal tv = { 1000, 0 };
+   gboolean removed;
+   GString *token;
+   guint64 handle;
+   guint badge;
+
+   index = postal_device_index_new();
+   token = g_string_new(NULL);
+
+   index_add(index, "000000000000000000000001", "user1", "gcm", "AbC");
+   index_add(index, "000000000000000000000002", "user2", "aps", lower);
+
+   /*
+    * Raw tokens are copied out terminated, like packed ones.
+    */
+   handle = postal_device_index_find(index, "user1", "AbC");
+   g_assert(postal_device_index_peek_device(index, handle, &device_type,
+                                            &user, token, &badge, &removed));
+   g_assert_cmpint(device_type, ==, POSTAL_DEVICE_GCM);
+   g_assert_cmpstr(user, ==, "user1");
+   g_assert_cmpstr(token->str, ==, "AbC");
+   g_assert(!removed);
+
+   handle = postal_device_index_find(index, "user2", lower);
+   g_assert(postal_device_index_peek_device(index, handle, &device_type,
+                                            &user, token, &badge, &removed));
+   g_assert_cmpint(device_type, ==, POSTAL_DEVICE_APS);
+   g_assert_cmpstr(user, ==, "user2");
+   g_assert_cmpstr(token->str, ==, lower);
+   g_assert(!removed);
+
+   g_assert_cmpint(1, ==,
+                   postal_device_index_mark_removed(index, "user2", 0,
+                                                    lower, &tv));
+   g_assert(postal_device_index_peek_device(index, handle, &device_type,
+                                            &user, token, &badge, &removed));
+   g_assert(removed);
+
+   oid = mongo_object_id_new_from_string("000000000000000000000002");
+   g_assert(postal_device_index_remove(index, oid));
+   mongo_object_id_free(oid);
+   g_assert(!postal_device_index_peek_device(index, handle, &device_type,
+                                             &user, token, &badge, &removed));
+
+   g_string_free(token, TRUE);
+   postal_device_index_unref(index);
+}
+
+static void
+test8 (void)
+{
+   PostalDeviceIndex *index;
+   PostalDeviceType device_type;
+   PostalDevice *device;
+   MongoObjectId *oid;
+   const gchar *user;
+   guint32 oplog_time = 0;
+   guint32 oplog_increment = 0;
+   MongoBson *entry;
+   MongoBson *doc;
+   MongoBson *o2;
+   gboolean removed;
+   GString *token;
+   GBytes *bytes;
+   guint64 handle;
+   gchar *filename;
+   guint offset;
+   guint badge;
+   gint fd;
+
+   index = postal_device_index_new();
+   token = g_string_new(NULL);
+
+   doc = device_new("000000000000000000000001", "user1", "aps", "abcd");
+   mongo_bson_append_int(doc, "badge", 3);
+   g_assert(postal_device_index_insert(index, doc));
+   mongo_bson_unref(doc);
+
+   /*
+    * The fan-out reads the badge along with the rest of the device.
+    */
+   handle = postal_device_index_find(index, "user1", "abcd");
+   g_assert(postal_device_index_peek_device(index, handle, &device_type,
+                                            &user, token, &badge, &removed));
+   g_assert_cmpint(badge, ==, 3);
+
+   /*
+    * {"$set": {"badge": 7}}, as written by postal_service_set_user_badge().
+    */
+   doc = mongo_bson_new_empty();
+   offset = mongo_bson_append_document_begin(doc, "$set");
+   mongo_bson_append_int(doc, "badge", 7);
+   mongo_bson_append_document_end(doc, offset);
+   oid = mongo_object_id_new_from_string("000000000000000000000001");
+   o2 = mongo_bson_new_empty();
+   mongo_bson_append_object_id(o2, "_id", oid);
+   mongo_object_id_free(oid);
+   entry = mongo_bson_new_empty();
+   mongo_bson_append_string(entry, "op", "u");
+   mongo_bson_append_bson(entry, "o2", o2);
+   mongo_bson_append_bson(entry, "o", doc);
+   g_assert(postal_device_index_replay(index, entry));
+   mongo_bson_unref(entry);
+   mongo_bson_unref(doc);
+   mongo_bson_unref(o2);
+
+   g_assert_cmpint(postal_device_index_find(index, "user1", "abcd"), ==,
+                   handle);
+   g_assert(postal_device_index_peek_device(index, handle, &device_type,
+                                            &user, token, &badge, &removed));
+   g_assert_cmpint(badge, ==, 7);
+
+   device = postal_device_index_get_device(index, handle);
+   g_assert_cmpint(postal_device_get_badge(device), ==, 7);
+   g_object_unref(device);
+
+   /*
+    * The badge survives a snapshot.
+    */
+   fd = g_file_open_tmp("test-postal-device-index-XXXXXX", &filename, NULL);
+   g_assert_cmpint(fd, !=, -1);
+   close(fd);
+
+   bytes = postal_device_index_save_to_bytes(index, 0, 0);
+   g_assert(g_file_set_contents(filename,
+                                g_bytes_get_data(bytes, NULL),
+                                g_bytes_get_size(bytes),
+                                NULL));
+   g_bytes_unref(bytes);
+   postal_device_index_unref(index);
+
+   index = postal_device_index_new_from_file(filename,
+                                             &oplog_time,
+                                             &oplog_increment,
+                                             NULL);
+   g_assert(index);
+   handle = postal_device_index_find(index, "user1", "abcd");
+   g_assert(postal_device_index_peek_device(index, handle, &device_type,
+                                            &user, token, &badge, &removed));
+   g_assert_cmpint(badge, ==, 7);
+
+   g_unlink(filename);
+   g_free(filename);
+   g_string_free(token, TRUE);
+   postal_device_index_unref(index);
+}
+
+gint
+main (gint   argc,
+      gchar *argv[])
+{
+   g_type_init();
+   g_test_init(&argc, &argv, NULL);
+   g_test_add_func("/PostalDeviceIndex/lookup", test1);
+   g_test_add_func("/PostalDeviceIndex/remove", test2);
+   g_test_add_func("/PostalDeviceIndex/replay", test3);
+   g_test_add_func("/PostalDeviceIndex/snapshot", test4);
+   g_test_add_func("/PostalDeviceIndex/token_case", test5);
+   g_test_add_func("/PostalDeviceIndex/slot_order", test6);
+   g_test_add_func("/PostalDeviceIndex/peek_device", test7);
+   g_test_add_func("/PostalDeviceIndex/badge", test8);
+   return g_test_run();
+}
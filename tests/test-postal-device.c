@@ -23,6 +23,51 @@ test1 (void)
    g_object_unref(d);
 }
 
+static void
+test2 (void)
+{
+   static const gchar token[] =
+      "0123456789ABCDEF0123456789abcdef0123456789abcdef0123456789abcdef";
+   MongoBsonIter iter;
+   PostalDevice *d;
+   MongoBson *b;
+   guint8 packed[POSTAL_DEVICE_APS_TOKEN_SIZE];
+   gchar str[POSTAL_DEVICE_APS_TOKEN_SIZE * 2 + 1];
+   gchar *lower;
+   gsize len = 0;
+
+   g_assert(!postal_device_aps_token_pack("0123", packed));
+   g_assert(!postal_device_aps_token_pack("AbC", packed));
+   g_assert(postal_device_aps_token_pack(token, packed));
+   g_assert_cmpint(packed[0], ==, 0x01);
+   g_assert_cmpint(packed[7], ==, 0xef);
+   postal_device_aps_token_unpack(packed, str);
+   lower = g_ascii_strdown(token, -1);
+   g_assert_cmpstr(str, ==, lower);
+   g_free(lower);
+
+   /*
+    * APS tokens are stored packed and read back as lowercase hex.
+    */
+   d = postal_device_new();
+   postal_device_set_user(d, "000011110000111100001111");
+   postal_device_set_device_type(d, POSTAL_DEVICE_APS);
+   postal_device_set_device_token(d, token);
+   b = postal_device_save_to_bson(d, NULL);
+   g_assert(b);
+   g_assert(mongo_bson_iter_init_find(&iter, b, "device_token"));
+   g_assert(MONGO_BSON_ITER_HOLDS_BINARY(&iter));
+   mongo_bson_iter_get_value_binary(&iter, NULL, &len);
+   g_assert_cmpint(len, ==, POSTAL_DEVICE_APS_TOKEN_SIZE);
+   g_object_unref(d);
+
+   d = postal_device_new();
+   g_assert(postal_device_load_from_bson(d, b, NULL));
+   g_assert_cmpstr(postal_device_get_device_token(d), ==, str);
+   g_object_unref(d);
+   mongo_bson_unref(b);
+}
+
 gint
 main (gint   argc,
       gchar *argv[])
@@ -31,5 +76,6 @@ main (gint   argc,
    g_type_init();
    g_test_init(&argc, &argv, NULL);
    g_test_add_func("/Postal/Device/save_to_bson", test1);
+   g_test_add_func("/Postal/Device/aps_token", test2);
    return g_test_run();
 }
@@ -0,0 +1,121 @@
+#include <postal/postal-fp-cache.h>
+
+typedef struct
+{
+   const gchar *token;
+   const gchar *collapse_key;
+   gboolean expected;
+} Test1Data;
+
+static Test1Data gTest1Data[] = {
+   { "abcdef", "a", FALSE },
+   { "abcdef", "a", TRUE },
+   { "abcdef", "b", FALSE },
+   { "abcdefg", "a", FALSE },
+   { "abcdefg", "a", TRUE },
+   { "abcdef", "a", TRUE },
+   { "abcdef", "b", TRUE },
+   { "123456", "c", FALSE },
+   { "123456", "c", TRUE },
+   { "888", "8888", FALSE },
+   { "888:8888", NULL, FALSE },
+   { "888", "8888", TRUE },
+};
+
+static void
+test1 (void)
+{
+   PostalFpCache *cache;
+   Test1Data *data;
+   guint64 fp;
+   gint64 now = 0;
+   guint i;
+
+   cache = postal_fp_cache_new(2048, 10, 20);
+
+   for (i = 0; i < G_N_ELEMENTS(gTest1Data); i++) {
+      data = &gTest1Data[i];
+      fp = postal_fp_cache_hash(data->token, data->collapse_key);
+      g_assert_cmpint(data->expected, ==, postal_fp_cache_contains(cache, fp, now));
+      g_assert_cmpint(data->expected, ==, postal_fp_cache_insert(cache, fp, now));
+   }
+
+   postal_fp_cache_unref(cache);
+}
+
+static void
+test2 (void)
+{
+   PostalFpCache *cache;
+   guint64 fp;
+   gint64 now = 0;
+
+   cache = postal_fp_cache_new(2048, 10, 20);
+
+   fp = postal_fp_cache_hash("abcdef", "a");
+   g_assert(!postal_fp_cache_insert(cache, fp, now));
+
+   /*
+    * Still present in the last bucket of the window.
+    */
+   now += 19 * 10 * G_USEC_PER_SEC;
+   g_assert(postal_fp_cache_contains(cache, fp, now));
+
+   /*
+    * Expired once the window has passed.
+    */
+   now += 10 * G_USEC_PER_SEC;
+   g_assert(!postal_fp_cache_contains(cache, fp, now));
+   g_assert(!postal_fp_cache_insert(cache, fp, now));
+   g_assert(postal_fp_cache_insert(cache, fp, now));
+
+   postal_fp_cache_unref(cache);
+}
+
+static void
+test3 (void)
+{
+   PostalFpCache *cache;
+   gchar token[32];
+   guint64 fp;
+   guint n_found = 0;
+   guint i;
+
+   /*
+    * A single set. Inserting more keys than ways must evict the oldest.
+    */
+   cache = postal_fp_cache_new(1, 10, 20);
+
+   for (i = 0; i < 64; i++) {
+      g_snprintf(token, sizeof token, "%u", i);
+      fp = postal_fp_cache_hash(token, "a");
+      postal_fp_cache_insert(cache, fp, (gint64)i * 10 * G_USEC_PER_SEC / 4);
+   }
+
+   for (i = 0; i < 64; i++) {
+      g_snprintf(token, sizeof token, "%u", i);
+      fp = postal_fp_cache_hash(token, "a");
+      n_found += postal_fp_cache_contains(cache, fp, 160 * G_USEC_PER_SEC);
+   }
+
+   g_assert_cmpint(n_found, >, 0);
+   g_assert_cmpint(n_found, <=, 8);
+
+   g_snprintf(token, sizeof token, "%u", 63);
+   fp = postal_fp_cache_hash(token, "a");
+   g_assert(postal_fp_cache_contains(cache, fp, 160 * G_USEC_PER_SEC));
+
+   postal_fp_cache_unref(cache);
+}
+
+gint
+main (gint   argc,
+      gchar *argv[])
+{
+   g_type_init();
+   g_test_init(&argc, &argv, NULL);
+   g_test_add_func("/PostalFpCache/basic", test1);
+   g_test_add_func("/PostalFpCache/expire", test2);
+   g_test_add_func("/PostalFpCache/evict", test3);
+   return g_test_run();
+}
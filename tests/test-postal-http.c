@@ -8,6 +8,7 @@ static GKeyFile          *gKeyFile;
 static gchar             *gAccount;
 static gchar             *gC2dmDevice;
 static gint               gC2dmDeviceId;
+static guint              gPending;
 static const gchar       *gConfig =
    "[mongo]\n"
    "db = test\n"
@@ -415,6 +416,56 @@ test6 (void)
    g_clear_object(&gApplication);
 }
 
+static void
+worker_get_devices_cb (SoupSession *session,
+                       SoupMessage *message,
+                       gpointer     user_data)
+{
+   g_assert(SOUP_IS_SESSION(session));
+   g_assert(SOUP_IS_MESSAGE(message));
+
+   g_assert_cmpint(message->status_code, ==, 200);
+
+   if (!--gPending) {
+      g_application_quit(G_APPLICATION(gApplication));
+   }
+}
+
+static void
+test7 (void)
+{
+   SoupSession *session;
+   SoupMessage *message;
+   gchar *url;
+   guint i;
+
+   /*
+    * Serve from two SO_REUSEPORT workers, falling back to the main loop
+    * where they are not supported. Every request goes through
+    * PostalService and back to the worker that received it.
+    */
+   g_key_file_set_integer(gKeyFile, "http", "workers", 2);
+   gApplication = application_new(G_STRFUNC);
+
+   session = soup_session_async_new();
+   g_assert(SOUP_IS_SESSION(session));
+
+   url = g_strdup_printf("http://127.0.0.1:6616/v1/users/%s/devices", gAccount);
+   for (i = 0; i < 8; i++) {
+      message = soup_message_new("GET", url);
+      g_assert(SOUP_IS_MESSAGE(message));
+      soup_session_queue_message(session, message, worker_get_devices_cb, NULL);
+      gPending++;
+   }
+   g_free(url);
+
+   g_application_run(G_APPLICATION(gApplication), 0, NULL);
+   g_assert_cmpint(gPending, ==, 0);
+
+   g_clear_object(&gApplication);
+   g_key_file_remove_key(gKeyFile, "http", "workers", NULL);
+}
+
 gint
 main (gint argc,
       gchar *argv[])
@@ -441,6 +492,7 @@ main (gint argc,
    g_test_add_func("/PostalHttp/get_device", test4);
    g_test_add_func("/PostalHttp/update_device", test5);
    g_test_add_func("/PostalHttp/remove_device", test6);
+   g_test_add_func("/PostalHttp/workers", test7);
 
    return g_test_run();
 }
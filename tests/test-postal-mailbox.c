@@ -0,0 +1,130 @@
+#include <postal/postal-mailbox.h>
+#include <string.h>
+
+#define N_THREADS  4
+#define N_MESSAGES 10000
+
+typedef struct
+{
+   guint thread;
+   guint seq;
+} Message;
+
+typedef struct
+{
+   PostalMailbox *mailbox;
+   guint          thread;
+} Producer;
+
+static GMainLoop *gMainLoop;
+static guint      gLastSeq[N_THREADS];
+static guint      gReceived;
+
+static void
+test1_cb (gpointer data)
+{
+   guint *count = data;
+
+   g_assert_cmpint(*count, ==, gReceived);
+   gReceived++;
+   g_free(count);
+   if (gReceived == 3) {
+      g_main_loop_quit(gMainLoop);
+   }
+}
+
+static void
+test1 (void)
+{
+   PostalMailbox *mailbox;
+   guint i;
+
+   gReceived = 0;
+   gMainLoop = g_main_loop_new(NULL, FALSE);
+   mailbox = postal_mailbox_new(NULL);
+
+   for (i = 0; i < 3; i++) {
+      postal_mailbox_post(mailbox, test1_cb, g_memdup(&i, sizeof i));
+   }
+
+   postal_mailbox_unref(mailbox);
+   g_main_loop_run(gMainLoop);
+   g_main_loop_unref(gMainLoop);
+
+   g_assert_cmpint(gReceived, ==, 3);
+}
+
+static void
+test2_cb (gpointer data)
+{
+   Message *message = data;
+
+   /*
+    * Messages from a single thread must arrive in the order posted.
+    */
+   g_assert_cmpint(message->seq, ==, gLastSeq[message->thread] + 1);
+   gLastSeq[message->thread] = message->seq;
+   g_slice_free(Message, message);
+
+   if (++gReceived == (N_THREADS * N_MESSAGES)) {
+      g_main_loop_quit(gMainLoop);
+   }
+}
+
+static gpointer
+test2_thread (gpointer data)
+{
+   Producer *producer = data;
+   Message *message;
+   guint i;
+
+   for (i = 1; i <= N_MESSAGES; i++) {
+      message = g_slice_new(Message);
+      message->thread = producer->thread;
+      message->seq = i;
+      postal_mailbox_post(producer->mailbox, test2_cb, message);
+   }
+
+   return NULL;
+}
+
+static void
+test2 (void)
+{
+   PostalMailbox *mailbox;
+   Producer producers[N_THREADS];
+   GThread *threads[N_THREADS];
+   guint i;
+
+   gReceived = 0;
+   memset(gLastSeq, 0, sizeof gLastSeq);
+   gMainLoop = g_main_loop_new(NULL, FALSE);
+   mailbox = postal_mailbox_new(NULL);
+
+   for (i = 0; i < N_THREADS; i++) {
+      producers[i].mailbox = mailbox;
+      producers[i].thread = i;
+      threads[i] = g_thread_new("test2", test2_thread, &producers[i]);
+   }
+
+   g_main_loop_run(gMainLoop);
+
+   for (i = 0; i < N_THREADS; i++) {
+      g_thread_join(threads[i]);
+      g_assert_cmpint(gLastSeq[i], ==, N_MESSAGES);
+   }
+
+   postal_mailbox_unref(mailbox);
+   g_main_loop_unref(gMainLoop);
+}
+
+gint
+main (gint   argc,
+      gchar *argv[])
+{
+   g_type_init();
+   g_test_init(&argc, &argv, NULL);
+   g_test_add_func("/PostalMailbox/post", test1);
+   g_test_add_func("/PostalMailbox/threads", test2);
+   return g_test_run();
+}
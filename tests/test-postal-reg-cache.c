@@ -0,0 +1,112 @@
+#include <postal/postal-reg-cache.h>
+
+static MongoBson *
+doc_new (const gchar *user,
+         const gchar *device_type,
+         const gchar *device_token)
+{
+   MongoBson *bson;
+
+   bson = mongo_bson_new_empty();
+   mongo_bson_append_string(bson, "device_token", device_token);
+   mongo_bson_append_string(bson, "device_type", device_type);
+   mongo_bson_append_string(bson, "user", user);
+   mongo_bson_append_null(bson, "removed_at");
+
+   return bson;
+}
+
+static void
+test1 (void)
+{
+   PostalRegCache *cache;
+   MongoBson *changed;
+   MongoBson *doc;
+   GTimeVal created_at = { 1000, 0 };
+   GTimeVal tv = { 0 };
+   gint64 now = 0;
+
+   cache = postal_reg_cache_new(1024, 60);
+   doc = doc_new("user1", "aps", "abcd");
+   changed = doc_new("user1", "aps", "abce");
+
+   g_assert(!postal_reg_cache_lookup(cache, "user1", POSTAL_DEVICE_APS,
+                                     "abcd", doc, now, &tv));
+
+   postal_reg_cache_insert(cache, "user1", POSTAL_DEVICE_APS, "abcd", doc,
+                           &created_at, now);
+   g_assert(postal_reg_cache_lookup(cache, "user1", POSTAL_DEVICE_APS,
+                                    "abcd", doc, now, &tv));
+   g_assert_cmpint(tv.tv_sec, ==, 1000);
+
+   /*
+    * A different document, type or user is not answered from the cache.
+    */
+   g_assert(!postal_reg_cache_lookup(cache, "user1", POSTAL_DEVICE_APS,
+                                     "abcd", changed, now, &tv));
+   g_assert(!postal_reg_cache_lookup(cache, "user1", POSTAL_DEVICE_GCM,
+                                     "abcd", doc, now, &tv));
+   g_assert(!postal_reg_cache_lookup(cache, "user2", POSTAL_DEVICE_APS,
+                                     "abcd", doc, now, &tv));
+
+   /*
+    * Entries expire after their lifetime.
+    */
+   now += 60 * G_USEC_PER_SEC;
+   g_assert(!postal_reg_cache_lookup(cache, "user1", POSTAL_DEVICE_APS,
+                                     "abcd", doc, now, &tv));
+
+   mongo_bson_unref(changed);
+   mongo_bson_unref(doc);
+   postal_reg_cache_unref(cache);
+}
+
+static void
+test2 (void)
+{
+   PostalRegCache *cache;
+   MongoBson *doc1;
+   MongoBson *doc2;
+   GTimeVal created_at = { 1000, 0 };
+   GTimeVal tv;
+
+   cache = postal_reg_cache_new(1024, 60);
+   doc1 = doc_new("user1", "gcm", "abcd");
+   doc2 = doc_new("user2", "gcm", "abcd");
+
+   postal_reg_cache_insert(cache, "user1", POSTAL_DEVICE_GCM, "abcd", doc1,
+                           &created_at, 0);
+   postal_reg_cache_insert(cache, "user2", POSTAL_DEVICE_GCM, "abcd", doc2,
+                           &created_at, 0);
+
+   g_assert_cmpint(0, ==, postal_reg_cache_remove(cache, "user1", "abce"));
+   g_assert_cmpint(1, ==, postal_reg_cache_remove(cache, "user1", "abcd"));
+   g_assert(!postal_reg_cache_lookup(cache, "user1", POSTAL_DEVICE_GCM,
+                                     "abcd", doc1, 0, &tv));
+   g_assert(postal_reg_cache_lookup(cache, "user2", POSTAL_DEVICE_GCM,
+                                    "abcd", doc2, 0, &tv));
+
+   /*
+    * Removing by token alone forgets the device of every user.
+    */
+   postal_reg_cache_insert(cache, "user1", POSTAL_DEVICE_GCM, "abcd", doc1,
+                           &created_at, 0);
+   g_assert_cmpint(2, ==, postal_reg_cache_remove(cache, NULL, "abcd"));
+   g_assert(!postal_reg_cache_lookup(cache, "user2", POSTAL_DEVICE_GCM,
+                                     "abcd", doc2, 0, &tv));
+
+   mongo_bson_unref(doc1);
+   mongo_bson_unref(doc2);
+   postal_reg_cache_unref(cache);
+}
+
+gint
+main (gint   argc,
+      gchar *argv[])
+{
+   g_type_init();
+   g_test_init(&argc, &argv, NULL);
+   g_test_add_func("/PostalRegCache/lookup", test1);
+   g_test_add_func("/PostalRegCache/remove", test2);
+   return g_test_run();
+}
@@ -4,6 +4,8 @@
 static GApplication *gApp;
 static GMainLoop    *gMainLoop;
 static gboolean      gSuccess;
+static guint         gPending;
+static gboolean      gExpectRemoved;
 static const gchar   gKeyData[] =
    "[mongo]\n"
    "uri = mongodb://127.0.0.1:27017/?w=1&fsync=true\n"
@@ -12,6 +14,55 @@ static const gchar   gKeyData[] =
    "[http]\n"
    "nologging = true\n";
 
+static PostalService *
+get_service (void)
+{
+   GKeyFile *key_file;
+
+   if (!gApp) {
+      key_file = g_key_file_new();
+      g_assert(g_key_file_load_from_data(key_file, gKeyData, -1, 0, NULL));
+      gApp = g_object_new(POSTAL_TYPE_APPLICATION,
+                          "application-id", "com.catch.postald.service-tests",
+                          "flags", G_APPLICATION_NON_UNIQUE | G_APPLICATION_HANDLES_COMMAND_LINE,
+                          NULL);
+      neo_application_set_config(NEO_APPLICATION(gApp), key_file);
+      neo_service_start(NEO_SERVICE(gApp), NULL);
+   }
+
+   return POSTAL_SERVICE(neo_service_get_child(NEO_SERVICE(gApp), "service"));
+}
+
+static PostalDevice *
+device_new (PostalDeviceType device_type)
+{
+   PostalDevice *device;
+   gchar *rand_str;
+
+   device = postal_device_new();
+   rand_str = g_strdup_printf("%u", g_random_int());
+   postal_device_set_device_token(device, rand_str);
+   g_free(rand_str);
+   postal_device_set_user(device, "000011110000111100001111");
+   postal_device_set_device_type(device, device_type);
+
+   return device;
+}
+
+static guint64
+get_devices_written (PostalService *service)
+{
+   guint64 added;
+   guint64 updated;
+
+   g_object_get(neo_service_get_peer(NEO_SERVICE(service), "metrics"),
+                "devices-added", &added,
+                "devices-updated", &updated,
+                NULL);
+
+   return added + updated;
+}
+
 static void
 test1_cb3 (GObject      *object,
            GAsyncResult *result,
@@ -108,29 +159,14 @@ test1 (void)
 {
    PostalService *service;
    PostalDevice *device;
-   GKeyFile *key_file;
    guint64 added;
    guint64 removed;
    guint64 updated;
-   gchar *rand_str;
 
    gSuccess = FALSE;
-   key_file = g_key_file_new();
-   g_assert(g_key_file_load_from_data(key_file, gKeyData, -1, 0, NULL));
-   gApp = g_object_new(POSTAL_TYPE_APPLICATION,
-                       "application-id", "com.catch.postald.service-tests",
-                       "flags", G_APPLICATION_NON_UNIQUE | G_APPLICATION_HANDLES_COMMAND_LINE,
-                       NULL);
-   neo_application_set_config(NEO_APPLICATION(gApp), key_file);
-   service = POSTAL_SERVICE(neo_service_get_child(NEO_SERVICE(gApp), "service"));
+   service = get_service();
    g_assert(POSTAL_IS_SERVICE(service));
-   device = postal_device_new();
-   rand_str = g_strdup_printf("%u", g_random_int());
-   postal_device_set_device_token(device, rand_str);
-   g_free(rand_str);
-   postal_device_set_user(device, "000011110000111100001111");
-   postal_device_set_device_type(device, POSTAL_DEVICE_C2DM);
-   neo_service_start(NEO_SERVICE(gApp), NULL);
+   device = device_new(POSTAL_DEVICE_C2DM);
    postal_service_add_device(service, device, NULL, test1_cb, device);
    g_main_loop_run(gMainLoop);
    g_object_get(neo_service_get_peer(NEO_SERVICE(service), "metrics"),
@@ -145,6 +181,292 @@ test1 (void)
    g_assert(gSuccess);
 }
 
+static void
+test2_find_cb (GObject      *object,
+               GAsyncResult *result,
+               gpointer      user_data)
+{
+   PostalService *service = (PostalService *)object;
+   PostalDevice *device;
+   GError *error = NULL;
+
+   device = postal_service_find_device_finish(service, result, &error);
+   g_assert_no_error(error);
+   g_assert(device);
+
+   /*
+    * The most recent registration wins.
+    */
+   g_assert_cmpint(postal_device_get_device_type(device), ==,
+                   POSTAL_DEVICE_GCM);
+   g_assert(!postal_device_get_removed_at(device));
+   g_object_unref(device);
+
+   gSuccess = TRUE;
+   g_main_loop_quit(gMainLoop);
+}
+
+static void
+test2_add_cb (GObject      *object,
+              GAsyncResult *result,
+              gpointer      user_data)
+{
+   PostalService *service = (PostalService *)object;
+   PostalDevice *device = user_data;
+   gboolean updated_existing;
+   GError *error = NULL;
+
+   g_assert(postal_service_add_device_finish(service, result,
+                                             &updated_existing, &error));
+   g_assert_no_error(error);
+
+   /*
+    * Every waiter is completed from the same write.
+    */
+   g_assert(!updated_existing);
+
+   if (!--gPending) {
+      postal_service_find_device(service,
+                                 postal_device_get_user(device),
+                                 postal_device_get_device_token(device),
+                                 NULL,
+                                 test2_find_cb,
+                                 NULL);
+   }
+}
+
+static void
+test2 (void)
+{
+   PostalService *service;
+   PostalDevice *device1;
+   PostalDevice *device2;
+   guint64 written;
+
+   gSuccess = FALSE;
+   service = get_service();
+
+   /*
+    * Registrations of the same device within the window are written with
+    * a single upsert of the last document.
+    */
+   device1 = device_new(POSTAL_DEVICE_C2DM);
+   device2 = postal_device_new();
+   postal_device_set_device_token(device2,
+                                  postal_device_get_device_token(device1));
+   postal_device_set_user(device2, postal_device_get_user(device1));
+   postal_device_set_device_type(device2, POSTAL_DEVICE_GCM);
+
+   written = get_devices_written(service);
+   gPending = 2;
+   postal_service_add_device(service, device1, NULL, test2_add_cb, device1);
+   postal_service_add_device(service, device2, NULL, test2_add_cb, device2);
+   g_main_loop_run(gMainLoop);
+   g_assert(gSuccess);
+   g_assert_cmpint(get_devices_written(service), ==, written + 1);
+
+   g_object_unref(device1);
+   g_object_unref(device2);
+}
+
+static void
+test3_find_cb (GObject      *object,
+               GAsyncResult *result,
+               gpointer      user_data)
+{
+   PostalService *service = (PostalService *)object;
+   PostalDevice *device;
+   GError *error = NULL;
+
+   device = postal_service_find_device_finish(service, result, &error);
+   g_assert_no_error(error);
+   g_assert(device);
+
+   if (gExpectRemoved) {
+      g_assert(postal_device_get_removed_at(device));
+   } else {
+      g_assert(!postal_device_get_removed_at(device));
+   }
+   g_object_unref(device);
+
+   gSuccess = TRUE;
+   g_main_loop_quit(gMainLoop);
+}
+
+static void
+test3_add_cb (GObject      *object,
+              GAsyncResult *result,
+              gpointer      user_data)
+{
+   PostalService *service = (PostalService *)object;
+   PostalDevice *device = user_data;
+   GError *error = NULL;
+
+   g_assert(postal_service_add_device_finish(service, result, NULL, &error));
+   g_assert_no_error(error);
+
+   if (!--gPending) {
+      postal_service_find_device(service,
+                                 postal_device_get_user(device),
+                                 postal_device_get_device_token(device),
+                                 NULL,
+                                 test3_find_cb,
+                                 NULL);
+   }
+}
+
+static void
+test3_remove_cb (GObject      *object,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+   PostalService *service = (PostalService *)object;
+   PostalDevice *device = user_data;
+   GError *error = NULL;
+
+   g_assert(postal_service_remove_device_finish(service, result, &error));
+   g_assert_no_error(error);
+
+   if (!--gPending) {
+      postal_service_find_device(service,
+                                 postal_device_get_user(device),
+                                 postal_device_get_device_token(device),
+                                 NULL,
+                                 test3_find_cb,
+                                 NULL);
+   }
+}
+
+static void
+test3 (void)
+{
+   PostalService *service;
+   PostalDevice *device;
+
+   gSuccess = FALSE;
+   service = get_service();
+   device = device_new(POSTAL_DEVICE_C2DM);
+
+   /*
+    * Removing a device flushes its pending registration first, so the
+    * device ends up removed.
+    */
+   gPending = 2;
+   gExpectRemoved = TRUE;
+   postal_service_add_device(service, device, NULL, test3_add_cb, device);
+   postal_service_remove_device(service, device, NULL, test3_remove_cb, device);
+   g_main_loop_run(gMainLoop);
+   g_assert(gSuccess);
+
+   /*
+    * Registering it again is written rather than answered from the
+    * registration cache.
+    */
+   gSuccess = FALSE;
+   gPending = 1;
+   gExpectRemoved = FALSE;
+   postal_service_add_device(service, device, NULL, test3_add_cb, device);
+   g_main_loop_run(gMainLoop);
+   g_assert(gSuccess);
+
+   g_object_unref(device);
+}
+
+static void
+test4_find_cb (GObject      *object,
+               GAsyncResult *result,
+               gpointer      user_data)
+{
+   PostalService *service = (PostalService *)object;
+   PostalDevice *device;
+   GError *error = NULL;
+
+   device = postal_service_find_device_finish(service, result, &error);
+   g_assert_no_error(error);
+   g_assert(device);
+
+   /*
+    * The re-registration came last, so its document wins.
+    */
+   g_assert_cmpint(postal_device_get_device_type(device), ==,
+                   POSTAL_DEVICE_C2DM);
+   g_object_unref(device);
+
+   gSuccess = TRUE;
+   g_main_loop_quit(gMainLoop);
+}
+
+static void
+test4_add_cb (GObject      *object,
+              GAsyncResult *result,
+              gpointer      user_data)
+{
+   PostalService *service = (PostalService *)object;
+   PostalDevice *device = user_data;
+   GError *error = NULL;
+
+   g_assert(postal_service_add_device_finish(service, result, NULL, &error));
+   g_assert_no_error(error);
+
+   if (!--gPending) {
+      postal_service_find_device(service,
+                                 postal_device_get_user(device),
+                                 postal_device_get_device_token(device),
+                                 NULL,
+                                 test4_find_cb,
+                                 NULL);
+   }
+}
+
+static void
+test4_registered_cb (GObject      *object,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+   PostalService *service = (PostalService *)object;
+   GError *error = NULL;
+
+   g_assert(postal_service_add_device_finish(service, result, NULL, &error));
+   g_assert_no_error(error);
+   g_main_loop_quit(gMainLoop);
+}
+
+static void
+test4 (void)
+{
+   PostalService *service;
+   PostalDevice *device1;
+   PostalDevice *device2;
+
+   gSuccess = FALSE;
+   service = get_service();
+
+   device1 = device_new(POSTAL_DEVICE_C2DM);
+   device2 = postal_device_new();
+   postal_device_set_device_token(device2,
+                                  postal_device_get_device_token(device1));
+   postal_device_set_user(device2, postal_device_get_user(device1));
+   postal_device_set_device_type(device2, POSTAL_DEVICE_GCM);
+
+   postal_service_add_device(service, device1, NULL, test4_registered_cb,
+                             NULL);
+   g_main_loop_run(gMainLoop);
+
+   /*
+    * The original document is in the registration cache, but a newer
+    * one is pending, so re-registering the original must coalesce with
+    * the pending write rather than be answered from the cache.
+    */
+   gPending = 2;
+   postal_service_add_device(service, device2, NULL, test4_add_cb, device2);
+   postal_service_add_device(service, device1, NULL, test4_add_cb, device1);
+   g_main_loop_run(gMainLoop);
+   g_assert(gSuccess);
+
+   g_object_unref(device1);
+   g_object_unref(device2);
+}
+
 gint
 main (gint   argc,
       gchar *argv[])
@@ -154,5 +476,8 @@ main (gint   argc,
    g_test_init(&argc, &argv, NULL);
    gMainLoop = g_main_loop_new(NULL, FALSE);
    g_test_add_func("/Postal/Service/add_update_remove_find", test1);
+   g_test_add_func("/Postal/Service/register_coalesce", test2);
+   g_test_add_func("/Postal/Service/remove_flushes_register", test3);
+   g_test_add_func("/Postal/Service/register_pending_wins", test4);
    return g_test_run();
 }
@@ -0,0 +1,540 @@
+#include "test-helper.h"
+
+#include <string.h>
+
+/*
+ * The client is built into the test with small tunables so that queues
+ * fill and ack windows pass quickly. Plain sockets are attached to the
+ * pool in place of TLS connections to the gateway.
+ */
+#define PUSH_APS_CLIENT_ACK_WINDOW_MSEC 50
+#define PUSH_APS_CLIENT_IN_FLIGHT_SIZE  512
+
+#include "push-glib/push-aps-client.c"
+
+#define PUMP_MAIN_LOOP \
+   G_STMT_START { \
+      while (g_main_context_pending(g_main_context_default())) { \
+         g_main_context_iteration(g_main_context_default(), FALSE); \
+      } \
+   } G_STMT_END
+
+#define TEST_TOKEN \
+   "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"
+
+typedef struct
+{
+   guint n_ok;
+   guint n_failed;
+   gint  code;
+} Results;
+
+static void
+deliver_cb (GObject      *object,
+            GAsyncResult *result,
+            gpointer      user_data)
+{
+   Results *results = user_data;
+   GError *error = NULL;
+
+   if (push_aps_client_deliver_finish(PUSH_APS_CLIENT(object),
+                                      result,
+                                      &error)) {
+      results->n_ok++;
+   } else {
+      g_assert(error->domain == PUSH_APS_CLIENT_ERROR);
+      results->n_failed++;
+      results->code = error->code;
+      g_error_free(error);
+   }
+}
+
+static void
+deliver (PushApsClient *client,
+         Results       *results)
+{
+   PushApsIdentity *identity;
+   PushApsMessage *message;
+
+   identity = g_object_new(PUSH_TYPE_APS_IDENTITY,
+                           "device-token", TEST_TOKEN,
+                           NULL);
+   message = push_aps_message_new();
+   push_aps_message_set_alert(message, "Hello");
+   push_aps_client_deliver_async(client, identity, message, NULL,
+                                 deliver_cb, results);
+   g_object_unref(message);
+   g_object_unref(identity);
+}
+
+static void
+wait_for (Results *results,
+          guint    n_completed)
+{
+   while ((results->n_ok + results->n_failed) < n_completed) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+}
+
+/*
+ * Attaches a plain TCP connection to @conn as if it had just connected to
+ * the gateway, and returns the gateway side of it.
+ */
+static GSocketConnection *
+attach (PushApsConnection *conn)
+{
+   GSocketConnection *gateway;
+   GSocketConnection *sconn;
+   GSocketListener *listener;
+   GSocketClient *socket_client;
+   GError *error = NULL;
+   guint16 port;
+
+   listener = g_socket_listener_new();
+   port = g_socket_listener_add_any_inet_port(listener, NULL, &error);
+   g_assert_no_error(error);
+
+   socket_client = g_socket_client_new();
+   sconn = g_socket_client_connect_to_host(socket_client, "127.0.0.1", port,
+                                           NULL, &error);
+   g_assert_no_error(error);
+   gateway = g_socket_listener_accept(listener, NULL, NULL, &error);
+   g_assert_no_error(error);
+   g_socket_set_blocking(g_socket_connection_get_socket(gateway), FALSE);
+
+   g_clear_object(&conn->stream);
+   conn->stream = G_IO_STREAM(sconn);
+   conn->state = STATE_CONNECTED;
+   g_input_stream_read_async(g_io_stream_get_input_stream(conn->stream),
+                             conn->read_buf,
+                             sizeof conn->read_buf,
+                             G_PRIORITY_DEFAULT,
+                             conn->client->priv->dispose_cancellable,
+                             push_aps_client_read_gateway_cb,
+                             conn);
+   push_aps_client_write_next(conn);
+
+   g_object_unref(socket_client);
+   g_socket_listener_close(listener);
+   g_object_unref(listener);
+
+   return gateway;
+}
+
+/*
+ * Returns the length of the frame at the start of @data, or zero if it has
+ * not been received completely.
+ */
+static gsize
+frame_length (const guint8 *data,
+              gsize         len)
+{
+   guint16 b16;
+   gsize token_len;
+
+   if (len < 11) {
+      return 0;
+   }
+   memcpy(&b16, data + 9, sizeof b16);
+   token_len = GUINT16_FROM_BE(b16);
+   if (len < (11 + token_len + 2)) {
+      return 0;
+   }
+   memcpy(&b16, data + 11 + token_len, sizeof b16);
+   if (len < (13 + token_len + GUINT16_FROM_BE(b16))) {
+      return 0;
+   }
+   return 13 + token_len + GUINT16_FROM_BE(b16);
+}
+
+/*
+ * Reads @n_frames frames from @gateway while running the main loop and
+ * returns their request ids.
+ */
+static GArray *
+read_frames (GSocketConnection *gateway,
+             guint              n_frames)
+{
+   GByteArray *received;
+   GSocket *socket;
+   GArray *ids;
+   GError *error = NULL;
+   guint32 request_id;
+   guint8 buf[4096];
+   gssize r;
+   gsize offset = 0;
+   gsize len;
+
+   received = g_byte_array_new();
+   ids = g_array_new(FALSE, FALSE, sizeof(guint32));
+   socket = g_socket_connection_get_socket(gateway);
+
+   while (ids->len < n_frames) {
+      PUMP_MAIN_LOOP;
+      r = g_socket_receive(socket, (gchar *)buf, sizeof buf, NULL, &error);
+      if (r < 0) {
+         g_assert_error(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK);
+         g_clear_error(&error);
+         g_usleep(1000);
+         continue;
+      }
+      g_assert_cmpint(r, >, 0);
+      g_byte_array_append(received, buf, r);
+      while ((len = frame_length(received->data + offset,
+                                 received->len - offset))) {
+         g_assert_cmpint(received->data[offset], ==, 1);
+         memcpy(&request_id, received->data + offset + 1, sizeof request_id);
+         request_id = GUINT32_FROM_BE(request_id);
+         g_array_append_val(ids, request_id);
+         offset += len;
+      }
+   }
+
+   g_assert_cmpint(ids->len, ==, n_frames);
+   g_assert_cmpint(offset, ==, received->len);
+   g_byte_array_free(received, TRUE);
+
+   return ids;
+}
+
+static void
+test1 (void)
+{
+   GSocketConnection *gateway;
+   PushApsClient *client;
+   Results results = { 0 };
+   GArray *ids;
+   guint i;
+
+   client = g_object_new(PUSH_TYPE_APS_CLIENT,
+                         "queue-size", 4,
+                         NULL);
+
+   /*
+    * Frames wait in the bounded queue until the connection is up. The
+    * client is congested at three quarters of the queue and refuses
+    * deliveries once it is full.
+    */
+   for (i = 0; i < 4; i++) {
+      g_assert_cmpint(push_aps_client_get_congested(client), ==, (i >= 3));
+      deliver(client, &results);
+   }
+   g_assert_cmpint(push_aps_client_get_queue_length(client), ==, 4);
+   g_assert(push_aps_client_get_congested(client));
+
+   deliver(client, &results);
+   wait_for(&results, 1);
+   g_assert_cmpint(results.n_failed, ==, 1);
+   g_assert_cmpint(results.code, ==, PUSH_APS_CLIENT_ERROR_QUEUE_FULL);
+
+   /*
+    * Once connected the queue drains without blocking the main loop.
+    */
+   gateway = attach(&client->priv->pool[0]);
+   ids = read_frames(gateway, 4);
+   for (i = 1; i < ids->len; i++) {
+      g_assert_cmpint(g_array_index(ids, guint32, i), ==,
+                      g_array_index(ids, guint32, i - 1) + 1);
+   }
+   PUMP_MAIN_LOOP;
+   g_assert_cmpint(push_aps_client_get_queue_length(client), ==, 0);
+   g_assert(!push_aps_client_get_congested(client));
+
+   /*
+    * Without an error response, the deliveries succeed once their ack
+    * window has passed.
+    */
+   wait_for(&results, 5);
+   g_assert_cmpint(results.n_ok, ==, 4);
+
+   g_array_free(ids, TRUE);
+   g_object_unref(client);
+   g_object_unref(gateway);
+}
+
+static void
+test2 (void)
+{
+   GSocketConnection *gateway;
+   PushApsClient *client;
+   Results results = { 0 };
+   GArray *ids;
+   guint i;
+
+   client = g_object_new(PUSH_TYPE_APS_CLIENT, NULL);
+   gateway = attach(&client->priv->pool[0]);
+
+   /*
+    * Frames queued within one main loop iteration share a single write.
+    */
+   for (i = 0; i < 10; i++) {
+      deliver(client, &results);
+   }
+   ids = read_frames(gateway, 10);
+   g_array_free(ids, TRUE);
+   g_assert_cmpint(push_aps_client_get_flush_count(client), ==, 1);
+   g_assert_cmpfloat(push_aps_client_get_average_batch_size(client), ==, 10.0);
+
+   /*
+    * Filling the output buffer writes it right away. Everything queued
+    * while that write is in flight goes out in the next one.
+    */
+   for (i = 0; i < 300; i++) {
+      deliver(client, &results);
+   }
+   ids = read_frames(gateway, 300);
+   g_array_free(ids, TRUE);
+   g_assert_cmpint(push_aps_client_get_flush_count(client), ==, 3);
+
+   wait_for(&results, 310);
+   g_assert_cmpint(results.n_ok, ==, 310);
+
+   g_object_unref(client);
+   g_object_unref(gateway);
+}
+
+static void
+test3 (void)
+{
+   GSocketConnection *gateway;
+   PushApsConnection *conn;
+   PushApsInFlight *entry;
+   PushApsClient *client;
+   Results results = { 0 };
+   GArray *ids;
+   guint32 first_id;
+   gsize len;
+
+   client = g_object_new(PUSH_TYPE_APS_CLIENT, NULL);
+   conn = &client->priv->pool[0];
+
+   deliver(client, &results);
+   deliver(client, &results);
+   deliver(client, &results);
+   first_id = client->priv->last_id - 2;
+   PUMP_MAIN_LOOP;
+
+   /*
+    * Pretend the connection failed after writing the first two frames of
+    * the output buffer and part of the third.
+    */
+   push_aps_client_fill(conn);
+   g_assert_cmpint(conn->out_frames, ==, 3);
+   len = conn->queue[conn->queue_head]->len;
+   conn->out_offset = (len * 2) + 5;
+   push_aps_client_reset(conn);
+
+   /*
+    * The written frames are retired but stay in the ring to match error
+    * responses. Only the partial frame is sent again.
+    */
+   g_assert_cmpint(conn->queue_length, ==, 1);
+   g_assert_cmpint(conn->queue_bytes, ==, len);
+   g_assert_cmpint(conn->out->len, ==, 0);
+   entry = push_aps_client_lookup(client, first_id);
+   g_assert(entry && entry->written_at && (entry->conn == conn));
+   entry = push_aps_client_lookup(client, first_id + 1);
+   g_assert(entry && entry->written_at && (entry->conn == conn));
+   entry = push_aps_client_lookup(client, first_id + 2);
+   g_assert(entry && !entry->written_at);
+
+   gateway = attach(conn);
+   ids = read_frames(gateway, 1);
+   g_assert_cmpint(g_array_index(ids, guint32, 0), ==, first_id + 2);
+
+   wait_for(&results, 3);
+   g_assert_cmpint(results.n_ok, ==, 3);
+
+   g_array_free(ids, TRUE);
+   g_object_unref(client);
+   g_object_unref(gateway);
+}
+
+/*
+ * Sends an error response for @request_id from @gateway and waits for
+ * @conn to be torn down.
+ */
+static void
+send_error (GSocketConnection *gateway,
+            PushApsConnection *conn,
+            guint32            request_id)
+{
+   GError *error = NULL;
+   guint8 buf[6];
+
+   buf[0] = 8;
+   buf[1] = PUSH_APS_CLIENT_ERROR_INVALID_TOKEN;
+   request_id = GUINT32_TO_BE(request_id);
+   memcpy(buf + 2, &request_id, sizeof request_id);
+   g_assert_cmpint(g_socket_send(g_socket_connection_get_socket(gateway),
+                                 (gchar *)buf, sizeof buf, NULL, &error),
+                   ==, sizeof buf);
+   g_assert_no_error(error);
+
+   while (conn->state == STATE_CONNECTED) {
+      g_main_context_iteration(NULL, TRUE);
+   }
+}
+
+static void
+test4 (void)
+{
+   GSocketConnection *gateway;
+   PushApsConnection *conn;
+   PushApsClient *client;
+   Results results = { 0 };
+   GArray *ids;
+   guint32 first_id;
+
+   client = g_object_new(PUSH_TYPE_APS_CLIENT,
+                         "pool-size", 1,
+                         NULL);
+   conn = &client->priv->pool[0];
+   gateway = attach(conn);
+
+   deliver(client, &results);
+   deliver(client, &results);
+   deliver(client, &results);
+   ids = read_frames(gateway, 3);
+   first_id = g_array_index(ids, guint32, 0);
+   g_array_free(ids, TRUE);
+   PUMP_MAIN_LOOP;
+
+   /*
+    * The frame after the failed one is queued again on the only
+    * connection, which stops writing until it has reconnected.
+    */
+   send_error(gateway, conn, first_id + 1);
+   g_assert_cmpint(conn->state, !=, STATE_CONNECTED);
+   g_assert(!conn->stream);
+   g_assert_cmpint(conn->queue_length, ==, 1);
+   g_object_unref(gateway);
+
+   gateway = attach(conn);
+   ids = read_frames(gateway, 1);
+   g_assert_cmpint(g_array_index(ids, guint32, 0), ==, first_id + 2);
+   g_array_free(ids, TRUE);
+
+   wait_for(&results, 3);
+   g_assert_cmpint(results.n_ok, ==, 2);
+   g_assert_cmpint(results.n_failed, ==, 1);
+   g_assert_cmpint(results.code, ==, PUSH_APS_CLIENT_ERROR_INVALID_TOKEN);
+
+   /*
+    * The sweep stops once nothing is left in flight.
+    */
+   g_assert_cmpint(client->priv->sweep_handler, ==, 0);
+
+   g_object_unref(client);
+   g_object_unref(gateway);
+}
+
+static void
+test5 (void)
+{
+   GSocketConnection *gateway[2];
+   PushApsInFlight *entry;
+   PushApsClient *client;
+   Results results = { 0 };
+   GArray *ids;
+   guint32 first_id;
+   guint i;
+
+   client = g_object_new(PUSH_TYPE_APS_CLIENT,
+                         "pool-size", 2,
+                         NULL);
+   gateway[0] = attach(&client->priv->pool[0]);
+   gateway[1] = attach(&client->priv->pool[1]);
+
+   /*
+    * Deliveries alternate between the two connections.
+    */
+   for (i = 0; i < 4; i++) {
+      deliver(client, &results);
+   }
+   ids = read_frames(gateway[0], 2);
+   first_id = g_array_index(ids, guint32, 0);
+   g_assert_cmpint(g_array_index(ids, guint32, 1), ==, first_id + 2);
+   g_array_free(ids, TRUE);
+   ids = read_frames(gateway[1], 2);
+   g_assert_cmpint(g_array_index(ids, guint32, 0), ==, first_id + 1);
+   g_array_free(ids, TRUE);
+   PUMP_MAIN_LOOP;
+
+   /*
+    * The frame written after the failed one is sent again on the healthy
+    * connection rather than the one that failed.
+    */
+   send_error(gateway[0], &client->priv->pool[0], first_id);
+   g_assert_cmpint(client->priv->pool[0].state, ==, STATE_0);
+   entry = push_aps_client_lookup(client, first_id + 2);
+   g_assert(entry && (entry->conn == &client->priv->pool[1]));
+   ids = read_frames(gateway[1], 1);
+   g_assert_cmpint(g_array_index(ids, guint32, 0), ==, first_id + 2);
+   g_array_free(ids, TRUE);
+
+   wait_for(&results, 4);
+   g_assert_cmpint(results.n_ok, ==, 3);
+   g_assert_cmpint(results.n_failed, ==, 1);
+
+   g_object_unref(client);
+   g_object_unref(gateway[0]);
+   g_object_unref(gateway[1]);
+}
+
+static void
+test6 (void)
+{
+   GSocketConnection *gateway;
+   PushApsClient *client;
+   Results results = { 0 };
+   GArray *ids;
+   guint i;
+
+   client = g_object_new(PUSH_TYPE_APS_CLIENT, NULL);
+
+   /*
+    * Once the in-flight ring is full of frames that were never written,
+    * further deliveries are refused rather than reported as delivered.
+    */
+   for (i = 0; i < PUSH_APS_CLIENT_IN_FLIGHT_SIZE; i++) {
+      deliver(client, &results);
+   }
+   deliver(client, &results);
+   wait_for(&results, 1);
+   g_assert_cmpint(results.n_failed, ==, 1);
+   g_assert_cmpint(results.code, ==, PUSH_APS_CLIENT_ERROR_QUEUE_FULL);
+
+   /*
+    * A written frame may be replaced once the ring wraps onto it.
+    */
+   gateway = attach(&client->priv->pool[0]);
+   ids = read_frames(gateway, PUSH_APS_CLIENT_IN_FLIGHT_SIZE);
+   g_array_free(ids, TRUE);
+   PUMP_MAIN_LOOP;
+   deliver(client, &results);
+   ids = read_frames(gateway, 1);
+   g_array_free(ids, TRUE);
+
+   wait_for(&results, PUSH_APS_CLIENT_IN_FLIGHT_SIZE + 2);
+   g_assert_cmpint(results.n_ok, ==, PUSH_APS_CLIENT_IN_FLIGHT_SIZE + 1);
+   g_assert_cmpint(results.n_failed, ==, 1);
+
+   g_object_unref(client);
+   g_object_unref(gateway);
+}
+
+gint
+main (gint   argc,
+      gchar *argv[])
+{
+   g_type_init();
+   g_test_init(&argc, &argv, NULL);
+   g_test_add_func("/PushApsClient/queue", test1);
+   g_test_add_func("/PushApsClient/coalesce", test2);
+   g_test_add_func("/PushApsClient/partial_write", test3);
+   g_test_add_func("/PushApsClient/resend_pool_one", test4);
+   g_test_add_func("/PushApsClient/resend_pool_two", test5);
+   g_test_add_func("/PushApsClient/in_flight_wrap", test6);
+   return g_test_run();
+}
@@ -0,0 +1,104 @@
+#include <string.h>
+
+#include <push-glib/push-aps-message.h>
+
+static void
+test1 (void)
+{
+   PushApsMessage *message;
+
+   message = push_aps_message_new();
+   g_assert_cmpstr(push_aps_message_get_json(message), ==,
+                   "{\"aps\":{\"badge\":0}}");
+
+   push_aps_message_set_alert(message, "Hello");
+   g_assert_cmpstr(push_aps_message_get_json(message), ==,
+                   "{\"aps\":{\"alert\":\"Hello\"}}");
+
+   /*
+    * Changing only the badge splices the new digits into the template.
+    */
+   push_aps_message_set_badge(message, 3);
+   g_assert_cmpstr(push_aps_message_get_json(message), ==,
+                   "{\"aps\":{\"badge\":3,\"alert\":\"Hello\"}}");
+   push_aps_message_set_badge(message, 4294967295U);
+   g_assert_cmpstr(push_aps_message_get_json(message), ==,
+                   "{\"aps\":{\"badge\":4294967295,\"alert\":\"Hello\"}}");
+
+   push_aps_message_add_extra_string(message, "key", "value");
+   g_assert_cmpstr(push_aps_message_get_json(message), ==,
+                   "{\"key\":\"value\","
+                   "\"aps\":{\"badge\":4294967295,\"alert\":\"Hello\"}}");
+
+   g_object_unref(message);
+}
+
+static void
+test2 (void)
+{
+   PushApsMessage *message;
+
+   /*
+    * Content that looks like a badge value is left alone.
+    */
+   message = push_aps_message_new();
+   push_aps_message_set_alert(message, ":7395186204519387462");
+   push_aps_message_add_extra_string(message, "badge",
+                                     ":7395186204519387462");
+   push_aps_message_set_badge(message, 12);
+   g_assert_cmpstr(push_aps_message_get_json(message), ==,
+                   "{\"badge\":\":7395186204519387462\","
+                   "\"aps\":{\"badge\":12,"
+                   "\"alert\":\":7395186204519387462\"}}");
+   push_aps_message_set_badge(message, 7);
+   g_assert_cmpstr(push_aps_message_get_json(message), ==,
+                   "{\"badge\":\":7395186204519387462\","
+                   "\"aps\":{\"badge\":7,"
+                   "\"alert\":\":7395186204519387462\"}}");
+
+   g_object_unref(message);
+}
+
+static void
+test3 (void)
+{
+   PushApsMessage *message;
+   gchar *alert;
+
+   /*
+    * {"aps":{"badge":9,"alert":"..."}} is 30 bytes plus the alert.
+    */
+   alert = g_strnfill(PUSH_APS_MESSAGE_MAX_PAYLOAD - 30, 'a');
+   message = push_aps_message_new();
+   push_aps_message_set_alert(message, alert);
+   push_aps_message_set_badge(message, 9);
+   g_assert(!push_aps_message_get_oversized(message));
+   g_assert_cmpint(strlen(push_aps_message_get_json(message)), ==,
+                   PUSH_APS_MESSAGE_MAX_PAYLOAD);
+
+   /*
+    * One more badge digit puts it over the limit.
+    */
+   push_aps_message_set_badge(message, 10);
+   g_assert(push_aps_message_get_oversized(message));
+   g_assert_cmpint(strlen(push_aps_message_get_json(message)), ==,
+                   PUSH_APS_MESSAGE_MAX_PAYLOAD + 1);
+
+   push_aps_message_set_badge(message, 0);
+   g_assert(!push_aps_message_get_oversized(message));
+
+   g_object_unref(message);
+   g_free(alert);
+}
+
+gint
+main (gint   argc,
+      gchar *argv[])
+{
+   g_type_init();
+   g_test_init(&argc, &argv, NULL);
+   g_test_add_func("/PushApsMessage/badge", test1);
+   g_test_add_func("/PushApsMessage/badge_collision", test2);
+   g_test_add_func("/PushApsMessage/oversized", test3);
+   return g_test_run();
+}